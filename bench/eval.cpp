@@ -0,0 +1,475 @@
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "batch.hpp"
+#include "calc.hpp"
+#include "derivative.hpp"
+#include "executor.hpp"
+#include "jit.hpp"
+#include "program.hpp"
+#include "shared_program.hpp"
+#include "static_expr.hpp"
+
+namespace
+{
+calc::Context make_context()
+{
+    return calc::Context{ { "x", 0.75 }, { "y", 2.5 }, { "z", -1.0 } };
+}
+
+// Every form an expression can be evaluated in.
+struct Compiled
+{
+    const calc::Expr& expr;
+    calc::JitProgram jit;
+    mutable calc::EvalWorkspace workspace;
+
+    explicit Compiled(const calc::Expr& expr)
+        : expr{ expr }
+        , jit{ calc::JitProgram::compile(expr) }
+    {
+    }
+};
+
+struct Tree
+{
+    static double run(const Compiled& compiled, calc::Context& ctx)
+    {
+        return compiled.expr.eval(ctx);
+    }
+};
+
+struct Bytecode
+{
+    static double run(const Compiled& compiled, calc::Context& ctx)
+    {
+        return compiled.jit.program().run(ctx);
+    }
+};
+
+// Tree and Bytecode, with call arguments taken from a reused workspace instead of allocated per call.
+struct TreeInWorkspace
+{
+    static double run(const Compiled& compiled, calc::Context& ctx)
+    {
+        return calc::eval(compiled.expr, ctx, compiled.workspace);
+    }
+};
+
+struct BytecodeInWorkspace
+{
+    static double run(const Compiled& compiled, calc::Context& ctx)
+    {
+        return compiled.jit.program().run(ctx, compiled.workspace);
+    }
+};
+
+struct Jit
+{
+    static double run(const Compiled& compiled, calc::Context& ctx)
+    {
+        return compiled.jit.run(ctx);
+    }
+};
+
+template <class Evaluator>
+void eval_text(benchmark::State& state, const calc::Parser& parser, const std::string& text)
+{
+    const auto expr = parser(text);
+    const Compiled compiled{ *expr };
+    auto ctx = make_context();
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(Evaluator::run(compiled, ctx));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+template <class Evaluator>
+void eval_text(benchmark::State& state, const std::string& text)
+{
+    eval_text<Evaluator>(state, calc::parse, text);
+}
+
+// One benchmark per node type, each on the smallest expression that has it at the root.
+template <class Evaluator>
+void BM_eval_value(benchmark::State& state)
+{
+    eval_text<Evaluator>(state, "1.5");
+}
+
+template <class Evaluator>
+void BM_eval_variable(benchmark::State& state)
+{
+    eval_text<Evaluator>(state, "x");
+}
+
+template <class Evaluator>
+void BM_eval_unary_op(benchmark::State& state)
+{
+    eval_text<Evaluator>(state, "-x");
+}
+
+template <class Evaluator>
+void BM_eval_binary_op(benchmark::State& state)
+{
+    eval_text<Evaluator>(state, "x * y");
+}
+
+template <class Evaluator>
+void BM_eval_func(benchmark::State& state)
+{
+    eval_text<Evaluator>(state, "max(x, y, z)");
+}
+
+template <class Evaluator>
+void BM_eval_assignment(benchmark::State& state)
+{
+    eval_text<Evaluator>(state, "w = x");
+}
+
+// Function-call overhead: a built-in against the same function registered as a calc::Function callback.
+template <class Evaluator>
+void BM_call_builtin(benchmark::State& state)
+{
+    eval_text<Evaluator>(state, "sqrt(x)");
+}
+
+template <class Evaluator>
+void BM_call_user_function(benchmark::State& state)
+{
+    calc::Parser parser;
+    parser.register_function("root", [](const std::vector<double>& args) { return std::sqrt(args.at(0)); });
+    eval_text<Evaluator>(state, parser, "root(x)");
+}
+
+// A formula fixed at build time, against the same text parsed at run time.
+constexpr const char* polynomial = "x * (y ^ 2) - 3 * x * y + sqrt(y) / 2";
+
+template <class Evaluator>
+void BM_eval_polynomial(benchmark::State& state)
+{
+    eval_text<Evaluator>(state, polynomial);
+}
+
+void BM_eval_polynomial_static(benchmark::State& state)
+{
+    const auto expr = CALC_STATIC_EXPR(polynomial);
+    auto ctx = make_context();
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(expr.eval(ctx));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+// Scaling sweep over expression size.
+template <class Evaluator>
+void BM_eval_terms(benchmark::State& state)
+{
+    std::string text = "x";
+    for (int i = 1; i < state.range(0); ++i)
+    {
+        text += i % 2 ? " + y * " : " - x / ";
+        text += std::to_string(i);
+    }
+    eval_text<Evaluator>(state, text);
+    state.SetComplexityN(state.range(0));
+}
+
+void BM_eval_batch(benchmark::State& state)
+{
+    const auto program = calc::Program::compile(*calc::parse("a * x ^ 2 + b * x + c"));
+    std::vector<double> x(static_cast<std::size_t>(state.range(0)), 0.5);
+    std::vector<double> out(x.size());
+    const calc::Context ctx{ { "a", 1.0 }, { "b", 2.0 }, { "c", 3.0 } };
+    const std::vector<calc::Column> columns{ { "x", x } };
+    for (auto _ : state)
+    {
+        calc::eval_batch(program, columns, out, ctx);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetItemsProcessed(state.iterations() * x.size());
+}
+
+// The same polynomial over columns of each element type; float fits twice as many rows in a vector register.
+template <class T>
+void BM_eval_batch_typed(benchmark::State& state)
+{
+    const auto program = calc::TypedProgram<T>::compile(*calc::parse("a * x * x + b * x + c"));
+    std::vector<T> x(static_cast<std::size_t>(state.range(0)), T{ 3 });
+    std::vector<T> out(x.size());
+    const calc::Context ctx{ { "a", 1.0 }, { "b", 2.0 }, { "c", 3.0 } };
+    const std::vector<calc::BasicColumn<T>> columns{ { "x", x } };
+    for (auto _ : state)
+    {
+        calc::eval_batch(program, columns, out, ctx);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetItemsProcessed(state.iterations() * x.size());
+    state.SetBytesProcessed(state.iterations() * x.size() * sizeof(T) * 2);
+}
+
+// A lookup table registered as a user function, called per row through the scalar form or per block through the
+// batch form.
+template <bool batch>
+void BM_batch_user_function(benchmark::State& state)
+{
+    static const std::vector<double> table = [] {
+        std::vector<double> res(1024);
+        for (std::size_t i = 0; i < res.size(); ++i)
+        {
+            res[i] = std::sin(0.01 * i);
+        }
+        return res;
+    }();
+    const auto lookup = [](double v) { return table[static_cast<std::size_t>(v) & 1023]; };
+    calc::Parser parser;
+    if (batch)
+    {
+        parser.register_function("lookup", [=](calc::Span<const calc::Span<const double>> args, calc::Span<double> out) {
+            std::transform(args[0].begin(), args[0].end(), out.begin(), lookup);
+        });
+    }
+    else
+    {
+        parser.register_function("lookup", [=](const std::vector<double>& args) { return lookup(args.at(0)); });
+    }
+    const auto program = calc::Program::compile(*parser("lookup(x * 3) + x"));
+    std::vector<double> x(static_cast<std::size_t>(state.range(0)));
+    for (std::size_t i = 0; i < x.size(); ++i)
+    {
+        x[i] = static_cast<double>(i);
+    }
+    std::vector<double> out(x.size());
+    const std::vector<calc::Column> columns{ { "x", x } };
+    for (auto _ : state)
+    {
+        calc::eval_batch(program, columns, out);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetItemsProcessed(state.iterations() * x.size());
+}
+
+// Scoring rows where one in eight misses a variable, either by catching the exception or through try_eval.
+template <bool use_try_eval>
+void BM_eval_missing_variables(benchmark::State& state)
+{
+    const auto expr = calc::parse("x * 2 + score_bonus");
+    const auto bonus = calc::symbols().intern("score_bonus");
+    std::vector<calc::Context> rows;
+    for (int i = 0; i < 64; ++i)
+    {
+        rows.push_back(make_context());
+        if (i % 8 != 0)
+        {
+            rows.back().set(bonus, 1.0);
+        }
+    }
+    for (auto _ : state)
+    {
+        double total = 0.0;
+        for (auto& ctx : rows)
+        {
+            if (use_try_eval)
+            {
+                const auto res = calc::try_eval(*expr, ctx);
+                total += res ? res.value : 0.0;
+                continue;
+            }
+            try
+            {
+                total += expr->eval(ctx);
+            }
+            catch (const std::runtime_error&)
+            {
+            }
+        }
+        benchmark::DoNotOptimize(total);
+    }
+    state.SetItemsProcessed(state.iterations() * rows.size());
+}
+
+// A costly term that only matters when a condition holds, which it does not for x = 0.75: masked by multiplying
+// with the condition, so always computed, against the conditional operator, which skips it.
+template <class Evaluator, bool lazy>
+void BM_eval_guarded(benchmark::State& state)
+{
+    calc::Parser parser;
+    parser.register_function("expensive", [](const std::vector<double>& args) {
+        double res = args.at(0);
+        for (int i = 0; i < 64; ++i)
+        {
+            res = std::sqrt(res + i);
+        }
+        return res;
+    });
+    eval_text<Evaluator>(state, parser, lazy ? "x > 1 ? expensive(x) : 0" : "(x > 1) * expensive(x)");
+}
+
+// 64 rules over the same distance, compiled one by one against one shared DAG.
+std::vector<calc::ExprPtr> distance_rules()
+{
+    std::vector<calc::ExprPtr> rules;
+    for (int k = 0; k < 64; ++k)
+    {
+        rules.push_back(calc::parse("sqrt(x ^ 2 + y ^ 2) * " + std::to_string(k) + " > z"));
+    }
+    return rules;
+}
+
+void BM_rules_separate(benchmark::State& state)
+{
+    std::vector<calc::Program> programs;
+    for (const auto& rule : distance_rules())
+    {
+        programs.push_back(calc::Program::compile(*rule));
+    }
+    auto ctx = make_context();
+    for (auto _ : state)
+    {
+        for (const auto& program : programs)
+        {
+            benchmark::DoNotOptimize(program.run(ctx));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * programs.size());
+}
+
+void BM_rules_shared(benchmark::State& state)
+{
+    const auto rules = distance_rules();
+    const auto program = calc::SharedProgram::compile(rules);
+    std::vector<double> results(rules.size());
+    auto ctx = make_context();
+    for (auto _ : state)
+    {
+        program.run(ctx, results);
+        benchmark::DoNotOptimize(results.data());
+    }
+    state.SetItemsProcessed(state.iterations() * rules.size());
+}
+
+const char* const gradient_expr = "sqrt(x ^ 2 + y ^ 2) * sin(x * y) + x / (1 + z * z)";
+
+// The value and three partials from central differences: two compiled evaluations per variable.
+void BM_gradient_finite_differences(benchmark::State& state)
+{
+    const auto program = calc::Program::compile(*calc::parse(gradient_expr));
+    const calc::Slot slots[] = { calc::symbols().intern("x"), calc::symbols().intern("y"), calc::symbols().intern("z") };
+    calc::Context ctx{ { "x", 0.4 }, { "y", -1.1 }, { "z", 3.0 } };
+    std::vector<double> results(4);
+    for (auto _ : state)
+    {
+        constexpr double h = 1e-6;
+        results[0] = program.run(ctx);
+        for (std::size_t k = 0; k < 3; ++k)
+        {
+            const double v = ctx.get(slots[k]);
+            ctx.set(slots[k], v + h);
+            const double above = program.run(ctx);
+            ctx.set(slots[k], v - h);
+            const double below = program.run(ctx);
+            ctx.set(slots[k], v);
+            results[1 + k] = (above - below) / (2 * h);
+        }
+        benchmark::DoNotOptimize(results.data());
+    }
+}
+
+void BM_gradient_symbolic(benchmark::State& state)
+{
+    const auto gradient = calc::Gradient::compile(*calc::parse(gradient_expr), { "x", "y", "z" });
+    calc::Context ctx{ { "x", 0.4 }, { "y", -1.1 }, { "z", 3.0 } };
+    std::vector<double> results(4);
+    for (auto _ : state)
+    {
+        gradient.run(ctx, results);
+        benchmark::DoNotOptimize(results.data());
+    }
+}
+
+// 256 rules scored against every row; the argument is the number of worker threads.
+void BM_executor_rules(benchmark::State& state)
+{
+    std::vector<calc::Program> programs;
+    for (int k = 0; k < 256; ++k)
+    {
+        programs.push_back(calc::Program::compile(*calc::parse("x * " + std::to_string(k) + " + y > 100")));
+    }
+    const std::size_t rows = 1 << 16;
+    std::vector<double> x(rows, 0.5);
+    std::vector<double> y(rows, 2.0);
+    const std::vector<calc::Column> columns{ { "x", x }, { "y", y } };
+    std::vector<std::vector<double>> storage(programs.size(), std::vector<double>(rows));
+    const std::vector<calc::Span<double>> outputs(storage.begin(), storage.end());
+
+    calc::Executor executor{ static_cast<std::size_t>(state.range(0)) };
+    for (auto _ : state)
+    {
+        executor.run(programs, columns, outputs);
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * rows * programs.size());
+}
+
+}  // namespace
+
+BENCHMARK_TEMPLATE(BM_eval_value, Tree);
+BENCHMARK_TEMPLATE(BM_eval_value, Bytecode);
+BENCHMARK_TEMPLATE(BM_eval_value, Jit);
+BENCHMARK_TEMPLATE(BM_eval_variable, Tree);
+BENCHMARK_TEMPLATE(BM_eval_variable, Bytecode);
+BENCHMARK_TEMPLATE(BM_eval_variable, Jit);
+BENCHMARK_TEMPLATE(BM_eval_unary_op, Tree);
+BENCHMARK_TEMPLATE(BM_eval_unary_op, Bytecode);
+BENCHMARK_TEMPLATE(BM_eval_unary_op, Jit);
+BENCHMARK_TEMPLATE(BM_eval_binary_op, Tree);
+BENCHMARK_TEMPLATE(BM_eval_binary_op, Bytecode);
+BENCHMARK_TEMPLATE(BM_eval_binary_op, Jit);
+BENCHMARK_TEMPLATE(BM_eval_func, Tree);
+BENCHMARK_TEMPLATE(BM_eval_func, Bytecode);
+BENCHMARK_TEMPLATE(BM_eval_func, Jit);
+BENCHMARK_TEMPLATE(BM_eval_assignment, Tree);
+BENCHMARK_TEMPLATE(BM_eval_assignment, Bytecode);
+BENCHMARK_TEMPLATE(BM_eval_assignment, Jit);
+BENCHMARK_TEMPLATE(BM_call_builtin, Tree);
+BENCHMARK_TEMPLATE(BM_call_builtin, Bytecode);
+BENCHMARK_TEMPLATE(BM_call_builtin, Jit);
+BENCHMARK_TEMPLATE(BM_call_user_function, Tree);
+BENCHMARK_TEMPLATE(BM_call_user_function, Bytecode);
+BENCHMARK_TEMPLATE(BM_call_user_function, Jit);
+BENCHMARK_TEMPLATE(BM_call_user_function, TreeInWorkspace);
+BENCHMARK_TEMPLATE(BM_call_user_function, BytecodeInWorkspace);
+BENCHMARK_TEMPLATE(BM_eval_polynomial, Tree);
+BENCHMARK_TEMPLATE(BM_eval_polynomial, Bytecode);
+BENCHMARK_TEMPLATE(BM_eval_polynomial, Jit);
+BENCHMARK(BM_eval_polynomial_static);
+BENCHMARK_TEMPLATE(BM_eval_terms, Tree)->RangeMultiplier(4)->Range(4, 1024)->Complexity();
+BENCHMARK_TEMPLATE(BM_eval_terms, Bytecode)->RangeMultiplier(4)->Range(4, 1024)->Complexity();
+BENCHMARK_TEMPLATE(BM_eval_terms, Jit)->RangeMultiplier(4)->Range(4, 1024)->Complexity();
+BENCHMARK_TEMPLATE(BM_eval_batch_typed, float)->Arg(1 << 16);
+BENCHMARK_TEMPLATE(BM_eval_batch_typed, double)->Arg(1 << 16);
+BENCHMARK_TEMPLATE(BM_eval_batch_typed, std::int64_t)->Arg(1 << 16);
+BENCHMARK_TEMPLATE(BM_batch_user_function, false)->Arg(1 << 16);
+BENCHMARK_TEMPLATE(BM_batch_user_function, true)->Arg(1 << 16);
+BENCHMARK_TEMPLATE(BM_eval_missing_variables, false);
+BENCHMARK_TEMPLATE(BM_eval_missing_variables, true);
+BENCHMARK_TEMPLATE(BM_eval_guarded, Tree, false);
+BENCHMARK_TEMPLATE(BM_eval_guarded, Tree, true);
+BENCHMARK_TEMPLATE(BM_eval_guarded, Bytecode, false);
+BENCHMARK_TEMPLATE(BM_eval_guarded, Bytecode, true);
+BENCHMARK_TEMPLATE(BM_eval_guarded, Jit, false);
+BENCHMARK_TEMPLATE(BM_eval_guarded, Jit, true);
+BENCHMARK(BM_eval_batch)->RangeMultiplier(16)->Range(16, 1 << 16);
+BENCHMARK(BM_rules_separate);
+BENCHMARK(BM_rules_shared);
+BENCHMARK(BM_gradient_finite_differences);
+BENCHMARK(BM_gradient_symbolic);
+BENCHMARK(BM_executor_rules)->RangeMultiplier(2)->Range(1, 64)->UseRealTime();
@@ -0,0 +1,161 @@
+#include <benchmark/benchmark.h>
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "calc.hpp"
+#include "expression_file.hpp"
+#include "program.hpp"
+#include "program_file.hpp"
+
+namespace
+{
+const auto short_text = std::string{ "2 * x + 1" };
+const auto long_text = std::string{ "a * x ^ 2 + b * x + c - sqrt(x * x + 1.5e3) / (2 - max(x, 0.5, 3)) + sin(a) * cos(b) - min(a, b, c) * 4" };
+
+std::string chain(int terms)
+{
+    std::string res = "x";
+    for (int i = 1; i < terms; ++i)
+    {
+        res += i % 2 ? " + x * " : " - x / ";
+        res += std::to_string(i);
+    }
+    return res;
+}
+
+std::string nested(int depth)
+{
+    std::string res = "x";
+    for (int i = 0; i < depth; ++i)
+    {
+        res = "(" + res + " + 1)";
+    }
+    return res;
+}
+
+template <calc::Parser::Engine engine>
+void run(benchmark::State& state, const std::string& text)
+{
+    const calc::Parser parser{ engine };
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(parser(text));
+    }
+    state.SetBytesProcessed(state.iterations() * text.size());
+}
+
+template <calc::Parser::Engine engine>
+void BM_parse_short(benchmark::State& state)
+{
+    run<engine>(state, short_text);
+}
+
+template <calc::Parser::Engine engine>
+void BM_parse_long(benchmark::State& state)
+{
+    run<engine>(state, long_text);
+}
+
+template <calc::Parser::Engine engine>
+void BM_parse_nested(benchmark::State& state)
+{
+    run<engine>(state, nested(static_cast<int>(state.range(0))));
+    state.SetComplexityN(state.range(0));
+}
+
+// Deep nesting with nothing but parens around the operand: the legacy engine used to re-validate every layer it
+// stripped.
+template <calc::Parser::Engine engine>
+void BM_parse_wrapped(benchmark::State& state)
+{
+    const auto depth = static_cast<std::size_t>(state.range(0));
+    run<engine>(state, std::string(depth, '(') + "x" + std::string(depth, ')'));
+    state.SetComplexityN(state.range(0));
+}
+
+// Scaling sweep over the number of terms in a flat formula.
+template <calc::Parser::Engine engine>
+void BM_parse_terms(benchmark::State& state)
+{
+    run<engine>(state, chain(static_cast<int>(state.range(0))));
+    state.SetComplexityN(state.range(0));
+}
+
+void BM_parse_in_arena(benchmark::State& state)
+{
+    const auto text = chain(static_cast<int>(state.range(0)));
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(calc::parse.parse_in_arena(text));
+    }
+    state.SetBytesProcessed(state.iterations() * text.size());
+}
+
+// Loads a file of 100k rules, with state.range(0) threads.
+void BM_load_expression_file(benchmark::State& state)
+{
+    const std::string path = "bench_expression_file.txt";
+    {
+        std::ofstream file{ path, std::ios::binary };
+        for (int i = 0; i < 100000; ++i)
+        {
+            file << long_text << "\n";
+        }
+    }
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(calc::ExpressionFile(path, calc::parse, state.range(0)));
+    }
+    state.SetBytesProcessed(state.iterations() * 100000 * (long_text.size() + 1));
+    std::remove(path.c_str());
+}
+
+// Cold start of 10k rules: parsing and compiling their text, against loading them precompiled.
+void BM_compile_rules(benchmark::State& state)
+{
+    for (auto _ : state)
+    {
+        std::vector<calc::Program> programs;
+        for (int i = 0; i < 10000; ++i)
+        {
+            programs.push_back(calc::Program::compile(*calc::parse(long_text)));
+        }
+        benchmark::DoNotOptimize(programs);
+    }
+}
+
+void BM_load_rules(benchmark::State& state)
+{
+    const std::vector<calc::Program> programs(10000, calc::Program::compile(*calc::parse(long_text)));
+    std::ostringstream os;
+    calc::save_programs(programs, os);
+    const std::string data = os.str();
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(calc::load_programs(data));
+    }
+    state.SetBytesProcessed(state.iterations() * data.size());
+}
+
+constexpr auto legacy = calc::Parser::Engine::legacy;
+constexpr auto pratt = calc::Parser::Engine::pratt;
+
+}  // namespace
+
+BENCHMARK_TEMPLATE(BM_parse_short, legacy);
+BENCHMARK_TEMPLATE(BM_parse_short, pratt);
+BENCHMARK_TEMPLATE(BM_parse_long, legacy);
+BENCHMARK_TEMPLATE(BM_parse_long, pratt);
+BENCHMARK_TEMPLATE(BM_parse_nested, legacy)->RangeMultiplier(4)->Range(4, 1024)->Complexity();
+BENCHMARK_TEMPLATE(BM_parse_nested, pratt)->RangeMultiplier(4)->Range(4, 256);
+BENCHMARK_TEMPLATE(BM_parse_wrapped, legacy)->RangeMultiplier(4)->Range(4, 4096)->Complexity();
+BENCHMARK_TEMPLATE(BM_parse_wrapped, pratt)->RangeMultiplier(4)->Range(4, 4096)->Complexity();
+BENCHMARK_TEMPLATE(BM_parse_terms, legacy)->RangeMultiplier(4)->Range(4, 256)->Complexity();
+BENCHMARK_TEMPLATE(BM_parse_terms, pratt)->RangeMultiplier(4)->Range(4, 1024)->Complexity();
+BENCHMARK(BM_parse_in_arena)->RangeMultiplier(4)->Range(4, 1024);
+BENCHMARK(BM_load_expression_file)->RangeMultiplier(2)->Range(1, 4)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_compile_rules)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_load_rules)->Unit(benchmark::kMillisecond);
@@ -0,0 +1,71 @@
+#include <benchmark/benchmark.h>
+
+#include <array>
+#include <optional>
+#include <string>
+
+#include "calc.hpp"
+
+namespace
+{
+// The std::stod based implementation parse_double replaced, kept as the baseline.
+std::optional<double> parse_double_stod(std::string_view text)
+{
+    try
+    {
+        std::size_t size{};
+        const double res = std::stod(std::string{ text }, &size);
+        if (size != text.size())
+        {
+            return std::nullopt;
+        }
+        return res;
+    }
+    catch (const std::invalid_argument&)
+    {
+        return std::nullopt;
+    }
+}
+
+// What the legacy parser feeds parse_double: mostly operator-bearing substrings that are not numbers at all.
+const auto inputs = std::array<std::string_view, 8>{ "3.14159", "1e-3", "x + 2", "(a * b)", "sin(x) * 2", "-12.5", "2 * 10 ^ 3", "0x1F" };
+
+template <class Parse>
+void parse_literals(benchmark::State& state, Parse parse)
+{
+    for (auto _ : state)
+    {
+        for (const auto text : inputs)
+        {
+            benchmark::DoNotOptimize(parse(text));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * inputs.size());
+}
+
+void BM_parse_double_stod(benchmark::State& state)
+{
+    parse_literals(state, parse_double_stod);
+}
+
+void BM_parse_double(benchmark::State& state)
+{
+    parse_literals(state, calc::parse_double);
+}
+
+void BM_legacy_parser(benchmark::State& state)
+{
+    const calc::Parser parser{ calc::Parser::Engine::legacy };
+    const std::string text = "a * x ^ 2 + b * x + c - sqrt(x * x + 1.5e3) / (2 - max(x, 0.5, 3))";
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(parser(text));
+    }
+    state.SetBytesProcessed(state.iterations() * text.size());
+}
+
+}  // namespace
+
+BENCHMARK(BM_parse_double_stod);
+BENCHMARK(BM_parse_double);
+BENCHMARK(BM_legacy_parser);
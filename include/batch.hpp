@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#include "calc.hpp"
+#include "program.hpp"
+#include "span.hpp"
+
+namespace calc
+{
+// Input column bound to the variable it provides values for.
+template <class T>
+struct BasicColumn
+{
+    Slot slot;
+    Span<const T> values;
+
+    BasicColumn(Slot slot, Span<const T> values)
+        : slot{ slot }
+        , values{ values }
+    {
+    }
+
+    BasicColumn(std::string_view name, Span<const T> values)
+        : BasicColumn{ symbols().intern(name), values }
+    {
+    }
+};
+
+using Column = BasicColumn<double>;
+using FloatColumn = BasicColumn<float>;
+using Int64Column = BasicColumn<std::int64_t>;
+
+// Number of rows every instruction processes at once.
+constexpr std::size_t batch_block_size = 256;
+
+// Scratch buffers for eval_batch over columns of T. Keeping one per thread and passing it to every call avoids
+// reallocating them for each batch; the buffers only ever grow.
+template <class T>
+struct BasicBatchWorkspace
+{
+    // A conditional whose condition differs between the rows of a block: both branches run, each over the rows that
+    // take it, and the results are blended at end_pc.
+    struct Region
+    {
+        std::size_t else_pc;
+        std::size_t end_pc;
+        bool in_else;
+        std::vector<char> then_rows;
+        std::vector<char> else_rows;
+        // The result of the then branch while the else branch runs.
+        std::vector<T> then_values;
+    };
+
+    std::vector<T> stack;
+    // Per slot: the input column, and the block stored by an assignment in the current block of rows.
+    std::vector<const T*> columns;
+    std::vector<const T*> assigned;
+    std::vector<std::vector<T>> assigned_blocks;
+    std::vector<const T*> args;
+    std::vector<Span<const double>> arg_spans;
+    std::vector<double> scalar_args;
+    // Nested conditionals being evaluated per row, and how many of them are open.
+    std::vector<Region> regions;
+    // User functions take doubles: the rows they are called on, packed and converted.
+    std::vector<double> gathered;
+};
+
+using BatchWorkspace = BasicBatchWorkspace<double>;
+
+// A Program checked for evaluation over columns of T, which is float, double or std::int64_t. Float programs run
+// every operation in single precision, user operators and functions excepted, which take and return doubles. For
+// std::int64_t the constructor throws std::invalid_argument if the program has a constant that is not an integer,
+// '/', '^', a user operator or function, or a built-in other than sum, max and min; integer arithmetic wraps around.
+template <class T>
+struct TypedProgram
+{
+public:
+    explicit TypedProgram(Program program);
+
+    static TypedProgram compile(const Expr& expr);
+
+    const Program& program() const;
+
+private:
+    Program source;
+};
+
+extern template struct TypedProgram<float>;
+extern template struct TypedProgram<double>;
+extern template struct TypedProgram<std::int64_t>;
+
+// Evaluates the program once per output row. Variables with a column read the row's value, any other variable is
+// taken from ctx and is the same for every row. Assignments are visible to the rest of the row but are not written
+// back to ctx. Branches only see the rows that take them: user functions are not called for the other rows, and
+// assignments in them leave the other rows unchanged.
+void eval_batch(const Program& program, Span<const Column> columns, Span<double> out, const Context& ctx = {});
+
+// Evaluates rows [first_row, first_row + out.size) of the columns into out, reusing the workspace's buffers.
+void eval_batch(
+    const Program& program, Span<const Column> columns, std::size_t first_row, Span<double> out, const Context& ctx, BatchWorkspace& workspace);
+
+void eval_batch(const Expr& expr, Span<const Column> columns, Span<double> out, const Context& ctx = {});
+
+// Keeps T to be deduced from the program alone, so that vectors still convert to the spans of columns and outputs.
+template <class T>
+struct NonDeduced
+{
+    using type = T;
+};
+
+template <class T>
+using non_deduced_t = typename NonDeduced<T>::type;
+
+// As above, over columns of T. Variables taken from ctx are converted to T; for std::int64_t they throw
+// std::invalid_argument unless they hold an integer. Assignments in branches leave a variable that had no value
+// before at NaN, or at 0 for std::int64_t, in the rows not taking the branch.
+template <class T>
+void eval_batch(
+    const TypedProgram<T>& program, Span<const BasicColumn<non_deduced_t<T>>> columns, Span<non_deduced_t<T>> out, const Context& ctx = {});
+
+template <class T>
+void eval_batch(
+    const TypedProgram<T>& program,
+    Span<const BasicColumn<non_deduced_t<T>>> columns,
+    std::size_t first_row,
+    Span<non_deduced_t<T>> out,
+    const Context& ctx,
+    BasicBatchWorkspace<non_deduced_t<T>>& workspace);
+
+}  // namespace calc
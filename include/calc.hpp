@@ -1,20 +1,237 @@
 #pragma once
 
+#include <array>
+#include <deque>
 #include <functional>
+#include <initializer_list>
 #include <iostream>
-#include <map>
+#include <limits>
 #include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <string>
 #include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "span.hpp"
 
 namespace calc
 {
+using Slot = std::size_t;
+
+// Binds every variable name to a slot index, once and for the lifetime of the process.
+// Names are interned when an expression is parsed, so evaluation only ever deals with slots.
+struct SymbolTable
+{
+public:
+    Slot intern(std::string_view name);
+    std::optional<Slot> find(std::string_view name) const;
+    std::string_view name(Slot slot) const;
+    std::size_t size() const;
+
+private:
+    mutable std::mutex mutex;
+    std::deque<std::string> names;
+    std::unordered_map<std::string_view, Slot> slots;
+};
+
+SymbolTable& symbols();
+
+struct EvalWorkspace;
+
+enum class EvalError
+{
+    none,
+    undefined_variable,
+};
+
+// The outcome of try_eval. On error, value is NaN and slot names the first variable read while undefined.
+struct EvalResult
+{
+    double value = 0.0;
+    EvalError error = EvalError::none;
+    Slot slot = 0;
+
+    explicit operator bool() const
+    {
+        return error == EvalError::none;
+    }
+};
+
 struct Context
 {
-    std::map<std::string, double> vars;
+    Context() = default;
+    Context(std::initializer_list<std::pair<std::string_view, double>> init);
+
+    // Variable values indexed by slot; a slot is only meaningful where `defined` is set.
+    std::vector<double> values;
+    std::vector<char> defined;
+    // Set by calc::eval for the duration of one evaluation; copies of the Context share it.
+    EvalWorkspace* workspace = nullptr;
+    // Set by calc::try_eval: reading an undefined variable then records the error here and yields NaN instead of
+    // throwing.
+    EvalResult* status = nullptr;
+
+    bool contains(Slot slot) const
+    {
+        return slot < defined.size() && defined[slot];
+    }
+
+    double get(Slot slot) const
+    {
+        if (!contains(slot))
+        {
+            return undefined(slot);
+        }
+        return values[slot];
+    }
+
+    void set(Slot slot, double value)
+    {
+        if (slot >= values.size())
+        {
+            reserve(slot + 1);
+        }
+        values[slot] = value;
+        defined[slot] = true;
+    }
+
+    void reserve(std::size_t slot_count);
+
+    std::optional<double> get(std::string_view name) const;
+    void set(std::string_view name, double value);
+
+    struct Variables
+    {
+        struct iterator
+        {
+            const Context* ctx;
+            Slot slot;
+
+            std::pair<std::string_view, double> operator*() const;
+            iterator& operator++();
+
+            friend bool operator==(const iterator& lhs, const iterator& rhs)
+            {
+                return lhs.slot == rhs.slot;
+            }
+
+            friend bool operator!=(const iterator& lhs, const iterator& rhs)
+            {
+                return !(lhs == rhs);
+            }
+        };
+
+        const Context& ctx;
+
+        iterator begin() const;
+        iterator end() const;
+    };
+
+    // Name-based view of the defined variables, in slot order.
+    Variables vars() const
+    {
+        return Variables{ *this };
+    }
+
+private:
+    double undefined(Slot slot) const;
+};
+
+// Scratch memory that lets evaluation run without allocating once it has warmed up. Reuse one per thread across
+// evaluations; the buffers only ever grow.
+struct EvalWorkspace
+{
+public:
+    // A call's argument buffer, released when the call returns so that the next call at this depth reuses it.
+    struct Args
+    {
+        EvalWorkspace& workspace;
+        std::vector<double>& values;
+
+        Args(const Args&) = delete;
+        Args& operator=(const Args&) = delete;
+
+        ~Args()
+        {
+            --workspace.depth;
+        }
+    };
+
+    // A buffer of `size` values for a call nested inside `depth` other calls whose arguments are still in use.
+    Args args(std::size_t size)
+    {
+        if (depth == buffers.size())
+        {
+            buffers.emplace_back();
+        }
+        auto& values = buffers[depth++];
+        values.resize(size);
+        return Args{ *this, values };
+    }
+
+    // Value stack for Program::run.
+    std::vector<double> stack;
+
+private:
+    // A deque, so that growing it for a nested call leaves the buffers of the enclosing calls in place.
+    std::deque<std::vector<double>> buffers;
+    std::size_t depth = 0;
 };
 
+// Binds a workspace to ctx until destroyed, first making room in ctx for the first slot_count slots. Callers pass how
+// many slots the evaluation uses, which keeps ctx proportional to the expression rather than to every name ever
+// interned.
+struct ScopedWorkspace
+{
+public:
+    ScopedWorkspace(Context& ctx, EvalWorkspace& workspace, std::size_t slot_count = 0);
+    ~ScopedWorkspace();
+
+    ScopedWorkspace(const ScopedWorkspace&) = delete;
+    ScopedWorkspace& operator=(const ScopedWorkspace&) = delete;
+
+private:
+    Context& ctx;
+    EvalWorkspace* previous;
+};
+
+struct FuncInfo;
+struct UnaryOpInfo;
+struct BinaryOpInfo;
+
 using Function = std::function<double(const std::vector<double>&)>;
 
+// How many arguments a function accepts, checked when a call is parsed so that functions can index their arguments
+// without checking.
+struct Arity
+{
+    std::size_t min = 0;
+    std::size_t max = static_cast<std::size_t>(-1);
+
+    static constexpr Arity exactly(std::size_t n)
+    {
+        return Arity{ n, n };
+    }
+
+    static constexpr Arity at_least(std::size_t n)
+    {
+        return Arity{ n };
+    }
+
+    constexpr bool accepts(std::size_t n) const
+    {
+        return min <= n && n <= max;
+    }
+};
+
+// Computes a function for a block of rows at once: args[k][i] is argument k of row i and out[i] receives the result
+// for row i. Every argument span has out.size elements.
+using BatchFunction = std::function<void(Span<const Span<const double>> args, Span<double> out)>;
+
 struct Expr
 {
     virtual ~Expr() = default;
@@ -23,18 +240,170 @@ struct Expr
     virtual void print(std::ostream& os, int level) const = 0;
 };
 
-using ExprPtr = std::unique_ptr<Expr>;
+struct ExprDeleter
+{
+    // Nodes placed in an arena are released together with the arena, never one by one.
+    bool owning = true;
+
+    ExprDeleter() = default;
+
+    explicit ExprDeleter(bool owning)
+        : owning{ owning }
+    {
+    }
+
+    template <class T>
+    ExprDeleter(const std::default_delete<T>&)
+    {
+    }
+
+    void operator()(Expr* expr) const
+    {
+        if (owning)
+        {
+            destroy(expr);
+        }
+    }
+
+    // Deletes expr and its subtree one node at a time: nodes released while another one is being deleted are queued,
+    // so tearing down a deep tree does not recurse.
+    static void destroy(Expr* expr);
+};
+
+using ExprPtr = std::unique_ptr<Expr, ExprDeleter>;
+
+// An expression whose nodes all live in one bump-allocated arena: destroying it is a single deallocation.
+struct ArenaExpr
+{
+    std::unique_ptr<std::pmr::monotonic_buffer_resource> arena;
+    ExprPtr root;
+
+    const Expr* get() const
+    {
+        return root.get();
+    }
+
+    const Expr& operator*() const
+    {
+        return *root;
+    }
+
+    const Expr* operator->() const
+    {
+        return root.get();
+    }
+
+    explicit operator bool() const
+    {
+        return static_cast<bool>(root);
+    }
+};
 
+// Work done by a parse, for finding inputs that are slow to parse. The legacy engine re-scans substrings, so most
+// counters only move for it; the Pratt engine lexes once and reports its tokens.
+struct ParseStats
+{
+    // Indices into failed_attempts: the legacy parse_expr tries these in order on every substring.
+    enum Method
+    {
+        number,
+        binary_or_assignment,
+        unary,
+        function,
+        variable,
+        method_count,
+    };
+
+    std::size_t parses = 0;
+    std::size_t bytes = 0;
+    // Parses that returned null, and parses that threw.
+    std::size_t failures = 0;
+    std::size_t errors = 0;
+
+    std::size_t parse_expr_calls = 0;
+    std::size_t max_depth = 0;
+    // valid_parens checks and paren layers stripped by simplify_parens, and the bytes read to index the parens, which
+    // happens once per parse.
+    std::size_t paren_scans = 0;
+    std::size_t paren_scan_bytes = 0;
+    // Bytes read by find_binary_oper looking for the operator to split at; parenthesized groups are skipped whole.
+    std::size_t operator_scan_bytes = 0;
+    std::array<std::size_t, method_count> failed_attempts{};
+    // Calls to parse_double that rejected their text.
+    std::size_t rejected_numbers = 0;
+    std::size_t tokens = 0;
+
+    ParseStats& operator+=(const ParseStats& other);
+};
+
+// Receives each parsed text with the stats of that parse alone.
+using ParseHook = std::function<void(std::string_view text, const ParseStats& stats)>;
+
+// Concurrency contract:
+// - A Parser may be used from many threads at once: parsing takes a shared lock on the function
+//   registry and register_function an exclusive one. set_engine and the stats setters are not
+//   synchronized and must not race with parsing.
+// - Registered functions are never moved, so trees parsed before a later register_function stay
+//   valid for the lifetime of the Parser.
+// - A parsed tree is immutable: eval only reads the nodes and writes the Context passed in, so
+//   one ExprPtr can be evaluated concurrently without locking as long as every thread uses its
+//   own Context. Registered Functions must themselves be safe to call concurrently.
 struct Parser
 {
 public:
+    enum class Engine
+    {
+        // Recursive descent over substrings: re-scans the text at every level.
+        legacy,
+        // Single lexing pass into a token buffer, then precedence climbing over the tokens.
+        pratt,
+    };
+
     Parser();
+    explicit Parser(Engine engine);
     ~Parser();
 
-    void register_function(std::string name, Function func);
+    // Pure functions depend only on their arguments and have no side effects, so calls to them may be evaluated
+    // ahead of time or shared between identical call sites. Leave pure unset for any callback that keeps state.
+    // Calls with an argument count outside arity fail to parse.
+    void register_function(std::string name, Function func, bool pure = false, Arity arity = {});
+
+    // Also registers a batch form, which eval_batch calls once per block of rows instead of calling func per row.
+    void register_function(std::string name, Function func, BatchFunction batch, bool pure = false, Arity arity = {});
+
+    // Registers only the batch form; scalar evaluation calls it with one-row spans.
+    void register_function(std::string name, BatchFunction batch, bool pure = false, Arity arity = {});
+
+    // The function registered under name, or null.
+    const FuncInfo* find_function(std::string_view name) const;
+
+    // The operators spelled symbol, or null.
+    const UnaryOpInfo* find_unary_op(std::string_view symbol) const;
+    const BinaryOpInfo* find_binary_op(std::string_view symbol) const;
+
+    void set_engine(Engine engine);
+    Engine engine() const;
+
+    // Inputs nested deeper than max_depth fail to parse with std::runtime_error, which bounds the stack that the
+    // recursive Expr::eval and Expr::print need on the result. 0, the default, means no limit. The legacy engine
+    // recurses while parsing as well; the Pratt engine keeps its stacks on the heap.
+    void set_max_depth(std::size_t max_depth);
+    std::size_t max_depth() const;
+
+    // Stats are off by default and cost nothing then. When on, or when a hook is set, every parse counts its work,
+    // adds it to the totals returned by stats() and passes it to the hook, on whichever thread parsed.
+    void set_collect_stats(bool collect);
+    void set_parse_hook(ParseHook hook);
+    ParseStats stats() const;
+    void reset_stats();
 
     ExprPtr operator()(std::string_view text) const;
 
+    ArenaExpr parse_in_arena(std::string_view text) const;
+
+    // Allocates the nodes from arena, which must outlive the returned tree; destroying the tree frees nothing.
+    ExprPtr parse_in(std::string_view text, std::pmr::memory_resource& arena) const;
+
 private:
     struct Impl;
     std::unique_ptr<Impl> impl;
@@ -42,4 +411,40 @@ private:
 
 static const inline auto parse = Parser{};
 
+// Evaluates expr under a ScopedWorkspace, so that neither calls nor assignments allocate once warmed up: the first
+// assignment to a variable ctx has no room for grows it. Errors still throw, and throwing allocates.
+double eval(const Expr& expr, Context& ctx, EvalWorkspace& workspace);
+
+// Runs run(ctx) with ctx.status bound, so that an undefined variable neither throws nor allocates: it reads as NaN,
+// which the arithmetic carries to the result, and the first one is reported in the returned EvalResult. Exceptions
+// from registered functions still propagate.
+template <class Run>
+EvalResult try_eval_with(Context& ctx, Run&& run)
+{
+    struct Binding
+    {
+        Context& ctx;
+        EvalResult* previous;
+
+        ~Binding()
+        {
+            ctx.status = previous;
+        }
+    };
+    EvalResult res;
+    const Binding binding{ ctx, std::exchange(ctx.status, &res) };
+    res.value = run(ctx);
+    if (!res)
+    {
+        res.value = std::numeric_limits<double>::quiet_NaN();
+    }
+    return res;
+}
+
+EvalResult try_eval(const Expr& expr, Context& ctx);
+EvalResult try_eval(const Expr& expr, Context& ctx, EvalWorkspace& workspace);
+
+// Parses a numeric literal spanning the whole text, as std::stod would; never allocates or throws.
+std::optional<double> parse_double(std::string_view text);
+
 }  // namespace calc
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "calc.hpp"
+#include "shared_program.hpp"
+#include "span.hpp"
+
+namespace calc
+{
+// Symbolic differentiation of expression trees. Arithmetic operators, negation, sin, cos, sqrt, sum, max, min and
+// conditionals have built-in rules; other functions need one registered. Comparisons and logical operators are
+// piecewise constant and differentiate to 0. Powers need a constant exponent, and assignments are rejected. Results
+// are simplified as they are built: terms multiplied by a constant 0 are dropped, so the derivative of x * y with
+// respect to x is y even where the tree would evaluate y * 0 to NaN.
+struct Differentiator
+{
+public:
+    // Builds derivatives from the operators and built-ins of parser, which also parses registered rules.
+    explicit Differentiator(const Parser& parser = calc::parse);
+
+    // Registers the partial derivatives of a function with respect to each of its parameters, as expressions in
+    // the parameters: register_rule("lerp", { "a", "b", "t" }, { "1 - t", "t", "b - a" }). Throws
+    // std::invalid_argument if the counts differ or a partial does not parse.
+    void register_rule(std::string name, const std::vector<std::string_view>& params, const std::vector<std::string_view>& partials);
+
+    // The derivative of expr with respect to variable, simplified. Throws std::invalid_argument for anything
+    // there is no rule for.
+    ExprPtr derivative(const Expr& expr, Slot variable) const;
+    ExprPtr derivative(const Expr& expr, std::string_view variable) const;
+
+private:
+    struct Rule
+    {
+        std::vector<Slot> params;
+        std::vector<ExprPtr> partials;
+    };
+
+    const Parser& parser;
+    std::unordered_map<std::string, Rule> rules;
+
+    friend struct Derivation;
+};
+
+// An expression and its partial derivatives with respect to some variables, compiled together into one
+// SharedProgram so that a single run yields all of them, with the subexpressions they share computed once.
+struct Gradient
+{
+    // The simplified derivative trees, one per variable.
+    std::vector<ExprPtr> partials;
+    SharedProgram program;
+
+    static Gradient compile(const Expr& expr, Span<const Slot> variables, const Differentiator& differentiator = Differentiator{});
+    static Gradient compile(
+        const Expr& expr, const std::vector<std::string_view>& variables, const Differentiator& differentiator = Differentiator{});
+
+    // results[0] receives the value of the expression and results[1 + k] the derivative with respect to the k-th
+    // variable; results holds at least partials.size() + 1 values.
+    void run(Context& ctx, Span<double> results) const;
+};
+
+}  // namespace calc
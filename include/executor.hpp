@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "batch.hpp"
+
+namespace calc
+{
+// Evaluates many programs over the same input columns on a fixed pool of worker threads.
+// Work is split into (program, row chunk) tasks. Every worker owns a deque of them, works through it from the front
+// and, once it runs dry, steals from the back of the other workers' deques. Each worker keeps its own BatchWorkspace,
+// so repeated runs do not allocate scratch memory.
+struct Executor
+{
+public:
+    // Rows per task, a multiple of batch_block_size.
+    static constexpr std::size_t default_chunk_rows = 16 * batch_block_size;
+
+    explicit Executor(std::size_t thread_count = std::thread::hardware_concurrency(), std::size_t chunk_rows = default_chunk_rows);
+    ~Executor();
+
+    Executor(const Executor&) = delete;
+    Executor& operator=(const Executor&) = delete;
+
+    std::size_t thread_count() const;
+
+    // Evaluates programs[k] for every row into outputs[k]; all outputs must have the same size. Chunk boundaries are
+    // placed on cache-line boundaries of each output, so no two workers write to the same line. Blocks until all
+    // tasks have run and rethrows the first exception any of them threw. Runs are serialized.
+    void run(Span<const Program> programs, Span<const Column> columns, Span<const Span<double>> outputs, const Context& ctx = {});
+
+private:
+    struct Task
+    {
+        std::size_t program;
+        std::size_t begin;
+        std::size_t end;
+    };
+
+    struct Worker;
+
+    void work(std::size_t id);
+    bool next_task(std::size_t id, Task& task);
+    void execute(Worker& worker, const Task& task);
+
+    const std::size_t chunk_rows;
+    std::vector<std::unique_ptr<Worker>> workers;
+
+    std::mutex run_mutex;
+
+    // Guards the wake-up state below.
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::size_t generation = 0;
+    bool stopping = false;
+
+    // The job of the current run.
+    Span<const Program> programs;
+    Span<const Column> columns;
+    Span<const Span<double>> outputs;
+    const Context* ctx = nullptr;
+    std::atomic<std::size_t> remaining{ 0 };
+    std::atomic<bool> failed{ false };
+    std::exception_ptr error;
+};
+
+}  // namespace calc
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "calc.hpp"
+#include "program.hpp"
+
+namespace calc
+{
+// A parsed expression together with its compiled program; never modified once built.
+struct CompiledExpr
+{
+    ExprPtr expr;
+    Program program;
+
+    double eval(Context& ctx) const
+    {
+        return program.run(ctx);
+    }
+};
+
+// Capacity-bounded LRU cache of compiled expressions keyed by their whitespace-trimmed source text.
+// All member functions may be called concurrently.
+struct ExpressionCache
+{
+public:
+    struct Stats
+    {
+        std::size_t hits = 0;
+        std::size_t misses = 0;
+        std::size_t evictions = 0;
+    };
+
+    ExpressionCache(const Parser& parser, std::size_t capacity);
+
+    // Returns null when the text cannot be parsed; parse errors are rethrown and nothing is cached for them.
+    std::shared_ptr<const CompiledExpr> get(std::string_view text);
+
+    Stats stats() const;
+    std::size_t size() const;
+    std::size_t capacity() const;
+    void clear();
+
+private:
+    struct Entry
+    {
+        std::string key;
+        std::shared_ptr<const CompiledExpr> value;
+    };
+
+    const Parser& parser;
+    const std::size_t max_size;
+
+    mutable std::mutex mutex;
+    // Most recently used first.
+    std::list<Entry> entries;
+    std::unordered_map<std::string_view, std::list<Entry>::iterator> index;
+
+    std::atomic<std::size_t> hits{ 0 };
+    std::atomic<std::size_t> misses{ 0 };
+    std::atomic<std::size_t> evictions{ 0 };
+};
+
+}  // namespace calc
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "calc.hpp"
+#include "mapped_file.hpp"
+
+namespace calc
+{
+// A file of expressions, one per line, parsed straight out of a memory mapping of it. Blank lines and lines starting
+// with '#' are skipped. Nodes are allocated from one arena per chunk of lines and variable names are interned, so
+// loading allocates little beyond the trees themselves; the texts are slices of the mapping.
+struct ExpressionFile
+{
+public:
+    // Parses the file in up to `threads` contiguous chunks at once. Throws std::runtime_error naming the first line
+    // that cannot be parsed.
+    ExpressionFile(const std::string& path, const Parser& parser, std::size_t threads = 1);
+
+    std::size_t size() const;
+
+    const Expr& operator[](std::size_t index) const;
+
+    std::string_view text(std::size_t index) const;
+
+    // The trees in file order, for functions taking Span<const ExprPtr>.
+    const std::vector<ExprPtr>& exprs() const;
+
+private:
+    MappedFile file;
+    std::vector<std::unique_ptr<std::pmr::monotonic_buffer_resource>> arenas;
+    std::vector<std::string_view> texts;
+    std::vector<ExprPtr> trees;
+};
+
+}  // namespace calc
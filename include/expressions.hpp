@@ -0,0 +1,613 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <iterator>
+#include <memory_resource>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "calc.hpp"
+
+namespace calc
+{
+inline std::string indent(int level)
+{
+    return std::string(level * 2, ' ');
+}
+
+using UnaryFunc = std::function<double(double)>;
+using BinaryFunc = std::function<double(double, double)>;
+
+struct Precedence
+{
+    int value;
+    bool right_associative;
+
+    friend bool operator<(const Precedence& precedence, int value)
+    {
+        return (precedence.value <= value && !precedence.right_associative) || (precedence.value < value && precedence.right_associative);
+    }
+};
+
+inline Precedence left_associative(int v)
+{
+    return { v, false };
+}
+
+inline Precedence right_associative(int v)
+{
+    return { v, true };
+}
+
+// Built-in operators are dispatched on their kind at compile time; `custom` operators go through `func`.
+enum class BinaryOpKind
+{
+    custom,
+    eq,
+    ne,
+    lt,
+    le,
+    gt,
+    ge,
+    add,
+    sub,
+    mul,
+    div,
+    pow,
+    assign,
+    // Short-circuiting: expressions::Logical evaluates the right operand only when needed.
+    logical_and,
+    logical_or,
+};
+
+enum class UnaryOpKind
+{
+    custom,
+    pos,
+    neg,
+};
+
+struct BinaryOpInfo
+{
+    std::string symbol;
+    Precedence precedence;
+    BinaryFunc func;
+    BinaryOpKind kind = BinaryOpKind::custom;
+};
+
+struct UnaryOpInfo
+{
+    std::string symbol;
+    UnaryFunc func;
+    UnaryOpKind kind = UnaryOpKind::custom;
+};
+
+// The truth value of a condition, as in C++: any nonzero value, NaN included, is true.
+constexpr bool truth(double x)
+{
+    return x != 0.0;
+}
+
+constexpr double apply(BinaryOpKind kind, double x, double y)
+{
+    switch (kind)
+    {
+        case BinaryOpKind::eq: return x == y;
+        case BinaryOpKind::ne: return x != y;
+        case BinaryOpKind::lt: return x < y;
+        case BinaryOpKind::le: return x <= y;
+        case BinaryOpKind::gt: return x > y;
+        case BinaryOpKind::ge: return x >= y;
+        case BinaryOpKind::add: return x + y;
+        case BinaryOpKind::sub: return x - y;
+        case BinaryOpKind::mul: return x * y;
+        case BinaryOpKind::div: return x / y;
+        case BinaryOpKind::pow: return std::pow(x, y);
+        case BinaryOpKind::logical_and: return truth(x) && truth(y);
+        case BinaryOpKind::logical_or: return truth(x) || truth(y);
+        default: throw std::logic_error{ "not a built-in binary operator" };
+    }
+}
+
+constexpr double apply(UnaryOpKind kind, double x)
+{
+    switch (kind)
+    {
+        case UnaryOpKind::pos: return x;
+        case UnaryOpKind::neg: return -x;
+        default: throw std::logic_error{ "not a built-in unary operator" };
+    }
+}
+
+// Evaluates a function over a block of n rows: args[k][i] is the k-th argument of row i.
+using BlockFunc = void (*)(const double* const* args, std::size_t argc, std::size_t n, double* out);
+using UnaryFuncPtr = double (*)(double);
+using SpanFuncPtr = double (*)(const double* args, std::size_t argc);
+
+struct FuncInfo
+{
+    std::string name;
+    // Generic entry point, always set; built-ins also provide the direct forms below.
+    Function func;
+    BlockFunc block = nullptr;
+    UnaryFuncPtr unary = nullptr;
+    SpanFuncPtr span = nullptr;
+    // Pure functions depend only on their arguments, so calls with constant arguments can be evaluated ahead of time.
+    bool pure = false;
+    // Optional block-at-a-time form of a registered function; built-ins provide `block` instead.
+    BatchFunction batch;
+    Arity arity;
+};
+
+// Throws std::runtime_error unless info accepts argc arguments.
+void check_arity(const FuncInfo& info, std::size_t argc);
+
+inline bool is_assignment(const BinaryOpInfo& op_info)
+{
+    return op_info.kind == BinaryOpKind::assign;
+}
+
+namespace expressions
+{
+struct Value : public Expr
+{
+    double v;
+
+    Value(double v)
+        : v{ v }
+    {
+    }
+
+    double eval(Context&) const override
+    {
+        return v;
+    }
+
+    void print(std::ostream& os, int level) const override
+    {
+        os << indent(level) << v << std::endl;
+    }
+};
+
+struct Variable : public Expr
+{
+    Slot slot;
+    std::string_view name;
+
+    Variable(std::string_view name)
+        : slot{ symbols().intern(name) }
+        , name{ symbols().name(slot) }
+    {
+    }
+
+    double eval(Context& ctx) const override
+    {
+        return ctx.get(slot);
+    }
+
+    void print(std::ostream& os, int level) const override
+    {
+        os << indent(level) << name << std::endl;
+    }
+};
+
+struct UnaryOp : public Expr
+{
+    const UnaryOpInfo& info;
+    ExprPtr sub;
+
+    UnaryOp(const UnaryOpInfo& info, ExprPtr sub)
+        : info{ info }
+        , sub{ std::move(sub) }
+    {
+    }
+
+    double eval(Context& ctx) const override
+    {
+        return info.func(sub->eval(ctx));
+    }
+
+    void print(std::ostream& os, int level) const override
+    {
+        os << indent(level) << info.symbol << std::endl;
+        sub->print(os, level + 1);
+    }
+};
+
+struct BinaryOp : public Expr
+{
+    const BinaryOpInfo& info;
+    ExprPtr lhs;
+    ExprPtr rhs;
+
+    BinaryOp(const BinaryOpInfo& info, ExprPtr lhs, ExprPtr rhs)
+        : info{ info }
+        , lhs{ std::move(lhs) }
+        , rhs{ std::move(rhs) }
+    {
+    }
+
+    double eval(Context& ctx) const override
+    {
+        // Left to right, so that an assignment on the left is visible on the right.
+        const double x = lhs->eval(ctx);
+        return info.func(x, rhs->eval(ctx));
+    }
+
+    void print(std::ostream& os, int level) const override
+    {
+        os << indent(level) << info.symbol << std::endl;
+        lhs->print(os, level + 1);
+        rhs->print(os, level + 1);
+    }
+};
+
+struct Func : public Expr
+{
+    const FuncInfo& info;
+    std::pmr::vector<ExprPtr> subs;
+
+    Func(const FuncInfo& info, std::pmr::vector<ExprPtr> subs)
+        : info{ info }
+        , subs{ std::move(subs) }
+    {
+    }
+
+    Func(const FuncInfo& info, std::vector<ExprPtr> subs)
+        : info{ info }
+        , subs{ std::make_move_iterator(subs.begin()), std::make_move_iterator(subs.end()) }
+    {
+    }
+
+    double eval(Context& ctx) const override
+    {
+        constexpr std::size_t inline_args = 8;
+        if (info.span && subs.size() <= inline_args)
+        {
+            double args[inline_args];
+            std::transform(subs.begin(), subs.end(), args, [&](const auto& expr_ptr) { return expr_ptr->eval(ctx); });
+            return info.span(args, subs.size());
+        }
+        if (ctx.workspace)
+        {
+            const auto args = ctx.workspace->args(subs.size());
+            std::transform(subs.begin(), subs.end(), args.values.begin(), [&](const auto& expr_ptr) { return expr_ptr->eval(ctx); });
+            return info.span ? info.span(args.values.data(), args.values.size()) : info.func(args.values);
+        }
+        std::vector<double> args(subs.size());
+        std::transform(subs.begin(), subs.end(), args.begin(), [&](const auto& expr_ptr) { return expr_ptr->eval(ctx); });
+        return info.span ? info.span(args.data(), args.size()) : info.func(args);
+    }
+
+    void print(std::ostream& os, int level) const override
+    {
+        os << indent(level) << info.name << std::endl;
+        for (std::size_t i = 0; i < subs.size(); ++i)
+        {
+            subs[i]->print(os, level + 1);
+        }
+    }
+};
+
+struct Assignment : public Expr
+{
+    Slot slot;
+    std::string_view name;
+    ExprPtr expr;
+
+    Assignment(std::string_view name, ExprPtr expr)
+        : slot{ symbols().intern(name) }
+        , name{ symbols().name(slot) }
+        , expr{ std::move(expr) }
+    {
+    }
+
+    double eval(Context& ctx) const override
+    {
+        const double res = expr->eval(ctx);
+        ctx.set(slot, res);
+        return res;
+    }
+
+    void print(std::ostream& os, int level) const override
+    {
+        os << indent(level) << name << std::endl;
+        expr->print(os, level + 1);
+    }
+};
+
+template <UnaryOpKind Kind>
+struct BuiltinUnaryOp : public UnaryOp
+{
+    using UnaryOp::UnaryOp;
+
+    double eval(Context& ctx) const override
+    {
+        return apply(Kind, sub->eval(ctx));
+    }
+};
+
+template <BinaryOpKind Kind>
+struct BuiltinBinaryOp : public BinaryOp
+{
+    using BinaryOp::BinaryOp;
+
+    double eval(Context& ctx) const override
+    {
+        const double x = lhs->eval(ctx);
+        return apply(Kind, x, rhs->eval(ctx));
+    }
+};
+
+// cond ? then : otherwise, also spelled if(cond, then, otherwise); only the branch that cond selects is evaluated.
+struct Conditional : public Expr
+{
+    ExprPtr cond;
+    ExprPtr then;
+    ExprPtr otherwise;
+
+    Conditional(ExprPtr cond, ExprPtr then, ExprPtr otherwise)
+        : cond{ std::move(cond) }
+        , then{ std::move(then) }
+        , otherwise{ std::move(otherwise) }
+    {
+    }
+
+    double eval(Context& ctx) const override
+    {
+        return truth(cond->eval(ctx)) ? then->eval(ctx) : otherwise->eval(ctx);
+    }
+
+    void print(std::ostream& os, int level) const override
+    {
+        os << indent(level) << "?" << std::endl;
+        cond->print(os, level + 1);
+        then->print(os, level + 1);
+        otherwise->print(os, level + 1);
+    }
+};
+
+// lhs && rhs and lhs || rhs: 1 or 0, with rhs evaluated only when lhs does not decide the result.
+struct Logical : public Expr
+{
+    const BinaryOpInfo& info;
+    ExprPtr lhs;
+    ExprPtr rhs;
+
+    Logical(const BinaryOpInfo& info, ExprPtr lhs, ExprPtr rhs)
+        : info{ info }
+        , lhs{ std::move(lhs) }
+        , rhs{ std::move(rhs) }
+    {
+    }
+
+    bool is_and() const
+    {
+        return info.kind == BinaryOpKind::logical_and;
+    }
+
+    // The result when lhs alone decides it: false for &&, true for ||.
+    bool decided_by(double lhs_value) const
+    {
+        return truth(lhs_value) != is_and();
+    }
+
+    double eval(Context& ctx) const override
+    {
+        const double x = lhs->eval(ctx);
+        if (decided_by(x))
+        {
+            return !is_and();
+        }
+        return truth(rhs->eval(ctx));
+    }
+
+    void print(std::ostream& os, int level) const override
+    {
+        os << indent(level) << info.symbol << std::endl;
+        lhs->print(os, level + 1);
+        rhs->print(os, level + 1);
+    }
+};
+
+// Call of a one-argument function through a plain function pointer.
+struct UnaryFuncCall : public Func
+{
+    using Func::Func;
+
+    double eval(Context& ctx) const override
+    {
+        return info.unary(subs[0]->eval(ctx));
+    }
+};
+
+}  // namespace expressions
+
+struct HeapNodes
+{
+    template <class T, class... Args>
+    ExprPtr make(Args&&... args) const
+    {
+        return std::make_unique<T>(std::forward<Args>(args)...);
+    }
+};
+
+// The factories below pick the node specialized for the operator or function; `nodes` decides where it is allocated.
+template <class Nodes = HeapNodes>
+ExprPtr make_unary_op(const UnaryOpInfo& info, ExprPtr sub, const Nodes& nodes = {})
+{
+    switch (info.kind)
+    {
+        case UnaryOpKind::pos: return nodes.template make<expressions::BuiltinUnaryOp<UnaryOpKind::pos>>(info, std::move(sub));
+        case UnaryOpKind::neg: return nodes.template make<expressions::BuiltinUnaryOp<UnaryOpKind::neg>>(info, std::move(sub));
+        default: return nodes.template make<expressions::UnaryOp>(info, std::move(sub));
+    }
+}
+
+template <class Nodes = HeapNodes>
+ExprPtr make_binary_op(const BinaryOpInfo& info, ExprPtr lhs, ExprPtr rhs, const Nodes& nodes = {})
+{
+    using expressions::BuiltinBinaryOp;
+    switch (info.kind)
+    {
+        case BinaryOpKind::eq: return nodes.template make<BuiltinBinaryOp<BinaryOpKind::eq>>(info, std::move(lhs), std::move(rhs));
+        case BinaryOpKind::ne: return nodes.template make<BuiltinBinaryOp<BinaryOpKind::ne>>(info, std::move(lhs), std::move(rhs));
+        case BinaryOpKind::lt: return nodes.template make<BuiltinBinaryOp<BinaryOpKind::lt>>(info, std::move(lhs), std::move(rhs));
+        case BinaryOpKind::le: return nodes.template make<BuiltinBinaryOp<BinaryOpKind::le>>(info, std::move(lhs), std::move(rhs));
+        case BinaryOpKind::gt: return nodes.template make<BuiltinBinaryOp<BinaryOpKind::gt>>(info, std::move(lhs), std::move(rhs));
+        case BinaryOpKind::ge: return nodes.template make<BuiltinBinaryOp<BinaryOpKind::ge>>(info, std::move(lhs), std::move(rhs));
+        case BinaryOpKind::add: return nodes.template make<BuiltinBinaryOp<BinaryOpKind::add>>(info, std::move(lhs), std::move(rhs));
+        case BinaryOpKind::sub: return nodes.template make<BuiltinBinaryOp<BinaryOpKind::sub>>(info, std::move(lhs), std::move(rhs));
+        case BinaryOpKind::mul: return nodes.template make<BuiltinBinaryOp<BinaryOpKind::mul>>(info, std::move(lhs), std::move(rhs));
+        case BinaryOpKind::div: return nodes.template make<BuiltinBinaryOp<BinaryOpKind::div>>(info, std::move(lhs), std::move(rhs));
+        case BinaryOpKind::pow: return nodes.template make<BuiltinBinaryOp<BinaryOpKind::pow>>(info, std::move(lhs), std::move(rhs));
+        case BinaryOpKind::logical_and:
+        case BinaryOpKind::logical_or: return nodes.template make<expressions::Logical>(info, std::move(lhs), std::move(rhs));
+        default: return nodes.template make<expressions::BinaryOp>(info, std::move(lhs), std::move(rhs));
+    }
+}
+
+template <class Subs, class Nodes = HeapNodes>
+ExprPtr make_func(const FuncInfo& info, Subs subs, const Nodes& nodes = {})
+{
+    check_arity(info, subs.size());
+    // The built-in if() is lazy, unlike any function.
+    if (info.pure && info.name == "if")
+    {
+        return nodes.template make<expressions::Conditional>(std::move(subs[0]), std::move(subs[1]), std::move(subs[2]));
+    }
+    if (info.unary && subs.size() == 1)
+    {
+        return nodes.template make<expressions::UnaryFuncCall>(info, std::move(subs));
+    }
+    return nodes.template make<expressions::Func>(info, std::move(subs));
+}
+
+template <class... Ts>
+struct overloaded : Ts...
+{
+    using Ts::operator()...;
+};
+
+template <class... Ts>
+overloaded(Ts...) -> overloaded<Ts...>;
+
+// Dispatches on the dynamic type of an expression node; every node type has to be handled by the visitor.
+template <class Visitor>
+decltype(auto) visit(const Expr& expr, Visitor&& visitor)
+{
+    if (const auto e = dynamic_cast<const expressions::Value*>(&expr))
+    {
+        return visitor(*e);
+    }
+    if (const auto e = dynamic_cast<const expressions::Variable*>(&expr))
+    {
+        return visitor(*e);
+    }
+    if (const auto e = dynamic_cast<const expressions::UnaryOp*>(&expr))
+    {
+        return visitor(*e);
+    }
+    if (const auto e = dynamic_cast<const expressions::BinaryOp*>(&expr))
+    {
+        return visitor(*e);
+    }
+    if (const auto e = dynamic_cast<const expressions::Func*>(&expr))
+    {
+        return visitor(*e);
+    }
+    if (const auto e = dynamic_cast<const expressions::Assignment*>(&expr))
+    {
+        return visitor(*e);
+    }
+    if (const auto e = dynamic_cast<const expressions::Conditional*>(&expr))
+    {
+        return visitor(*e);
+    }
+    if (const auto e = dynamic_cast<const expressions::Logical*>(&expr))
+    {
+        return visitor(*e);
+    }
+    throw std::logic_error{ "unknown expression type" };
+}
+
+// The operands of a node, for walking a tree without recursing through it.
+inline std::size_t operand_count(const Expr& expr)
+{
+    return visit(
+        expr,
+        overloaded{
+            [](const expressions::Value&) -> std::size_t { return 0; },
+            [](const expressions::Variable&) -> std::size_t { return 0; },
+            [](const expressions::UnaryOp&) -> std::size_t { return 1; },
+            [](const expressions::BinaryOp&) -> std::size_t { return 2; },
+            [](const expressions::Func& e) -> std::size_t { return e.subs.size(); },
+            [](const expressions::Assignment&) -> std::size_t { return 1; },
+            [](const expressions::Conditional&) -> std::size_t { return 3; },
+            [](const expressions::Logical&) -> std::size_t { return 2; },
+        });
+}
+
+// Operands are numbered in evaluation order.
+inline const Expr& operand(const Expr& expr, std::size_t index)
+{
+    return visit(
+        expr,
+        overloaded{
+            [](const expressions::Value&) -> const Expr& { throw std::out_of_range{ "constants have no operands" }; },
+            [](const expressions::Variable&) -> const Expr& { throw std::out_of_range{ "variables have no operands" }; },
+            [](const expressions::UnaryOp& e) -> const Expr& { return *e.sub; },
+            [&](const expressions::BinaryOp& e) -> const Expr& { return index == 0 ? *e.lhs : *e.rhs; },
+            [&](const expressions::Func& e) -> const Expr& { return *e.subs[index]; },
+            [](const expressions::Assignment& e) -> const Expr& { return *e.expr; },
+            [&](const expressions::Conditional& e) -> const Expr& { return index == 0 ? *e.cond : index == 1 ? *e.then : *e.otherwise; },
+            [&](const expressions::Logical& e) -> const Expr& { return index == 0 ? *e.lhs : *e.rhs; },
+        });
+}
+
+// Calls on_node for every node after all of its operands, keeping the path from the root on the heap instead of the
+// call stack, so that the depth of the tree does not matter. enter_operand(node, index) is called before the walk
+// descends into an operand, and the operand is skipped when it returns false: lazy evaluators decide there whether a
+// branch is needed, and compilers emit the jumps between operands.
+template <class EnterOperand, class OnNode>
+void walk_postorder(const Expr& root, EnterOperand&& enter_operand, OnNode&& on_node)
+{
+    struct Frame
+    {
+        const Expr* node;
+        std::size_t count;
+        std::size_t next;
+    };
+    std::vector<Frame> path{ Frame{ &root, operand_count(root), 0 } };
+    while (!path.empty())
+    {
+        Frame& top = path.back();
+        if (top.next < top.count)
+        {
+            const Expr& node = *top.node;
+            const std::size_t index = top.next++;
+            if (enter_operand(node, index))
+            {
+                const Expr& sub = operand(node, index);
+                path.push_back(Frame{ &sub, operand_count(sub), 0 });
+            }
+        }
+        else
+        {
+            const Expr& node = *top.node;
+            path.pop_back();
+            on_node(node);
+        }
+    }
+}
+
+template <class OnNode>
+void walk_postorder(const Expr& root, OnNode&& on_node)
+{
+    walk_postorder(root, [](const Expr&, std::size_t) { return true; }, on_node);
+}
+
+}  // namespace calc
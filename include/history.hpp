@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <fstream>
+#include <string>
+
+#include "calc.hpp"
+#include "program.hpp"
+
+namespace calc
+{
+// The lines evaluated so far, each with its compiled program so that it can be evaluated again without parsing.
+// Entries are numbered from 0 in the order they were pushed, and keep their numbers when older ones are dropped to
+// stay within max_size. A history opened on a file appends every pushed line to it; the file is a plain expression
+// file, one line per entry, loaded through ExpressionFile.
+struct History
+{
+public:
+    struct Entry
+    {
+        std::string text;
+        Program program;
+        // NaN for entries loaded from the file until they are run again.
+        double result;
+    };
+
+    explicit History(std::size_t max_size);
+
+    // Loads the last max_size lines of the file, if it exists, parsing them in up to `threads` chunks at once. Throws
+    // std::runtime_error if a line cannot be parsed or the file cannot be opened for appending.
+    History(const std::string& path, const Parser& parser, std::size_t max_size, std::size_t threads = 1);
+
+    void push(std::string text, Program program, double result);
+
+    // Entries first() to end() - 1 are kept.
+    std::size_t first() const;
+    std::size_t end() const;
+
+    // Throws std::out_of_range unless the entry is kept.
+    const Entry& operator[](std::size_t number) const;
+
+    // Evaluates the entry against ctx and records the new result.
+    double rerun(std::size_t number, Context& ctx);
+
+    // Writes the lines pushed since the last flush to the file. Lines are otherwise buffered.
+    void flush();
+
+private:
+    Entry& at(std::size_t number);
+
+    std::size_t max_size;
+    std::size_t dropped = 0;
+    std::deque<Entry> entries;
+    std::ofstream file;
+};
+
+}  // namespace calc
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <iostream>
+
+#include "calc.hpp"
+
+namespace calc
+{
+// Counterparts of Expr::eval and Expr::print that walk the tree with an explicit stack on the heap, for trees too
+// deep for the recursive versions on the calling thread's stack. They give the same results, only more slowly.
+double eval_iterative(const Expr& expr, Context& ctx);
+
+void print_iterative(const Expr& expr, std::ostream& os);
+
+}  // namespace calc
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "calc.hpp"
+#include "program.hpp"
+
+namespace calc
+{
+// Native x86-64 code generated from a Program. Code generation is only built with the CPP_CALCULATOR_JIT option on
+// an x86-64 Linux target; anywhere else, whenever executable memory cannot be mapped, and for programs whose
+// evaluation stack would make the native frame large, run() interprets the program instead. The generated code is never modified, so one JitProgram may be shared by threads that each run it
+// with their own Context.
+struct JitProgram
+{
+public:
+    explicit JitProgram(Program program);
+
+    static JitProgram compile(const Expr& expr);
+
+    // False when the program runs through the interpreter.
+    bool is_native() const;
+
+    const Program& program() const;
+
+    // Behaves like Program::run: variables read before being defined throw, or under try_eval_with read as NaN and
+    // are reported in ctx.status. Programs reading an undefined variable are left to the interpreter for that.
+    double run(Context& ctx) const;
+
+private:
+    // Reads variables from, and writes assignments to, an array of values indexed by slot. Errors raised by
+    // operators and functions are parked for run() to rethrow, so the generated code is only ever called by run().
+    using NativeFunc = double (*)(double* slots);
+
+    struct Code;
+
+    Program source;
+    // Slots read before the program assigns them, by code that always runs or only in some branch, and slots it
+    // assigns.
+    std::vector<Slot> inputs;
+    std::vector<Slot> lazy_inputs;
+    std::vector<Slot> outputs;
+    std::size_t slot_count = 0;
+    std::shared_ptr<const Code> code;
+};
+
+}  // namespace calc
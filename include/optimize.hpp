@@ -0,0 +1,18 @@
+#pragma once
+
+#include "calc.hpp"
+
+namespace calc
+{
+struct OptimizeOptions
+{
+    // Variables defined here are folded into the tree as constants, unless the expression assigns them.
+    const Context* constants = nullptr;
+};
+
+// Returns a simplified copy of the tree: constant subtrees and pure function calls with constant arguments are
+// evaluated, identities such as x * 1, x - 0 and --x are removed, and conditionals and logical operators whose
+// condition is constant keep only the operand that is still evaluated.
+ExprPtr optimize(const Expr& expr, const OptimizeOptions& options = {});
+
+}  // namespace calc
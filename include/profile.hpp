@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <string>
+
+#include "calc.hpp"
+
+namespace calc
+{
+// Heap allocations made by the calling thread so far. Counting replaces the global operator new and is only built
+// with the CPP_CALCULATOR_COUNT_ALLOCATIONS option; without it this is always 0.
+std::uint64_t allocation_count();
+
+// What one node of a profiled tree cost over all its evaluations. Times are wall-clock nanoseconds that include the
+// probes' own overhead, so they are for comparing nodes rather than for absolute figures.
+struct NodeProfile
+{
+    // Operator symbol, function or variable name, or constant value, as Expr::print shows it.
+    std::string label;
+    std::size_t depth = 0;
+    std::uint64_t calls = 0;
+    // The node together with everything below it.
+    std::uint64_t nanoseconds = 0;
+    // Function calls only: the part of the time spent inside the registered callback.
+    std::uint64_t callback_nanoseconds = 0;
+    // Heap allocations made while evaluating the node and everything below it.
+    std::uint64_t allocations = 0;
+};
+
+// Instrumented copy of a tree: every node is wrapped in a probe that accumulates a NodeProfile. Profiling is opt-in
+// per tree, so trees that are not profiled run exactly as before. Not safe to evaluate from several threads at once.
+struct ProfiledExpr
+{
+public:
+    // The probes time each node around the evaluation of its operands, so evaluation recurses once per level; the
+    // depth of the trees that can be profiled is bounded to keep that recursion well within a thread's stack.
+    static constexpr std::size_t max_depth = 2000;
+
+    // Throws std::invalid_argument if expr is nested deeper than max_depth.
+    explicit ProfiledExpr(const Expr& expr);
+
+    double eval(Context& ctx) const;
+
+    // One entry per node, in the pre-order of Expr::print.
+    const std::deque<NodeProfile>& nodes() const;
+
+    // Time spent in a node itself: its total minus that of its children.
+    std::uint64_t self_nanoseconds(std::size_t index) const;
+
+    void reset();
+
+    // The tree as Expr::print shows it, each node annotated with its counters.
+    void print(std::ostream& os) const;
+
+    // The counters as a JSON array of nodes, in pre-order.
+    void write_json(std::ostream& os) const;
+
+private:
+    std::deque<NodeProfile> profiles;
+    ExprPtr root;
+};
+
+}  // namespace calc
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "calc.hpp"
+
+namespace calc
+{
+struct UnaryOpInfo;
+struct BinaryOpInfo;
+struct FuncInfo;
+
+enum class OpCode : std::uint8_t
+{
+    push_const,  // push constants[index]
+    load_var,    // push the value of the variable in slot `index`
+    store_var,   // assign the top of the stack to the variable in slot `index`, leaving it on the stack
+    neg,
+    add,
+    sub,
+    mul,
+    div,
+    pow,
+    eq,
+    ne,
+    lt,
+    le,
+    gt,
+    ge,
+    unary,   // apply unary_ops[index] to the top of the stack
+    binary,  // apply binary_ops[index] to the two topmost values
+    call,        // call functions[index] with the `count` topmost values
+    call_unary,  // call functions[index] through its one-argument function pointer
+    call_span,   // call functions[index] with the `count` topmost values, read in place from the stack
+    jump,          // continue at code[index]; jumps only ever go forward
+    jump_if_zero,  // pop the top of the stack, and continue at code[index] if it is zero
+    to_bool,       // replace the top of the stack by 1 if it is true, else by 0
+    select,        // pop c, a and b, and push a if c is true, else b; only used by SharedProgram
+};
+
+struct Instruction
+{
+    OpCode op;
+    // Argument count of a call; the compilers reject calls with more arguments than it holds.
+    std::uint16_t count;
+    std::uint32_t index;
+};
+
+// Flat, stack-machine form of an expression tree.
+struct Program
+{
+    std::vector<Instruction> code;
+    std::vector<double> constants;
+    std::vector<const UnaryOpInfo*> unary_ops;
+    std::vector<const BinaryOpInfo*> binary_ops;
+    std::vector<const FuncInfo*> functions;
+    std::size_t stack_size = 0;
+    // One past the highest slot the code reads or writes.
+    std::size_t slot_count = 0;
+
+    // Throws std::invalid_argument for a call with more arguments than Instruction::count holds.
+    static Program compile(const Expr& expr);
+
+    // Takes its scratch buffers from ctx.workspace when one is bound.
+    double run(Context& ctx) const;
+
+    // As run, under a ScopedWorkspace that makes room in ctx for slot_count slots.
+    double run(Context& ctx, EvalWorkspace& workspace) const;
+
+    // As run, under try_eval_with.
+    EvalResult try_run(Context& ctx) const;
+
+    void print(std::ostream& os) const;
+};
+
+}  // namespace calc
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "calc.hpp"
+#include "program.hpp"
+#include "span.hpp"
+
+namespace calc
+{
+// Version of the format written by save_programs; data of any other version is rejected on load.
+constexpr std::uint32_t program_file_version = 1;
+
+// Writes programs in a compact binary form: flat sections of instructions, constants and name references behind a
+// fixed header, stored in the byte order of the writing machine. Variables, functions and custom operators are
+// recorded by name, since slots and registry entries only mean something within one process.
+void save_programs(Span<const Program> programs, std::ostream& os);
+
+// Reads back data written by save_programs, e.g. straight out of a MappedFile: each section is copied as is, then
+// names are interned once per file and functions and operators looked up in parser. Throws std::runtime_error on
+// malformed data, another version, or a name parser does not know.
+std::vector<Program> load_programs(std::string_view data, const Parser& parser = parse);
+
+// As load_programs, reading the data from a memory mapping of path.
+std::vector<Program> load_program_file(const std::string& path, const Parser& parser = parse);
+
+}  // namespace calc
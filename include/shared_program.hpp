@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "calc.hpp"
+#include "program.hpp"
+#include "span.hpp"
+
+namespace calc
+{
+// Several expressions compiled into one DAG in which structurally identical subtrees are a single node, so a
+// subexpression shared by many expressions is computed once per run. Assignments, calls to impure functions and
+// reads of variables that any of the expressions assign are never merged. The branches of conditionals and logical
+// operators stay lazy: their nodes are guarded, and skipped in runs where the branch is not taken.
+struct SharedProgram
+{
+    // Computes one value from the values of earlier nodes, listed in operands[first_operand, first_operand + count).
+    // op and index mean what they do in an Instruction; jumps are never used. The node is only computed while
+    // guards[guard] holds.
+    struct Node
+    {
+        OpCode op;
+        std::uint16_t count;
+        std::uint32_t index;
+        std::uint32_t first_operand;
+        std::uint32_t guard;
+    };
+
+    // Holds when its parent holds and the truth of node cond equals when. guards[0] always holds.
+    struct Guard
+    {
+        std::uint32_t parent;
+        std::uint32_t cond;
+        bool when;
+
+        friend bool operator==(const Guard& lhs, const Guard& rhs)
+        {
+            return lhs.parent == rhs.parent && lhs.cond == rhs.cond && lhs.when == rhs.when;
+        }
+    };
+
+    std::vector<Node> nodes;
+    std::vector<Guard> guards{ Guard{ 0, 0, true } };
+    std::vector<std::uint32_t> operands;
+    std::vector<double> constants;
+    std::vector<const UnaryOpInfo*> unary_ops;
+    std::vector<const BinaryOpInfo*> binary_ops;
+    std::vector<const FuncInfo*> functions;
+    // The node holding the value of each expression.
+    std::vector<std::uint32_t> roots;
+
+    // Throws std::invalid_argument for a call with more arguments than Node::count holds.
+    static SharedProgram compile(Span<const ExprPtr> exprs);
+
+    // Evaluates the expressions in order, with the same effect on ctx as evaluating them one by one; results[k]
+    // receives the value of the k-th expression.
+    void run(Context& ctx, Span<double> results) const;
+
+    void print(std::ostream& os) const;
+};
+
+}  // namespace calc
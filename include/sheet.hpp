@@ -0,0 +1,65 @@
+#pragma once
+
+#include <string_view>
+#include <vector>
+
+#include "calc.hpp"
+#include "program.hpp"
+
+namespace calc
+{
+// Spreadsheet-like set of live formulas over a Context. Every assignment defines its variable as a formula of the
+// variables it reads. A change to any variable only marks the formulas downstream of it as dirty; a dirty formula is
+// recomputed, after its own dirty inputs, when it is read. Values nobody reads are never computed.
+struct Sheet
+{
+public:
+    explicit Sheet(Context& ctx);
+
+    // Keeps expr, which must be an assignment, as the formula of the assigned variable, replacing any previous one.
+    // Throws std::invalid_argument if the formula would depend on itself or contains further assignments.
+    void define(ExprPtr expr);
+
+    // Replaces the variable's formula, if any, with a plain value.
+    void set(Slot slot, double value);
+    void set(std::string_view name, double value);
+
+    // Recomputes the variable first if it is dirty.
+    double get(Slot slot);
+    double get(std::string_view name);
+
+    // Defines an assignment and returns the assigned value; evaluates anything else against up-to-date variables.
+    double eval(ExprPtr expr);
+
+    // Replaces every formula by its value, leaving the variables of formulas that cannot be computed undefined, so
+    // that ctx can be written directly again.
+    void freeze();
+
+    bool is_formula(Slot slot) const;
+    bool is_dirty(Slot slot) const;
+
+    // Number of formula evaluations so far.
+    std::size_t evaluations() const;
+
+private:
+    struct Cell
+    {
+        ExprPtr formula;
+        // The formula compiled, so that recomputing it does not recurse through deep trees.
+        Program program;
+        std::vector<Slot> inputs;
+        std::vector<Slot> dependents;
+        bool dirty = false;
+    };
+
+    Cell& cell(Slot slot);
+    void unlink(Slot slot);
+    void invalidate(Slot slot);
+    void refresh(Slot slot);
+
+    Context& ctx;
+    std::vector<Cell> cells;
+    std::size_t evaluation_count = 0;
+};
+
+}  // namespace calc
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+
+namespace calc
+{
+// Non-owning view over a contiguous array, until the code base can move to C++20's std::span.
+template <class T>
+struct Span
+{
+    T* data = nullptr;
+    std::size_t size = 0;
+
+    Span() = default;
+
+    Span(T* data, std::size_t size)
+        : data{ data }
+        , size{ size }
+    {
+    }
+
+    template <class U, class = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+    Span(std::vector<U>& items)
+        : Span{ items.data(), items.size() }
+    {
+    }
+
+    template <class U, class = std::enable_if_t<std::is_convertible_v<const U*, T*>>>
+    Span(const std::vector<U>& items)
+        : Span{ items.data(), items.size() }
+    {
+    }
+
+    T& operator[](std::size_t index) const
+    {
+        return data[index];
+    }
+
+    T* begin() const
+    {
+        return data;
+    }
+
+    T* end() const
+    {
+        return data + size;
+    }
+
+    bool empty() const
+    {
+        return size == 0;
+    }
+};
+
+}  // namespace calc
@@ -0,0 +1,739 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "calc.hpp"
+#include "expressions.hpp"
+
+namespace calc
+{
+namespace static_expressions
+{
+enum class Kind
+{
+    value,
+    variable,
+    neg,
+    add,
+    sub,
+    mul,
+    div,
+    pow,
+    eq,
+    ne,
+    lt,
+    le,
+    gt,
+    ge,
+    logical_and,
+    logical_or,
+    conditional,
+    assign,
+    call,
+};
+
+// Built-in functions that are evaluated inline; every other call goes through a Parser's registry.
+enum class Builtin
+{
+    none,
+    sum,
+    sin,
+    cos,
+    max,
+    min,
+    sqrt,
+};
+
+struct Node
+{
+    Kind kind = Kind::value;
+    double value = 0.0;
+    // The variable's index in Tree::names, or for calls to registered functions their index in Tree::functions.
+    std::size_t symbol = 0;
+    // Operands; a negation or an assignment only uses lhs. A conditional yields lhs or rhs by the truth of cond.
+    std::size_t lhs = 0;
+    std::size_t rhs = 0;
+    std::size_t cond = 0;
+    // Calls take their arguments from Tree::args[first_arg, first_arg + arg_count).
+    std::size_t first_arg = 0;
+    std::size_t arg_count = 0;
+    Builtin builtin = Builtin::none;
+};
+
+// Every node consumes at least one character of the text, so N entries always suffice.
+template <std::size_t N>
+struct Tree
+{
+    std::array<Node, N> nodes{};
+    std::array<std::size_t, N> args{};
+    std::array<std::string_view, N> names{};
+    std::array<std::string_view, N> functions{};
+    std::size_t node_count = 0;
+    std::size_t arg_count = 0;
+    std::size_t name_count = 0;
+    std::size_t function_count = 0;
+    std::size_t root = 0;
+};
+
+struct OpInfo
+{
+    std::string_view symbol;
+    int precedence;
+    bool right_associative;
+    Kind kind;
+};
+
+// Mirrors the operator table of Parser::Impl; longest symbols first, as the tokenizer matches them. The conditional
+// operator is parsed on its own.
+constexpr std::array<OpInfo, 14> binary_ops{ {
+    { "&&", 8, false, Kind::logical_and },
+    { "||", 7, false, Kind::logical_or },
+    { "==", 10, false, Kind::eq },
+    { "!=", 10, false, Kind::ne },
+    { "<=", 10, false, Kind::le },
+    { ">=", 10, false, Kind::ge },
+    { "<", 10, false, Kind::lt },
+    { ">", 10, false, Kind::gt },
+    { "+", 20, false, Kind::add },
+    { "-", 20, false, Kind::sub },
+    { "*", 40, false, Kind::mul },
+    { "/", 40, false, Kind::div },
+    { "^", 30, true, Kind::pow },
+    { "=", 5, false, Kind::assign },
+} };
+
+constexpr int conditional_precedence = 6;
+
+constexpr bool is_space(char ch)
+{
+    return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\v' || ch == '\f' || ch == '\r';
+}
+
+constexpr bool is_identifier_char(char ch)
+{
+    return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || ch == '_';
+}
+
+constexpr bool is_digit(char ch)
+{
+    return ch >= '0' && ch <= '9';
+}
+
+constexpr bool equal_ignoring_case(std::string_view lhs, std::string_view rhs)
+{
+    if (lhs.size() != rhs.size())
+    {
+        return false;
+    }
+    for (std::size_t i = 0; i < lhs.size(); ++i)
+    {
+        const char ch = lhs[i] >= 'A' && lhs[i] <= 'Z' ? static_cast<char>(lhs[i] - 'A' + 'a') : lhs[i];
+        if (ch != rhs[i])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+constexpr double pow10(int exponent)
+{
+    long double res = 1;
+    for (int i = 0; i < (exponent < 0 ? -exponent : exponent); ++i)
+    {
+        res *= 10;
+    }
+    return static_cast<double>(exponent < 0 ? 1 / res : res);
+}
+
+// Decimal literal to double. Up to 2^53 with at most 22 decimal places either way, this is exact like
+// std::from_chars; beyond that it is computed in long double and may differ in the last bit.
+constexpr double decimal_value(std::uint64_t mantissa, int exponent, bool exact)
+{
+    if (exact && mantissa <= (std::uint64_t{ 1 } << 53) && exponent >= -22 && exponent <= 22)
+    {
+        return exponent < 0 ? static_cast<double>(mantissa) / pow10(-exponent) : static_cast<double>(mantissa) * pow10(exponent);
+    }
+    long double res = static_cast<long double>(mantissa);
+    for (; exponent > 0; --exponent)
+    {
+        res *= 10;
+    }
+    for (; exponent < 0; ++exponent)
+    {
+        res /= 10;
+    }
+    return static_cast<double>(res);
+}
+
+struct Token
+{
+    enum class Kind
+    {
+        number,
+        identifier,
+        op,
+        lparen,
+        rparen,
+        comma,
+        end,
+    };
+
+    Kind kind = Kind::end;
+    std::string_view text;
+    double value = 0.0;
+    // Offset just past the token.
+    std::size_t end = 0;
+};
+
+// The Pratt engine of Parser::Impl, evaluated by the compiler. Malformed text fails to compile at the throw.
+template <std::size_t N>
+struct Parser
+{
+    std::string_view text;
+    std::size_t pos = 0;
+    Tree<N> tree{};
+
+    constexpr Token scan_number(std::size_t begin) const
+    {
+        if (text.size() > begin + 2 && text[begin] == '0' && (text[begin + 1] == 'x' || text[begin + 1] == 'X'))
+        {
+            throw std::invalid_argument{ "hexadecimal literals are not supported in static expressions" };
+        }
+        std::uint64_t mantissa = 0;
+        int exponent = 0;
+        bool exact = true;
+        std::size_t digits = 0;
+        std::size_t i = begin;
+        const auto digit = [&](char ch, bool fraction) {
+            if (mantissa < std::numeric_limits<std::uint64_t>::max() / 10)
+            {
+                mantissa = mantissa * 10 + static_cast<std::uint64_t>(ch - '0');
+                exponent -= fraction;
+            }
+            else
+            {
+                exact = exact && ch == '0';
+                exponent += !fraction;
+            }
+            ++digits;
+        };
+        for (; i < text.size() && is_digit(text[i]); ++i)
+        {
+            digit(text[i], false);
+        }
+        if (i < text.size() && text[i] == '.')
+        {
+            for (++i; i < text.size() && is_digit(text[i]); ++i)
+            {
+                digit(text[i], true);
+            }
+        }
+        if (digits == 0)
+        {
+            return Token{};
+        }
+        if (i < text.size() && (text[i] == 'e' || text[i] == 'E'))
+        {
+            std::size_t j = i + 1;
+            const bool negative = j < text.size() && text[j] == '-';
+            if (j < text.size() && (text[j] == '+' || text[j] == '-'))
+            {
+                ++j;
+            }
+            if (j < text.size() && is_digit(text[j]))
+            {
+                int value = 0;
+                for (i = j; i < text.size() && is_digit(text[i]); ++i)
+                {
+                    value = std::min(value * 10 + (text[i] - '0'), 100000);
+                }
+                exponent += negative ? -value : value;
+            }
+        }
+        return Token{ Token::Kind::number, text.substr(begin, i - begin), decimal_value(mantissa, exponent, exact), i };
+    }
+
+    constexpr Token peek() const
+    {
+        std::size_t i = pos;
+        while (i < text.size() && is_space(text[i]))
+        {
+            ++i;
+        }
+        if (i == text.size())
+        {
+            return Token{ Token::Kind::end, text.substr(i), 0.0, i };
+        }
+        const char ch = text[i];
+        if (ch == '?' || ch == ':')
+        {
+            return Token{ Token::Kind::op, text.substr(i, 1), 0.0, i + 1 };
+        }
+        if (ch == '(' || ch == ')' || ch == ',')
+        {
+            return Token{ ch == '(' ? Token::Kind::lparen : ch == ')' ? Token::Kind::rparen : Token::Kind::comma, text.substr(i, 1), 0.0, i + 1 };
+        }
+        if (is_digit(ch) || ch == '.')
+        {
+            if (const Token number = scan_number(i); number.kind == Token::Kind::number)
+            {
+                return number;
+            }
+        }
+        if (is_identifier_char(ch))
+        {
+            std::size_t size = 1;
+            while (i + size < text.size() && is_identifier_char(text[i + size]))
+            {
+                ++size;
+            }
+            return Token{ Token::Kind::identifier, text.substr(i, size), 0.0, i + size };
+        }
+        for (const OpInfo& op : binary_ops)
+        {
+            if (text.substr(i, op.symbol.size()) == op.symbol)
+            {
+                return Token{ Token::Kind::op, op.symbol, 0.0, i + op.symbol.size() };
+            }
+        }
+        throw std::invalid_argument{ "unexpected character in static expression" };
+    }
+
+    constexpr Token next()
+    {
+        const Token res = peek();
+        pos = res.end;
+        return res;
+    }
+
+    constexpr bool accept(Token::Kind kind)
+    {
+        if (peek().kind == kind)
+        {
+            next();
+            return true;
+        }
+        return false;
+    }
+
+    constexpr void expect(Token::Kind kind)
+    {
+        if (!accept(kind))
+        {
+            throw std::invalid_argument{ "unbalanced parens or separators in static expression" };
+        }
+    }
+
+    constexpr std::size_t add(Node node)
+    {
+        tree.nodes[tree.node_count] = node;
+        return tree.node_count++;
+    }
+
+    template <std::size_t M>
+    static constexpr std::size_t intern(std::array<std::string_view, M>& items, std::size_t& count, std::string_view name)
+    {
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            if (items[i] == name)
+            {
+                return i;
+            }
+        }
+        items[count] = name;
+        return count++;
+    }
+
+    constexpr std::size_t parse_operand_chain(int min_precedence)
+    {
+        std::size_t lhs = parse_prefix();
+        while (peek().kind == Token::Kind::op)
+        {
+            const std::string_view symbol = peek().text;
+            if (symbol == ":")
+            {
+                break;
+            }
+            if (symbol == "?")
+            {
+                // Conditionals chain to the right: a ? b : c ? d : e.
+                if (conditional_precedence < min_precedence)
+                {
+                    break;
+                }
+                next();
+                Node node{};
+                node.kind = Kind::conditional;
+                node.cond = lhs;
+                node.lhs = parse_operand_chain(std::numeric_limits<int>::min());
+                if (next().text != ":")
+                {
+                    throw std::invalid_argument{ "expected ':' in static expression" };
+                }
+                node.rhs = parse_operand_chain(conditional_precedence);
+                lhs = add(node);
+                continue;
+            }
+            const OpInfo* op = nullptr;
+            for (const OpInfo& candidate : binary_ops)
+            {
+                op = candidate.symbol == symbol ? &candidate : op;
+            }
+            if (op->precedence < min_precedence)
+            {
+                break;
+            }
+            next();
+
+            if (op->kind == Kind::assign)
+            {
+                if (tree.nodes[lhs].kind != Kind::variable)
+                {
+                    throw std::invalid_argument{ "only a variable can be assigned to in a static expression" };
+                }
+                // Assignments chain to the right: a = b = 1.
+                const std::size_t rhs = parse_operand_chain(op->precedence);
+                Node node{};
+                node.kind = Kind::assign;
+                node.symbol = tree.nodes[lhs].symbol;
+                node.lhs = rhs;
+                lhs = add(node);
+            }
+            else
+            {
+                const std::size_t rhs = parse_operand_chain(op->right_associative ? op->precedence : op->precedence + 1);
+                Node node{};
+                node.kind = op->kind;
+                node.lhs = lhs;
+                node.rhs = rhs;
+                lhs = add(node);
+            }
+        }
+        return lhs;
+    }
+
+    constexpr std::size_t parse_prefix()
+    {
+        const Token token = next();
+        Node node{};
+        switch (token.kind)
+        {
+            case Token::Kind::number: node.value = token.value; return add(node);
+            case Token::Kind::identifier:
+                if (peek().kind == Token::Kind::lparen)
+                {
+                    return parse_call(token.text);
+                }
+                // std::from_chars accepts "inf" and "nan", so the runtime parser treats them as numbers.
+                if (equal_ignoring_case(token.text, "inf") || equal_ignoring_case(token.text, "infinity"))
+                {
+                    node.value = std::numeric_limits<double>::infinity();
+                    return add(node);
+                }
+                if (equal_ignoring_case(token.text, "nan"))
+                {
+                    node.value = std::numeric_limits<double>::quiet_NaN();
+                    return add(node);
+                }
+                node.kind = Kind::variable;
+                node.symbol = intern(tree.names, tree.name_count, token.text);
+                return add(node);
+            case Token::Kind::lparen:
+            {
+                const std::size_t res = parse_operand_chain(std::numeric_limits<int>::min());
+                expect(Token::Kind::rparen);
+                return res;
+            }
+            case Token::Kind::op:
+                // Unary operators bind tighter than any binary operator: -2 ^ 2 == (-2) ^ 2.
+                if (token.text == "+")
+                {
+                    return parse_prefix();
+                }
+                if (token.text == "-")
+                {
+                    node.kind = Kind::neg;
+                    node.lhs = parse_prefix();
+                    return add(node);
+                }
+                throw std::invalid_argument{ "expected an operand in static expression" };
+            default: throw std::invalid_argument{ "expected an operand in static expression" };
+        }
+    }
+
+    constexpr std::size_t parse_call(std::string_view name)
+    {
+        expect(Token::Kind::lparen);
+        // Nested calls add their own arguments, so gather ours before storing them contiguously.
+        std::array<std::size_t, N> subs{};
+        std::size_t count = 0;
+        if (!accept(Token::Kind::rparen))
+        {
+            do
+            {
+                subs[count++] = parse_operand_chain(std::numeric_limits<int>::min());
+            } while (accept(Token::Kind::comma));
+            expect(Token::Kind::rparen);
+        }
+
+        Node node{};
+        if (name == "if" && count == 3)
+        {
+            node.kind = Kind::conditional;
+            node.cond = subs[0];
+            node.lhs = subs[1];
+            node.rhs = subs[2];
+            return add(node);
+        }
+        node.kind = Kind::call;
+        node.first_arg = tree.arg_count;
+        node.arg_count = count;
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            tree.args[tree.arg_count++] = subs[i];
+        }
+        const bool unary = count == 1;
+        node.builtin = name == "sum"                ? Builtin::sum
+                       : name == "sin" && unary     ? Builtin::sin
+                       : name == "cos" && unary     ? Builtin::cos
+                       : name == "sqrt" && unary    ? Builtin::sqrt
+                       : name == "max" && count > 0 ? Builtin::max
+                       : name == "min" && count > 0 ? Builtin::min
+                                                    : Builtin::none;
+        if (node.builtin == Builtin::none)
+        {
+            node.symbol = intern(tree.functions, tree.function_count, name);
+        }
+        return add(node);
+    }
+};
+
+template <std::size_t N>
+constexpr Tree<N> parse(std::string_view text)
+{
+    Parser<N> parser{ text };
+    if (parser.peek().kind == Token::Kind::end)
+    {
+        throw std::invalid_argument{ "empty static expression" };
+    }
+    parser.tree.root = parser.parse_operand_chain(std::numeric_limits<int>::min());
+    if (parser.peek().kind != Token::Kind::end)
+    {
+        throw std::invalid_argument{ "trailing text in static expression" };
+    }
+    return parser.tree;
+}
+
+template <class Source>
+inline constexpr auto tree = parse<Source::value().size()>(Source::value());
+
+}  // namespace static_expressions
+
+// Expression parsed at compile time, with the grammar and precedence of the Pratt engine. Source is a type with a
+// static constexpr value() returning the text; CALC_STATIC_EXPR declares one in place. Every node is a separate
+// template instantiation, so evaluation compiles to straight-line code without parsing or virtual calls; only
+// conditionals and logical operators branch, evaluating just the operands they need.
+// Variables are read from and assigned in the Context as usual. Calls to anything but the inlined built-ins are
+// resolved against the registry of a Parser when the static_expr is constructed, and throw if it has no such function
+// or a call passes it the wrong number of arguments.
+template <class Source>
+struct static_expr
+{
+public:
+    static constexpr const auto& tree = static_expressions::tree<Source>;
+
+    explicit static_expr(const Parser& parser = calc::parse)
+    {
+        for (std::size_t i = 0; i < tree.name_count; ++i)
+        {
+            slots[i] = symbols().intern(tree.names[i]);
+        }
+        for (std::size_t i = 0; i < tree.function_count; ++i)
+        {
+            functions[i] = parser.find_function(tree.functions[i]);
+            if (!functions[i])
+            {
+                throw std::runtime_error{ "unknown function '" + std::string{ tree.functions[i] } + "'" };
+            }
+        }
+        // Each call with the function's own argument count, as the runtime parser checks it.
+        for (std::size_t i = 0; i < tree.node_count; ++i)
+        {
+            const auto& node = tree.nodes[i];
+            if (node.kind == static_expressions::Kind::call && node.builtin == static_expressions::Builtin::none)
+            {
+                check_arity(*functions[node.symbol], node.arg_count);
+            }
+        }
+    }
+
+    double eval(Context& ctx) const
+    {
+        return eval_node<tree.root>(ctx);
+    }
+
+    double operator()(Context& ctx) const
+    {
+        return eval(ctx);
+    }
+
+private:
+    template <std::size_t I>
+    double eval_node(Context& ctx) const
+    {
+        using static_expressions::Kind;
+        constexpr static_expressions::Node node = tree.nodes[I];
+        if constexpr (node.kind == Kind::value)
+        {
+            return node.value;
+        }
+        else if constexpr (node.kind == Kind::variable)
+        {
+            return ctx.get(slots[node.symbol]);
+        }
+        else if constexpr (node.kind == Kind::neg)
+        {
+            return -eval_node<node.lhs>(ctx);
+        }
+        else if constexpr (node.kind == Kind::assign)
+        {
+            const double value = eval_node<node.lhs>(ctx);
+            ctx.set(slots[node.symbol], value);
+            return value;
+        }
+        else if constexpr (node.kind == Kind::call)
+        {
+            return eval_call<I>(ctx, std::make_index_sequence<node.arg_count>{});
+        }
+        else if constexpr (node.kind == Kind::conditional)
+        {
+            return truth(eval_node<node.cond>(ctx)) ? eval_node<node.lhs>(ctx) : eval_node<node.rhs>(ctx);
+        }
+        else if constexpr (node.kind == Kind::logical_and)
+        {
+            return truth(eval_node<node.lhs>(ctx)) && truth(eval_node<node.rhs>(ctx));
+        }
+        else if constexpr (node.kind == Kind::logical_or)
+        {
+            return truth(eval_node<node.lhs>(ctx)) || truth(eval_node<node.rhs>(ctx));
+        }
+        else
+        {
+            // Operands are evaluated left to right, as in expressions::BinaryOp.
+            const double x = eval_node<node.lhs>(ctx);
+            const double y = eval_node<node.rhs>(ctx);
+            if constexpr (node.kind == Kind::add)
+            {
+                return x + y;
+            }
+            else if constexpr (node.kind == Kind::sub)
+            {
+                return x - y;
+            }
+            else if constexpr (node.kind == Kind::mul)
+            {
+                return x * y;
+            }
+            else if constexpr (node.kind == Kind::div)
+            {
+                return x / y;
+            }
+            else if constexpr (node.kind == Kind::pow)
+            {
+                return std::pow(x, y);
+            }
+            else if constexpr (node.kind == Kind::eq)
+            {
+                return x == y;
+            }
+            else if constexpr (node.kind == Kind::ne)
+            {
+                return x != y;
+            }
+            else if constexpr (node.kind == Kind::lt)
+            {
+                return x < y;
+            }
+            else if constexpr (node.kind == Kind::le)
+            {
+                return x <= y;
+            }
+            else if constexpr (node.kind == Kind::gt)
+            {
+                return x > y;
+            }
+            else
+            {
+                static_assert(node.kind == Kind::ge);
+                return x >= y;
+            }
+        }
+    }
+
+    template <std::size_t I, std::size_t... K>
+    double eval_call(Context& ctx, std::index_sequence<K...>) const
+    {
+        using static_expressions::Builtin;
+        constexpr static_expressions::Node node = tree.nodes[I];
+        // Braced initialization evaluates the arguments in order.
+        const std::array<double, sizeof...(K)> args{ { eval_node<tree.args[node.first_arg + K]>(ctx)... } };
+        if constexpr (node.builtin == Builtin::sum)
+        {
+            return std::accumulate(args.begin(), args.end(), 0.0);
+        }
+        else if constexpr (node.builtin == Builtin::sin)
+        {
+            return std::sin(args[0]);
+        }
+        else if constexpr (node.builtin == Builtin::cos)
+        {
+            return std::cos(args[0]);
+        }
+        else if constexpr (node.builtin == Builtin::sqrt)
+        {
+            return std::sqrt(args[0]);
+        }
+        else if constexpr (node.builtin == Builtin::max)
+        {
+            return *std::max_element(args.begin(), args.end());
+        }
+        else if constexpr (node.builtin == Builtin::min)
+        {
+            return *std::min_element(args.begin(), args.end());
+        }
+        else
+        {
+            return functions[node.symbol]->func(std::vector<double>(args.begin(), args.end()));
+        }
+    }
+
+    std::array<Slot, tree.names.size()> slots{};
+    std::array<const FuncInfo*, tree.functions.size()> functions{};
+};
+
+}  // namespace calc
+
+// Declares the source type of a static expression in place: auto f = CALC_STATIC_EXPR("a * x ^ 2 + b");
+#define CALC_STATIC_EXPR(text)                          \
+    []                                                  \
+    {                                                   \
+        struct Source                                   \
+        {                                               \
+            static constexpr std::string_view value()   \
+            {                                           \
+                return text;                            \
+            }                                           \
+        };                                              \
+        return ::calc::static_expr<Source>{};           \
+    }()
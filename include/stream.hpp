@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "calc.hpp"
+#include "program.hpp"
+
+namespace calc
+{
+struct StreamOptions
+{
+    enum class Format
+    {
+        // One row per line, comma-separated numbers; one result per output line.
+        csv,
+        // Rows of packed native doubles, one per column; results are written as packed doubles as well.
+        binary,
+    };
+
+    Format format = Format::csv;
+    // Variable bound to each input column, in order. Required for binary input; for CSV input, when left empty, the
+    // names are taken from the header line.
+    std::vector<std::string> columns;
+};
+
+// Evaluates the program once per input row, in batches of rows, and writes the results to out. Output is buffered
+// and only flushed when the stream is done. Throws std::runtime_error, naming the line, for malformed input.
+// Returns the number of rows evaluated.
+std::size_t eval_stream(const Program& program, std::FILE* in, std::FILE* out, const StreamOptions& options, const Context& ctx = {});
+
+// The same over input that is already in memory, such as a MappedFile.
+std::size_t eval_stream(const Program& program, std::string_view in, std::FILE* out, const StreamOptions& options, const Context& ctx = {});
+
+}  // namespace calc
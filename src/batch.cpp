@@ -0,0 +1,729 @@
+#include "batch.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <type_traits>
+
+#include "expressions.hpp"
+
+// Clones the block kernels for AVX2 and picks the widest supported version once, at load time.
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+#define CALC_MULTIVERSION __attribute__((target_clones("avx2", "default")))
+#else
+#define CALC_MULTIVERSION
+#endif
+
+namespace calc
+{
+namespace
+{
+// Integer arithmetic goes through unsigned values, so that it wraps around instead of overflowing.
+constexpr std::int64_t wrap(std::uint64_t x)
+{
+    return static_cast<std::int64_t>(x);
+}
+
+constexpr std::uint64_t bits(std::int64_t x)
+{
+    return static_cast<std::uint64_t>(x);
+}
+
+struct Add
+{
+    template <class T>
+    T operator()(T x, T y) const
+    {
+        if constexpr (std::is_integral_v<T>)
+        {
+            return wrap(bits(x) + bits(y));
+        }
+        else
+        {
+            return x + y;
+        }
+    }
+};
+
+struct Sub
+{
+    template <class T>
+    T operator()(T x, T y) const
+    {
+        if constexpr (std::is_integral_v<T>)
+        {
+            return wrap(bits(x) - bits(y));
+        }
+        else
+        {
+            return x - y;
+        }
+    }
+};
+
+struct Mul
+{
+    template <class T>
+    T operator()(T x, T y) const
+    {
+        if constexpr (std::is_integral_v<T>)
+        {
+            return wrap(bits(x) * bits(y));
+        }
+        else
+        {
+            return x * y;
+        }
+    }
+};
+
+// Division and powers never reach integer columns: TypedProgram rejects them.
+struct Div
+{
+    template <class T>
+    T operator()(T x, T y) const
+    {
+        return x / y;
+    }
+};
+
+struct Pow
+{
+    template <class T>
+    T operator()(T x, T y) const
+    {
+        return static_cast<T>(std::pow(x, y));
+    }
+};
+
+// Comparisons yield 0 or 1 without branching, so they vectorize like arithmetic.
+struct Eq
+{
+    template <class T>
+    T operator()(T x, T y) const
+    {
+        return x == y;
+    }
+};
+
+struct Ne
+{
+    template <class T>
+    T operator()(T x, T y) const
+    {
+        return x != y;
+    }
+};
+
+struct Lt
+{
+    template <class T>
+    T operator()(T x, T y) const
+    {
+        return x < y;
+    }
+};
+
+struct Le
+{
+    template <class T>
+    T operator()(T x, T y) const
+    {
+        return x <= y;
+    }
+};
+
+struct Gt
+{
+    template <class T>
+    T operator()(T x, T y) const
+    {
+        return x > y;
+    }
+};
+
+struct Ge
+{
+    template <class T>
+    T operator()(T x, T y) const
+    {
+        return x >= y;
+    }
+};
+
+template <class Op, class T>
+CALC_MULTIVERSION void binary_kernel(T* __restrict lhs, const T* __restrict rhs, std::size_t n)
+{
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        lhs[i] = Op{}(lhs[i], rhs[i]);
+    }
+}
+
+template <class T>
+CALC_MULTIVERSION void neg_kernel(T* __restrict x, std::size_t n)
+{
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        if constexpr (std::is_integral_v<T>)
+        {
+            x[i] = wrap(0 - bits(x[i]));
+        }
+        else
+        {
+            x[i] = -x[i];
+        }
+    }
+}
+
+template <class T>
+CALC_MULTIVERSION void to_bool_kernel(T* __restrict x, std::size_t n)
+{
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        x[i] = x[i] != T{};
+    }
+}
+
+// Keeps lhs[i] where rows[i] is set and takes rhs[i] elsewhere.
+template <class T>
+CALC_MULTIVERSION void blend_kernel(T* __restrict lhs, const T* __restrict rhs, const char* __restrict rows, std::size_t n)
+{
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        lhs[i] = rows[i] ? lhs[i] : rhs[i];
+    }
+}
+
+// The built-ins, recognized by the block kernel they register, which only handles doubles.
+enum class Builtin
+{
+    none,
+    sum,
+    max,
+    min,
+    sqrt,
+    sin,
+    cos,
+};
+
+Builtin builtin_of(const FuncInfo& info)
+{
+    if (!info.block)
+    {
+        return Builtin::none;
+    }
+    return info.name == "sum"    ? Builtin::sum
+           : info.name == "max"  ? Builtin::max
+           : info.name == "min"  ? Builtin::min
+           : info.name == "sqrt" ? Builtin::sqrt
+           : info.name == "sin"  ? Builtin::sin
+           : info.name == "cos"  ? Builtin::cos
+                                 : Builtin::none;
+}
+
+// The block kernels of the built-ins for other element types than double.
+template <class T>
+CALC_MULTIVERSION void builtin_kernel(Builtin builtin, const T* const* args, std::size_t count, std::size_t n, T* __restrict out)
+{
+    if (builtin != Builtin::sum && count == 0)
+    {
+        throw std::out_of_range{ "missing function argument" };
+    }
+    switch (builtin)
+    {
+        case Builtin::sum:
+            std::fill_n(out, n, T{});
+            for (std::size_t k = 0; k < count; ++k)
+            {
+                binary_kernel<Add>(out, args[k], n);
+            }
+            break;
+        case Builtin::max:
+        case Builtin::min:
+            std::copy_n(args[0], n, out);
+            for (std::size_t k = 1; k < count; ++k)
+            {
+                for (std::size_t i = 0; i < n; ++i)
+                {
+                    out[i] = (builtin == Builtin::max ? out[i] < args[k][i] : args[k][i] < out[i]) ? args[k][i] : out[i];
+                }
+            }
+            break;
+        case Builtin::sqrt: std::transform(args[0], args[0] + n, out, [](T x) { return static_cast<T>(std::sqrt(x)); }); break;
+        case Builtin::sin: std::transform(args[0], args[0] + n, out, [](T x) { return static_cast<T>(std::sin(x)); }); break;
+        case Builtin::cos: std::transform(args[0], args[0] + n, out, [](T x) { return static_cast<T>(std::cos(x)); }); break;
+        case Builtin::none: throw std::logic_error{ "not a built-in" };
+    }
+}
+
+constexpr bool is_int64(double x)
+{
+    return x >= -0x1p63 && x < 0x1p63 && static_cast<double>(static_cast<std::int64_t>(x)) == x;
+}
+
+[[noreturn]] void unsupported_for_int64(const std::string& what)
+{
+    throw std::invalid_argument{ what + " is not supported for int64 columns" };
+}
+
+// What rows outside a branch read from a variable that had no value before the branch assigned it.
+template <class T>
+constexpr T missing()
+{
+    if constexpr (std::is_integral_v<T>)
+    {
+        return 0;
+    }
+    else
+    {
+        return std::numeric_limits<T>::quiet_NaN();
+    }
+}
+
+template <class T>
+T to_element(double value, Slot slot)
+{
+    if constexpr (std::is_integral_v<T>)
+    {
+        if (!is_int64(value))
+        {
+            throw std::invalid_argument{ "variable '" + std::string{ symbols().name(slot) } + "' is not an int64" };
+        }
+    }
+    return static_cast<T>(value);
+}
+
+// The evaluation stack: entry k holds one value per row of the current block.
+template <class T>
+struct BlockStack
+{
+    T* storage;
+
+    T* operator[](std::size_t index) const
+    {
+        return storage + index * batch_block_size;
+    }
+};
+
+template <class T>
+void run_batch(
+    const Program& program, Span<const BasicColumn<T>> columns, std::size_t first_row, Span<T> out, const Context& ctx, BasicBatchWorkspace<T>& workspace)
+{
+    using Region = typename BasicBatchWorkspace<T>::Region;
+    const std::size_t rows = first_row + out.size;
+    for (const BasicColumn<T>& column : columns)
+    {
+        if (column.values.size < rows)
+        {
+            throw std::invalid_argument{ "column '" + std::string{ symbols().name(column.slot) } + "' is shorter than the output" };
+        }
+    }
+
+    // Resolve every slot once for the whole batch: a column, a block assigned earlier in the program, or ctx.
+    std::size_t slot_count = 0;
+    for (const Instruction& instr : program.code)
+    {
+        if (instr.op == OpCode::load_var || instr.op == OpCode::store_var)
+        {
+            slot_count = std::max<std::size_t>(slot_count, instr.index + 1);
+        }
+    }
+    auto& sources = workspace.columns;
+    auto& assigned = workspace.assigned;
+    auto& assigned_blocks = workspace.assigned_blocks;
+    sources.assign(slot_count, nullptr);
+    assigned.assign(slot_count, nullptr);
+    for (const BasicColumn<T>& column : columns)
+    {
+        if (column.slot < slot_count)
+        {
+            sources[column.slot] = column.values.data;
+        }
+    }
+
+    workspace.stack.resize(std::max(workspace.stack.size(), (program.stack_size + 1) * batch_block_size));
+    const BlockStack<T> stack{ workspace.stack.data() };
+    auto& args = workspace.args;
+    auto& scalar_args = workspace.scalar_args;
+    auto& arg_spans = workspace.arg_spans;
+    auto& regions = workspace.regions;
+    // The rows running once the innermost `depth` regions are open.
+    const auto outer_rows = [&](std::size_t depth) -> const char*
+    {
+        if (depth == 0)
+        {
+            return nullptr;
+        }
+        const Region& region = regions[depth - 1];
+        return region.in_else ? region.else_rows.data() : region.then_rows.data();
+    };
+    for (std::size_t begin = first_row; begin < rows; begin += batch_block_size)
+    {
+        const std::size_t n = std::min(batch_block_size, rows - begin);
+        std::size_t top = 0;
+        std::fill(assigned.begin(), assigned.end(), nullptr);
+        // The rows taking the branch being run, or null while every row does.
+        const char* active = nullptr;
+        std::size_t open_regions = 0;
+
+        for (std::size_t pc = 0;;)
+        {
+            while (open_regions && regions[open_regions - 1].end_pc == pc)
+            {
+                Region& region = regions[--open_regions];
+                blend_kernel(region.then_values.data(), stack[top - 1], region.then_rows.data(), n);
+                std::copy_n(region.then_values.data(), n, stack[top - 1]);
+                active = outer_rows(open_regions);
+            }
+            if (pc == program.code.size())
+            {
+                break;
+            }
+            const Instruction& instr = program.code[pc++];
+            switch (instr.op)
+            {
+                case OpCode::push_const: std::fill_n(stack[top++], n, static_cast<T>(program.constants[instr.index])); break;
+                case OpCode::load_var:
+                {
+                    const T* column = sources[instr.index];
+                    if (const T* values = assigned[instr.index] ? assigned[instr.index] : column ? column + begin : nullptr)
+                    {
+                        std::copy_n(values, n, stack[top++]);
+                    }
+                    else
+                    {
+                        std::fill_n(stack[top++], n, to_element<T>(ctx.get(instr.index), instr.index));
+                    }
+                    break;
+                }
+                case OpCode::store_var:
+                {
+                    if (assigned_blocks.size() < slot_count)
+                    {
+                        assigned_blocks.resize(slot_count);
+                    }
+                    auto& block = assigned_blocks[instr.index];
+                    const T* value = stack[top - 1];
+                    if (active)
+                    {
+                        // Rows outside the branch keep what the variable held before.
+                        if (!assigned[instr.index] || assigned[instr.index] != block.data())
+                        {
+                            const T* column = sources[instr.index];
+                            if (const T* previous = assigned[instr.index] ? assigned[instr.index] : column ? column + begin : nullptr)
+                            {
+                                block.assign(previous, previous + n);
+                            }
+                            else
+                            {
+                                block.assign(n, ctx.contains(instr.index) ? to_element<T>(ctx.get(instr.index), instr.index) : missing<T>());
+                            }
+                        }
+                        for (std::size_t i = 0; i < n; ++i)
+                        {
+                            block[i] = active[i] ? value[i] : block[i];
+                        }
+                    }
+                    else
+                    {
+                        block.assign(value, value + n);
+                    }
+                    assigned[instr.index] = block.data();
+                    break;
+                }
+                case OpCode::jump_if_zero:
+                {
+                    const T* cond = stack[--top];
+                    std::size_t taken = 0;
+                    std::size_t considered = 0;
+                    for (std::size_t i = 0; i < n; ++i)
+                    {
+                        const bool row = !active || active[i];
+                        considered += row;
+                        taken += row && cond[i] != T{};
+                    }
+                    if (taken == 0)
+                    {
+                        pc = instr.index;
+                    }
+                    else if (taken < considered)
+                    {
+                        if (regions.size() == open_regions)
+                        {
+                            regions.emplace_back();
+                        }
+                        Region& region = regions[open_regions++];
+                        region.else_pc = instr.index;
+                        region.end_pc = program.code[instr.index - 1].index;
+                        region.in_else = false;
+                        region.then_rows.resize(n);
+                        region.else_rows.resize(n);
+                        for (std::size_t i = 0; i < n; ++i)
+                        {
+                            const bool row = !active || active[i];
+                            region.then_rows[i] = row && cond[i] != T{};
+                            region.else_rows[i] = row && cond[i] == T{};
+                        }
+                        active = region.then_rows.data();
+                    }
+                    // Otherwise every row takes the then branch, and the jump closing it skips the else branch.
+                    break;
+                }
+                case OpCode::jump:
+                {
+                    if (open_regions && !regions[open_regions - 1].in_else && regions[open_regions - 1].else_pc == pc)
+                    {
+                        // The then branch of a mixed conditional is done: set its result aside and run the else branch.
+                        Region& region = regions[open_regions - 1];
+                        --top;
+                        region.then_values.assign(stack[top], stack[top] + n);
+                        region.in_else = true;
+                        active = region.else_rows.data();
+                    }
+                    else
+                    {
+                        pc = instr.index;
+                    }
+                    break;
+                }
+                case OpCode::to_bool: to_bool_kernel(stack[top - 1], n); break;
+                case OpCode::select:
+                {
+                    top -= 2;
+                    T* cond = stack[top - 1];
+                    for (std::size_t i = 0; i < n; ++i)
+                    {
+                        cond[i] = cond[i] != T{} ? stack[top][i] : stack[top + 1][i];
+                    }
+                    break;
+                }
+                case OpCode::neg: neg_kernel(stack[top - 1], n); break;
+                case OpCode::add: --top, binary_kernel<Add>(stack[top - 1], stack[top], n); break;
+                case OpCode::sub: --top, binary_kernel<Sub>(stack[top - 1], stack[top], n); break;
+                case OpCode::mul: --top, binary_kernel<Mul>(stack[top - 1], stack[top], n); break;
+                case OpCode::div: --top, binary_kernel<Div>(stack[top - 1], stack[top], n); break;
+                case OpCode::pow: --top, binary_kernel<Pow>(stack[top - 1], stack[top], n); break;
+                case OpCode::eq: --top, binary_kernel<Eq>(stack[top - 1], stack[top], n); break;
+                case OpCode::ne: --top, binary_kernel<Ne>(stack[top - 1], stack[top], n); break;
+                case OpCode::lt: --top, binary_kernel<Lt>(stack[top - 1], stack[top], n); break;
+                case OpCode::le: --top, binary_kernel<Le>(stack[top - 1], stack[top], n); break;
+                case OpCode::gt: --top, binary_kernel<Gt>(stack[top - 1], stack[top], n); break;
+                case OpCode::ge: --top, binary_kernel<Ge>(stack[top - 1], stack[top], n); break;
+                case OpCode::unary:
+                {
+                    const auto& func = program.unary_ops[instr.index]->func;
+                    T* x = stack[top - 1];
+                    std::transform(x, x + n, x, [&](T v) { return static_cast<T>(func(static_cast<double>(v))); });
+                    break;
+                }
+                case OpCode::binary:
+                {
+                    const auto& func = program.binary_ops[instr.index]->func;
+                    --top;
+                    T* x = stack[top - 1];
+                    std::transform(
+                        x, x + n, stack[top], x, [&](T v, T w) { return static_cast<T>(func(static_cast<double>(v), static_cast<double>(w))); });
+                    break;
+                }
+                case OpCode::call:
+                case OpCode::call_unary:
+                case OpCode::call_span:
+                {
+                    const FuncInfo& info = *program.functions[instr.index];
+                    top -= instr.count;
+                    // The spare entry above the stack receives the result, so kernels never write over their arguments.
+                    T* result = stack[program.stack_size];
+                    // Built-in kernels are pure, so they run over the whole block even inside a branch.
+                    if (info.block)
+                    {
+                        args.clear();
+                        for (std::size_t k = 0; k < instr.count; ++k)
+                        {
+                            args.push_back(stack[top + k]);
+                        }
+                        if constexpr (std::is_same_v<T, double>)
+                        {
+                            info.block(args.data(), args.size(), n, result);
+                        }
+                        else
+                        {
+                            builtin_kernel(builtin_of(info), args.data(), args.size(), n, result);
+                        }
+                    }
+                    else if (info.batch && (active || !std::is_same_v<T, double>))
+                    {
+                        // Packs the rows taking the branch as doubles, so the function never sees the others.
+                        auto& gathered = workspace.gathered;
+                        gathered.resize((instr.count + 1) * n);
+                        std::size_t m = 0;
+                        for (std::size_t i = 0; i < n; ++i)
+                        {
+                            if (!active || active[i])
+                            {
+                                for (std::size_t k = 0; k < instr.count; ++k)
+                                {
+                                    gathered[k * n + m] = static_cast<double>(stack[top + k][i]);
+                                }
+                                ++m;
+                            }
+                        }
+                        arg_spans.clear();
+                        for (std::size_t k = 0; k < instr.count; ++k)
+                        {
+                            arg_spans.emplace_back(gathered.data() + k * n, m);
+                        }
+                        double* packed = gathered.data() + instr.count * n;
+                        info.batch(arg_spans, Span<double>{ packed, m });
+                        for (std::size_t i = 0, j = 0; i < n; ++i)
+                        {
+                            result[i] = !active || active[i] ? static_cast<T>(packed[j++]) : missing<T>();
+                        }
+                    }
+                    else if (info.batch)
+                    {
+                        if constexpr (std::is_same_v<T, double>)
+                        {
+                            arg_spans.clear();
+                            for (std::size_t k = 0; k < instr.count; ++k)
+                            {
+                                arg_spans.emplace_back(stack[top + k], n);
+                            }
+                            info.batch(arg_spans, Span<double>{ result, n });
+                        }
+                    }
+                    else
+                    {
+                        scalar_args.resize(instr.count);
+                        for (std::size_t i = 0; i < n; ++i)
+                        {
+                            if (active && !active[i])
+                            {
+                                result[i] = missing<T>();
+                                continue;
+                            }
+                            for (std::size_t k = 0; k < instr.count; ++k)
+                            {
+                                scalar_args[k] = static_cast<double>(stack[top + k][i]);
+                            }
+                            result[i] = static_cast<T>(info.func(scalar_args));
+                        }
+                    }
+                    std::copy_n(result, n, stack[top++]);
+                    break;
+                }
+            }
+        }
+        std::copy_n(stack[0], n, out.data + (begin - first_row));
+    }
+}
+
+}  // namespace
+
+template <class T>
+TypedProgram<T>::TypedProgram(Program program)
+    : source{ std::move(program) }
+{
+    if constexpr (std::is_integral_v<T>)
+    {
+        for (const double value : source.constants)
+        {
+            if (!is_int64(value))
+            {
+                std::ostringstream os;
+                os << "constant " << value;
+                unsupported_for_int64(os.str());
+            }
+        }
+        for (const Instruction& instr : source.code)
+        {
+            switch (instr.op)
+            {
+                case OpCode::div: unsupported_for_int64("'/'");
+                case OpCode::pow: unsupported_for_int64("'^'");
+                case OpCode::unary: unsupported_for_int64("operator '" + source.unary_ops[instr.index]->symbol + "'");
+                case OpCode::binary: unsupported_for_int64("operator '" + source.binary_ops[instr.index]->symbol + "'");
+                case OpCode::call:
+                case OpCode::call_unary:
+                case OpCode::call_span:
+                {
+                    const FuncInfo& info = *source.functions[instr.index];
+                    const Builtin builtin = builtin_of(info);
+                    if (builtin != Builtin::sum && builtin != Builtin::max && builtin != Builtin::min)
+                    {
+                        unsupported_for_int64("function '" + info.name + "'");
+                    }
+                    break;
+                }
+                default: break;
+            }
+        }
+    }
+}
+
+template <class T>
+TypedProgram<T> TypedProgram<T>::compile(const Expr& expr)
+{
+    return TypedProgram{ Program::compile(expr) };
+}
+
+template <class T>
+const Program& TypedProgram<T>::program() const
+{
+    return source;
+}
+
+template struct TypedProgram<float>;
+template struct TypedProgram<double>;
+template struct TypedProgram<std::int64_t>;
+
+void eval_batch(const Program& program, Span<const Column> columns, Span<double> out, const Context& ctx)
+{
+    BatchWorkspace workspace;
+    run_batch(program, columns, 0, out, ctx, workspace);
+}
+
+void eval_batch(
+    const Program& program, Span<const Column> columns, std::size_t first_row, Span<double> out, const Context& ctx, BatchWorkspace& workspace)
+{
+    run_batch(program, columns, first_row, out, ctx, workspace);
+}
+
+void eval_batch(const Expr& expr, Span<const Column> columns, Span<double> out, const Context& ctx)
+{
+    eval_batch(Program::compile(expr), columns, out, ctx);
+}
+
+template <class T>
+void eval_batch(
+    const TypedProgram<T>& program, Span<const BasicColumn<non_deduced_t<T>>> columns, Span<non_deduced_t<T>> out, const Context& ctx)
+{
+    BasicBatchWorkspace<T> workspace;
+    run_batch(program.program(), columns, 0, out, ctx, workspace);
+}
+
+template <class T>
+void eval_batch(
+    const TypedProgram<T>& program,
+    Span<const BasicColumn<non_deduced_t<T>>> columns,
+    std::size_t first_row,
+    Span<non_deduced_t<T>> out,
+    const Context& ctx,
+    BasicBatchWorkspace<non_deduced_t<T>>& workspace)
+{
+    run_batch(program.program(), columns, first_row, out, ctx, workspace);
+}
+
+template void eval_batch(const TypedProgram<float>&, Span<const FloatColumn>, Span<float>, const Context&);
+template void eval_batch(const TypedProgram<double>&, Span<const Column>, Span<double>, const Context&);
+template void eval_batch(const TypedProgram<std::int64_t>&, Span<const Int64Column>, Span<std::int64_t>, const Context&);
+template void eval_batch(
+    const TypedProgram<float>&, Span<const FloatColumn>, std::size_t, Span<float>, const Context&, BasicBatchWorkspace<float>&);
+template void eval_batch(
+    const TypedProgram<double>&, Span<const Column>, std::size_t, Span<double>, const Context&, BasicBatchWorkspace<double>&);
+template void eval_batch(
+    const TypedProgram<std::int64_t>&, Span<const Int64Column>, std::size_t, Span<std::int64_t>, const Context&, BasicBatchWorkspace<std::int64_t>&);
+
+}  // namespace calc
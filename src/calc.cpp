@@ -1,10 +1,16 @@
 #include "calc.hpp"
 
 #include <algorithm>
+#include <array>
+#include <charconv>
 #include <cmath>
+#include <limits>
+#include <memory_resource>
 #include <numeric>
 #include <optional>
+#include <shared_mutex>
 
+#include "expressions.hpp"
 #include "string_utils.hpp"
 
 namespace calc
@@ -15,320 +21,392 @@ void assert(bool value)
         throw std::logic_error{ "assertion failed" };
 }
 
-std::optional<double> parse_double(std::string_view text)
+Slot SymbolTable::intern(std::string_view name)
 {
-    try
-    {
-        std::size_t size{};
-        const double res = std::stod(std::string{ text }, &size);
-        if (size != text.size())
-        {
-            return std::nullopt;
-        }
-        return res;
-    }
-    catch (const std::invalid_argument&)
+    std::lock_guard lock{ mutex };
+    if (const auto it = slots.find(name); it != slots.end())
     {
-        return std::nullopt;
+        return it->second;
     }
+    const Slot slot = names.size();
+    slots.emplace(names.emplace_back(name), slot);
+    return slot;
 }
 
-bool valid_parens(std::string_view text)
+std::optional<Slot> SymbolTable::find(std::string_view name) const
 {
-    int counter = 0;
-    for (char ch : text)
+    std::lock_guard lock{ mutex };
+    if (const auto it = slots.find(name); it != slots.end())
     {
-        if (ch == '(')
-        {
-            ++counter;
-        }
-        else if (ch == ')')
-        {
-            --counter;
-            if (counter < 0)
-            {
-                return false;
-            }
-        }
+        return it->second;
     }
-    return counter == 0;
+    return std::nullopt;
 }
 
-std::string_view simplify_parens(std::string_view text)
+std::string_view SymbolTable::name(Slot slot) const
 {
-    while (true)
-    {
-        text = trim_whitespace(text);
-        if (!text.empty() && text.front() == '(' && text.back() == ')')
-        {
-            auto temp = trim_whitespace(drop_last(drop(text, 1), 1));
-            if (valid_parens(temp))
-            {
-                text = temp;
-            }
-            else
-            {
-                break;
-            }
-        }
-        else
-        {
-            break;
-        }
-    }
-    return text;
+    std::lock_guard lock{ mutex };
+    return names.at(slot);
 }
 
-std::string indent(int level)
+std::size_t SymbolTable::size() const
 {
-    return std::string(level * 2, ' ');
+    std::lock_guard lock{ mutex };
+    return names.size();
 }
 
-using UnaryFunc = std::function<double(double)>;
-using BinaryFunc = std::function<double(double, double)>;
-
-struct Precedence
+SymbolTable& symbols()
 {
-    int value;
-    bool right_associative;
+    static SymbolTable instance;
+    return instance;
+}
 
-    friend bool operator<(const Precedence& precedence, int value)
+Context::Context(std::initializer_list<std::pair<std::string_view, double>> init)
+{
+    for (const auto& [name, value] : init)
     {
-        return (precedence.value <= value && !precedence.right_associative) || (precedence.value < value && precedence.right_associative);
+        set(name, value);
     }
-};
+}
 
-Precedence left_associative(int v)
+void Context::reserve(std::size_t slot_count)
 {
-    return { v, false };
+    if (slot_count > values.size())
+    {
+        values.resize(slot_count);
+        defined.resize(slot_count);
+    }
 }
 
-Precedence right_associative(int v)
+std::optional<double> Context::get(std::string_view name) const
 {
-    return { v, true };
+    if (const auto slot = symbols().find(name); slot && contains(*slot))
+    {
+        return values[*slot];
+    }
+    return std::nullopt;
 }
 
-struct BinaryOpInfo
+void Context::set(std::string_view name, double value)
 {
-    std::string symbol;
-    Precedence precedence;
-    BinaryFunc func;
-};
+    set(symbols().intern(name), value);
+}
 
-struct UnaryOpInfo
+ScopedWorkspace::ScopedWorkspace(Context& ctx, EvalWorkspace& workspace, std::size_t slot_count)
+    : ctx{ ctx }
+    , previous{ ctx.workspace }
 {
-    std::string symbol;
-    UnaryFunc func;
-};
+    ctx.reserve(slot_count);
+    ctx.workspace = &workspace;
+}
 
-struct FuncInfo
+ScopedWorkspace::~ScopedWorkspace()
 {
-    std::string name;
-    Function func;
-};
+    ctx.workspace = previous;
+}
 
-bool is_assignment(const BinaryOpInfo& op_info)
+double eval(const Expr& expr, Context& ctx, EvalWorkspace& workspace)
 {
-    return !op_info.func;
+    const ScopedWorkspace scope{ ctx, workspace };
+    return expr.eval(ctx);
 }
 
-namespace expressions
-{
-struct Value : public Expr
+double Context::undefined(Slot slot) const
 {
-    double v;
-
-    Value(double v)
-        : v{ v }
+    if (!status)
     {
+        throw std::runtime_error{ "undefined variable '" + std::string{ symbols().name(slot) } + "'" };
     }
-
-    double eval(Context& ctx) const override
+    if (*status)
     {
-        return v;
+        status->error = EvalError::undefined_variable;
+        status->slot = slot;
     }
+    return std::numeric_limits<double>::quiet_NaN();
+}
 
-    void print(std::ostream& os, int level) const override
-    {
-        os << indent(level) << v << std::endl;
-    }
-};
+EvalResult try_eval(const Expr& expr, Context& ctx)
+{
+    return try_eval_with(ctx, [&](Context& ctx) { return expr.eval(ctx); });
+}
 
-struct Variable : public Expr
+EvalResult try_eval(const Expr& expr, Context& ctx, EvalWorkspace& workspace)
 {
-    std::string name;
+    const ScopedWorkspace scope{ ctx, workspace };
+    return try_eval(expr, ctx);
+}
 
-    Variable(std::string name)
-        : name{ std::move(name) }
+void check_arity(const FuncInfo& info, std::size_t argc)
+{
+    const Arity& arity = info.arity;
+    if (arity.accepts(argc))
     {
+        return;
     }
-
-    double eval(Context& ctx) const override
+    std::string expected = std::to_string(arity.min);
+    std::size_t last = arity.min;
+    if (arity.max == Arity{}.max)
     {
-        if (auto it = ctx.vars.find(name); it != ctx.vars.end())
-        {
-            return it->second;
-        }
-        throw std::runtime_error{ "undefined variable '" + name + "'" };
+        expected = "at least " + expected;
     }
-
-    void print(std::ostream& os, int level) const override
+    else if (arity.max != arity.min)
     {
-        os << indent(level) << name << std::endl;
+        expected += " to " + std::to_string(arity.max);
+        last = arity.max;
     }
-};
+    throw std::runtime_error{ "'" + info.name + "' takes " + expected + (last == 1 ? " argument" : " arguments") + ", got "
+                              + std::to_string(argc) };
+}
 
-struct UnaryOp : public Expr
+std::pair<std::string_view, double> Context::Variables::iterator::operator*() const
 {
-    const UnaryOpInfo& info;
-    ExprPtr sub;
-
-    UnaryOp(const UnaryOpInfo& info, ExprPtr sub)
-        : info{ info }
-        , sub{ std::move(sub) }
-    {
-    }
+    return { symbols().name(slot), ctx->values[slot] };
+}
 
-    double eval(Context& ctx) const override
+Context::Variables::iterator& Context::Variables::iterator::operator++()
+{
+    do
     {
-        return info.func(sub->eval(ctx));
-    }
+        ++slot;
+    } while (slot < ctx->defined.size() && !ctx->defined[slot]);
+    return *this;
+}
 
-    void print(std::ostream& os, int level) const override
-    {
-        os << indent(level) << info.symbol << std::endl;
-        sub->print(os, level + 1);
-    }
-};
+Context::Variables::iterator Context::Variables::begin() const
+{
+    auto it = iterator{ &ctx, 0 };
+    return ctx.contains(0) ? it : ++it;
+}
 
-struct BinaryOp : public Expr
+Context::Variables::iterator Context::Variables::end() const
 {
-    const BinaryOpInfo& info;
-    ExprPtr lhs;
-    ExprPtr rhs;
+    return iterator{ &ctx, std::max(ctx.defined.size(), Slot{ 1 }) };
+}
 
-    BinaryOp(const BinaryOpInfo& info, ExprPtr lhs, ExprPtr rhs)
-        : info{ info }
-        , lhs{ std::move(lhs) }
-        , rhs{ std::move(rhs) }
+std::optional<double> parse_double(std::string_view text)
+{
+    // Same literals as std::stod consuming the whole text: leading whitespace, an optional sign, then a decimal or
+    // 0x-prefixed hexadecimal number, inf/infinity or nan. std::from_chars covers the rest of that grammar.
+    std::size_t pos = 0;
+    while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos])))
     {
+        ++pos;
     }
-
-    double eval(Context& ctx) const override
+    const bool negative = pos < text.size() && text[pos] == '-';
+    if (pos < text.size() && (text[pos] == '+' || text[pos] == '-'))
     {
-        return info.func(lhs->eval(ctx), rhs->eval(ctx));
+        ++pos;
     }
-
-    void print(std::ostream& os, int level) const override
+    auto format = std::chars_format::general;
+    if (text.size() > pos + 1 && text[pos] == '0' && (text[pos + 1] == 'x' || text[pos + 1] == 'X'))
     {
-        os << indent(level) << info.symbol << std::endl;
-        lhs->print(os, level + 1);
-        rhs->print(os, level + 1);
+        format = std::chars_format::hex;
+        pos += 2;
     }
-};
-
-struct Func : public Expr
-{
-    const FuncInfo& info;
-    std::vector<ExprPtr> subs;
-
-    Func(const FuncInfo& info, std::vector<ExprPtr> subs)
-        : info{ info }
-        , subs{ std::move(subs) }
+    // std::from_chars accepts a minus sign of its own, which must not follow the one consumed above.
+    if (pos == text.size() || text[pos] == '+' || text[pos] == '-')
     {
+        return std::nullopt;
     }
 
-    double eval(Context& ctx) const override
+    double res{};
+    const char* last = text.data() + text.size();
+    const auto [ptr, ec] = std::from_chars(text.data() + pos, last, res, format);
+    if (ec != std::errc{} || ptr != last)
     {
-        std::vector<double> args(subs.size());
-        std::transform(subs.begin(), subs.end(), args.begin(), [&](const auto& expr_ptr) { return expr_ptr->eval(ctx); });
-        return info.func(args);
+        return std::nullopt;
     }
+    return negative ? -res : res;
+}
 
-    void print(std::ostream& os, int level) const override
+ParseStats& ParseStats::operator+=(const ParseStats& other)
+{
+    parses += other.parses;
+    bytes += other.bytes;
+    failures += other.failures;
+    errors += other.errors;
+    parse_expr_calls += other.parse_expr_calls;
+    max_depth = std::max(max_depth, other.max_depth);
+    paren_scans += other.paren_scans;
+    paren_scan_bytes += other.paren_scan_bytes;
+    operator_scan_bytes += other.operator_scan_bytes;
+    for (std::size_t i = 0; i < failed_attempts.size(); ++i)
     {
-        os << indent(level) << info.name << std::endl;
-        for (std::size_t i = 0; i < subs.size(); ++i)
-        {
-            subs[i]->print(os, level + 1);
-        }
+        failed_attempts[i] += other.failed_attempts[i];
     }
-};
+    rejected_numbers += other.rejected_numbers;
+    tokens += other.tokens;
+    return *this;
+}
 
-struct Assignment : public Expr
+static double unary_pos(double x)
 {
-    std::string name;
-    ExprPtr expr;
+    return x;
+}
 
-    Assignment(std::string name, ExprPtr expr)
-        : name{ std::move(name) }
-        , expr{ std::move(expr) }
-    {
-    }
+static double binary_pow(double x, double y)
+{
+    return std::pow(x, y);
+}
 
-    double eval(Context& ctx) const override
-    {
-        ctx.vars.insert_or_assign(name, expr->eval(ctx));
-        return ctx.vars.at(name);
-    }
+// Both operands already evaluated; parsed && and || become expressions::Logical, which short-circuits.
+static double logical_and(double x, double y)
+{
+    return apply(BinaryOpKind::logical_and, x, y);
+}
 
-    void print(std::ostream& os, int level) const override
-    {
-        os << indent(level) << name << std::endl;
-        expr->print(os, level + 1);
-    }
-};
+static double logical_or(double x, double y)
+{
+    return apply(BinaryOpKind::logical_or, x, y);
+}
 
-}  // namespace expressions
+static double span_sum(const double* args, std::size_t argc)
+{
+    return std::accumulate(args, args + argc, 0.0);
+}
 
-static double unary_pos(double x)
+static double span_max(const double* args, std::size_t argc)
 {
-    return x;
+    return *std::max_element(args, args + argc);
 }
 
-static double unary_neg(double x)
+static double span_min(const double* args, std::size_t argc)
 {
-    return -x;
+    return *std::min_element(args, args + argc);
 }
 
-static double binary_pow(double x, double y)
+static double unary_sin(double x)
 {
-    return std::pow(x, y);
+    return std::sin(x);
+}
+
+static double unary_cos(double x)
+{
+    return std::cos(x);
+}
+
+static double unary_sqrt(double x)
+{
+    return std::sqrt(x);
 }
 
 static double func_sum(const std::vector<double>& args)
 {
-    return std::accumulate(args.begin(), args.end(), 0.0);
+    return span_sum(args.data(), args.size());
 }
 
 static double func_sin(const std::vector<double>& args)
 {
-    return std::sin(args.at(0));
+    return unary_sin(args[0]);
 }
 
 static double func_cos(const std::vector<double>& args)
 {
-    return std::cos(args.at(0));
+    return unary_cos(args[0]);
 }
 
 static double func_max(const std::vector<double>& args)
 {
-    return *std::max_element(args.begin(), args.end());
+    return span_max(args.data(), args.size());
 }
 
 static double func_min(const std::vector<double>& args)
 {
-    return *std::min_element(args.begin(), args.end());
+    return span_min(args.data(), args.size());
 }
 
 static double func_sqrt(const std::vector<double>& args)
 {
-    return std::sqrt(args.at(0));
+    return unary_sqrt(args[0]);
+}
+
+// Only reached by code that calls FuncInfo::func directly; parsed calls to if() become expressions::Conditional.
+static double func_if(const std::vector<double>& args)
+{
+    return truth(args[0]) ? args[1] : args[2];
+}
+
+static const double* block_arg(const double* const* args, std::size_t argc, std::size_t index)
+{
+    if (index >= argc)
+    {
+        throw std::out_of_range{ "missing function argument" };
+    }
+    return args[index];
+}
+
+static void block_sum(const double* const* args, std::size_t argc, std::size_t n, double* out)
+{
+    std::fill(out, out + n, 0.0);
+    for (std::size_t k = 0; k < argc; ++k)
+    {
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            out[i] += args[k][i];
+        }
+    }
+}
+
+static void block_sin(const double* const* args, std::size_t argc, std::size_t n, double* out)
+{
+    const double* x = block_arg(args, argc, 0);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        out[i] = std::sin(x[i]);
+    }
+}
+
+static void block_cos(const double* const* args, std::size_t argc, std::size_t n, double* out)
+{
+    const double* x = block_arg(args, argc, 0);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        out[i] = std::cos(x[i]);
+    }
+}
+
+static void block_max(const double* const* args, std::size_t argc, std::size_t n, double* out)
+{
+    const double* first = block_arg(args, argc, 0);
+    std::copy(first, first + n, out);
+    for (std::size_t k = 1; k < argc; ++k)
+    {
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            out[i] = out[i] < args[k][i] ? args[k][i] : out[i];
+        }
+    }
+}
+
+static void block_min(const double* const* args, std::size_t argc, std::size_t n, double* out)
+{
+    const double* first = block_arg(args, argc, 0);
+    std::copy(first, first + n, out);
+    for (std::size_t k = 1; k < argc; ++k)
+    {
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            out[i] = args[k][i] < out[i] ? args[k][i] : out[i];
+        }
+    }
+}
+
+static void block_sqrt(const double* const* args, std::size_t argc, std::size_t n, double* out)
+{
+    const double* x = block_arg(args, argc, 0);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        out[i] = std::sqrt(x[i]);
+    }
 }
 
+// cond ? then : otherwise binds looser than || and tighter than assignment, and chains to the right.
+constexpr int conditional_precedence = 6;
+
 struct BinaryOpResult
 {
     std::string_view::iterator it;
+    // Null for the '?' of a conditional.
     const BinaryOpInfo* op_info;
 };
 
@@ -337,193 +415,934 @@ bool is_valid_variable_name(std::string_view text)
     return !text.empty() && std::all_of(text.begin(), text.end(), [](char ch) { return std::isalpha(ch) || ch == '_'; });
 }
 
-struct Parser::Impl
+bool is_identifier_char(char ch)
 {
-    Impl()
-    {
-        binary_op_info_list.push_back(BinaryOpInfo{ "==", left_associative(10), std::equal_to<>{} });
-        binary_op_info_list.push_back(BinaryOpInfo{ "!=", left_associative(10), std::not_equal_to<>{} });
-        binary_op_info_list.push_back(BinaryOpInfo{ "<", left_associative(10), std::less<>{} });
-        binary_op_info_list.push_back(BinaryOpInfo{ "<=", left_associative(10), std::less_equal<>{} });
-        binary_op_info_list.push_back(BinaryOpInfo{ ">", left_associative(10), std::greater<>{} });
-        binary_op_info_list.push_back(BinaryOpInfo{ ">=", left_associative(10), std::greater_equal<>{} });
+    return std::isalpha(static_cast<unsigned char>(ch)) || ch == '_';
+}
 
-        binary_op_info_list.push_back(BinaryOpInfo{ "+", left_associative(20), std::plus<>{} });
-        binary_op_info_list.push_back(BinaryOpInfo{ "-", left_associative(20), std::minus<>{} });
-        binary_op_info_list.push_back(BinaryOpInfo{ "*", left_associative(40), std::multiplies<>{} });
-        binary_op_info_list.push_back(BinaryOpInfo{ "/", left_associative(40), std::divides<>{} });
-        binary_op_info_list.push_back(BinaryOpInfo{ "^", right_associative(30), binary_pow });
+bool is_digit(char ch)
+{
+    return std::isdigit(static_cast<unsigned char>(ch));
+}
 
-        binary_op_info_list.push_back(BinaryOpInfo{ "=", left_associative(5), nullptr });
+bool is_hex_digit(char ch)
+{
+    return std::isxdigit(static_cast<unsigned char>(ch));
+}
 
-        unary_op_info_list.push_back(UnaryOpInfo{ "+", unary_pos });
-        unary_op_info_list.push_back(UnaryOpInfo{ "-", std::negate<>{} });
-    }
+// Returns the length of the numeric literal (decimal or hexadecimal, as accepted by std::stod) at the front of text.
+std::size_t scan_number(std::string_view text)
+{
+    const bool hex = text.size() > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X') && (is_hex_digit(text[2]) || text[2] == '.');
+    const auto is_mantissa_digit = hex ? is_hex_digit : is_digit;
+    const char exponent = hex ? 'p' : 'e';
 
-    void register_function(std::string name, Function func)
+    std::size_t i = hex ? 2 : 0;
+    std::size_t digits = 0;
+    for (; i < text.size() && is_mantissa_digit(text[i]); ++i, ++digits)
     {
-        function_info_list.push_back(FuncInfo{ std::move(name), std::move(func) });
     }
-
-    ExprPtr parse_expr(std::string_view text) const
+    if (i < text.size() && text[i] == '.')
     {
-        if (!valid_parens(text))
+        for (++i; i < text.size() && is_mantissa_digit(text[i]); ++i, ++digits)
         {
-            throw std::runtime_error{ "Invalid parens" };
         }
-
-        text = simplify_parens(text);
-
-        static const auto methods = std::array{ &Impl::parse_number,
-                                                &Impl::parse_binary_or_assignment,
-                                                &Impl::parse_unary,
-                                                &Impl::parse_function,
-                                                &Impl::parse_variable };
-
-        for (const auto& method : methods)
+    }
+    if (digits == 0)
+    {
+        return 0;
+    }
+    if (i < text.size() && std::tolower(static_cast<unsigned char>(text[i])) == exponent)
+    {
+        std::size_t j = i + 1;
+        if (j < text.size() && (text[j] == '+' || text[j] == '-'))
+        {
+            ++j;
+        }
+        if (j < text.size() && is_digit(text[j]))
         {
-            if (auto res = ((*this).*method)(text))
+            for (i = j; i < text.size() && is_digit(text[i]); ++i)
             {
-                return res;
             }
         }
+    }
+    return i;
+}
 
-        return nullptr;
+struct Token
+{
+    enum class Kind
+    {
+        number,
+        identifier,
+        op,
+        lparen,
+        rparen,
+        comma,
+        end,
+    };
+
+    Kind kind;
+    std::string_view text;
+    double value = 0.0;
+};
+
+struct TokenStream
+{
+    std::vector<Token> tokens;
+    std::size_t pos = 0;
+
+    const Token& peek() const
+    {
+        return tokens[pos];
     }
 
-    ExprPtr parse_number(std::string_view text) const
+    const Token& next()
     {
-        if (auto res = parse_double(text))
+        const Token& res = tokens[pos];
+        if (res.kind != Token::Kind::end)
         {
-            return std::make_unique<expressions::Value>(*res);
+            ++pos;
         }
-        return nullptr;
+        return res;
     }
 
-    ExprPtr parse_variable(std::string_view text) const
+    bool accept(Token::Kind kind)
     {
-        if (is_valid_variable_name(text))
+        if (peek().kind == kind)
         {
-            return std::make_unique<expressions::Variable>(std::string{ text });
+            next();
+            return true;
         }
-        return nullptr;
+        return false;
     }
+};
 
-    ExprPtr parse_unary(std::string_view text) const
+// Paren structure of a whole legacy-engine input, built in one pass so that the substrings the parser recurses into
+// can be checked, stripped of enclosing parens and split without re-counting parens.
+struct ParenIndex
+{
+    const char* base;
+    // Paren depth before each position, and for each position the first one after it at a lower depth.
+    std::vector<int> depth;
+    std::vector<std::uint32_t> next_lower;
+    // For each paren, the position of its partner, or the text size if it has none.
+    std::vector<std::uint32_t> partner;
+
+    explicit ParenIndex(std::string_view text)
+        : base{ text.data() }
+        , depth(text.size() + 1)
+        , next_lower(text.size() + 1, static_cast<std::uint32_t>(text.size() + 1))
+        , partner(text.size(), static_cast<std::uint32_t>(text.size()))
     {
-        for (const auto& op_info : unary_op_info_list)
+        std::vector<std::uint32_t> open;
+        for (std::uint32_t i = 0; i < text.size(); ++i)
         {
-            if (starts_with(text, op_info.symbol))
+            depth[i + 1] = depth[i];
+            if (text[i] == '(')
+            {
+                ++depth[i + 1];
+                open.push_back(i);
+            }
+            else if (text[i] == ')')
             {
-                if (auto sub = parse_expr(make_string_view(text.begin() + op_info.symbol.size(), text.end())))
+                --depth[i + 1];
+                if (!open.empty())
                 {
-                    return std::make_unique<expressions::UnaryOp>(op_info, std::move(sub));
+                    partner[i] = open.back();
+                    partner[open.back()] = i;
+                    open.pop_back();
                 }
             }
         }
-        return nullptr;
+        std::vector<std::uint32_t> pending;
+        for (std::uint32_t i = 0; i < depth.size(); ++i)
+        {
+            while (!pending.empty() && depth[i] < depth[pending.back()])
+            {
+                next_lower[pending.back()] = i;
+                pending.pop_back();
+            }
+            pending.push_back(i);
+        }
     }
 
-    ExprPtr parse_binary_or_assignment(std::string_view text) const
+    std::size_t offset(const char* ptr) const
     {
-        const auto oper_result = find_binary_oper(text);
-        if (!oper_result)
-        {
-            return nullptr;
-        }
+        return static_cast<std::size_t>(ptr - base);
+    }
 
-        const auto [it, op_info] = *oper_result;
+    // Whether every paren in text, a substring of the indexed input, is matched within it.
+    bool balanced(std::string_view text) const
+    {
+        const std::size_t first = offset(text.data());
+        const std::size_t last = first + text.size();
+        return depth[first] == depth[last] && next_lower[first] > last;
+    }
 
-        auto rhs = parse_expr(make_string_view(it + op_info->symbol.size(), text.end()));
-        if (!rhs)
+    // The paren matching the one at ptr; in a balanced substring it is always there.
+    const char* partner_of(const char* ptr) const
+    {
+        return base + partner[offset(ptr)];
+    }
+};
+
+// Per-call parsing state, shared by both engines.
+struct ParseState
+{
+    // When set, nodes are placed in this arena instead of being allocated one by one.
+    std::pmr::memory_resource* arena = nullptr;
+    // When set, the parse counts its work here.
+    ParseStats* stats = nullptr;
+    std::size_t depth = 0;
+    // Set by the legacy engine for the input being parsed.
+    const ParenIndex* parens = nullptr;
+
+    void count(std::size_t ParseStats::*counter, std::size_t n = 1) const
+    {
+        if (stats)
         {
-            return nullptr;
+            stats->*counter += n;
         }
+    }
 
-        const auto lhs_str = trim_whitespace(make_string_view(text.begin(), it));
+    bool valid_parens(std::string_view text) const
+    {
+        count(&ParseStats::paren_scans);
+        return parens->balanced(text);
+    }
 
-        if (is_valid_variable_name(lhs_str) && is_assignment(*op_info))
-        {
-            return std::make_unique<expressions::Assignment>(std::string{ lhs_str }, std::move(rhs));
-        }
-        else if (auto lhs = parse_expr(lhs_str))
+    // Strips whitespace and any enclosing parens around the whole text.
+    std::string_view simplify_parens(std::string_view text) const
+    {
+        text = trim_whitespace(text);
+        while (text.size() >= 2 && text.front() == '(' && parens->partner_of(text.data()) == &text.back())
         {
-            return std::make_unique<expressions::BinaryOp>(*op_info, std::move(lhs), std::move(rhs));
+            count(&ParseStats::paren_scans);
+            text = trim_whitespace(text.substr(1, text.size() - 2));
         }
-        return nullptr;
+        return text;
     }
 
-    ExprPtr parse_function(std::string_view text) const
+    std::optional<double> number(std::string_view text) const
     {
-        auto it = std::find(text.begin(), text.end(), '(');
-        if (it == text.end() || text.back() != ')')
+        auto res = parse_double(text);
+        if (!res)
         {
-            return nullptr;
+            count(&ParseStats::rejected_numbers);
         }
-        const auto name = trim_whitespace(make_string_view(text.begin(), it));
-        const auto info = std::invoke([&]() -> const FuncInfo* {
-            for (const auto& func_info : function_info_list)
-            {
-                if (func_info.name == name)
-                {
-                    return &func_info;
-                }
-            }
-            return nullptr;
-        });
-        if (!info)
+        return res;
+    }
+
+    template <class T, class... Args>
+    ExprPtr make(Args&&... args) const
+    {
+        if (!arena)
         {
-            return nullptr;
+            return std::make_unique<T>(std::forward<Args>(args)...);
+        }
+        void* ptr = arena->allocate(sizeof(T), alignof(T));
+        return ExprPtr{ new (ptr) T(std::forward<Args>(args)...), ExprDeleter{ false } };
+    }
+
+    std::pmr::memory_resource* resource() const
+    {
+        return arena ? arena : std::pmr::get_default_resource();
+    }
+};
+
+// 0 means no limit.
+void check_depth(std::size_t depth, std::size_t max_depth)
+{
+    if (max_depth && depth > max_depth)
+    {
+        throw std::runtime_error{ "Expression nested deeper than " + std::to_string(max_depth) + " levels" };
+    }
+}
+
+// An operator, group or call of the Pratt engine still waiting for its operands.
+struct PendingOp
+{
+    enum class Kind
+    {
+        unary,
+        binary,
+        group,
+        call,
+        // The '?' of a conditional, waiting for its ':', and then the ':', waiting for the last operand.
+        condition,
+        alternative,
+    };
+
+    Kind kind;
+    const UnaryOpInfo* unary_op = nullptr;
+    const BinaryOpInfo* binary_op = nullptr;
+    const FuncInfo* func = nullptr;
+    // Calls only: where the arguments start on the operand stack.
+    std::size_t first_operand = 0;
+};
+
+struct PrattStacks
+{
+    struct Operand
+    {
+        ExprPtr expr;
+        std::size_t depth;
+    };
+
+    ParseState& state;
+    std::size_t max_depth;
+    std::vector<Operand> operands;
+    std::vector<PendingOp> pending;
+
+    void push(ExprPtr expr, std::size_t depth)
+    {
+        check_depth(depth, max_depth);
+        if (state.stats)
+        {
+            state.stats->max_depth = std::max(state.stats->max_depth, depth);
+        }
+        operands.push_back(Operand{ std::move(expr), depth });
+    }
+
+    // A complete operand takes the unary operators in front of it at once.
+    void push_operand(ExprPtr expr)
+    {
+        push(std::move(expr), 1);
+        apply_unary_ops();
+    }
+
+    void apply_unary_ops()
+    {
+        while (!pending.empty() && pending.back().kind == PendingOp::Kind::unary)
+        {
+            Operand sub = std::move(operands.back());
+            operands.pop_back();
+            push(make_unary_op(*pending.back().unary_op, std::move(sub.expr), state), sub.depth + 1);
+            pending.pop_back();
+        }
+    }
+
+    static bool binds_right(const BinaryOpInfo& op_info)
+    {
+        // Assignments chain to the right: a = b = 1.
+        return op_info.precedence.right_associative || is_assignment(op_info);
+    }
+
+    Operand pop_operand()
+    {
+        Operand res = std::move(operands.back());
+        operands.pop_back();
+        return res;
+    }
+
+    // Reduces the pending binary operators and conditionals that bind at least as tightly as an operator of the
+    // given precedence that follows them; false if that builds an assignment to something other than a variable.
+    bool reduce_binary_ops(int precedence)
+    {
+        while (!pending.empty() && (pending.back().kind == PendingOp::Kind::binary || pending.back().kind == PendingOp::Kind::alternative))
+        {
+            if (pending.back().kind == PendingOp::Kind::alternative)
+            {
+                if (conditional_precedence <= precedence)
+                {
+                    break;
+                }
+                Operand otherwise = pop_operand();
+                Operand then = pop_operand();
+                Operand cond = pop_operand();
+                pending.pop_back();
+                const std::size_t depth = std::max({ cond.depth, then.depth, otherwise.depth }) + 1;
+                push(state.make<expressions::Conditional>(std::move(cond.expr), std::move(then.expr), std::move(otherwise.expr)), depth);
+                continue;
+            }
+            const BinaryOpInfo& op_info = *pending.back().binary_op;
+            if (op_info.precedence.value < precedence || (op_info.precedence.value == precedence && binds_right(op_info)))
+            {
+                break;
+            }
+            Operand rhs = std::move(operands.back());
+            operands.pop_back();
+            Operand lhs = std::move(operands.back());
+            operands.pop_back();
+            pending.pop_back();
+            const std::size_t depth = std::max(lhs.depth, rhs.depth) + 1;
+            if (is_assignment(op_info))
+            {
+                const auto var = dynamic_cast<const expressions::Variable*>(lhs.expr.get());
+                if (!var)
+                {
+                    return false;
+                }
+                push(state.make<expressions::Assignment>(var->name, std::move(rhs.expr)), depth);
+            }
+            else
+            {
+                push(make_binary_op(op_info, std::move(lhs.expr), std::move(rhs.expr), state), depth);
+            }
+        }
+        return true;
+    }
+
+    void close_call()
+    {
+        const PendingOp call = pending.back();
+        pending.pop_back();
+        std::pmr::vector<ExprPtr> subs{ state.resource() };
+        std::size_t depth = 0;
+        for (std::size_t i = call.first_operand; i < operands.size(); ++i)
+        {
+            depth = std::max(depth, operands[i].depth);
+            subs.push_back(std::move(operands[i].expr));
+        }
+        operands.resize(call.first_operand);
+        push(make_func(*call.func, std::move(subs), state), depth + 1);
+        apply_unary_ops();
+    }
+};
+
+struct Parser::Impl
+{
+    Impl()
+    {
+        binary_op_info_list.push_back(BinaryOpInfo{ "==", left_associative(10), std::equal_to<>{}, BinaryOpKind::eq });
+        binary_op_info_list.push_back(BinaryOpInfo{ "!=", left_associative(10), std::not_equal_to<>{}, BinaryOpKind::ne });
+        binary_op_info_list.push_back(BinaryOpInfo{ "<", left_associative(10), std::less<>{}, BinaryOpKind::lt });
+        binary_op_info_list.push_back(BinaryOpInfo{ "<=", left_associative(10), std::less_equal<>{}, BinaryOpKind::le });
+        binary_op_info_list.push_back(BinaryOpInfo{ ">", left_associative(10), std::greater<>{}, BinaryOpKind::gt });
+        binary_op_info_list.push_back(BinaryOpInfo{ ">=", left_associative(10), std::greater_equal<>{}, BinaryOpKind::ge });
+
+        binary_op_info_list.push_back(BinaryOpInfo{ "+", left_associative(20), std::plus<>{}, BinaryOpKind::add });
+        binary_op_info_list.push_back(BinaryOpInfo{ "-", left_associative(20), std::minus<>{}, BinaryOpKind::sub });
+        binary_op_info_list.push_back(BinaryOpInfo{ "*", left_associative(40), std::multiplies<>{}, BinaryOpKind::mul });
+        binary_op_info_list.push_back(BinaryOpInfo{ "/", left_associative(40), std::divides<>{}, BinaryOpKind::div });
+        binary_op_info_list.push_back(BinaryOpInfo{ "^", right_associative(30), binary_pow, BinaryOpKind::pow });
+
+        binary_op_info_list.push_back(BinaryOpInfo{ "&&", left_associative(8), logical_and, BinaryOpKind::logical_and });
+        binary_op_info_list.push_back(BinaryOpInfo{ "||", left_associative(7), logical_or, BinaryOpKind::logical_or });
+
+        binary_op_info_list.push_back(BinaryOpInfo{ "=", left_associative(5), nullptr, BinaryOpKind::assign });
+
+        unary_op_info_list.push_back(UnaryOpInfo{ "+", unary_pos, UnaryOpKind::pos });
+        unary_op_info_list.push_back(UnaryOpInfo{ "-", std::negate<>{}, UnaryOpKind::neg });
+
+        for (const auto& op_info : binary_op_info_list)
+        {
+            operator_symbols.push_back(op_info.symbol);
+        }
+        for (const auto& op_info : unary_op_info_list)
+        {
+            operator_symbols.push_back(op_info.symbol);
+        }
+        operator_symbols.push_back("?");
+        operator_symbols.push_back(":");
+        // Longest symbols first, so that the lexer matches "<=" before "<".
+        std::stable_sort(
+            operator_symbols.begin(), operator_symbols.end(), [](std::string_view lhs, std::string_view rhs) { return lhs.size() > rhs.size(); });
+    }
+
+    void register_function(std::string name, Function func, BatchFunction batch, bool pure, Arity arity)
+    {
+        std::unique_lock lock{ function_mutex };
+        function_info_list.push_back(FuncInfo{ std::move(name), std::move(func), nullptr, nullptr, nullptr, pure, std::move(batch), arity });
+    }
+
+    void register_builtin(std::string name, Function func, BlockFunc block, UnaryFuncPtr unary, SpanFuncPtr span, Arity arity)
+    {
+        std::unique_lock lock{ function_mutex };
+        function_info_list.push_back(FuncInfo{ std::move(name), std::move(func), block, unary, span, true, nullptr, arity });
+    }
+
+    ExprPtr parse(std::string_view text, ParseState& state) const
+    {
+        if (engine == Engine::pratt)
+        {
+            return parse_pratt(text, state);
+        }
+        const ParenIndex parens{ text };
+        state.parens = &parens;
+        state.count(&ParseStats::paren_scan_bytes, text.size());
+        return parse_expr(text, state);
+    }
+
+    // Parses with stats when they are being collected.
+    ExprPtr parse_counted(std::string_view text, std::pmr::memory_resource* arena) const
+    {
+        if (!collect_stats && !parse_hook)
+        {
+            ParseState state{ arena };
+            return parse(text, state);
+        }
+        ParseStats stats;
+        stats.parses = 1;
+        stats.bytes = text.size();
+        ParseState state{ arena, &stats };
+        ExprPtr res;
+        try
+        {
+            res = parse(text, state);
+        }
+        catch (...)
+        {
+            ++stats.errors;
+            record(text, stats);
+            throw;
+        }
+        stats.failures += res ? 0 : 1;
+        record(text, stats);
+        return res;
+    }
+
+    void record(std::string_view text, const ParseStats& stats) const
+    {
+        {
+            std::lock_guard lock{ stats_mutex };
+            total_stats += stats;
+        }
+        if (parse_hook)
+        {
+            parse_hook(text, stats);
+        }
+    }
+
+    ExprPtr parse_expr(std::string_view text, ParseState& state) const
+    {
+        check_depth(state.depth + 1, max_depth);
+        if (state.stats)
+        {
+            ++state.stats->parse_expr_calls;
+            state.stats->max_depth = std::max(state.stats->max_depth, state.depth + 1);
+        }
+        if (!state.valid_parens(text))
+        {
+            throw std::runtime_error{ "Invalid parens" };
+        }
+
+        text = state.simplify_parens(text);
+
+        static const auto methods = std::array{ &Impl::parse_number,
+                                                &Impl::parse_binary_or_assignment,
+                                                &Impl::parse_unary,
+                                                &Impl::parse_function,
+                                                &Impl::parse_variable };
+
+        ++state.depth;
+        for (std::size_t i = 0; i < methods.size(); ++i)
+        {
+            if (auto res = ((*this).*methods[i])(text, state))
+            {
+                --state.depth;
+                return res;
+            }
+            if (state.stats)
+            {
+                ++state.stats->failed_attempts[i];
+            }
+        }
+        --state.depth;
+        return nullptr;
+    }
+
+    ExprPtr parse_number(std::string_view text, ParseState& state) const
+    {
+        if (auto res = state.number(text))
+        {
+            return state.make<expressions::Value>(*res);
+        }
+        return nullptr;
+    }
+
+    ExprPtr parse_variable(std::string_view text, ParseState& state) const
+    {
+        if (is_valid_variable_name(text))
+        {
+            return state.make<expressions::Variable>(text);
+        }
+        return nullptr;
+    }
+
+    ExprPtr parse_unary(std::string_view text, ParseState& state) const
+    {
+        for (const auto& op_info : unary_op_info_list)
+        {
+            if (starts_with(text, op_info.symbol))
+            {
+                if (auto sub = parse_expr(make_string_view(text.begin() + op_info.symbol.size(), text.end()), state))
+                {
+                    return make_unary_op(op_info, std::move(sub), state);
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    ExprPtr parse_binary_or_assignment(std::string_view text, ParseState& state) const
+    {
+        const auto oper_result = find_binary_oper(text, state);
+        if (!oper_result)
+        {
+            return nullptr;
+        }
+
+        const auto [it, op_info] = *oper_result;
+        if (!op_info)
+        {
+            return parse_conditional(text, it, state);
+        }
+
+        auto rhs = parse_expr(make_string_view(it + op_info->symbol.size(), text.end()), state);
+        if (!rhs)
+        {
+            return nullptr;
+        }
+
+        const auto lhs_str = trim_whitespace(make_string_view(text.begin(), it));
+
+        if (is_valid_variable_name(lhs_str) && is_assignment(*op_info))
+        {
+            return state.make<expressions::Assignment>(lhs_str, std::move(rhs));
+        }
+        else if (auto lhs = parse_expr(lhs_str, state))
+        {
+            return make_binary_op(*op_info, std::move(lhs), std::move(rhs), state);
+        }
+        return nullptr;
+    }
+
+    // text is "cond ? then : otherwise" with its top-level '?' at question.
+    ExprPtr parse_conditional(std::string_view text, std::string_view::iterator question, ParseState& state) const
+    {
+        const auto rest = make_string_view(question + 1, text.end());
+        // The ':' that pairs with this '?', past any conditionals nested in the middle operand.
+        auto colon = rest.end();
+        int nested = 0;
+        for (auto it = rest.begin(); it != rest.end(); ++it)
+        {
+            if (*it == '(')
+            {
+                it = rest.begin() + (state.parens->partner_of(&*it) - rest.data());
+            }
+            else if (*it == '?')
+            {
+                ++nested;
+            }
+            else if (*it == ':' && nested-- == 0)
+            {
+                colon = it;
+                break;
+            }
+        }
+        if (colon == rest.end())
+        {
+            return nullptr;
+        }
+        auto cond = parse_expr(make_string_view(text.begin(), question), state);
+        auto then = cond ? parse_expr(make_string_view(rest.begin(), colon), state) : nullptr;
+        auto otherwise = then ? parse_expr(make_string_view(colon + 1, rest.end()), state) : nullptr;
+        if (!otherwise)
+        {
+            return nullptr;
+        }
+        return state.make<expressions::Conditional>(std::move(cond), std::move(then), std::move(otherwise));
+    }
+
+    ExprPtr parse_function(std::string_view text, ParseState& state) const
+    {
+        auto it = std::find(text.begin(), text.end(), '(');
+        if (it == text.end() || text.back() != ')')
+        {
+            return nullptr;
+        }
+        const auto name = trim_whitespace(make_string_view(text.begin(), it));
+        const auto info = find_function(name);
+        if (!info)
+        {
+            return nullptr;
         }
         auto subs = std::invoke([&]() {
-            std::vector<ExprPtr> subs;
-            text = simplify_parens(make_string_view(it, text.end()));
+            std::pmr::vector<ExprPtr> subs{ state.resource() };
+            text = state.simplify_parens(make_string_view(it, text.end()));
             while (!text.empty())
             {
+                // Top-level comma, stepping over parenthesized groups whole.
                 auto next = std::invoke([&]() {
-                    int paren_counter = 0;
                     for (auto it = text.begin(); it != text.end(); ++it)
                     {
                         if (*it == '(')
                         {
-                            ++paren_counter;
+                            it = text.begin() + (state.parens->partner_of(&*it) - text.data());
                         }
-                        if (*it == ')')
-                        {
-                            --paren_counter;
-                        }
-
-                        if (*it == ',' && paren_counter == 0)
+                        else if (*it == ',')
                         {
                             return it;
                         }
                     }
                     return text.end();
                 });
-                subs.push_back(parse_expr(make_string_view(text.begin(), next)));
-                text = simplify_parens(drop(make_string_view(next, text.end()), 1));
+                subs.push_back(parse_expr(make_string_view(text.begin(), next), state));
+                text = state.simplify_parens(drop(make_string_view(next, text.end()), 1));
             }
             return subs;
         });
-        return std::make_unique<expressions::Func>(*info, std::move(subs));
+        return make_func(*info, std::move(subs), state);
+    }
+
+    const FuncInfo* find_function(std::string_view name) const
+    {
+        std::shared_lock lock{ function_mutex };
+        for (const auto& func_info : function_info_list)
+        {
+            if (func_info.name == name)
+            {
+                return &func_info;
+            }
+        }
+        return nullptr;
+    }
+
+    const BinaryOpInfo* find_binary_op(std::string_view symbol) const
+    {
+        for (const auto& op_info : binary_op_info_list)
+        {
+            if (op_info.symbol == symbol)
+            {
+                return &op_info;
+            }
+        }
+        return nullptr;
+    }
+
+    const UnaryOpInfo* find_unary_op(std::string_view symbol) const
+    {
+        for (const auto& op_info : unary_op_info_list)
+        {
+            if (op_info.symbol == symbol)
+            {
+                return &op_info;
+            }
+        }
+        return nullptr;
+    }
+
+    std::optional<TokenStream> tokenize(std::string_view text, const ParseState& state) const
+    {
+        TokenStream res;
+        int paren_counter = 0;
+        std::size_t i = 0;
+        while (i < text.size())
+        {
+            const char ch = text[i];
+            if (std::isspace(static_cast<unsigned char>(ch)))
+            {
+                ++i;
+            }
+            else if (ch == '(' || ch == ')' || ch == ',')
+            {
+                const auto kind = ch == '(' ? Token::Kind::lparen : ch == ')' ? Token::Kind::rparen : Token::Kind::comma;
+                paren_counter += ch == '(' ? 1 : ch == ')' ? -1 : 0;
+                if (paren_counter < 0)
+                {
+                    throw std::runtime_error{ "Invalid parens" };
+                }
+                res.tokens.push_back(Token{ kind, text.substr(i, 1) });
+                ++i;
+            }
+            else if (const auto size = scan_number(text.substr(i)))
+            {
+                const auto literal = text.substr(i, size);
+                const auto value = state.number(literal);
+                if (!value)
+                {
+                    return std::nullopt;
+                }
+                res.tokens.push_back(Token{ Token::Kind::number, literal, *value });
+                i += size;
+            }
+            else if (is_identifier_char(ch))
+            {
+                std::size_t size = 1;
+                while (i + size < text.size() && is_identifier_char(text[i + size]))
+                {
+                    ++size;
+                }
+                res.tokens.push_back(Token{ Token::Kind::identifier, text.substr(i, size) });
+                i += size;
+            }
+            else
+            {
+                const auto rest = text.substr(i);
+                const auto symbol
+                    = std::find_if(operator_symbols.begin(), operator_symbols.end(), [&](const std::string& s) { return starts_with(rest, s); });
+                if (symbol == operator_symbols.end())
+                {
+                    return std::nullopt;
+                }
+                res.tokens.push_back(Token{ Token::Kind::op, text.substr(i, symbol->size()) });
+                i += symbol->size();
+            }
+        }
+        if (paren_counter != 0)
+        {
+            throw std::runtime_error{ "Invalid parens" };
+        }
+        res.tokens.push_back(Token{ Token::Kind::end, text.substr(text.size()) });
+        state.count(&ParseStats::tokens, res.tokens.size());
+        return res;
+    }
+
+    // Precedence climbing with explicit operand and operator stacks, so that neither long chains nor deep nesting
+    // recurse.
+    ExprPtr parse_pratt(std::string_view text, ParseState& state) const
+    {
+        auto tokens = tokenize(text, state);
+        if (!tokens || tokens->peek().kind == Token::Kind::end)
+        {
+            return nullptr;
+        }
+        PrattStacks stacks{ state, max_depth, {}, {} };
+        bool expect_operand = true;
+        while (true)
+        {
+            const Token& token = tokens->next();
+            if (expect_operand)
+            {
+                switch (token.kind)
+                {
+                    case Token::Kind::number: stacks.push_operand(state.make<expressions::Value>(token.value)); break;
+                    case Token::Kind::identifier:
+                        if (tokens->accept(Token::Kind::lparen))
+                        {
+                            const auto info = find_function(token.text);
+                            if (!info)
+                            {
+                                return nullptr;
+                            }
+                            stacks.pending.push_back(PendingOp{ PendingOp::Kind::call, nullptr, nullptr, info, stacks.operands.size() });
+                            if (!tokens->accept(Token::Kind::rparen))
+                            {
+                                continue;
+                            }
+                            stacks.close_call();
+                            break;
+                        }
+                        // std::stod accepts "inf" and "nan", so the legacy parser treats them as numbers.
+                        if (auto res = state.number(token.text))
+                        {
+                            stacks.push_operand(state.make<expressions::Value>(*res));
+                        }
+                        else
+                        {
+                            stacks.push_operand(state.make<expressions::Variable>(token.text));
+                        }
+                        break;
+                    case Token::Kind::lparen: stacks.pending.push_back(PendingOp{ PendingOp::Kind::group }); continue;
+                    case Token::Kind::op:
+                        // Unary operators bind tighter than any binary operator: -2 ^ 2 == (-2) ^ 2.
+                        if (const auto op_info = find_unary_op(token.text))
+                        {
+                            stacks.pending.push_back(PendingOp{ PendingOp::Kind::unary, op_info });
+                            continue;
+                        }
+                        return nullptr;
+                    default: return nullptr;
+                }
+                expect_operand = false;
+                continue;
+            }
+
+            switch (token.kind)
+            {
+                case Token::Kind::op:
+                {
+                    if (token.text == "?")
+                    {
+                        if (!stacks.reduce_binary_ops(conditional_precedence))
+                        {
+                            return nullptr;
+                        }
+                        stacks.pending.push_back(PendingOp{ PendingOp::Kind::condition });
+                        expect_operand = true;
+                        break;
+                    }
+                    if (token.text == ":")
+                    {
+                        if (!stacks.reduce_binary_ops(std::numeric_limits<int>::min()) || stacks.pending.empty()
+                            || stacks.pending.back().kind != PendingOp::Kind::condition)
+                        {
+                            return nullptr;
+                        }
+                        stacks.pending.back().kind = PendingOp::Kind::alternative;
+                        expect_operand = true;
+                        break;
+                    }
+                    const auto op_info = find_binary_op(token.text);
+                    if (!op_info || !stacks.reduce_binary_ops(op_info->precedence.value))
+                    {
+                        return nullptr;
+                    }
+                    stacks.pending.push_back(PendingOp{ PendingOp::Kind::binary, nullptr, op_info });
+                    expect_operand = true;
+                    break;
+                }
+                case Token::Kind::rparen:
+                    // The tokenizer has checked that every ')' closes a group or a call.
+                    if (!stacks.reduce_binary_ops(std::numeric_limits<int>::min())
+                        || stacks.pending.back().kind == PendingOp::Kind::condition)
+                    {
+                        return nullptr;
+                    }
+                    if (stacks.pending.back().kind == PendingOp::Kind::call)
+                    {
+                        stacks.close_call();
+                    }
+                    else
+                    {
+                        stacks.pending.pop_back();
+                        stacks.apply_unary_ops();
+                    }
+                    break;
+                case Token::Kind::comma:
+                    if (!stacks.reduce_binary_ops(std::numeric_limits<int>::min()) || stacks.pending.empty()
+                        || stacks.pending.back().kind != PendingOp::Kind::call)
+                    {
+                        return nullptr;
+                    }
+                    expect_operand = true;
+                    break;
+                case Token::Kind::end:
+                    // A '?' still pending here never got its ':'.
+                    if (!stacks.reduce_binary_ops(std::numeric_limits<int>::min()) || !stacks.pending.empty())
+                    {
+                        return nullptr;
+                    }
+                    return std::move(stacks.operands.back().expr);
+                // An operand right after another one.
+                default: return nullptr;
+            }
+        }
     }
 
-    std::optional<BinaryOpResult> find_binary_oper(std::string_view text) const
+    // The top-level operator of lowest precedence, stepping over parenthesized groups whole.
+    std::optional<BinaryOpResult> find_binary_oper(std::string_view text, const ParseState& state) const
     {
         auto res = std::optional<BinaryOpResult>{};
         int min_precedence = std::numeric_limits<int>::max();
-        int paren_counter = 0;
         for (auto it = text.begin(); it != text.end(); ++it)
         {
+            state.count(&ParseStats::operator_scan_bytes);
             if (*it == '(')
             {
-                ++paren_counter;
+                it = text.begin() + (state.parens->partner_of(&*it) - text.data());
             }
-            if (*it == ')')
+            else if (it != text.begin() && *it == '?')
             {
-                --paren_counter;
+                if (right_associative(conditional_precedence) < min_precedence)
+                {
+                    min_precedence = conditional_precedence;
+                    res = BinaryOpResult{ it, nullptr };
+                }
             }
-            if (paren_counter == 0 && it != text.begin())
+            else if (it != text.begin())
             {
                 const auto sub = make_string_view(it, text.end());
                 for (const auto& op_info : binary_op_info_list)
@@ -544,30 +1363,159 @@ struct Parser::Impl
 
     std::vector<UnaryOpInfo> unary_op_info_list;
     std::vector<BinaryOpInfo> binary_op_info_list;
-    std::vector<FuncInfo> function_info_list;
+    // A deque never relocates its elements, so the FuncInfo references held by parsed trees and
+    // compiled programs stay valid while other threads register more functions.
+    std::deque<FuncInfo> function_info_list;
+    mutable std::shared_mutex function_mutex;
+    std::vector<std::string> operator_symbols;
+    Engine engine = Engine::pratt;
+    std::size_t max_depth = 0;
+    bool collect_stats = false;
+    ParseHook parse_hook;
+    mutable std::mutex stats_mutex;
+    mutable ParseStats total_stats;
 };
 
+void ExprDeleter::destroy(Expr* expr)
+{
+    thread_local std::vector<Expr*>* pending = nullptr;
+    if (pending)
+    {
+        pending->push_back(expr);
+        return;
+    }
+    std::vector<Expr*> queue{ expr };
+    pending = &queue;
+    while (!queue.empty())
+    {
+        Expr* next = queue.back();
+        queue.pop_back();
+        delete next;
+    }
+    pending = nullptr;
+}
+
 Parser::Parser()
+    : Parser{ Engine::pratt }
+{
+}
+
+Parser::Parser(Engine engine)
     : impl{ std::make_unique<Impl>() }
 {
-    register_function("sum", func_sum);
-    register_function("sin", func_sin);
-    register_function("cos", func_cos);
-    register_function("max", func_max);
-    register_function("min", func_min);
-    register_function("sqrt", func_sqrt);
+    impl->engine = engine;
+    impl->register_builtin("sum", func_sum, block_sum, nullptr, span_sum, Arity{});
+    impl->register_builtin("sin", func_sin, block_sin, unary_sin, nullptr, Arity::exactly(1));
+    impl->register_builtin("cos", func_cos, block_cos, unary_cos, nullptr, Arity::exactly(1));
+    impl->register_builtin("max", func_max, block_max, nullptr, span_max, Arity::at_least(1));
+    impl->register_builtin("min", func_min, block_min, nullptr, span_min, Arity::at_least(1));
+    impl->register_builtin("sqrt", func_sqrt, block_sqrt, unary_sqrt, nullptr, Arity::exactly(1));
+    impl->register_builtin("if", func_if, nullptr, nullptr, nullptr, Arity::exactly(3));
 }
 
 Parser::~Parser() = default;
 
-void Parser::register_function(std::string name, Function func)
+void Parser::register_function(std::string name, Function func, bool pure, Arity arity)
+{
+    impl->register_function(std::move(name), std::move(func), nullptr, pure, arity);
+}
+
+void Parser::register_function(std::string name, Function func, BatchFunction batch, bool pure, Arity arity)
+{
+    impl->register_function(std::move(name), std::move(func), std::move(batch), pure, arity);
+}
+
+void Parser::register_function(std::string name, BatchFunction batch, bool pure, Arity arity)
+{
+    Function func = [batch](const std::vector<double>& args)
+    {
+        std::vector<Span<const double>> columns;
+        columns.reserve(args.size());
+        for (const double& arg : args)
+        {
+            columns.emplace_back(&arg, 1);
+        }
+        double res = 0;
+        batch(columns, Span<double>{ &res, 1 });
+        return res;
+    };
+    impl->register_function(std::move(name), std::move(func), std::move(batch), pure, arity);
+}
+
+const FuncInfo* Parser::find_function(std::string_view name) const
+{
+    return impl->find_function(name);
+}
+
+const UnaryOpInfo* Parser::find_unary_op(std::string_view symbol) const
+{
+    return impl->find_unary_op(symbol);
+}
+
+const BinaryOpInfo* Parser::find_binary_op(std::string_view symbol) const
+{
+    return impl->find_binary_op(symbol);
+}
+
+void Parser::set_engine(Engine engine)
+{
+    impl->engine = engine;
+}
+
+Parser::Engine Parser::engine() const
 {
-    impl->register_function(name, func);
+    return impl->engine;
+}
+
+void Parser::set_max_depth(std::size_t max_depth)
+{
+    impl->max_depth = max_depth;
+}
+
+std::size_t Parser::max_depth() const
+{
+    return impl->max_depth;
+}
+
+void Parser::set_collect_stats(bool collect)
+{
+    impl->collect_stats = collect;
+}
+
+void Parser::set_parse_hook(ParseHook hook)
+{
+    impl->parse_hook = std::move(hook);
+}
+
+ParseStats Parser::stats() const
+{
+    std::lock_guard lock{ impl->stats_mutex };
+    return impl->total_stats;
+}
+
+void Parser::reset_stats()
+{
+    std::lock_guard lock{ impl->stats_mutex };
+    impl->total_stats = ParseStats{};
 }
 
 ExprPtr Parser::operator()(std::string_view text) const
 {
-    return impl->parse_expr(text);
+    return impl->parse_counted(text, nullptr);
+}
+
+ArenaExpr Parser::parse_in_arena(std::string_view text) const
+{
+    // Roughly one node per two characters of input, so that typical expressions fit the first buffer.
+    ArenaExpr res;
+    res.arena = std::make_unique<std::pmr::monotonic_buffer_resource>(256 + text.size() * 16);
+    res.root = parse_in(text, *res.arena);
+    return res;
+}
+
+ExprPtr Parser::parse_in(std::string_view text, std::pmr::memory_resource& arena) const
+{
+    return impl->parse_counted(text, &arena);
 }
 
 }  // namespace calc
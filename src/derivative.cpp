@@ -0,0 +1,549 @@
+#include "derivative.hpp"
+
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+#include "expressions.hpp"
+#include "optimize.hpp"
+
+namespace calc
+{
+namespace
+{
+const expressions::Value* as_value(const ExprPtr& expr)
+{
+    return dynamic_cast<const expressions::Value*>(expr.get());
+}
+
+// Compares bit patterns, so that the sign of zero is kept where it matters, as in optimize.
+bool is_value(const ExprPtr& expr, double v)
+{
+    const auto value = as_value(expr);
+    return value && std::memcmp(&value->v, &v, sizeof v) == 0;
+}
+
+bool is_zero(const ExprPtr& expr)
+{
+    const auto value = as_value(expr);
+    return value && value->v == 0.0;
+}
+
+[[noreturn]] void cannot_differentiate(const std::string& what)
+{
+    throw std::invalid_argument{ "cannot differentiate " + what };
+}
+
+// Copies a tree, replacing the variables in replacements with copies of the trees they map to. Post-order, without
+// recursing through deep trees: the copies of the operands of a node are the last ones on `results`.
+ExprPtr substitute(const Expr& expr, const std::unordered_map<Slot, const Expr*>& replacements)
+{
+    std::vector<ExprPtr> results;
+    walk_postorder(
+        expr,
+        [&](const Expr& node)
+        {
+            const std::size_t first = results.size() - operand_count(node);
+            ExprPtr* operands = &results[first];
+            auto res = visit(
+                node,
+                overloaded{
+                    [&](const expressions::Value& e) -> ExprPtr { return std::make_unique<expressions::Value>(e.v); },
+                    [&](const expressions::Variable& e) -> ExprPtr {
+                        if (const auto it = replacements.find(e.slot); it != replacements.end())
+                        {
+                            return substitute(*it->second, {});
+                        }
+                        return std::make_unique<expressions::Variable>(e.name);
+                    },
+                    [&](const expressions::UnaryOp& e) -> ExprPtr { return make_unary_op(e.info, std::move(operands[0])); },
+                    [&](const expressions::BinaryOp& e) -> ExprPtr { return make_binary_op(e.info, std::move(operands[0]), std::move(operands[1])); },
+                    [&](const expressions::Func& e) -> ExprPtr {
+                        std::vector<ExprPtr> subs{ std::make_move_iterator(operands), std::make_move_iterator(operands + e.subs.size()) };
+                        return make_func(e.info, std::move(subs));
+                    },
+                    [&](const expressions::Assignment& e) -> ExprPtr {
+                        return std::make_unique<expressions::Assignment>(e.name, std::move(operands[0]));
+                    },
+                    [&](const expressions::Conditional&) -> ExprPtr {
+                        return std::make_unique<expressions::Conditional>(std::move(operands[0]), std::move(operands[1]), std::move(operands[2]));
+                    },
+                    [&](const expressions::Logical& e) -> ExprPtr { return make_binary_op(e.info, std::move(operands[0]), std::move(operands[1])); },
+                });
+            results.resize(first);
+            results.push_back(std::move(res));
+        });
+    return std::move(results.back());
+}
+
+ExprPtr copy(const Expr& expr)
+{
+    return substitute(expr, {});
+}
+
+}  // namespace
+
+// Builds d expr / d variable bottom-up, folding constants and the identities of 0 and 1 in each new node. The
+// derivative of anything independent of the variable is -0, which unlike +0 leaves every addend as it is; where
+// such a derivative would be subtracted or negated, the term is left out instead.
+struct Derivation
+{
+    const Differentiator& differentiator;
+    Slot variable;
+
+    const BinaryOpInfo& binary_op(std::string_view symbol) const
+    {
+        const auto info = differentiator.parser.find_binary_op(symbol);
+        if (!info)
+        {
+            throw std::logic_error{ "the parser has no operator '" + std::string{ symbol } + "'" };
+        }
+        return *info;
+    }
+
+    const FuncInfo& function(std::string_view name) const
+    {
+        const auto info = differentiator.parser.find_function(name);
+        if (!info)
+        {
+            throw std::logic_error{ "the parser has no function '" + std::string{ name } + "'" };
+        }
+        return *info;
+    }
+
+    static ExprPtr value(double v)
+    {
+        return std::make_unique<expressions::Value>(v);
+    }
+
+    static ExprPtr zero()
+    {
+        return value(-0.0);
+    }
+
+    ExprPtr add(ExprPtr lhs, ExprPtr rhs) const
+    {
+        if (as_value(lhs) && as_value(rhs))
+        {
+            return value(as_value(lhs)->v + as_value(rhs)->v);
+        }
+        if (is_value(lhs, -0.0))
+        {
+            return rhs;
+        }
+        if (is_value(rhs, -0.0))
+        {
+            return lhs;
+        }
+        return make_binary_op(binary_op("+"), std::move(lhs), std::move(rhs));
+    }
+
+    ExprPtr sub(ExprPtr lhs, ExprPtr rhs) const
+    {
+        if (as_value(lhs) && as_value(rhs))
+        {
+            return value(as_value(lhs)->v - as_value(rhs)->v);
+        }
+        if (is_value(rhs, 0.0))
+        {
+            return lhs;
+        }
+        if (is_value(lhs, -0.0))
+        {
+            return neg(std::move(rhs));
+        }
+        return make_binary_op(binary_op("-"), std::move(lhs), std::move(rhs));
+    }
+
+    ExprPtr mul(ExprPtr lhs, ExprPtr rhs) const
+    {
+        if (as_value(lhs) && as_value(rhs))
+        {
+            return value(as_value(lhs)->v * as_value(rhs)->v);
+        }
+        if (is_zero(lhs) || is_zero(rhs))
+        {
+            return zero();
+        }
+        if (is_value(lhs, 1.0))
+        {
+            return rhs;
+        }
+        if (is_value(rhs, 1.0))
+        {
+            return lhs;
+        }
+        if (is_value(lhs, -1.0))
+        {
+            return neg(std::move(rhs));
+        }
+        if (is_value(rhs, -1.0))
+        {
+            return neg(std::move(lhs));
+        }
+        return make_binary_op(binary_op("*"), std::move(lhs), std::move(rhs));
+    }
+
+    ExprPtr div(ExprPtr lhs, ExprPtr rhs) const
+    {
+        if (is_zero(lhs))
+        {
+            return zero();
+        }
+        if (is_value(rhs, 1.0))
+        {
+            return lhs;
+        }
+        return make_binary_op(binary_op("/"), std::move(lhs), std::move(rhs));
+    }
+
+    ExprPtr pow(ExprPtr lhs, ExprPtr rhs) const
+    {
+        if (is_value(rhs, 1.0))
+        {
+            return lhs;
+        }
+        return make_binary_op(binary_op("^"), std::move(lhs), std::move(rhs));
+    }
+
+    ExprPtr neg(ExprPtr sub) const
+    {
+        if (const auto v = as_value(sub))
+        {
+            return value(-v->v);
+        }
+        if (const auto inner = dynamic_cast<expressions::UnaryOp*>(sub.get()); inner && inner->info.kind == UnaryOpKind::neg)
+        {
+            return std::move(inner->sub);
+        }
+        return make_unary_op(*differentiator.parser.find_unary_op("-"), std::move(sub));
+    }
+
+    ExprPtr call(std::string_view name, ExprPtr arg) const
+    {
+        std::vector<ExprPtr> subs;
+        subs.push_back(std::move(arg));
+        return make_func(function(name), std::move(subs));
+    }
+
+    // Chain rule for a function of one argument: outer'(arg) * d arg, skipping outer' when arg is constant.
+    template <class Outer>
+    ExprPtr chain(ExprPtr inner, Outer outer) const
+    {
+        if (is_zero(inner))
+        {
+            return inner;
+        }
+        return mul(outer(), std::move(inner));
+    }
+
+    static bool has_builtin_rule(const expressions::Func& e)
+    {
+        const std::string& name = e.info.name;
+        return e.info.block && (name == "sum" || name == "max" || name == "min" || (e.subs.size() == 1 && (name == "sin" || name == "cos" || name == "sqrt")));
+    }
+
+    const Differentiator::Rule& registered_rule(const expressions::Func& e) const
+    {
+        const std::string& name = e.info.name;
+        const auto it = differentiator.rules.find(name);
+        if (it == differentiator.rules.end())
+        {
+            cannot_differentiate("'" + name + "': no derivative rule is registered");
+        }
+        const Differentiator::Rule& rule = it->second;
+        if (rule.params.size() != e.subs.size())
+        {
+            cannot_differentiate("'" + name + "' called with " + std::to_string(e.subs.size()) + " arguments: its rule has "
+                                 + std::to_string(rule.params.size()) + " parameters");
+        }
+        return rule;
+    }
+
+    // max and min pick one argument, and have its derivative: the first argument equal to the result wins.
+    ExprPtr derive_selection(const expressions::Func& e, ExprPtr* inner) const
+    {
+        if (e.subs.empty())
+        {
+            return zero();
+        }
+        ExprPtr res = std::move(inner[e.subs.size() - 1]);
+        for (std::size_t k = e.subs.size() - 1; k-- > 0;)
+        {
+            if (is_zero(inner[k]) && is_zero(res))
+            {
+                continue;
+            }
+            auto cond = make_binary_op(binary_op("=="), copy(*e.subs[k]), copy(e));
+            res = std::make_unique<expressions::Conditional>(std::move(cond), std::move(inner[k]), std::move(res));
+        }
+        return res;
+    }
+
+    // inner holds the derivatives of the arguments.
+    ExprPtr derive_func(const expressions::Func& e, ExprPtr* inner) const
+    {
+        const std::string& name = e.info.name;
+        if (has_builtin_rule(e))
+        {
+            if (name == "sum")
+            {
+                ExprPtr res = zero();
+                for (std::size_t k = 0; k < e.subs.size(); ++k)
+                {
+                    res = add(std::move(res), std::move(inner[k]));
+                }
+                return res;
+            }
+            if (name == "max" || name == "min")
+            {
+                return derive_selection(e, inner);
+            }
+            if (name == "sin")
+            {
+                return chain(std::move(inner[0]), [&] { return call("cos", copy(*e.subs[0])); });
+            }
+            if (name == "cos")
+            {
+                return chain(std::move(inner[0]), [&] { return neg(call("sin", copy(*e.subs[0]))); });
+            }
+            return chain(std::move(inner[0]), [&] { return div(value(0.5), call("sqrt", copy(*e.subs[0]))); });
+        }
+
+        const Differentiator::Rule& rule = registered_rule(e);
+        std::unordered_map<Slot, const Expr*> args;
+        for (std::size_t k = 0; k < rule.params.size(); ++k)
+        {
+            args.emplace(rule.params[k], e.subs[k].get());
+        }
+        ExprPtr res = zero();
+        for (std::size_t k = 0; k < e.subs.size(); ++k)
+        {
+            if (!is_zero(inner[k]))
+            {
+                res = add(std::move(res), mul(substitute(*rule.partials[k], args), std::move(inner[k])));
+            }
+        }
+        return res;
+    }
+
+    // Post-order, without recursing through deep trees: the derivatives of the operands of a node are the last ones on
+    // `results`, with a null in place of each operand whose derivative is not needed. What cannot be differentiated
+    // is rejected before the walk descends into it.
+    ExprPtr derive(const Expr& expr) const
+    {
+        std::vector<ExprPtr> results;
+        walk_postorder(
+            expr,
+            [&](const Expr& node, std::size_t index)
+            {
+                if (!needs_derivative(node, index))
+                {
+                    results.push_back(nullptr);
+                    return false;
+                }
+                return true;
+            },
+            [&](const Expr& node)
+            {
+                const std::size_t first = results.size() - operand_count(node);
+                auto res = derive_node(node, &results[first]);
+                results.resize(first);
+                results.push_back(std::move(res));
+            });
+        return std::move(results.back());
+    }
+
+    // Whether the derivative of the operand at index is needed: comparisons and logical operators are piecewise
+    // constant, and only the branches of a conditional count.
+    bool needs_derivative(const Expr& node, std::size_t index) const
+    {
+        return visit(
+            node,
+            overloaded{
+                [&](const expressions::Value&) { return true; },
+                [&](const expressions::Variable&) { return true; },
+                [&](const expressions::UnaryOp& e) {
+                    if (e.info.kind != UnaryOpKind::pos && e.info.kind != UnaryOpKind::neg)
+                    {
+                        cannot_differentiate("operator '" + e.info.symbol + "'");
+                    }
+                    return true;
+                },
+                [&](const expressions::BinaryOp& e) {
+                    switch (e.info.kind)
+                    {
+                        case BinaryOpKind::add:
+                        case BinaryOpKind::sub:
+                        case BinaryOpKind::mul:
+                        case BinaryOpKind::div:
+                        case BinaryOpKind::pow: return true;
+                        case BinaryOpKind::eq:
+                        case BinaryOpKind::ne:
+                        case BinaryOpKind::lt:
+                        case BinaryOpKind::le:
+                        case BinaryOpKind::gt:
+                        case BinaryOpKind::ge: return false;
+                        default: cannot_differentiate("operator '" + e.info.symbol + "'");
+                    }
+                },
+                [&](const expressions::Func& e) {
+                    if (index == 0 && !has_builtin_rule(e))
+                    {
+                        registered_rule(e);
+                    }
+                    return true;
+                },
+                [&](const expressions::Assignment&) -> bool { cannot_differentiate("an assignment"); },
+                [&](const expressions::Conditional&) { return index > 0; },
+                [&](const expressions::Logical&) { return false; },
+            });
+    }
+
+    // inner holds the derivatives of the operands of node.
+    ExprPtr derive_node(const Expr& node, ExprPtr* inner) const
+    {
+        return visit(
+            node,
+            overloaded{
+                [&](const expressions::Value&) -> ExprPtr { return zero(); },
+                [&](const expressions::Variable& e) -> ExprPtr { return e.slot == variable ? value(1.0) : zero(); },
+                [&](const expressions::UnaryOp& e) -> ExprPtr {
+                    if (e.info.kind == UnaryOpKind::pos)
+                    {
+                        return std::move(inner[0]);
+                    }
+                    if (is_zero(inner[0]))
+                    {
+                        return zero();
+                    }
+                    return neg(std::move(inner[0]));
+                },
+                [&](const expressions::BinaryOp& e) -> ExprPtr {
+                    switch (e.info.kind)
+                    {
+                        case BinaryOpKind::add: return add(std::move(inner[0]), std::move(inner[1]));
+                        case BinaryOpKind::sub:
+                            // A subtrahend independent of the variable contributes nothing, rather than a -0.
+                            if (is_zero(inner[1]))
+                            {
+                                return std::move(inner[0]);
+                            }
+                            return sub(std::move(inner[0]), std::move(inner[1]));
+                        case BinaryOpKind::mul:
+                        {
+                            auto lhs = mul(std::move(inner[0]), copy(*e.rhs));
+                            return add(std::move(lhs), mul(copy(*e.lhs), std::move(inner[1])));
+                        }
+                        case BinaryOpKind::div:
+                        {
+                            // (a / b)' = a' / b - a * b' / b ^ 2
+                            auto lhs = div(std::move(inner[0]), copy(*e.rhs));
+                            if (is_zero(inner[1]))
+                            {
+                                return lhs;
+                            }
+                            auto rhs = div(mul(copy(*e.lhs), std::move(inner[1])), pow(copy(*e.rhs), value(2.0)));
+                            return sub(std::move(lhs), std::move(rhs));
+                        }
+                        case BinaryOpKind::pow:
+                            if (!is_zero(inner[1]))
+                            {
+                                cannot_differentiate("'^' with an exponent that depends on the variable");
+                            }
+                            // (a ^ n)' = n * a ^ (n - 1) * a'
+                            return chain(std::move(inner[0]), [&] {
+                                auto exponent = sub(copy(*e.rhs), value(1.0));
+                                return mul(copy(*e.rhs), pow(copy(*e.lhs), std::move(exponent)));
+                            });
+                        // The comparisons, the only other operators that get this far.
+                        default: return zero();
+                    }
+                },
+                [&](const expressions::Func& e) -> ExprPtr { return derive_func(e, inner); },
+                [&](const expressions::Assignment&) -> ExprPtr { cannot_differentiate("an assignment"); },
+                [&](const expressions::Conditional& e) -> ExprPtr {
+                    if (as_value(inner[1]) && is_value(inner[2], as_value(inner[1])->v))
+                    {
+                        return std::move(inner[1]);
+                    }
+                    return std::make_unique<expressions::Conditional>(copy(*e.cond), std::move(inner[1]), std::move(inner[2]));
+                },
+                [&](const expressions::Logical&) -> ExprPtr { return zero(); },
+            });
+    }
+};
+
+Differentiator::Differentiator(const Parser& parser)
+    : parser{ parser }
+{
+}
+
+void Differentiator::register_rule(std::string name, const std::vector<std::string_view>& params, const std::vector<std::string_view>& partials)
+{
+    if (params.size() != partials.size())
+    {
+        throw std::invalid_argument{ "'" + name + "' needs one partial derivative per parameter" };
+    }
+    Rule rule;
+    for (std::size_t k = 0; k < params.size(); ++k)
+    {
+        rule.params.push_back(symbols().intern(params[k]));
+        auto partial = parser(partials[k]);
+        if (!partial)
+        {
+            throw std::invalid_argument{ "cannot parse the derivative of '" + name + "' by " + std::string{ params[k] } };
+        }
+        rule.partials.push_back(std::move(partial));
+    }
+    rules.insert_or_assign(std::move(name), std::move(rule));
+}
+
+ExprPtr Differentiator::derivative(const Expr& expr, Slot variable) const
+{
+    auto res = optimize(*Derivation{ *this, variable }.derive(expr));
+    // A derivative that is zero throughout is +0, as derivatives are usually written.
+    if (const auto v = as_value(res); v && v->v == 0.0)
+    {
+        return std::make_unique<expressions::Value>(0.0);
+    }
+    return res;
+}
+
+ExprPtr Differentiator::derivative(const Expr& expr, std::string_view variable) const
+{
+    return derivative(expr, symbols().intern(variable));
+}
+
+Gradient Gradient::compile(const Expr& expr, Span<const Slot> variables, const Differentiator& differentiator)
+{
+    Gradient res;
+    std::vector<ExprPtr> exprs;
+    exprs.push_back(copy(expr));
+    for (const Slot variable : variables)
+    {
+        res.partials.push_back(differentiator.derivative(expr, variable));
+        exprs.push_back(copy(*res.partials.back()));
+    }
+    res.program = SharedProgram::compile(exprs);
+    return res;
+}
+
+Gradient Gradient::compile(const Expr& expr, const std::vector<std::string_view>& variables, const Differentiator& differentiator)
+{
+    std::vector<Slot> slots;
+    for (const auto name : variables)
+    {
+        slots.push_back(symbols().intern(name));
+    }
+    return compile(expr, slots, differentiator);
+}
+
+void Gradient::run(Context& ctx, Span<double> results) const
+{
+    program.run(ctx, results);
+}
+
+}  // namespace calc
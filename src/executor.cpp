@@ -0,0 +1,216 @@
+#include "executor.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <stdexcept>
+
+namespace calc
+{
+namespace
+{
+constexpr std::size_t cache_line_size = 64;
+constexpr std::size_t doubles_per_line = cache_line_size / sizeof(double);
+
+// Rows to skip before out + row starts a cache line; 0 when the output is not even aligned to a double.
+std::size_t rows_to_line_boundary(const double* out)
+{
+    const auto address = reinterpret_cast<std::uintptr_t>(out);
+    if (address % sizeof(double) != 0)
+    {
+        return 0;
+    }
+    return (cache_line_size - address % cache_line_size) % cache_line_size / sizeof(double);
+}
+
+}  // namespace
+
+// Aligned to a cache line so that one worker's deque lock does not share a line with another's.
+struct alignas(cache_line_size) Executor::Worker
+{
+    std::mutex mutex;
+    std::deque<Task> tasks;
+    BatchWorkspace workspace;
+    std::thread thread;
+};
+
+Executor::Executor(std::size_t thread_count, std::size_t chunk_rows)
+    : chunk_rows{ std::max<std::size_t>(batch_block_size, chunk_rows / batch_block_size * batch_block_size) }
+{
+    static_assert(batch_block_size % doubles_per_line == 0);
+    thread_count = std::max<std::size_t>(thread_count, 1);
+    for (std::size_t id = 0; id < thread_count; ++id)
+    {
+        workers.push_back(std::make_unique<Worker>());
+    }
+    for (std::size_t id = 0; id < thread_count; ++id)
+    {
+        workers[id]->thread = std::thread{ [this, id] { work(id); } };
+    }
+}
+
+Executor::~Executor()
+{
+    {
+        std::lock_guard lock{ mutex };
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto& worker : workers)
+    {
+        worker->thread.join();
+    }
+}
+
+std::size_t Executor::thread_count() const
+{
+    return workers.size();
+}
+
+void Executor::run(Span<const Program> programs, Span<const Column> columns, Span<const Span<double>> outputs, const Context& ctx)
+{
+    if (programs.size != outputs.size)
+    {
+        throw std::invalid_argument{ "every program needs exactly one output" };
+    }
+    const std::size_t rows = outputs.empty() ? 0 : outputs[0].size;
+    for (const Span<double>& out : outputs)
+    {
+        if (out.size != rows)
+        {
+            throw std::invalid_argument{ "all outputs must have the same size" };
+        }
+    }
+
+    std::lock_guard run_lock{ run_mutex };
+
+    // Chunk-major order: consecutive tasks read the same rows of the columns, which keeps them in cache for the
+    // worker that runs them.
+    std::vector<Task> tasks;
+    std::vector<std::size_t> offsets;
+    for (const Span<double>& out : outputs)
+    {
+        offsets.push_back(std::min(rows, rows_to_line_boundary(out.data)));
+    }
+    const std::size_t chunk_count = (rows + chunk_rows - 1) / chunk_rows;
+    for (std::size_t chunk = 0; chunk < chunk_count; ++chunk)
+    {
+        for (std::size_t program = 0; program < programs.size; ++program)
+        {
+            // The first chunk absorbs the rows before the output's first cache-line boundary.
+            const std::size_t begin = chunk == 0 ? 0 : offsets[program] + chunk * chunk_rows;
+            const std::size_t end = std::min(rows, offsets[program] + (chunk + 1) * chunk_rows);
+            if (begin < end)
+            {
+                tasks.push_back(Task{ program, begin, end });
+            }
+        }
+    }
+    if (tasks.empty())
+    {
+        return;
+    }
+
+    this->programs = programs;
+    this->columns = columns;
+    this->outputs = outputs;
+    this->ctx = &ctx;
+    error = nullptr;
+    failed = false;
+    remaining = tasks.size();
+
+    // Contiguous slices, so each worker starts on rows of its own.
+    const std::size_t per_worker = (tasks.size() + workers.size() - 1) / workers.size();
+    for (std::size_t id = 0; id < workers.size(); ++id)
+    {
+        const std::size_t begin = std::min(tasks.size(), id * per_worker);
+        const std::size_t end = std::min(tasks.size(), begin + per_worker);
+        std::lock_guard lock{ workers[id]->mutex };
+        workers[id]->tasks.assign(tasks.begin() + begin, tasks.begin() + end);
+    }
+
+    std::unique_lock lock{ mutex };
+    ++generation;
+    wake.notify_all();
+    done.wait(lock, [this] { return remaining == 0; });
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+}
+
+void Executor::work(std::size_t id)
+{
+    std::size_t seen = 0;
+    while (true)
+    {
+        {
+            std::unique_lock lock{ mutex };
+            wake.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping)
+            {
+                return;
+            }
+            seen = generation;
+        }
+        Task task;
+        while (next_task(id, task))
+        {
+            execute(*workers[id], task);
+        }
+    }
+}
+
+bool Executor::next_task(std::size_t id, Task& task)
+{
+    {
+        Worker& own = *workers[id];
+        std::lock_guard lock{ own.mutex };
+        if (!own.tasks.empty())
+        {
+            task = own.tasks.front();
+            own.tasks.pop_front();
+            return true;
+        }
+    }
+    for (std::size_t k = 1; k < workers.size(); ++k)
+    {
+        Worker& victim = *workers[(id + k) % workers.size()];
+        std::lock_guard lock{ victim.mutex };
+        if (!victim.tasks.empty())
+        {
+            task = victim.tasks.back();
+            victim.tasks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+void Executor::execute(Worker& worker, const Task& task)
+{
+    if (!failed)
+    {
+        try
+        {
+            const Span<double> out = outputs[task.program];
+            eval_batch(
+                programs[task.program], columns, task.begin, Span<double>{ out.data + task.begin, task.end - task.begin }, *ctx, worker.workspace);
+        }
+        catch (...)
+        {
+            std::lock_guard lock{ mutex };
+            if (!failed.exchange(true))
+            {
+                error = std::current_exception();
+            }
+        }
+    }
+    if (--remaining == 0)
+    {
+        std::lock_guard lock{ mutex };
+        done.notify_all();
+    }
+}
+
+}  // namespace calc
@@ -0,0 +1,81 @@
+#include "expression_cache.hpp"
+
+#include "string_utils.hpp"
+
+namespace calc
+{
+ExpressionCache::ExpressionCache(const Parser& parser, std::size_t capacity)
+    : parser{ parser }
+    , max_size{ capacity }
+{
+}
+
+std::shared_ptr<const CompiledExpr> ExpressionCache::get(std::string_view text)
+{
+    const auto key = trim_whitespace(text);
+    {
+        std::lock_guard lock{ mutex };
+        if (const auto it = index.find(key); it != index.end())
+        {
+            entries.splice(entries.begin(), entries, it->second);
+            ++hits;
+            return it->second->value;
+        }
+    }
+    ++misses;
+
+    // Parse without holding the lock, so that one slow expression does not stall lookups of the others.
+    auto expr = parser(key);
+    if (!expr)
+    {
+        return nullptr;
+    }
+    auto program = Program::compile(*expr);
+    auto value = std::make_shared<const CompiledExpr>(CompiledExpr{ std::move(expr), std::move(program) });
+
+    std::lock_guard lock{ mutex };
+    if (const auto it = index.find(key); it != index.end())
+    {
+        // Another thread compiled the same text meanwhile; keep the entry that is already shared.
+        entries.splice(entries.begin(), entries, it->second);
+        return it->second->value;
+    }
+    if (max_size == 0)
+    {
+        return value;
+    }
+    if (entries.size() == max_size)
+    {
+        index.erase(entries.back().key);
+        entries.pop_back();
+        ++evictions;
+    }
+    entries.push_front(Entry{ std::string{ key }, value });
+    index.emplace(entries.front().key, entries.begin());
+    return value;
+}
+
+ExpressionCache::Stats ExpressionCache::stats() const
+{
+    return Stats{ hits, misses, evictions };
+}
+
+std::size_t ExpressionCache::size() const
+{
+    std::lock_guard lock{ mutex };
+    return entries.size();
+}
+
+std::size_t ExpressionCache::capacity() const
+{
+    return max_size;
+}
+
+void ExpressionCache::clear()
+{
+    std::lock_guard lock{ mutex };
+    index.clear();
+    entries.clear();
+}
+
+}  // namespace calc
@@ -0,0 +1,120 @@
+#include "expression_file.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+#include <thread>
+
+#include "string_utils.hpp"
+
+namespace calc
+{
+namespace
+{
+std::vector<std::string_view> split_lines(std::string_view text)
+{
+    std::vector<std::string_view> res;
+    while (!text.empty())
+    {
+        const void* newline = std::memchr(text.data(), '\n', text.size());
+        const std::size_t size = newline ? static_cast<const char*>(newline) - text.data() : text.size();
+        const auto line = trim_whitespace(text.substr(0, size));
+        if (!line.empty() && line.front() != '#')
+        {
+            res.push_back(line);
+        }
+        text.remove_prefix(std::min(text.size(), size + 1));
+    }
+    return res;
+}
+
+std::size_t line_number(std::string_view file, std::string_view line)
+{
+    return 1 + std::count(file.data(), line.data(), '\n');
+}
+
+}  // namespace
+
+ExpressionFile::ExpressionFile(const std::string& path, const Parser& parser, std::size_t threads)
+    : file{ path }
+    , texts{ split_lines(file.text()) }
+    , trees(texts.size())
+{
+    const std::size_t chunk_count = std::max<std::size_t>(1, std::min(threads, texts.size()));
+    const std::size_t per_chunk = (texts.size() + chunk_count - 1) / chunk_count;
+    std::vector<std::exception_ptr> errors(chunk_count);
+
+    const auto parse_chunk = [&](std::size_t chunk)
+    {
+        const std::size_t begin = std::min(texts.size(), chunk * per_chunk);
+        const std::size_t end = std::min(texts.size(), begin + per_chunk);
+        std::size_t bytes = 0;
+        for (std::size_t i = begin; i < end; ++i)
+        {
+            bytes += texts[i].size();
+        }
+        // The same sizing as Parser::parse_in_arena, for the whole chunk.
+        arenas[chunk] = std::make_unique<std::pmr::monotonic_buffer_resource>(256 + bytes * 16);
+        auto& arena = *arenas[chunk];
+        for (std::size_t i = begin; i < end; ++i)
+        {
+            try
+            {
+                trees[i] = parser.parse_in(texts[i], arena);
+                if (!trees[i])
+                {
+                    throw std::runtime_error{ "cannot parse expression" };
+                }
+            }
+            catch (const std::exception& ex)
+            {
+                errors[chunk] = std::make_exception_ptr(
+                    std::runtime_error{ path + ":" + std::to_string(line_number(file.text(), texts[i])) + ": " + ex.what() });
+                return;
+            }
+        }
+    };
+
+    arenas.resize(chunk_count);
+    std::vector<std::thread> workers;
+    for (std::size_t chunk = 1; chunk < chunk_count; ++chunk)
+    {
+        workers.emplace_back(parse_chunk, chunk);
+    }
+    parse_chunk(0);
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+    // Chunks are in file order, so the first error found is the one on the earliest line.
+    for (const auto& error : errors)
+    {
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+std::size_t ExpressionFile::size() const
+{
+    return trees.size();
+}
+
+const Expr& ExpressionFile::operator[](std::size_t index) const
+{
+    return *trees[index];
+}
+
+std::string_view ExpressionFile::text(std::size_t index) const
+{
+    return texts[index];
+}
+
+const std::vector<ExprPtr>& ExpressionFile::exprs() const
+{
+    return trees;
+}
+
+}  // namespace calc
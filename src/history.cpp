@@ -0,0 +1,88 @@
+#include "history.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+#include "expression_file.hpp"
+
+namespace calc
+{
+History::History(std::size_t max_size)
+    : max_size{ max_size }
+{
+}
+
+History::History(const std::string& path, const Parser& parser, std::size_t max_size, std::size_t threads)
+    : History{ max_size }
+{
+    if (std::ifstream{ path })
+    {
+        const ExpressionFile lines{ path, parser, threads };
+        dropped = lines.size() - std::min(lines.size(), max_size);
+        for (std::size_t index = dropped; index < lines.size(); ++index)
+        {
+            entries.push_back({ std::string{ lines.text(index) }, Program::compile(lines[index]), std::numeric_limits<double>::quiet_NaN() });
+        }
+    }
+    file.open(path, std::ios::app | std::ios::binary);
+    if (!file)
+    {
+        throw std::runtime_error{ "cannot open '" + path + "' for appending" };
+    }
+}
+
+void History::push(std::string text, Program program, double result)
+{
+    if (file.is_open())
+    {
+        file << text << '\n';
+    }
+    entries.push_back({ std::move(text), std::move(program), result });
+    while (entries.size() > max_size)
+    {
+        entries.pop_front();
+        ++dropped;
+    }
+}
+
+std::size_t History::first() const
+{
+    return dropped;
+}
+
+std::size_t History::end() const
+{
+    return dropped + entries.size();
+}
+
+const History::Entry& History::operator[](std::size_t number) const
+{
+    return const_cast<History&>(*this).at(number);
+}
+
+double History::rerun(std::size_t number, Context& ctx)
+{
+    Entry& entry = at(number);
+    entry.result = entry.program.run(ctx);
+    return entry.result;
+}
+
+void History::flush()
+{
+    if (file.is_open())
+    {
+        file.flush();
+    }
+}
+
+History::Entry& History::at(std::size_t number)
+{
+    if (number < first() || number >= end())
+    {
+        throw std::out_of_range{ "no history entry " + std::to_string(number) };
+    }
+    return entries[number - dropped];
+}
+
+}  // namespace calc
@@ -0,0 +1,115 @@
+#include "iterative.hpp"
+
+#include <utility>
+#include <vector>
+
+#include "expressions.hpp"
+
+namespace calc
+{
+double eval_iterative(const Expr& expr, Context& ctx)
+{
+    std::vector<double> values;
+    // For every conditional and logical node being evaluated: whether its condition picked the first branch, or
+    // whether its left operand decided the result.
+    std::vector<char> taken;
+    walk_postorder(
+        expr,
+        [&](const Expr& node, std::size_t index)
+        {
+            if (dynamic_cast<const expressions::Conditional*>(&node))
+            {
+                if (index == 1)
+                {
+                    taken.push_back(truth(values.back()));
+                    values.pop_back();
+                }
+                return index == 0 || (index == 1) == static_cast<bool>(taken.back());
+            }
+            if (const auto e = dynamic_cast<const expressions::Logical*>(&node); e && index == 1)
+            {
+                taken.push_back(e->decided_by(values.back()));
+                values.pop_back();
+                return !taken.back();
+            }
+            return true;
+        },
+        [&](const Expr& node)
+        {
+            visit(
+                node,
+                overloaded{
+                    [&](const expressions::Value& e) { values.push_back(e.v); },
+                    [&](const expressions::Variable& e) { values.push_back(ctx.get(e.slot)); },
+                    [&](const expressions::UnaryOp& e) { values.back() = e.info.func(values.back()); },
+                    [&](const expressions::BinaryOp& e) {
+                        const double y = values.back();
+                        values.pop_back();
+                        values.back() = e.info.func(values.back(), y);
+                    },
+                    [&](const expressions::Func& e) {
+                        const std::size_t first = values.size() - e.subs.size();
+                        double res = 0;
+                        if (e.info.unary && e.subs.size() == 1)
+                        {
+                            res = e.info.unary(values[first]);
+                        }
+                        else if (e.info.span)
+                        {
+                            res = e.info.span(values.data() + first, e.subs.size());
+                        }
+                        else
+                        {
+                            res = e.info.func(std::vector<double>(values.begin() + first, values.end()));
+                        }
+                        values.resize(first);
+                        values.push_back(res);
+                    },
+                    [&](const expressions::Assignment& e) { ctx.set(e.slot, values.back()); },
+                    [&](const expressions::Conditional&) { taken.pop_back(); },
+                    [&](const expressions::Logical& e) {
+                        if (taken.back())
+                        {
+                            values.push_back(!e.is_and());
+                        }
+                        else
+                        {
+                            values.back() = truth(values.back());
+                        }
+                        taken.pop_back();
+                    },
+                });
+        });
+    return values.back();
+}
+
+void print_iterative(const Expr& expr, std::ostream& os)
+{
+    std::vector<std::pair<const Expr*, int>> pending{ { &expr, 0 } };
+    while (!pending.empty())
+    {
+        const auto [node, level] = pending.back();
+        pending.pop_back();
+        os << indent(level);
+        visit(
+            *node,
+            overloaded{
+                [&](const expressions::Value& e) { os << e.v; },
+                [&](const expressions::Variable& e) { os << e.name; },
+                [&](const expressions::UnaryOp& e) { os << e.info.symbol; },
+                [&](const expressions::BinaryOp& e) { os << e.info.symbol; },
+                [&](const expressions::Func& e) { os << e.info.name; },
+                [&](const expressions::Assignment& e) { os << e.name; },
+                [&](const expressions::Conditional&) { os << "?"; },
+                [&](const expressions::Logical& e) { os << e.info.symbol; },
+            });
+        os << '\n';
+        // Pushed last to first, so that the first operand is printed next.
+        for (std::size_t i = operand_count(*node); i-- > 0;)
+        {
+            pending.emplace_back(&operand(*node, i), level + 1);
+        }
+    }
+}
+
+}  // namespace calc
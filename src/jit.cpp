@@ -0,0 +1,539 @@
+#include "jit.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <limits>
+#include <optional>
+#include <utility>
+
+#include "expressions.hpp"
+
+#if defined(CPP_CALCULATOR_JIT) && defined(__x86_64__) && defined(__linux__)
+#define CALC_JIT_X86_64 1
+#include <sys/mman.h>
+#endif
+
+namespace calc
+{
+#ifdef CALC_JIT_X86_64
+namespace
+{
+// Exceptions must not unwind through generated code, which has no unwind tables. The helpers the code calls into
+// park them here instead, and JitProgram::run rethrows them once the native function has returned.
+thread_local std::exception_ptr pending_error;
+
+double call_pow(double x, double y)
+{
+    return std::pow(x, y);
+}
+
+double call_unary_op(const UnaryOpInfo* info, double x)
+{
+    try
+    {
+        return info->func(x);
+    }
+    catch (...)
+    {
+        pending_error = std::current_exception();
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+}
+
+double call_binary_op(const BinaryOpInfo* info, double x, double y)
+{
+    try
+    {
+        return info->func(x, y);
+    }
+    catch (...)
+    {
+        pending_error = std::current_exception();
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+}
+
+double call_function(const FuncInfo* info, const double* args, std::size_t count)
+{
+    try
+    {
+        return info->func(std::vector<double>(args, args + count));
+    }
+    catch (...)
+    {
+        pending_error = std::current_exception();
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+}
+
+// The evaluation stack of the generated code lives in its native frame, so programs that need a deeper one are left
+// to the interpreter, which keeps it on the heap: worker threads may run with small stacks.
+constexpr std::size_t max_native_stack_size = 512;
+
+// Emits the handful of SSE2 and integer instructions the code generator needs. The evaluation stack lives in the
+// native frame at [rsp + 8 * k]; rbx holds the slots pointer for the whole function.
+struct Assembler
+{
+    std::vector<std::uint8_t> bytes;
+
+    enum Reg : std::uint8_t
+    {
+        rax = 0,
+        rdx = 2,
+        rsi = 6,
+        rdi = 7,
+    };
+
+    void emit(std::initializer_list<std::uint8_t> values)
+    {
+        bytes.insert(bytes.end(), values);
+    }
+
+    void imm32(std::uint32_t value)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            bytes.push_back(static_cast<std::uint8_t>(value >> (8 * i)));
+        }
+    }
+
+    void imm64(std::uint64_t value)
+    {
+        for (int i = 0; i < 8; ++i)
+        {
+            bytes.push_back(static_cast<std::uint8_t>(value >> (8 * i)));
+        }
+    }
+
+    // ModRM + SIB + disp32 addressing [rsp + 8 * entry].
+    void stack_operand(std::uint8_t reg, std::size_t entry)
+    {
+        emit({ static_cast<std::uint8_t>(0x84 | reg << 3), 0x24 });
+        imm32(static_cast<std::uint32_t>(8 * entry));
+    }
+
+    // ModRM + disp32 addressing [rbx + 8 * slot].
+    void slot_operand(std::uint8_t reg, Slot slot)
+    {
+        emit({ static_cast<std::uint8_t>(0x83 | reg << 3) });
+        imm32(static_cast<std::uint32_t>(8 * slot));
+    }
+
+    // Scalar double instruction xmm<reg>, [rsp + 8 * entry], e.g. 0x10 movsd, 0x58 addsd.
+    void sse_stack(std::uint8_t opcode, std::uint8_t xmm, std::size_t entry)
+    {
+        emit({ 0xF2, 0x0F, opcode });
+        stack_operand(xmm, entry);
+    }
+
+    void load(std::uint8_t xmm, std::size_t entry)
+    {
+        sse_stack(0x10, xmm, entry);
+    }
+
+    void store(std::size_t entry, std::uint8_t xmm)
+    {
+        sse_stack(0x11, xmm, entry);
+    }
+
+    void load_slot(Slot slot)
+    {
+        emit({ 0xF2, 0x0F, 0x10 });
+        slot_operand(0, slot);
+    }
+
+    void store_slot(Slot slot)
+    {
+        emit({ 0xF2, 0x0F, 0x11 });
+        slot_operand(0, slot);
+    }
+
+    void mov_imm64(Reg reg, std::uint64_t value)
+    {
+        emit({ 0x48, static_cast<std::uint8_t>(0xB8 + reg) });
+        imm64(value);
+    }
+
+    void mov_imm32(Reg reg, std::uint32_t value)
+    {
+        emit({ static_cast<std::uint8_t>(0xB8 + reg) });
+        imm32(value);
+    }
+
+    // lea reg, [rsp + 8 * entry]
+    void lea_stack(Reg reg, std::size_t entry)
+    {
+        emit({ 0x48, 0x8D });
+        stack_operand(reg, entry);
+    }
+
+    // movq xmm1, rax
+    void xmm1_from_rax()
+    {
+        emit({ 0x66, 0x48, 0x0F, 0x6E, 0xC8 });
+    }
+
+    template <class Func>
+    void call(Func* func)
+    {
+        mov_imm64(rax, reinterpret_cast<std::uint64_t>(func));
+        emit({ 0xFF, 0xD0 });
+    }
+};
+
+std::uint64_t bits_of(double value)
+{
+    std::uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+// cmpsd predicates; gt and ge swap their operands so that NaN compares false, as in C++.
+struct Comparison
+{
+    std::uint8_t predicate;
+    bool swapped;
+};
+
+std::optional<Comparison> comparison(OpCode op)
+{
+    switch (op)
+    {
+        case OpCode::eq: return Comparison{ 0, false };
+        case OpCode::ne: return Comparison{ 4, false };
+        case OpCode::lt: return Comparison{ 1, false };
+        case OpCode::le: return Comparison{ 2, false };
+        case OpCode::gt: return Comparison{ 1, true };
+        case OpCode::ge: return Comparison{ 2, true };
+        default: return std::nullopt;
+    }
+}
+
+std::vector<std::uint8_t> generate(const Program& program)
+{
+    Assembler a;
+    std::size_t top_after_jump = 0;
+    // After the return address and rbx the stack is 16-byte aligned again; keep it so for every call.
+    const auto frame = static_cast<std::uint32_t>((8 * (program.stack_size + 1) + 15) / 16 * 16);
+    a.emit({ 0x53 });              // push rbx
+    a.emit({ 0x48, 0x89, 0xFB });  // mov rbx, rdi
+    a.emit({ 0x48, 0x81, 0xEC });  // sub rsp, frame
+    a.imm32(frame);
+
+    // Jumps are forward, so every target is reached after the jumps to it: their rel32 fields are patched there.
+    constexpr std::size_t unknown_depth = std::size_t(-1);
+    std::vector<std::size_t> depth_at(program.code.size() + 1, unknown_depth);
+    std::vector<std::pair<std::size_t, std::size_t>> fixups;
+    const auto jump_to = [&](std::size_t target)
+    {
+        depth_at[target] = top_after_jump;
+        fixups.emplace_back(a.bytes.size(), target);
+        a.imm32(0);
+    };
+    const auto land = [&](std::size_t pc)
+    {
+        for (const auto& [pos, target] : fixups)
+        {
+            if (target == pc)
+            {
+                const auto rel = static_cast<std::uint32_t>(a.bytes.size() - (pos + 4));
+                for (int i = 0; i < 4; ++i)
+                {
+                    a.bytes[pos + i] = static_cast<std::uint8_t>(rel >> (8 * i));
+                }
+            }
+        }
+    };
+
+    std::size_t top = 0;
+    for (std::size_t pc = 0; pc < program.code.size(); ++pc)
+    {
+        const Instruction& instr = program.code[pc];
+        land(pc);
+        if (depth_at[pc] != unknown_depth)
+        {
+            top = depth_at[pc];
+        }
+        switch (instr.op)
+        {
+            case OpCode::push_const:
+                a.mov_imm64(Assembler::rax, bits_of(program.constants[instr.index]));
+                a.emit({ 0x48, 0x89 });  // mov [rsp + 8 * top], rax
+                a.stack_operand(Assembler::rax, top++);
+                break;
+            case OpCode::load_var:
+                a.load_slot(instr.index);
+                a.store(top++, 0);
+                break;
+            case OpCode::store_var:
+                a.load(0, top - 1);
+                a.store_slot(instr.index);
+                break;
+            case OpCode::neg:
+                a.load(0, top - 1);
+                a.mov_imm64(Assembler::rax, bits_of(-0.0));
+                a.xmm1_from_rax();
+                a.emit({ 0x66, 0x0F, 0x57, 0xC1 });  // xorpd xmm0, xmm1
+                a.store(top - 1, 0);
+                break;
+            case OpCode::add:
+            case OpCode::sub:
+            case OpCode::mul:
+            case OpCode::div:
+            {
+                const std::uint8_t opcode = instr.op == OpCode::add ? 0x58 : instr.op == OpCode::sub ? 0x5C : instr.op == OpCode::mul ? 0x59 : 0x5E;
+                --top;
+                a.load(0, top - 1);
+                a.sse_stack(opcode, 0, top);
+                a.store(top - 1, 0);
+                break;
+            }
+            case OpCode::eq:
+            case OpCode::ne:
+            case OpCode::lt:
+            case OpCode::le:
+            case OpCode::gt:
+            case OpCode::ge:
+            {
+                const Comparison cmp = *comparison(instr.op);
+                --top;
+                a.load(0, cmp.swapped ? top : top - 1);
+                a.sse_stack(0xC2, 0, cmp.swapped ? top - 1 : top);  // cmpsd xmm0, [..], predicate
+                a.emit({ cmp.predicate });
+                // The all-ones mask and 1.0 share their set bits.
+                a.mov_imm64(Assembler::rax, bits_of(1.0));
+                a.xmm1_from_rax();
+                a.emit({ 0x66, 0x0F, 0x54, 0xC1 });  // andpd xmm0, xmm1
+                a.store(top - 1, 0);
+                break;
+            }
+            case OpCode::pow:
+                --top;
+                a.load(0, top - 1);
+                a.load(1, top);
+                a.call(&call_pow);
+                a.store(top - 1, 0);
+                break;
+            case OpCode::unary:
+                a.mov_imm64(Assembler::rdi, reinterpret_cast<std::uint64_t>(program.unary_ops[instr.index]));
+                a.load(0, top - 1);
+                a.call(&call_unary_op);
+                a.store(top - 1, 0);
+                break;
+            case OpCode::binary:
+                --top;
+                a.mov_imm64(Assembler::rdi, reinterpret_cast<std::uint64_t>(program.binary_ops[instr.index]));
+                a.load(0, top - 1);
+                a.load(1, top);
+                a.call(&call_binary_op);
+                a.store(top - 1, 0);
+                break;
+            case OpCode::call_unary:
+            {
+                const FuncInfo& info = *program.functions[instr.index];
+                if (info.pure && info.name == "sqrt")
+                {
+                    a.sse_stack(0x51, 0, top - 1);  // sqrtsd xmm0, [..]
+                }
+                else
+                {
+                    a.load(0, top - 1);
+                    a.call(info.unary);
+                }
+                a.store(top - 1, 0);
+                break;
+            }
+            case OpCode::call_span:
+                top -= instr.count;
+                a.lea_stack(Assembler::rdi, top);
+                a.mov_imm32(Assembler::rsi, instr.count);
+                a.call(program.functions[instr.index]->span);
+                a.store(top++, 0);
+                break;
+            case OpCode::call:
+                top -= instr.count;
+                a.mov_imm64(Assembler::rdi, reinterpret_cast<std::uint64_t>(program.functions[instr.index]));
+                a.lea_stack(Assembler::rsi, top);
+                a.mov_imm32(Assembler::rdx, instr.count);
+                a.call(&call_function);
+                a.store(top++, 0);
+                break;
+            case OpCode::jump:
+                a.emit({ 0xE9 });  // jmp rel32
+                top_after_jump = top;
+                jump_to(instr.index);
+                break;
+            case OpCode::jump_if_zero:
+                a.load(0, --top);
+                a.emit({ 0x66, 0x0F, 0x57, 0xC9 });  // xorpd xmm1, xmm1
+                a.emit({ 0x66, 0x0F, 0x2E, 0xC1 });  // ucomisd xmm0, xmm1
+                a.emit({ 0x7A, 0x06 });              // jp over the je: NaN is true
+                a.emit({ 0x0F, 0x84 });              // je rel32
+                top_after_jump = top;
+                jump_to(instr.index);
+                break;
+            case OpCode::to_bool:
+                a.load(0, top - 1);
+                a.emit({ 0x66, 0x0F, 0x57, 0xC9 });        // xorpd xmm1, xmm1
+                a.emit({ 0xF2, 0x0F, 0xC2, 0xC1, 0x04 });  // cmpneqsd xmm0, xmm1
+                a.mov_imm64(Assembler::rax, bits_of(1.0));
+                a.xmm1_from_rax();
+                a.emit({ 0x66, 0x0F, 0x54, 0xC1 });  // andpd xmm0, xmm1
+                a.store(top - 1, 0);
+                break;
+            case OpCode::select: break;
+        }
+    }
+    land(program.code.size());
+
+    a.load(0, 0);
+    a.emit({ 0x48, 0x81, 0xC4 });  // add rsp, frame
+    a.imm32(frame);
+    a.emit({ 0x5B, 0xC3 });  // pop rbx; ret
+    return a.bytes;
+}
+
+}  // namespace
+#endif
+
+struct JitProgram::Code
+{
+    void* memory = nullptr;
+    std::size_t size = 0;
+    NativeFunc func = nullptr;
+
+    explicit Code(const Program& program)
+    {
+#ifdef CALC_JIT_X86_64
+        const std::vector<std::uint8_t> bytes = generate(program);
+        void* mapped = mmap(nullptr, bytes.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapped == MAP_FAILED)
+        {
+            return;
+        }
+        std::memcpy(mapped, bytes.data(), bytes.size());
+        if (mprotect(mapped, bytes.size(), PROT_READ | PROT_EXEC) != 0)
+        {
+            munmap(mapped, bytes.size());
+            return;
+        }
+        memory = mapped;
+        size = bytes.size();
+        func = reinterpret_cast<NativeFunc>(mapped);
+#else
+        static_cast<void>(program);
+#endif
+    }
+
+    ~Code()
+    {
+#ifdef CALC_JIT_X86_64
+        if (memory)
+        {
+            munmap(memory, size);
+        }
+#endif
+    }
+
+    Code(const Code&) = delete;
+    Code& operator=(const Code&) = delete;
+};
+
+JitProgram::JitProgram(Program program)
+    : source{ std::move(program) }
+{
+    // Instructions that a jump may skip. Assignments there would have to mark their slot defined only when they run,
+    // and select only occurs in shared programs, so such programs are left to the interpreter.
+    std::vector<char> skippable(source.code.size());
+    bool native = true;
+    for (std::size_t pc = 0; pc < source.code.size(); ++pc)
+    {
+        const Instruction& instr = source.code[pc];
+        if (instr.op == OpCode::jump || instr.op == OpCode::jump_if_zero)
+        {
+            std::fill(skippable.begin() + static_cast<std::ptrdiff_t>(pc + 1), skippable.begin() + static_cast<std::ptrdiff_t>(instr.index), 1);
+        }
+        native &= instr.op != OpCode::select && !(instr.op == OpCode::store_var && skippable[pc]);
+    }
+    native &= source.stack_size <= max_native_stack_size;
+    for (std::size_t pc = 0; pc < source.code.size(); ++pc)
+    {
+        const Instruction& instr = source.code[pc];
+        if (instr.op == OpCode::load_var || instr.op == OpCode::store_var)
+        {
+            slot_count = std::max<std::size_t>(slot_count, instr.index + 1);
+            auto& slots = instr.op == OpCode::store_var ? outputs : skippable[pc] ? lazy_inputs : inputs;
+            // The code runs in order, so a load after a store of the same slot reads the stored value.
+            if (std::find(slots.begin(), slots.end(), instr.index) == slots.end()
+                && (instr.op == OpCode::store_var || std::find(outputs.begin(), outputs.end(), instr.index) == outputs.end()))
+            {
+                slots.push_back(instr.index);
+            }
+        }
+    }
+    if (!native)
+    {
+        return;
+    }
+    auto generated = std::make_shared<const Code>(source);
+    if (generated->func)
+    {
+        code = std::move(generated);
+    }
+}
+
+JitProgram JitProgram::compile(const Expr& expr)
+{
+    return JitProgram{ Program::compile(expr) };
+}
+
+bool JitProgram::is_native() const
+{
+    return code != nullptr;
+}
+
+const Program& JitProgram::program() const
+{
+    return source;
+}
+
+double JitProgram::run(Context& ctx) const
+{
+    if (!code)
+    {
+        return source.run(ctx);
+    }
+    // The interpreter reports undefined variables as ctx asks for, by throwing or through ctx.status, and for a
+    // branch only if it runs, which is not known until it does.
+    for (const auto* slots : { &inputs, &lazy_inputs })
+    {
+        for (const Slot slot : *slots)
+        {
+            if (!ctx.contains(slot))
+            {
+                return source.run(ctx);
+            }
+        }
+    }
+    ctx.reserve(slot_count);
+#ifdef CALC_JIT_X86_64
+    pending_error = nullptr;
+#endif
+    const double res = code->func(ctx.values.data());
+    for (const Slot slot : outputs)
+    {
+        ctx.defined[slot] = true;
+    }
+#ifdef CALC_JIT_X86_64
+    if (pending_error)
+    {
+        std::rethrow_exception(std::exchange(pending_error, nullptr));
+    }
+#endif
+    return res;
+}
+
+}  // namespace calc
@@ -1,81 +1,318 @@
+#include <algorithm>
+#include <charconv>
 #include <cmath>
-#include <deque>
 #include <iomanip>
 #include <iostream>
+#include <optional>
+#include <thread>
 
 #include "ansi.hpp"
 #include "calc.hpp"
+#include "expression_cache.hpp"
+#include "history.hpp"
+#include "mapped_file.hpp"
+#include "profile.hpp"
+#include "program.hpp"
+#include "sheet.hpp"
+#include "stream.hpp"
 #include "string_utils.hpp"
 
-std::string read_line(std::function<void(std::ostream& os)> prompt)
+// Output is buffered; it is flushed here, once per line read. Returns nullopt at the end of the input.
+std::optional<std::string> read_line(std::function<void(std::ostream& os)> prompt)
 {
     prompt(std::cout);
+    std::cout << std::flush;
     std::string line;
-    std::getline(std::cin, line);
+    if (!std::getline(std::cin, line))
+    {
+        return std::nullopt;
+    }
     return std::string{ calc::trim_whitespace(line) };
 }
 
-struct History
+std::optional<std::size_t> parse_index(std::string_view text)
 {
-    struct Entry
+    std::size_t res = 0;
+    const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), res);
+    if (error != std::errc{} || end != text.data() + text.size())
     {
-        std::string expr;
-        double result;
-    };
+        return std::nullopt;
+    }
+    return res;
+}
+
+void print_entry(std::ostream& os, std::size_t number, const calc::History::Entry& entry)
+{
+    using namespace ansi;
+    os << fg(color::dark_gray) << std::setw(2) << number << ". " << fg(color::dark_green) << entry.text << fg(color::dark_blue) << " = " << entry.result << reset << '\n';
+}
+
+// While live mode is on the sheet owns the variables. Code that reads and writes ctx directly, such as a rerun or a
+// profile, first brings the variables it reads up to date. Afterwards the variables it assigns become plain values,
+// which marks their dependents for recomputation.
+template <class Run>
+double run_in_sheet(calc::Sheet& sheet, const calc::Context& ctx, const calc::Program& program, Run run)
+{
+    for (const calc::Instruction& instr : program.code)
+    {
+        if (instr.op == calc::OpCode::load_var && sheet.is_dirty(instr.index))
+        {
+            sheet.get(instr.index);
+        }
+    }
+    const double res = run();
+    for (const calc::Instruction& instr : program.code)
+    {
+        if (instr.op == calc::OpCode::store_var && ctx.contains(instr.index))
+        {
+            sheet.set(instr.index, ctx.get(instr.index));
+        }
+    }
+    return res;
+}
+
+const char* const usage
+    = "usage: cpp_calculator [--history FILE | --eval EXPR [--input FILE] [--format csv|binary] [--columns NAME,...]]\n";
+
+std::vector<std::string> split_names(std::string_view text)
+{
+    std::vector<std::string> res;
+    while (!text.empty())
+    {
+        const auto comma = text.find(',');
+        res.emplace_back(calc::trim_whitespace(text.substr(0, comma)));
+        text.remove_prefix(comma == std::string_view::npos ? text.size() : comma + 1);
+    }
+    return res;
+}
 
-    void push(std::string expr, double result)
+// Non-interactive mode: evaluates one expression for every row of the input and writes plain results to stdout.
+int run_stream(int argc, char* argv[])
+{
+    std::string expression;
+    std::string input = "-";
+    calc::StreamOptions options;
+    for (int i = 1; i < argc; ++i)
     {
-        if (entries.size() == max_size)
+        const std::string_view arg = argv[i];
+        if (i + 1 == argc)
+        {
+            std::cerr << usage;
+            return 2;
+        }
+        const std::string_view value = argv[++i];
+        if (arg == "--eval")
+        {
+            expression = value;
+        }
+        else if (arg == "--input")
+        {
+            input = value;
+        }
+        else if (arg == "--format" && (value == "csv" || value == "binary"))
         {
-            entries.pop_back();
+            options.format = value == "csv" ? calc::StreamOptions::Format::csv : calc::StreamOptions::Format::binary;
+        }
+        else if (arg == "--columns")
+        {
+            options.columns = split_names(value);
+        }
+        else
+        {
+            std::cerr << usage;
+            return 2;
         }
-        entries.push_front({ std::move(expr), result });
     }
 
-    std::size_t max_size;
-    std::deque<Entry> entries;
-};
+    try
+    {
+        const auto expr = calc::parse(expression);
+        if (!expr)
+        {
+            std::cerr << "cannot parse expression" << '\n';
+            return 1;
+        }
+        const auto program = calc::Program::compile(*expr);
+        const calc::Context ctx{
+            { "pi", std::asin(1.0) * 2.0 }
+        };
+        if (input == "-")
+        {
+            calc::eval_stream(program, stdin, stdout, options, ctx);
+        }
+        else
+        {
+            const calc::MappedFile file{ input };
+            calc::eval_stream(program, file.text(), stdout, options, ctx);
+        }
+    }
+    catch (const std::exception& ex)
+    {
+        std::cerr << "error: " << ex.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
 
 int main(int argc, char* argv[])
 {
     using namespace ansi;
 
-    auto history = History{ 10 };
+    std::optional<std::string> history_path;
+    if (argc == 3 && std::string_view{ argv[1] } == "--history")
+    {
+        history_path = argv[2];
+    }
+    else if (argc > 1)
+    {
+        return run_stream(argc, argv);
+    }
+
+    // Scripts feed the REPL tens of thousands of lines; output goes through the stream's buffer, not stdio.
+    std::ios::sync_with_stdio(false);
+
+    const std::size_t history_size = 1 << 20;
+    std::optional<calc::History> history;
+    try
+    {
+        history.emplace(history_path ? calc::History{ *history_path, calc::parse, history_size, std::max(1u, std::thread::hardware_concurrency()) }
+                                     : calc::History{ history_size });
+    }
+    catch (const std::exception& ex)
+    {
+        std::cerr << "error: " << ex.what() << '\n';
+        return 1;
+    }
+    auto cache = calc::ExpressionCache{ calc::parse, 1024 };
     calc::Context ctx{
-        { { "pi", std::asin(1.0) * 2.0 } }
+        { "pi", std::asin(1.0) * 2.0 }
     };
+    // In live mode assignments stay formulas and are recomputed when the variables they read change.
+    auto sheet = calc::Sheet{ ctx };
+    bool live = false;
+    const auto set_ans = [&](double res) { live ? sheet.set("ans", res) : ctx.set("ans", res); };
 
     while (true)
     {
-        const auto line = read_line([](std::ostream& os) { os << fg(color::green) << "> "; });
+        history->flush();
+        const auto input = read_line([](std::ostream& os) { os << fg(color::green) << "> "; });
+        if (!input)
+        {
+            std::cout << reset << std::flush;
+            break;
+        }
+        const std::string& line = *input;
         if (line == "quit")
         {
             break;
         }
+        else if (line == "live")
+        {
+            live = !live;
+            if (!live)
+            {
+                sheet.freeze();
+            }
+            std::cout << (live ? "live mode on" : "live mode off: formulas are replaced by their values") << '\n';
+        }
         else if (line == "vars")
         {
-            for (const auto& [n, v] : ctx.vars)
+            for (const auto& [n, v] : ctx.vars())
             {
-                std::cout << "  " << n << " = " << v << std::endl;
+                try
+                {
+                    const double value = live ? sheet.get(n) : v;
+                    std::cout << "  " << n << " = " << value << '\n';
+                }
+                catch (const std::exception& ex)
+                {
+                    std::cout << "  " << n << ": exception: " << ex.what() << '\n';
+                }
             }
         }
-        else if (line == "history")
+        else if (line == "history" || line == "history all")
         {
-            int i = 0;
-            for (const auto& entry : history.entries)
+            const std::size_t shown = line == "history" ? 10 : history_size;
+            const std::size_t end = history->end();
+            for (std::size_t number = end - std::min(shown, end - history->first()); number < end; ++number)
             {
-                std::cout << fg(color::dark_gray) << std::setw(2) << i++ << ". " << fg(color::dark_green) << entry.expr << fg(color::dark_blue) << " = " << entry.result << ansi::reset << std::endl;
+                print_entry(std::cout, number, (*history)[number]);
+            }
+        }
+        else if (line.rfind("rerun ", 0) == 0)
+        {
+            // Runs the stored programs again against the current variables; nothing is parsed.
+            const auto arg = calc::trim_whitespace(std::string_view{ line }.substr(6));
+            const auto number = parse_index(arg);
+            if (arg != "all" && !number)
+            {
+                std::cout << "usage: rerun N | rerun all" << '\n';
+                continue;
+            }
+            const std::size_t first = number ? *number : history->first();
+            const std::size_t end = number ? *number + 1 : history->end();
+            try
+            {
+                for (std::size_t k = first; k < end; ++k)
+                {
+                    const auto rerun = [&] { return history->rerun(k, ctx); };
+                    const auto res = live ? run_in_sheet(sheet, ctx, (*history)[k].program, rerun) : rerun();
+                    set_ans(res);
+                    print_entry(std::cout, k, (*history)[k]);
+                }
+            }
+            catch (const std::exception& ex)
+            {
+                std::cout << "exception: " << ex.what() << '\n';
+            }
+        }
+        else if (line.rfind("profile ", 0) == 0)
+        {
+            try
+            {
+                if (const auto expr = calc::parse(std::string_view{ line }.substr(8)))
+                {
+                    const auto profiled = calc::ProfiledExpr{ *expr };
+                    const auto run = [&] { return profiled.eval(ctx); };
+                    const auto res = live ? run_in_sheet(sheet, ctx, calc::Program::compile(*expr), run) : run();
+                    set_ans(res);
+                    profiled.print(std::cout);
+                    std::cout << fg(color::yellow) << "ans = " << res << reset << '\n';
+                }
+                else
+                {
+                    std::cout << "cannot parse expression" << '\n';
+                }
+            }
+            catch (const std::exception& ex)
+            {
+                std::cout << "exception: " << ex.what() << '\n';
             }
         }
         else
         {
             try
             {
-                if (const auto expr = calc::parse(line))
+                if (live)
+                {
+                    if (auto expr = calc::parse(line))
+                    {
+                        auto program = calc::Program::compile(*expr);
+                        const auto res = sheet.eval(std::move(expr));
+                        sheet.set("ans", res);
+                        history->push(line, std::move(program), res);
+                        std::cout << fg(color::yellow) << "ans = " << res << reset << '\n';
+                    }
+                    else
+                    {
+                        std::cout << "cannot parse expression" << '\n';
+                    }
+                }
+                else if (const auto compiled = cache.get(line))
                 {
-                    const auto res = expr->eval(ctx);
-                    ctx.vars.insert_or_assign("ans", res);
-                    history.push(line, res);
+                    const auto res = compiled->eval(ctx);
+                    ctx.set("ans", res);
+                    history->push(line, compiled->program, res);
                     std::cout << fg(color::yellow) << "ans = " << res << reset << '\n';
                 }
                 else
@@ -89,5 +326,6 @@ int main(int argc, char* argv[])
             }
         }
     }
+    history->flush();
     return 0;
 }
@@ -0,0 +1,109 @@
+#include "mapped_file.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define CALC_HAS_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace calc
+{
+namespace
+{
+void unmap(void* mapping, std::size_t length)
+{
+#ifdef CALC_HAS_MMAP
+    if (mapping)
+    {
+        ::munmap(mapping, length);
+    }
+#else
+    static_cast<void>(mapping);
+    static_cast<void>(length);
+#endif
+}
+
+}  // namespace
+
+MappedFile::MappedFile(const std::string& path)
+{
+#ifdef CALC_HAS_MMAP
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw std::runtime_error{ "cannot open '" + path + "'" };
+    }
+    struct stat info;
+    if (::fstat(fd, &info) != 0)
+    {
+        ::close(fd);
+        throw std::runtime_error{ "cannot stat '" + path + "'" };
+    }
+    length = static_cast<std::size_t>(info.st_size);
+    // mmap rejects empty mappings; an empty file simply has no text.
+    if (length > 0)
+    {
+        void* res = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (res == MAP_FAILED)
+        {
+            ::close(fd);
+            throw std::runtime_error{ "cannot map '" + path + "'" };
+        }
+        ::madvise(res, length, MADV_SEQUENTIAL);
+        mapping = res;
+    }
+    ::close(fd);
+#else
+    std::ifstream file{ path, std::ios::binary };
+    if (!file)
+    {
+        throw std::runtime_error{ "cannot open '" + path + "'" };
+    }
+    std::ostringstream os;
+    os << file.rdbuf();
+    contents = std::move(os).str();
+    length = contents.size();
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+    unmap(mapping, length);
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept
+    : mapping{ std::exchange(other.mapping, nullptr) }
+    , length{ std::exchange(other.length, 0) }
+    , contents{ std::move(other.contents) }
+{
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept
+{
+    if (this != &other)
+    {
+        unmap(mapping, length);
+        mapping = std::exchange(other.mapping, nullptr);
+        length = std::exchange(other.length, 0);
+        contents = std::move(other.contents);
+    }
+    return *this;
+}
+
+std::string_view MappedFile::text() const
+{
+    if (mapping)
+    {
+        return { static_cast<const char*>(mapping), length };
+    }
+    return contents;
+}
+
+}  // namespace calc
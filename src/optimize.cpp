@@ -0,0 +1,200 @@
+#include "optimize.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <unordered_set>
+
+#include "expressions.hpp"
+
+namespace calc
+{
+namespace
+{
+const expressions::Value* as_value(const ExprPtr& expr)
+{
+    return dynamic_cast<const expressions::Value*>(expr.get());
+}
+
+// Compares bit patterns, since the rewrites below must keep the sign of zero: x + -0 and x - 0 are x for every x,
+// but -0 + 0 is +0.
+bool is_value(const ExprPtr& expr, double v)
+{
+    const auto value = as_value(expr);
+    return value && std::memcmp(&value->v, &v, sizeof v) == 0;
+}
+
+void collect_assigned(const Expr& expr, std::unordered_set<Slot>& slots)
+{
+    walk_postorder(
+        expr,
+        [&](const Expr& node)
+        {
+            if (const auto e = dynamic_cast<const expressions::Assignment*>(&node))
+            {
+                slots.insert(e->slot);
+            }
+        });
+}
+
+struct Optimizer
+{
+    const OptimizeOptions& options;
+    std::unordered_set<Slot> assigned;
+
+    ExprPtr value(double v) const
+    {
+        return std::make_unique<expressions::Value>(v);
+    }
+
+    // Post-order, without recursing through deep trees: the optimized operands of a node are the last ones on
+    // `results`, with a null in place of each operand that a constant made unnecessary.
+    ExprPtr optimize(const Expr& expr) const
+    {
+        std::vector<ExprPtr> results;
+        walk_postorder(
+            expr,
+            [&](const Expr& node, std::size_t index)
+            {
+                if (!skipped(node, index, results))
+                {
+                    return true;
+                }
+                results.push_back(nullptr);
+                return false;
+            },
+            [&](const Expr& node)
+            {
+                const std::size_t first = results.size() - operand_count(node);
+                auto res = rebuild(node, &results[first]);
+                results.resize(first);
+                results.push_back(std::move(res));
+            });
+        return std::move(results.back());
+    }
+
+    // A constant condition leaves only the branch it selects, and a constant left operand that decides a logical
+    // operator leaves out the right one.
+    static bool skipped(const Expr& node, std::size_t index, const std::vector<ExprPtr>& results)
+    {
+        if (dynamic_cast<const expressions::Conditional*>(&node) && index > 0)
+        {
+            const auto cond = as_value(results[results.size() - index]);
+            return cond && truth(cond->v) != (index == 1);
+        }
+        if (const auto e = dynamic_cast<const expressions::Logical*>(&node); e && index == 1)
+        {
+            const auto lhs = as_value(results.back());
+            return lhs && e->decided_by(lhs->v);
+        }
+        return false;
+    }
+
+    ExprPtr rebuild(const Expr& node, ExprPtr* operands) const
+    {
+        return visit(
+            node,
+            overloaded{
+                [&](const expressions::Value& e) -> ExprPtr { return value(e.v); },
+                [&](const expressions::Variable& e) -> ExprPtr {
+                    if (options.constants && options.constants->contains(e.slot) && assigned.count(e.slot) == 0)
+                    {
+                        return value(options.constants->get(e.slot));
+                    }
+                    return std::make_unique<expressions::Variable>(e.name);
+                },
+                [&](const expressions::UnaryOp& e) -> ExprPtr {
+                    auto sub = std::move(operands[0]);
+                    if (const auto v = as_value(sub))
+                    {
+                        return value(e.info.func(v->v));
+                    }
+                    if (e.info.kind == UnaryOpKind::pos)
+                    {
+                        return sub;
+                    }
+                    if (const auto inner = dynamic_cast<expressions::UnaryOp*>(sub.get());
+                        inner && e.info.kind == UnaryOpKind::neg && inner->info.kind == UnaryOpKind::neg)
+                    {
+                        return std::move(inner->sub);
+                    }
+                    return make_unary_op(e.info, std::move(sub));
+                },
+                [&](const expressions::BinaryOp& e) -> ExprPtr {
+                    auto lhs = std::move(operands[0]);
+                    auto rhs = std::move(operands[1]);
+                    if (as_value(lhs) && as_value(rhs))
+                    {
+                        return value(e.info.func(as_value(lhs)->v, as_value(rhs)->v));
+                    }
+                    const auto kind = e.info.kind;
+                    if ((kind == BinaryOpKind::add && is_value(rhs, -0.0)) || (kind == BinaryOpKind::sub && is_value(rhs, 0.0)))
+                    {
+                        return lhs;
+                    }
+                    if (kind == BinaryOpKind::add && is_value(lhs, -0.0))
+                    {
+                        return rhs;
+                    }
+                    if ((kind == BinaryOpKind::mul || kind == BinaryOpKind::div || kind == BinaryOpKind::pow) && is_value(rhs, 1.0))
+                    {
+                        return lhs;
+                    }
+                    if (kind == BinaryOpKind::mul && is_value(lhs, 1.0))
+                    {
+                        return rhs;
+                    }
+                    return make_binary_op(e.info, std::move(lhs), std::move(rhs));
+                },
+                [&](const expressions::Func& e) -> ExprPtr {
+                    std::vector<ExprPtr> subs{ std::make_move_iterator(operands), std::make_move_iterator(operands + e.subs.size()) };
+                    if (e.info.pure && std::all_of(subs.begin(), subs.end(), [](const ExprPtr& sub) { return as_value(sub); }))
+                    {
+                        std::vector<double> args;
+                        for (const auto& sub : subs)
+                        {
+                            args.push_back(as_value(sub)->v);
+                        }
+                        return value(e.info.func(args));
+                    }
+                    return make_func(e.info, std::move(subs));
+                },
+                [&](const expressions::Assignment& e) -> ExprPtr {
+                    return std::make_unique<expressions::Assignment>(e.name, std::move(operands[0]));
+                },
+                [&](const expressions::Conditional&) -> ExprPtr {
+                    if (const auto v = as_value(operands[0]))
+                    {
+                        return std::move(operands[truth(v->v) ? 1 : 2]);
+                    }
+                    return std::make_unique<expressions::Conditional>(std::move(operands[0]), std::move(operands[1]), std::move(operands[2]));
+                },
+                [&](const expressions::Logical& e) -> ExprPtr {
+                    const auto v = as_value(operands[0]);
+                    if (v && e.decided_by(v->v))
+                    {
+                        return value(!e.is_and());
+                    }
+                    if (v && as_value(operands[1]))
+                    {
+                        return value(truth(as_value(operands[1])->v));
+                    }
+                    return make_binary_op(e.info, std::move(operands[0]), std::move(operands[1]));
+                },
+            });
+    }
+};
+
+}  // namespace
+
+ExprPtr optimize(const Expr& expr, const OptimizeOptions& options)
+{
+    auto optimizer = Optimizer{ options, {} };
+    if (options.constants)
+    {
+        collect_assigned(expr, optimizer.assigned);
+    }
+    return optimizer.optimize(expr);
+}
+
+}  // namespace calc
@@ -0,0 +1,318 @@
+#include "profile.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iterator>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "expressions.hpp"
+
+namespace calc
+{
+namespace
+{
+thread_local std::uint64_t allocations = 0;
+
+std::uint64_t now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct Probe : public Expr
+{
+    ExprPtr inner;
+    NodeProfile& profile;
+
+    Probe(ExprPtr inner, NodeProfile& profile)
+        : inner{ std::move(inner) }
+        , profile{ profile }
+    {
+    }
+
+    double eval(Context& ctx) const override
+    {
+        const std::uint64_t start_allocations = allocation_count();
+        const std::uint64_t start = now();
+        const double res = inner->eval(ctx);
+        profile.nanoseconds += now() - start;
+        profile.allocations += allocation_count() - start_allocations;
+        ++profile.calls;
+        return res;
+    }
+
+    void print(std::ostream& os, int level) const override
+    {
+        inner->print(os, level);
+    }
+};
+
+// Evaluates the arguments as expressions::Func does, timing the callback on its own.
+struct ProfiledCall : public expressions::Func
+{
+    NodeProfile& profile;
+
+    ProfiledCall(const FuncInfo& info, std::vector<ExprPtr> subs, NodeProfile& profile)
+        : Func{ info, std::move(subs) }
+        , profile{ profile }
+    {
+    }
+
+    double eval(Context& ctx) const override
+    {
+        constexpr std::size_t inline_args = 8;
+        const auto eval_sub = [&](const auto& expr_ptr) { return expr_ptr->eval(ctx); };
+        if (info.unary && subs.size() == 1)
+        {
+            const double arg = subs[0]->eval(ctx);
+            const std::uint64_t start = now();
+            const double res = info.unary(arg);
+            profile.callback_nanoseconds += now() - start;
+            return res;
+        }
+        if (info.span && subs.size() <= inline_args)
+        {
+            double args[inline_args];
+            std::transform(subs.begin(), subs.end(), args, eval_sub);
+            const std::uint64_t start = now();
+            const double res = info.span(args, subs.size());
+            profile.callback_nanoseconds += now() - start;
+            return res;
+        }
+        std::vector<double> args(subs.size());
+        std::transform(subs.begin(), subs.end(), args.begin(), eval_sub);
+        const std::uint64_t start = now();
+        const double res = info.span ? info.span(args.data(), args.size()) : info.func(args);
+        profile.callback_nanoseconds += now() - start;
+        return res;
+    }
+};
+
+// Copies the tree in post-order, without recursing through it: the copies of the operands of a node are the last ones
+// on `results`. Profiles are created in pre-order, when the walk first reaches a node.
+struct Instrumenter
+{
+    std::deque<NodeProfile>& profiles;
+
+    ExprPtr wrap(const Expr& expr)
+    {
+        std::vector<NodeProfile*> path{ &profiles.emplace_back() };
+        std::vector<ExprPtr> results;
+        walk_postorder(
+            expr,
+            [&](const Expr&, std::size_t)
+            {
+                if (path.size() >= ProfiledExpr::max_depth)
+                {
+                    throw std::invalid_argument{ "cannot profile expressions nested deeper than " + std::to_string(ProfiledExpr::max_depth) + " levels" };
+                }
+                NodeProfile& profile = profiles.emplace_back();
+                profile.depth = path.size();
+                path.push_back(&profile);
+                return true;
+            },
+            [&](const Expr& node)
+            {
+                NodeProfile& profile = *path.back();
+                path.pop_back();
+                const std::size_t first = results.size() - operand_count(node);
+                auto res = std::make_unique<Probe>(copy(node, &results[first], profile), profile);
+                results.resize(first);
+                results.push_back(std::move(res));
+            });
+        return std::move(results.back());
+    }
+
+    static ExprPtr copy(const Expr& node, ExprPtr* operands, NodeProfile& profile)
+    {
+        return visit(
+            node,
+            overloaded{
+                [&](const expressions::Value& e) -> ExprPtr {
+                    std::ostringstream os;
+                    os << e.v;
+                    profile.label = os.str();
+                    return std::make_unique<expressions::Value>(e.v);
+                },
+                [&](const expressions::Variable& e) -> ExprPtr {
+                    profile.label = std::string{ e.name };
+                    return std::make_unique<expressions::Variable>(e.name);
+                },
+                [&](const expressions::UnaryOp& e) -> ExprPtr {
+                    profile.label = e.info.symbol;
+                    return make_unary_op(e.info, std::move(operands[0]));
+                },
+                [&](const expressions::BinaryOp& e) -> ExprPtr {
+                    profile.label = e.info.symbol;
+                    return make_binary_op(e.info, std::move(operands[0]), std::move(operands[1]));
+                },
+                [&](const expressions::Func& e) -> ExprPtr {
+                    profile.label = e.info.name;
+                    std::vector<ExprPtr> subs{ std::make_move_iterator(operands), std::make_move_iterator(operands + e.subs.size()) };
+                    return std::make_unique<ProfiledCall>(e.info, std::move(subs), profile);
+                },
+                [&](const expressions::Assignment& e) -> ExprPtr {
+                    profile.label = std::string{ e.name };
+                    return std::make_unique<expressions::Assignment>(e.name, std::move(operands[0]));
+                },
+                [&](const expressions::Conditional&) -> ExprPtr {
+                    profile.label = "?";
+                    return std::make_unique<expressions::Conditional>(std::move(operands[0]), std::move(operands[1]), std::move(operands[2]));
+                },
+                [&](const expressions::Logical& e) -> ExprPtr {
+                    profile.label = e.info.symbol;
+                    return std::make_unique<expressions::Logical>(e.info, std::move(operands[0]), std::move(operands[1]));
+                },
+            });
+    }
+};
+
+}  // namespace
+
+std::uint64_t allocation_count()
+{
+    return allocations;
+}
+
+ProfiledExpr::ProfiledExpr(const Expr& expr)
+    : root{ Instrumenter{ profiles }.wrap(expr) }
+{
+}
+
+double ProfiledExpr::eval(Context& ctx) const
+{
+    return root->eval(ctx);
+}
+
+const std::deque<NodeProfile>& ProfiledExpr::nodes() const
+{
+    return profiles;
+}
+
+std::uint64_t ProfiledExpr::self_nanoseconds(std::size_t index) const
+{
+    std::uint64_t children = 0;
+    for (std::size_t i = index + 1; i < profiles.size() && profiles[i].depth > profiles[index].depth; ++i)
+    {
+        if (profiles[i].depth == profiles[index].depth + 1)
+        {
+            children += profiles[i].nanoseconds;
+        }
+    }
+    // Clock granularity can make the children add up to slightly more than their parent.
+    return profiles[index].nanoseconds > children ? profiles[index].nanoseconds - children : 0;
+}
+
+void ProfiledExpr::reset()
+{
+    for (NodeProfile& profile : profiles)
+    {
+        profile.calls = profile.nanoseconds = profile.callback_nanoseconds = profile.allocations = 0;
+    }
+}
+
+void ProfiledExpr::print(std::ostream& os) const
+{
+    for (std::size_t i = 0; i < profiles.size(); ++i)
+    {
+        const NodeProfile& profile = profiles[i];
+        os << indent(static_cast<int>(profile.depth)) << profile.label << "  [calls " << profile.calls << ", total " << profile.nanoseconds
+           << " ns, self " << self_nanoseconds(i) << " ns";
+        if (profile.callback_nanoseconds)
+        {
+            os << ", callback " << profile.callback_nanoseconds << " ns";
+        }
+        if (profile.allocations)
+        {
+            os << ", allocations " << profile.allocations;
+        }
+        os << "]\n";
+    }
+}
+
+void ProfiledExpr::write_json(std::ostream& os) const
+{
+    os << "[";
+    for (std::size_t i = 0; i < profiles.size(); ++i)
+    {
+        const NodeProfile& profile = profiles[i];
+        os << (i ? ",\n " : "\n ") << "{\"label\": \"";
+        for (const char ch : profile.label)
+        {
+            if (ch == '"' || ch == '\\')
+            {
+                os << '\\';
+            }
+            os << ch;
+        }
+        os << "\", \"depth\": " << profile.depth << ", \"calls\": " << profile.calls << ", \"total_ns\": " << profile.nanoseconds
+           << ", \"self_ns\": " << self_nanoseconds(i) << ", \"callback_ns\": " << profile.callback_nanoseconds
+           << ", \"allocations\": " << profile.allocations << "}";
+    }
+    os << "\n]\n";
+}
+
+}  // namespace calc
+
+#ifdef CPP_CALCULATOR_COUNT_ALLOCATIONS
+// Every replaceable form except the aligned ones, so that allocation and deallocation always pair malloc with free.
+void* operator new(std::size_t size)
+{
+    ++calc::allocations;
+    if (void* ptr = std::malloc(size ? size : 1))
+    {
+        return ptr;
+    }
+    throw std::bad_alloc{};
+}
+
+void* operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    ++calc::allocations;
+    return std::malloc(size ? size : 1);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t& tag) noexcept
+{
+    return operator new(size, tag);
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+    std::free(ptr);
+}
+#endif
@@ -0,0 +1,365 @@
+#include "program.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+#include "expressions.hpp"
+
+namespace calc
+{
+namespace
+{
+std::optional<OpCode> builtin_opcode(const BinaryOpInfo& info)
+{
+    switch (info.kind)
+    {
+        case BinaryOpKind::add: return OpCode::add;
+        case BinaryOpKind::sub: return OpCode::sub;
+        case BinaryOpKind::mul: return OpCode::mul;
+        case BinaryOpKind::div: return OpCode::div;
+        case BinaryOpKind::pow: return OpCode::pow;
+        case BinaryOpKind::eq: return OpCode::eq;
+        case BinaryOpKind::ne: return OpCode::ne;
+        case BinaryOpKind::lt: return OpCode::lt;
+        case BinaryOpKind::le: return OpCode::le;
+        case BinaryOpKind::gt: return OpCode::gt;
+        case BinaryOpKind::ge: return OpCode::ge;
+        default: return std::nullopt;
+    }
+}
+
+const char* opcode_name(OpCode op)
+{
+    switch (op)
+    {
+        case OpCode::push_const: return "push_const";
+        case OpCode::load_var: return "load_var";
+        case OpCode::store_var: return "store_var";
+        case OpCode::neg: return "neg";
+        case OpCode::add: return "add";
+        case OpCode::sub: return "sub";
+        case OpCode::mul: return "mul";
+        case OpCode::div: return "div";
+        case OpCode::pow: return "pow";
+        case OpCode::eq: return "eq";
+        case OpCode::ne: return "ne";
+        case OpCode::lt: return "lt";
+        case OpCode::le: return "le";
+        case OpCode::gt: return "gt";
+        case OpCode::ge: return "ge";
+        case OpCode::unary: return "unary";
+        case OpCode::binary: return "binary";
+        case OpCode::call: return "call";
+        case OpCode::call_unary: return "call_unary";
+        case OpCode::call_span: return "call_span";
+        case OpCode::jump: return "jump";
+        case OpCode::jump_if_zero: return "jump_if_zero";
+        case OpCode::to_bool: return "to_bool";
+        case OpCode::select: return "select";
+    }
+    return "?";
+}
+
+// Instructions hold the argument count of a call in 16 bits.
+std::uint16_t argument_count(const expressions::Func& e)
+{
+    if (e.subs.size() > std::numeric_limits<std::uint16_t>::max())
+    {
+        throw std::invalid_argument{ "'" + std::string{ e.info.name } + "' is called with more than " +
+                                     std::to_string(std::numeric_limits<std::uint16_t>::max()) + " arguments" };
+    }
+    return static_cast<std::uint16_t>(e.subs.size());
+}
+
+template <class T>
+std::uint32_t index_of(std::vector<T>& items, const T& item)
+{
+    const auto it = std::find(items.begin(), items.end(), item);
+    if (it != items.end())
+    {
+        return static_cast<std::uint32_t>(it - items.begin());
+    }
+    items.push_back(item);
+    return static_cast<std::uint32_t>(items.size() - 1);
+}
+
+struct Compiler
+{
+    Program& program;
+    std::size_t depth = 0;
+    // Jumps whose target is the end of a conditional or logical node still being compiled.
+    std::vector<std::size_t> open_jumps;
+    // Indices of the constants by bit pattern, which keeps -0.0 apart from 0.0.
+    std::unordered_map<std::uint64_t, std::uint32_t> constant_indices;
+
+    std::uint32_t constant(double v)
+    {
+        std::uint64_t bits;
+        std::memcpy(&bits, &v, sizeof bits);
+        const auto [it, inserted] = constant_indices.try_emplace(bits, static_cast<std::uint32_t>(program.constants.size()));
+        if (inserted)
+        {
+            program.constants.push_back(v);
+        }
+        return it->second;
+    }
+
+    void emit(OpCode op, std::uint32_t index = 0, std::uint16_t count = 0)
+    {
+        program.code.push_back(Instruction{ op, count, index });
+        if (op == OpCode::load_var || op == OpCode::store_var)
+        {
+            program.slot_count = std::max<std::size_t>(program.slot_count, index + 1);
+        }
+    }
+
+    // Emits a jump to be pointed at the next instruction emitted after land(jump).
+    std::size_t emit_jump(OpCode op)
+    {
+        emit(op);
+        return program.code.size() - 1;
+    }
+
+    void land(std::size_t jump)
+    {
+        program.code[jump].index = static_cast<std::uint32_t>(program.code.size());
+    }
+
+    // Between the operands of the lazy nodes. A conditional compiles to
+    //     cond; jump_if_zero else; then; jump end; else: otherwise; end:
+    // a && b to
+    //     a; jump_if_zero false; b; to_bool; jump end; false: push 0; end:
+    // and a || b to
+    //     a; jump_if_zero rhs; push 1; jump end; rhs: b; to_bool; end:
+    void enter_operand(const Expr& node, std::size_t index)
+    {
+        if (dynamic_cast<const expressions::Conditional*>(&node) && index > 0)
+        {
+            if (index == 1)
+            {
+                open_jumps.push_back(emit_jump(OpCode::jump_if_zero));
+            }
+            else
+            {
+                const std::size_t end = emit_jump(OpCode::jump);
+                land(open_jumps.back());
+                open_jumps.back() = end;
+            }
+            pop(1);
+        }
+        else if (const auto e = dynamic_cast<const expressions::Logical*>(&node); e && index == 1)
+        {
+            open_jumps.push_back(emit_jump(OpCode::jump_if_zero));
+            pop(1);
+            if (!e->is_and())
+            {
+                emit(OpCode::push_const, constant(1.0));
+                push();
+                const std::size_t end = emit_jump(OpCode::jump);
+                land(open_jumps.back());
+                open_jumps.back() = end;
+                pop(1);
+            }
+        }
+    }
+
+    void push()
+    {
+        program.stack_size = std::max(program.stack_size, ++depth);
+    }
+
+    void pop(std::size_t n)
+    {
+        depth -= n;
+    }
+
+    // Post-order, so that every node is emitted after its operands, without recursing through deep trees.
+    void compile(const Expr& expr)
+    {
+        walk_postorder(
+            expr,
+            [&](const Expr& node, std::size_t index)
+            {
+                enter_operand(node, index);
+                return true;
+            },
+            [&](const Expr& node)
+            {
+                visit(
+                    node,
+                    overloaded{
+                        [&](const expressions::Value& e) {
+                            emit(OpCode::push_const, constant(e.v));
+                            push();
+                        },
+                        [&](const expressions::Variable& e) {
+                            emit(OpCode::load_var, static_cast<std::uint32_t>(e.slot));
+                            push();
+                        },
+                        [&](const expressions::UnaryOp& e) {
+                            if (e.info.kind == UnaryOpKind::neg)
+                            {
+                                emit(OpCode::neg);
+                            }
+                            else if (e.info.kind != UnaryOpKind::pos)
+                            {
+                                emit(OpCode::unary, index_of(program.unary_ops, &e.info));
+                            }
+                        },
+                        [&](const expressions::BinaryOp& e) {
+                            if (const auto opcode = builtin_opcode(e.info))
+                            {
+                                emit(*opcode);
+                            }
+                            else
+                            {
+                                emit(OpCode::binary, index_of(program.binary_ops, &e.info));
+                            }
+                            pop(1);
+                        },
+                        [&](const expressions::Func& e) {
+                            const auto opcode = e.info.unary && e.subs.size() == 1 ? OpCode::call_unary : e.info.span ? OpCode::call_span : OpCode::call;
+                            emit(opcode, index_of(program.functions, &e.info), argument_count(e));
+                            pop(e.subs.size());
+                            push();
+                        },
+                        [&](const expressions::Assignment& e) { emit(OpCode::store_var, static_cast<std::uint32_t>(e.slot)); },
+                        [&](const expressions::Conditional&) {
+                            land(open_jumps.back());
+                            open_jumps.pop_back();
+                        },
+                        [&](const expressions::Logical& e) {
+                            emit(OpCode::to_bool);
+                            if (e.is_and())
+                            {
+                                const std::size_t end = emit_jump(OpCode::jump);
+                                land(open_jumps.back());
+                                open_jumps.back() = end;
+                                pop(1);
+                                emit(OpCode::push_const, constant(0.0));
+                                push();
+                            }
+                            land(open_jumps.back());
+                            open_jumps.pop_back();
+                        },
+                    });
+            });
+    }
+};
+
+}  // namespace
+
+Program Program::compile(const Expr& expr)
+{
+    Program res;
+    Compiler{ res, 0, {}, {} }.compile(expr);
+    return res;
+}
+
+double Program::run(Context& ctx) const
+{
+    constexpr std::size_t inline_stack_size = 64;
+    double inline_stack[inline_stack_size];
+    std::vector<double> heap_stack;
+    double* top = inline_stack;
+    if (stack_size > inline_stack_size)
+    {
+        auto& stack = ctx.workspace ? ctx.workspace->stack : heap_stack;
+        stack.resize(std::max(stack.size(), stack_size));
+        top = stack.data();
+    }
+
+    std::size_t pc = 0;
+    while (pc < code.size())
+    {
+        const Instruction& instr = code[pc++];
+        switch (instr.op)
+        {
+            case OpCode::push_const: *top++ = constants[instr.index]; break;
+            case OpCode::load_var: *top++ = ctx.get(instr.index); break;
+            case OpCode::store_var: ctx.set(instr.index, top[-1]); break;
+            case OpCode::neg: top[-1] = -top[-1]; break;
+            case OpCode::add: --top, top[-1] = top[-1] + top[0]; break;
+            case OpCode::sub: --top, top[-1] = top[-1] - top[0]; break;
+            case OpCode::mul: --top, top[-1] = top[-1] * top[0]; break;
+            case OpCode::div: --top, top[-1] = top[-1] / top[0]; break;
+            case OpCode::pow: --top, top[-1] = std::pow(top[-1], top[0]); break;
+            case OpCode::eq: --top, top[-1] = top[-1] == top[0]; break;
+            case OpCode::ne: --top, top[-1] = top[-1] != top[0]; break;
+            case OpCode::lt: --top, top[-1] = top[-1] < top[0]; break;
+            case OpCode::le: --top, top[-1] = top[-1] <= top[0]; break;
+            case OpCode::gt: --top, top[-1] = top[-1] > top[0]; break;
+            case OpCode::ge: --top, top[-1] = top[-1] >= top[0]; break;
+            case OpCode::unary: top[-1] = unary_ops[instr.index]->func(top[-1]); break;
+            case OpCode::binary: --top, top[-1] = binary_ops[instr.index]->func(top[-1], top[0]); break;
+            case OpCode::call:
+            {
+                top -= instr.count;
+                if (ctx.workspace)
+                {
+                    const auto args = ctx.workspace->args(instr.count);
+                    std::copy_n(top, instr.count, args.values.begin());
+                    *top++ = functions[instr.index]->func(args.values);
+                    break;
+                }
+                const std::vector<double> args(top, top + instr.count);
+                *top++ = functions[instr.index]->func(args);
+                break;
+            }
+            case OpCode::call_unary: top[-1] = functions[instr.index]->unary(top[-1]); break;
+            case OpCode::call_span:
+                top -= instr.count;
+                *top = functions[instr.index]->span(top, instr.count);
+                ++top;
+                break;
+            case OpCode::jump: pc = instr.index; break;
+            case OpCode::jump_if_zero: pc = truth(*--top) ? pc : instr.index; break;
+            case OpCode::to_bool: top[-1] = truth(top[-1]); break;
+            case OpCode::select: top -= 2, top[-1] = truth(top[-1]) ? top[0] : top[1]; break;
+        }
+    }
+    return top[-1];
+}
+
+double Program::run(Context& ctx, EvalWorkspace& workspace) const
+{
+    const ScopedWorkspace scope{ ctx, workspace, slot_count };
+    return run(ctx);
+}
+
+EvalResult Program::try_run(Context& ctx) const
+{
+    return try_eval_with(ctx, [&](Context& ctx) { return run(ctx); });
+}
+
+void Program::print(std::ostream& os) const
+{
+    for (std::size_t i = 0; i < code.size(); ++i)
+    {
+        const Instruction& instr = code[i];
+        os << indent(1) << i << ": " << opcode_name(instr.op);
+        switch (instr.op)
+        {
+            case OpCode::push_const: os << " " << constants[instr.index]; break;
+            case OpCode::load_var:
+            case OpCode::store_var: os << " " << symbols().name(instr.index); break;
+            case OpCode::unary: os << " " << unary_ops[instr.index]->symbol; break;
+            case OpCode::binary: os << " " << binary_ops[instr.index]->symbol; break;
+            case OpCode::call:
+            case OpCode::call_unary:
+            case OpCode::call_span: os << " " << functions[instr.index]->name << "/" << instr.count; break;
+            case OpCode::jump:
+            case OpCode::jump_if_zero: os << " " << instr.index; break;
+            default: break;
+        }
+        os << '\n';
+    }
+}
+
+}  // namespace calc
@@ -0,0 +1,473 @@
+#include "program_file.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+#include <unordered_map>
+
+#include "expressions.hpp"
+#include "mapped_file.hpp"
+
+namespace calc
+{
+namespace
+{
+constexpr char magic[8] = { 'C', 'A', 'L', 'C', 'P', 'R', 'G', '\0' };
+
+enum class SymbolKind : std::uint32_t
+{
+    variable,
+    function,
+    unary_op,
+    binary_op,
+};
+
+struct Header
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t program_count;
+    std::uint32_t symbol_count;
+    std::uint32_t string_size;
+    std::uint32_t constant_count;
+    std::uint32_t instruction_count;
+    std::uint32_t reference_count;
+    std::uint32_t reserved;
+};
+
+// The references of a program are its unary operators, binary operators and functions, in that order, as symbol ids.
+struct ProgramRecord
+{
+    std::uint32_t first_instruction;
+    std::uint32_t instruction_count;
+    std::uint32_t first_constant;
+    std::uint32_t constant_count;
+    std::uint32_t first_reference;
+    std::uint32_t unary_count;
+    std::uint32_t binary_count;
+    std::uint32_t function_count;
+};
+
+struct SymbolRecord
+{
+    SymbolKind kind;
+    std::uint32_t name_offset;
+    std::uint32_t name_size;
+};
+
+// Instructions are stored exactly as they are laid out in memory, with load_var and store_var holding a symbol id
+// instead of a slot, so a whole program's code is loaded with one copy.
+static_assert(std::is_trivially_copyable_v<Instruction> && sizeof(Instruction) == 8);
+static_assert(offsetof(Instruction, op) == 0 && offsetof(Instruction, count) == 2 && offsetof(Instruction, index) == 4);
+
+// Every section starts at a multiple of 8 bytes, so constants and instructions remain aligned within a mapping.
+constexpr std::size_t padded(std::size_t size)
+{
+    return (size + 7) & ~std::size_t{ 7 };
+}
+
+[[noreturn]] void invalid(const char* what)
+{
+    throw std::runtime_error{ std::string{ "invalid program file: " } + what };
+}
+
+struct Writer
+{
+    Header header{};
+    std::vector<ProgramRecord> records;
+    std::vector<SymbolRecord> symbol_records;
+    std::string strings;
+    std::vector<double> constants;
+    std::vector<std::array<unsigned char, sizeof(Instruction)>> instructions;
+    std::vector<std::uint32_t> references;
+    std::array<std::unordered_map<std::string, std::uint32_t>, 4> ids;
+
+    std::uint32_t symbol(SymbolKind kind, std::string_view name)
+    {
+        auto [it, inserted] = ids[static_cast<std::size_t>(kind)].try_emplace(std::string{ name }, 0);
+        if (inserted)
+        {
+            it->second = static_cast<std::uint32_t>(symbol_records.size());
+            symbol_records.push_back(SymbolRecord{ kind, static_cast<std::uint32_t>(strings.size()), static_cast<std::uint32_t>(name.size()) });
+            strings += name;
+        }
+        return it->second;
+    }
+
+    void add(const Program& program)
+    {
+        ProgramRecord record{};
+        record.first_instruction = static_cast<std::uint32_t>(instructions.size());
+        record.instruction_count = static_cast<std::uint32_t>(program.code.size());
+        record.first_constant = static_cast<std::uint32_t>(constants.size());
+        record.constant_count = static_cast<std::uint32_t>(program.constants.size());
+        record.first_reference = static_cast<std::uint32_t>(references.size());
+        record.unary_count = static_cast<std::uint32_t>(program.unary_ops.size());
+        record.binary_count = static_cast<std::uint32_t>(program.binary_ops.size());
+        record.function_count = static_cast<std::uint32_t>(program.functions.size());
+        records.push_back(record);
+
+        constants.insert(constants.end(), program.constants.begin(), program.constants.end());
+        for (const auto* op : program.unary_ops)
+        {
+            references.push_back(symbol(SymbolKind::unary_op, op->symbol));
+        }
+        for (const auto* op : program.binary_ops)
+        {
+            references.push_back(symbol(SymbolKind::binary_op, op->symbol));
+        }
+        for (const auto* func : program.functions)
+        {
+            references.push_back(symbol(SymbolKind::function, func->name));
+        }
+        for (Instruction instr : program.code)
+        {
+            if (instr.op == OpCode::load_var || instr.op == OpCode::store_var)
+            {
+                instr.index = symbol(SymbolKind::variable, symbols().name(instr.index));
+            }
+            // Field by field, so that the padding byte is written as zero.
+            auto& bytes = instructions.emplace_back();
+            bytes.fill(0);
+            std::memcpy(bytes.data() + offsetof(Instruction, op), &instr.op, sizeof(instr.op));
+            std::memcpy(bytes.data() + offsetof(Instruction, count), &instr.count, sizeof(instr.count));
+            std::memcpy(bytes.data() + offsetof(Instruction, index), &instr.index, sizeof(instr.index));
+        }
+    }
+
+    static void write_section(std::ostream& os, const void* data, std::size_t size)
+    {
+        static constexpr char zeros[8] = {};
+        os.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+        os.write(zeros, static_cast<std::streamsize>(padded(size) - size));
+    }
+
+    void write(std::ostream& os)
+    {
+        std::memcpy(header.magic, magic, sizeof(magic));
+        header.version = program_file_version;
+        header.program_count = static_cast<std::uint32_t>(records.size());
+        header.symbol_count = static_cast<std::uint32_t>(symbol_records.size());
+        header.string_size = static_cast<std::uint32_t>(strings.size());
+        header.constant_count = static_cast<std::uint32_t>(constants.size());
+        header.instruction_count = static_cast<std::uint32_t>(instructions.size());
+        header.reference_count = static_cast<std::uint32_t>(references.size());
+
+        write_section(os, &header, sizeof(header));
+        write_section(os, records.data(), records.size() * sizeof(ProgramRecord));
+        write_section(os, symbol_records.data(), symbol_records.size() * sizeof(SymbolRecord));
+        write_section(os, strings.data(), strings.size());
+        write_section(os, constants.data(), constants.size() * sizeof(double));
+        write_section(os, instructions.data(), instructions.size() * sizeof(Instruction));
+        write_section(os, references.data(), references.size() * sizeof(std::uint32_t));
+    }
+};
+
+// Hands out the sections in order; the data may be unaligned, so items are read with memcpy.
+struct Reader
+{
+    std::string_view data;
+    std::size_t offset = 0;
+
+    const char* section(std::size_t size)
+    {
+        if (data.size() - offset < size)
+        {
+            invalid("truncated data");
+        }
+        const char* res = data.data() + offset;
+        offset = std::min(data.size(), offset + padded(size));
+        return res;
+    }
+
+    template <class T>
+    static T item(const char* section, std::size_t index)
+    {
+        T res;
+        std::memcpy(&res, section + index * sizeof(T), sizeof(T));
+        return res;
+    }
+};
+
+struct Symbol
+{
+    SymbolKind kind;
+    Slot slot = 0;
+    const FuncInfo* func = nullptr;
+    const UnaryOpInfo* unary_op = nullptr;
+    const BinaryOpInfo* binary_op = nullptr;
+};
+
+Symbol resolve(const SymbolRecord& record, std::string_view name, const Parser& parser)
+{
+    Symbol res{ record.kind };
+    switch (record.kind)
+    {
+        case SymbolKind::variable: res.slot = symbols().intern(name); return res;
+        case SymbolKind::function: res.func = parser.find_function(name); break;
+        case SymbolKind::unary_op: res.unary_op = parser.find_unary_op(name); break;
+        case SymbolKind::binary_op: res.binary_op = parser.find_binary_op(name); break;
+        default: invalid("unknown symbol kind");
+    }
+    if (!res.func && !res.unary_op && !res.binary_op)
+    {
+        throw std::runtime_error{ "program file refers to unknown '" + std::string{ name } + "'" };
+    }
+    return res;
+}
+
+template <class T>
+T* reference(const std::vector<Symbol>& symbols, std::uint32_t id, SymbolKind kind, T* Symbol::*member)
+{
+    if (id >= symbols.size() || symbols[id].kind != kind)
+    {
+        invalid("bad symbol reference");
+    }
+    return symbols[id].*member;
+}
+
+// A branch construct as Program::compile lays it out: jump_if_zero to else_pc; the then branch, closed by a jump to
+// end_pc at else_pc - 1; the else branch up to end_pc.
+struct Branch
+{
+    std::size_t else_pc;
+    std::size_t end_pc;
+    std::size_t depth;
+    std::size_t then_depth;
+    bool in_else;
+};
+
+// Checks every operand against the program's tables, maps symbol ids to slots and works out the stack size, so that
+// corrupt data is rejected here rather than at run time. Jumps must form properly nested branches, which is what the
+// batch evaluator relies on.
+void link(Program& program, const std::vector<Symbol>& file_symbols)
+{
+    std::size_t depth = 0;
+    const auto pop = [&](std::size_t n)
+    {
+        if (depth < n)
+        {
+            invalid("stack underflow");
+        }
+        depth -= n;
+    };
+    const auto push = [&]() { program.stack_size = std::max(program.stack_size, ++depth); };
+    const auto check = [](std::size_t index, std::size_t size)
+    {
+        if (index >= size)
+        {
+            invalid("operand out of range");
+        }
+    };
+
+    std::vector<Branch> branches;
+    const auto close_branches = [&](std::size_t pc)
+    {
+        for (; !branches.empty() && branches.back().end_pc == pc; branches.pop_back())
+        {
+            if (depth != branches.back().then_depth)
+            {
+                invalid("unbalanced stack");
+            }
+        }
+    };
+
+    for (std::size_t pc = 0; pc < program.code.size(); ++pc)
+    {
+        close_branches(pc);
+        Instruction& instr = program.code[pc];
+        switch (instr.op)
+        {
+            case OpCode::push_const:
+                check(instr.index, program.constants.size());
+                push();
+                break;
+            case OpCode::jump_if_zero:
+            {
+                pop(1);
+                const std::size_t else_pc = instr.index;
+                if (else_pc <= pc + 1 || else_pc > program.code.size() || program.code[else_pc - 1].op != OpCode::jump)
+                {
+                    invalid("malformed branch");
+                }
+                const std::size_t end_pc = program.code[else_pc - 1].index;
+                const std::size_t limit = branches.empty()            ? program.code.size()
+                                          : branches.back().in_else ? branches.back().end_pc
+                                                                    : branches.back().else_pc - 1;
+                if (end_pc < else_pc || end_pc > limit)
+                {
+                    invalid("malformed branch");
+                }
+                branches.push_back(Branch{ else_pc, end_pc, depth, 0, false });
+                break;
+            }
+            case OpCode::jump:
+            {
+                if (branches.empty() || branches.back().in_else || branches.back().else_pc != pc + 1)
+                {
+                    invalid("malformed branch");
+                }
+                Branch& branch = branches.back();
+                branch.then_depth = depth;
+                branch.in_else = true;
+                depth = branch.depth;
+                break;
+            }
+            case OpCode::to_bool: pop(1), push(); break;
+            case OpCode::load_var:
+            case OpCode::store_var:
+                check(instr.index, file_symbols.size());
+                if (file_symbols[instr.index].kind != SymbolKind::variable)
+                {
+                    invalid("bad symbol reference");
+                }
+                instr.index = static_cast<std::uint32_t>(file_symbols[instr.index].slot);
+                program.slot_count = std::max<std::size_t>(program.slot_count, instr.index + 1);
+                if (instr.op == OpCode::load_var)
+                {
+                    push();
+                }
+                else
+                {
+                    pop(1), push();
+                }
+                break;
+            case OpCode::neg: pop(1), push(); break;
+            case OpCode::add:
+            case OpCode::sub:
+            case OpCode::mul:
+            case OpCode::div:
+            case OpCode::pow:
+            case OpCode::eq:
+            case OpCode::ne:
+            case OpCode::lt:
+            case OpCode::le:
+            case OpCode::gt:
+            case OpCode::ge: pop(2), push(); break;
+            case OpCode::unary:
+                check(instr.index, program.unary_ops.size());
+                pop(1), push();
+                break;
+            case OpCode::binary:
+                check(instr.index, program.binary_ops.size());
+                pop(2), push();
+                break;
+            case OpCode::call:
+            case OpCode::call_unary:
+            case OpCode::call_span:
+            {
+                check(instr.index, program.functions.size());
+                const FuncInfo& info = *program.functions[instr.index];
+                // The function registered under this name now may accept other argument counts than when saved, and
+                // need not offer the direct form it had.
+                check_arity(info, instr.count);
+                if ((instr.op == OpCode::call_unary && (!info.unary || instr.count != 1)) || (instr.op == OpCode::call_span && !info.span))
+                {
+                    instr.op = OpCode::call;
+                }
+                pop(instr.count), push();
+                break;
+            }
+            default: invalid("unknown opcode");
+        }
+    }
+    close_branches(program.code.size());
+    if (depth != 1)
+    {
+        invalid("unbalanced stack");
+    }
+}
+
+}  // namespace
+
+void save_programs(Span<const Program> programs, std::ostream& os)
+{
+    Writer writer;
+    for (const Program& program : programs)
+    {
+        writer.add(program);
+    }
+    writer.write(os);
+}
+
+std::vector<Program> load_programs(std::string_view data, const Parser& parser)
+{
+    Reader reader{ data };
+    const auto header = Reader::item<Header>(reader.section(sizeof(Header)), 0);
+    if (std::memcmp(header.magic, magic, sizeof(magic)) != 0)
+    {
+        invalid("bad magic");
+    }
+    if (header.version != program_file_version)
+    {
+        throw std::runtime_error{ "unsupported program file version " + std::to_string(header.version) };
+    }
+    const char* records = reader.section(std::size_t{ header.program_count } * sizeof(ProgramRecord));
+    const char* symbol_records = reader.section(std::size_t{ header.symbol_count } * sizeof(SymbolRecord));
+    const std::string_view strings{ reader.section(header.string_size), header.string_size };
+    const char* constants = reader.section(std::size_t{ header.constant_count } * sizeof(double));
+    const char* instructions = reader.section(std::size_t{ header.instruction_count } * sizeof(Instruction));
+    const char* references = reader.section(std::size_t{ header.reference_count } * sizeof(std::uint32_t));
+
+    std::vector<Symbol> file_symbols;
+    file_symbols.reserve(header.symbol_count);
+    for (std::size_t i = 0; i < header.symbol_count; ++i)
+    {
+        const auto record = Reader::item<SymbolRecord>(symbol_records, i);
+        if (record.name_offset > strings.size() || strings.size() - record.name_offset < record.name_size)
+        {
+            invalid("name out of range");
+        }
+        file_symbols.push_back(resolve(record, strings.substr(record.name_offset, record.name_size), parser));
+    }
+
+    const auto check_range = [](std::size_t first, std::size_t count, std::size_t size)
+    {
+        if (first > size || size - first < count)
+        {
+            invalid("section range out of bounds");
+        }
+    };
+
+    std::vector<Program> res(header.program_count);
+    for (std::size_t i = 0; i < res.size(); ++i)
+    {
+        const auto record = Reader::item<ProgramRecord>(records, i);
+        check_range(record.first_instruction, record.instruction_count, header.instruction_count);
+        check_range(record.first_constant, record.constant_count, header.constant_count);
+        check_range(record.first_reference, std::size_t{ record.unary_count } + record.binary_count + record.function_count, header.reference_count);
+
+        Program& program = res[i];
+        program.code.resize(record.instruction_count);
+        std::memcpy(program.code.data(), instructions + std::size_t{ record.first_instruction } * sizeof(Instruction), program.code.size() * sizeof(Instruction));
+        program.constants.resize(record.constant_count);
+        std::memcpy(program.constants.data(), constants + std::size_t{ record.first_constant } * sizeof(double), program.constants.size() * sizeof(double));
+
+        std::size_t ref = record.first_reference;
+        for (std::size_t j = 0; j < record.unary_count; ++j)
+        {
+            program.unary_ops.push_back(reference(file_symbols, Reader::item<std::uint32_t>(references, ref++), SymbolKind::unary_op, &Symbol::unary_op));
+        }
+        for (std::size_t j = 0; j < record.binary_count; ++j)
+        {
+            program.binary_ops.push_back(reference(file_symbols, Reader::item<std::uint32_t>(references, ref++), SymbolKind::binary_op, &Symbol::binary_op));
+        }
+        for (std::size_t j = 0; j < record.function_count; ++j)
+        {
+            program.functions.push_back(reference(file_symbols, Reader::item<std::uint32_t>(references, ref++), SymbolKind::function, &Symbol::func));
+        }
+        link(program, file_symbols);
+    }
+    return res;
+}
+
+std::vector<Program> load_program_file(const std::string& path, const Parser& parser)
+{
+    const MappedFile file{ path };
+    return load_programs(file.text(), parser);
+}
+
+}  // namespace calc
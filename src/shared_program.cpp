@@ -0,0 +1,386 @@
+#include "shared_program.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "expressions.hpp"
+
+namespace calc
+{
+namespace
+{
+std::optional<OpCode> builtin_opcode(const BinaryOpInfo& info)
+{
+    switch (info.kind)
+    {
+        case BinaryOpKind::add: return OpCode::add;
+        case BinaryOpKind::sub: return OpCode::sub;
+        case BinaryOpKind::mul: return OpCode::mul;
+        case BinaryOpKind::div: return OpCode::div;
+        case BinaryOpKind::pow: return OpCode::pow;
+        case BinaryOpKind::eq: return OpCode::eq;
+        case BinaryOpKind::ne: return OpCode::ne;
+        case BinaryOpKind::lt: return OpCode::lt;
+        case BinaryOpKind::le: return OpCode::le;
+        case BinaryOpKind::gt: return OpCode::gt;
+        case BinaryOpKind::ge: return OpCode::ge;
+        default: return std::nullopt;
+    }
+}
+
+// Nodes hold the argument count of a call in 16 bits.
+void check_argument_count(const expressions::Func& e)
+{
+    if (e.subs.size() > std::numeric_limits<std::uint16_t>::max())
+    {
+        throw std::invalid_argument{ "'" + std::string{ e.info.name } + "' is called with more than " +
+                                     std::to_string(std::numeric_limits<std::uint16_t>::max()) + " arguments" };
+    }
+}
+
+template <class T>
+std::uint32_t index_of(std::vector<T>& items, const T& item)
+{
+    const auto it = std::find(items.begin(), items.end(), item);
+    if (it != items.end())
+    {
+        return static_cast<std::uint32_t>(it - items.begin());
+    }
+    items.push_back(item);
+    return static_cast<std::uint32_t>(items.size() - 1);
+}
+
+void collect_assigned(const Expr& expr, std::unordered_set<Slot>& slots)
+{
+    walk_postorder(
+        expr,
+        [&](const Expr& node)
+        {
+            if (const auto e = dynamic_cast<const expressions::Assignment*>(&node))
+            {
+                slots.insert(e->slot);
+            }
+        });
+}
+
+// Identity of a node for hash-consing: what it computes, from which nodes and under which guard.
+struct NodeKey
+{
+    OpCode op;
+    std::uint32_t index;
+    std::vector<std::uint32_t> operands;
+    std::uint32_t guard;
+
+    friend bool operator==(const NodeKey& lhs, const NodeKey& rhs)
+    {
+        return lhs.op == rhs.op && lhs.index == rhs.index && lhs.operands == rhs.operands && lhs.guard == rhs.guard;
+    }
+};
+
+struct NodeKeyHash
+{
+    std::size_t operator()(const NodeKey& key) const
+    {
+        std::size_t res = (static_cast<std::size_t>(key.op) * 0x9E3779B97F4A7C15ull ^ key.index) + key.guard;
+        for (const std::uint32_t operand : key.operands)
+        {
+            res = (res ^ operand) * 0x100000001B3ull;
+        }
+        return res;
+    }
+};
+
+struct Compiler
+{
+    SharedProgram& program;
+    std::unordered_set<Slot> assigned;
+    std::unordered_map<NodeKey, std::uint32_t, NodeKeyHash> known;
+    // The guard of the branch being compiled.
+    std::uint32_t guard = 0;
+    // Indices of the constants by bit pattern, which keeps -0.0 apart from 0.0.
+    std::unordered_map<std::uint64_t, std::uint32_t> constant_indices;
+
+    std::uint32_t constant(double v)
+    {
+        std::uint64_t bits;
+        std::memcpy(&bits, &v, sizeof bits);
+        const auto [it, inserted] = constant_indices.try_emplace(bits, static_cast<std::uint32_t>(program.constants.size()));
+        if (inserted)
+        {
+            program.constants.push_back(v);
+        }
+        return it->second;
+    }
+
+    std::uint32_t emit(OpCode op, std::uint32_t index, std::vector<std::uint32_t> operands, bool mergeable)
+    {
+        NodeKey key{ op, index, std::move(operands), guard };
+        if (mergeable)
+        {
+            // A node computed under this guard or any enclosing one has its value whenever this one would.
+            for (std::uint32_t g = guard;; g = program.guards[g].parent)
+            {
+                key.guard = g;
+                if (const auto it = known.find(key); it != known.end())
+                {
+                    return it->second;
+                }
+                if (g == 0)
+                {
+                    break;
+                }
+            }
+            key.guard = guard;
+        }
+        const auto id = static_cast<std::uint32_t>(program.nodes.size());
+        program.nodes.push_back(SharedProgram::Node{
+            op, static_cast<std::uint16_t>(key.operands.size()), index, static_cast<std::uint32_t>(program.operands.size()), guard });
+        program.operands.insert(program.operands.end(), key.operands.begin(), key.operands.end());
+        if (mergeable)
+        {
+            known.emplace(std::move(key), id);
+        }
+        return id;
+    }
+
+    // Post-order, without recursing through deep trees: the nodes computing the operands of a node are the last ones
+    // on `values`.
+    std::uint32_t compile(const Expr& expr)
+    {
+        std::vector<std::uint32_t> values;
+        // The guard around each conditional and logical node being compiled.
+        std::vector<std::uint32_t> outer_guards;
+        walk_postorder(
+            expr,
+            [&](const Expr& node, std::size_t index)
+            {
+                if (dynamic_cast<const expressions::Conditional*>(&node) && index > 0)
+                {
+                    // The then branch runs when the condition holds, the otherwise branch when it does not.
+                    if (index == 1)
+                    {
+                        outer_guards.push_back(guard);
+                    }
+                    const std::uint32_t cond = values[values.size() - index];
+                    guard = index_of(program.guards, SharedProgram::Guard{ outer_guards.back(), cond, index == 1 });
+                }
+                else if (const auto e = dynamic_cast<const expressions::Logical*>(&node); e && index == 1)
+                {
+                    outer_guards.push_back(guard);
+                    guard = index_of(program.guards, SharedProgram::Guard{ guard, values.back(), e->is_and() });
+                }
+                return true;
+            },
+            [&](const Expr& node)
+            {
+                const std::size_t first = values.size() - operand_count(node);
+                const std::uint32_t res = compile_node(node, &values[first], outer_guards);
+                values.resize(first);
+                values.push_back(res);
+            });
+        return values.back();
+    }
+
+    std::uint32_t compile_node(const Expr& node, const std::uint32_t* operands, std::vector<std::uint32_t>& outer_guards)
+    {
+        return visit(
+            node,
+            overloaded{
+                [&](const expressions::Value& e) { return emit(OpCode::push_const, constant(e.v), {}, true); },
+                [&](const expressions::Variable& e) {
+                    // A read after an assignment must see the new value, so reads of assigned variables stay apart.
+                    return emit(OpCode::load_var, static_cast<std::uint32_t>(e.slot), {}, assigned.count(e.slot) == 0);
+                },
+                [&](const expressions::UnaryOp& e) {
+                    if (e.info.kind == UnaryOpKind::pos)
+                    {
+                        return operands[0];
+                    }
+                    if (e.info.kind == UnaryOpKind::neg)
+                    {
+                        return emit(OpCode::neg, 0, { operands[0] }, true);
+                    }
+                    return emit(OpCode::unary, index_of(program.unary_ops, &e.info), { operands[0] }, true);
+                },
+                [&](const expressions::BinaryOp& e) {
+                    if (const auto opcode = builtin_opcode(e.info))
+                    {
+                        return emit(*opcode, 0, { operands[0], operands[1] }, true);
+                    }
+                    return emit(OpCode::binary, index_of(program.binary_ops, &e.info), { operands[0], operands[1] }, true);
+                },
+                [&](const expressions::Func& e) {
+                    check_argument_count(e);
+                    const auto opcode = e.info.unary && e.subs.size() == 1 ? OpCode::call_unary : e.info.span ? OpCode::call_span : OpCode::call;
+                    return emit(opcode, index_of(program.functions, &e.info), { operands, operands + e.subs.size() }, e.info.pure);
+                },
+                [&](const expressions::Assignment& e) {
+                    return emit(OpCode::store_var, static_cast<std::uint32_t>(e.slot), { operands[0] }, false);
+                },
+                [&](const expressions::Conditional&) {
+                    guard = outer_guards.back();
+                    outer_guards.pop_back();
+                    return emit(OpCode::select, 0, { operands[0], operands[1], operands[2] }, true);
+                },
+                [&](const expressions::Logical& e) {
+                    // The right operand is converted to 0 or 1 under its own guard.
+                    const std::uint32_t rhs = emit(OpCode::to_bool, 0, { operands[1] }, true);
+                    guard = outer_guards.back();
+                    outer_guards.pop_back();
+                    const std::uint32_t decided = emit(OpCode::push_const, constant(e.is_and() ? 0.0 : 1.0), {}, true);
+                    return emit(OpCode::select, 0, { operands[0], e.is_and() ? rhs : decided, e.is_and() ? decided : rhs }, true);
+                },
+            });
+    }
+};
+
+}  // namespace
+
+SharedProgram SharedProgram::compile(Span<const ExprPtr> exprs)
+{
+    SharedProgram res;
+    Compiler compiler{ res, {}, {}, 0, {} };
+    for (const ExprPtr& expr : exprs)
+    {
+        collect_assigned(*expr, compiler.assigned);
+    }
+    for (const ExprPtr& expr : exprs)
+    {
+        res.roots.push_back(compiler.compile(*expr));
+    }
+    return res;
+}
+
+void SharedProgram::run(Context& ctx, Span<double> results) const
+{
+    if (results.size < roots.size())
+    {
+        throw std::invalid_argument{ "results must hold one value per expression" };
+    }
+    std::vector<double> values(nodes.size());
+    std::vector<double> args;
+    // Per guard: 0 while unknown in this run, then 1 if it holds and 2 if not.
+    std::vector<char> guard_states(guards.size());
+    guard_states[0] = 1;
+    std::vector<std::uint32_t> unknown;
+    const auto holds = [&](std::uint32_t guard)
+    {
+        // Walks up to the innermost enclosing guard already decided, then decides the ones below it in turn.
+        for (std::uint32_t g = guard; !guard_states[g]; g = guards[g].parent)
+        {
+            unknown.push_back(g);
+        }
+        for (; !unknown.empty(); unknown.pop_back())
+        {
+            const Guard& inner = guards[unknown.back()];
+            guard_states[unknown.back()] = guard_states[inner.parent] == 1 && truth(values[inner.cond]) == inner.when ? 1 : 2;
+        }
+        return guard_states[guard] == 1;
+    };
+    for (std::size_t id = 0; id < nodes.size(); ++id)
+    {
+        const Node& node = nodes[id];
+        if (node.guard && !holds(node.guard))
+        {
+            continue;
+        }
+        const std::uint32_t* in = operands.data() + node.first_operand;
+        const auto x = [&] { return values[in[0]]; };
+        const auto y = [&] { return values[in[1]]; };
+        double& out = values[id];
+        switch (node.op)
+        {
+            case OpCode::push_const: out = constants[node.index]; break;
+            case OpCode::load_var: out = ctx.get(node.index); break;
+            case OpCode::store_var:
+                out = x();
+                ctx.set(node.index, out);
+                break;
+            case OpCode::neg: out = -x(); break;
+            case OpCode::add: out = x() + y(); break;
+            case OpCode::sub: out = x() - y(); break;
+            case OpCode::mul: out = x() * y(); break;
+            case OpCode::div: out = x() / y(); break;
+            case OpCode::pow: out = std::pow(x(), y()); break;
+            case OpCode::eq: out = x() == y(); break;
+            case OpCode::ne: out = x() != y(); break;
+            case OpCode::lt: out = x() < y(); break;
+            case OpCode::le: out = x() <= y(); break;
+            case OpCode::gt: out = x() > y(); break;
+            case OpCode::ge: out = x() >= y(); break;
+            case OpCode::unary: out = unary_ops[node.index]->func(x()); break;
+            case OpCode::binary: out = binary_ops[node.index]->func(x(), y()); break;
+            case OpCode::call_unary: out = functions[node.index]->unary(x()); break;
+            case OpCode::call:
+            case OpCode::call_span:
+            {
+                args.resize(node.count);
+                for (std::size_t k = 0; k < node.count; ++k)
+                {
+                    args[k] = values[in[k]];
+                }
+                const FuncInfo& info = *functions[node.index];
+                out = node.op == OpCode::call_span ? info.span(args.data(), args.size()) : info.func(args);
+                break;
+            }
+            case OpCode::to_bool: out = truth(x()); break;
+            // Only the operand that the condition selects has been computed.
+            case OpCode::select: out = truth(x()) ? y() : values[in[2]]; break;
+            case OpCode::jump:
+            case OpCode::jump_if_zero: throw std::logic_error{ "jumps are not used in shared programs" };
+        }
+    }
+    for (std::size_t k = 0; k < roots.size(); ++k)
+    {
+        results[k] = values[roots[k]];
+    }
+}
+
+void SharedProgram::print(std::ostream& os) const
+{
+    for (std::size_t id = 0; id < nodes.size(); ++id)
+    {
+        const Node& node = nodes[id];
+        os << indent(1) << "%" << id << " = ";
+        switch (node.op)
+        {
+            case OpCode::push_const: os << constants[node.index]; break;
+            case OpCode::load_var: os << symbols().name(node.index); break;
+            case OpCode::store_var: os << symbols().name(node.index) << " ="; break;
+            case OpCode::neg: os << "-"; break;
+            case OpCode::unary: os << unary_ops[node.index]->symbol; break;
+            case OpCode::binary: os << binary_ops[node.index]->symbol; break;
+            case OpCode::call:
+            case OpCode::call_unary:
+            case OpCode::call_span: os << functions[node.index]->name; break;
+            case OpCode::to_bool: os << "to_bool"; break;
+            case OpCode::select: os << "select"; break;
+            default:
+            {
+                // The remaining opcodes are the built-in binary operators, declared from add to ge.
+                static const char* const operator_symbols[] = { "+", "-", "*", "/", "^", "==", "!=", "<", "<=", ">", ">=" };
+                os << operator_symbols[static_cast<int>(node.op) - static_cast<int>(OpCode::add)];
+                break;
+            }
+        }
+        for (std::size_t k = 0; k < node.count; ++k)
+        {
+            os << " %" << operands[node.first_operand + k];
+        }
+        if (node.guard)
+        {
+            const Guard& guard = guards[node.guard];
+            os << (guard.when ? " if %" : " unless %") << guard.cond;
+        }
+        os << '\n';
+    }
+}
+
+}  // namespace calc
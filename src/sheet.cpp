@@ -0,0 +1,243 @@
+#include "sheet.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_set>
+
+#include "expressions.hpp"
+
+namespace calc
+{
+namespace
+{
+// Distinct variables read by expr, in order of first use. Both branches of conditionals and logical operators count,
+// since either may be taken on a later recalculation.
+void collect_inputs(const Expr& expr, std::vector<Slot>& inputs)
+{
+    std::unordered_set<Slot> seen;
+    walk_postorder(
+        expr,
+        [&](const Expr& node)
+        {
+            if (const auto variable = dynamic_cast<const expressions::Variable*>(&node))
+            {
+                if (seen.insert(variable->slot).second)
+                {
+                    inputs.push_back(variable->slot);
+                }
+            }
+            else if (const auto assignment = dynamic_cast<const expressions::Assignment*>(&node))
+            {
+                throw std::invalid_argument{ "formulas cannot assign other variables, such as '" + std::string{ assignment->name } + "'" };
+            }
+        });
+}
+
+}  // namespace
+
+Sheet::Sheet(Context& ctx)
+    : ctx{ ctx }
+{
+}
+
+Sheet::Cell& Sheet::cell(Slot slot)
+{
+    if (slot >= cells.size())
+    {
+        cells.resize(slot + 1);
+    }
+    return cells[slot];
+}
+
+void Sheet::define(ExprPtr expr)
+{
+    const auto assignment = dynamic_cast<const expressions::Assignment*>(expr.get());
+    if (!assignment)
+    {
+        throw std::invalid_argument{ "only assignments can be defined as formulas" };
+    }
+    const Slot slot = assignment->slot;
+    std::vector<Slot> inputs;
+    collect_inputs(*assignment->expr, inputs);
+
+    // The formula closes a cycle if one of its inputs is the variable itself or downstream of it. New cells are
+    // usually appended at the bottom of the graph, where there is nothing downstream to walk.
+    const auto is_input = [&](Slot candidate) { return std::find(inputs.begin(), inputs.end(), candidate) != inputs.end(); };
+    std::vector<Slot> pending{ slot };
+    std::unordered_set<Slot> visited;
+    while (!pending.empty())
+    {
+        const Slot current = pending.back();
+        pending.pop_back();
+        if (is_input(current))
+        {
+            throw std::invalid_argument{ "cyclic definition of '" + std::string{ assignment->name } + "'" };
+        }
+        if (current < cells.size() && visited.insert(current).second)
+        {
+            pending.insert(pending.end(), cells[current].dependents.begin(), cells[current].dependents.end());
+        }
+    }
+
+    unlink(slot);
+    for (const Slot input : inputs)
+    {
+        cell(input).dependents.push_back(slot);
+    }
+    Cell& target = cell(slot);
+    target.program = Program::compile(*expr);
+    target.formula = std::move(expr);
+    target.inputs = std::move(inputs);
+    invalidate(slot);
+}
+
+void Sheet::set(Slot slot, double value)
+{
+    unlink(slot);
+    cell(slot).formula = nullptr;
+    cells[slot].program = Program{};
+    invalidate(slot);
+    cells[slot].dirty = false;
+    ctx.set(slot, value);
+}
+
+void Sheet::set(std::string_view name, double value)
+{
+    set(symbols().intern(name), value);
+}
+
+double Sheet::get(Slot slot)
+{
+    refresh(slot);
+    return ctx.get(slot);
+}
+
+double Sheet::get(std::string_view name)
+{
+    return get(symbols().intern(name));
+}
+
+double Sheet::eval(ExprPtr expr)
+{
+    if (const auto assignment = dynamic_cast<const expressions::Assignment*>(expr.get()))
+    {
+        const Slot slot = assignment->slot;
+        define(std::move(expr));
+        return get(slot);
+    }
+    std::vector<Slot> inputs;
+    collect_inputs(*expr, inputs);
+    for (const Slot input : inputs)
+    {
+        refresh(input);
+    }
+    return Program::compile(*expr).run(ctx);
+}
+
+void Sheet::freeze()
+{
+    for (Slot slot = 0; slot < cells.size(); ++slot)
+    {
+        try
+        {
+            refresh(slot);
+        }
+        catch (const std::exception&)
+        {
+        }
+        // Failed formulas, and those downstream of them, are still dirty.
+        if (is_dirty(slot) && slot < ctx.defined.size())
+        {
+            ctx.defined[slot] = false;
+        }
+    }
+    cells.clear();
+}
+
+bool Sheet::is_formula(Slot slot) const
+{
+    return slot < cells.size() && cells[slot].formula;
+}
+
+bool Sheet::is_dirty(Slot slot) const
+{
+    return slot < cells.size() && cells[slot].dirty;
+}
+
+std::size_t Sheet::evaluations() const
+{
+    return evaluation_count;
+}
+
+// Drops the edges from the variable's current inputs to it.
+void Sheet::unlink(Slot slot)
+{
+    if (slot >= cells.size())
+    {
+        return;
+    }
+    for (const Slot input : cells[slot].inputs)
+    {
+        auto& dependents = cells[input].dependents;
+        dependents.erase(std::find(dependents.begin(), dependents.end(), slot));
+    }
+    cells[slot].inputs.clear();
+}
+
+// Marks the variable and everything downstream of it as dirty. Downstream of a dirty cell everything is already
+// dirty, so the walk stops there.
+void Sheet::invalidate(Slot slot)
+{
+    cell(slot).dirty = false;
+    std::vector<Slot> pending{ slot };
+    while (!pending.empty())
+    {
+        Cell& current = cells[pending.back()];
+        pending.pop_back();
+        if (!current.dirty)
+        {
+            current.dirty = true;
+            pending.insert(pending.end(), current.dependents.begin(), current.dependents.end());
+        }
+    }
+}
+
+// Recomputes the variable if it is dirty, after its dirty inputs, without recursion so that long chains cannot
+// overflow the stack.
+void Sheet::refresh(Slot slot)
+{
+    if (!is_dirty(slot))
+    {
+        return;
+    }
+    std::vector<std::pair<Slot, bool>> pending{ { slot, false } };
+    while (!pending.empty())
+    {
+        auto [current, inputs_ready] = pending.back();
+        Cell& target = cells[current];
+        if (!target.dirty)
+        {
+            pending.pop_back();
+        }
+        else if (!inputs_ready)
+        {
+            pending.back().second = true;
+            for (const Slot input : target.inputs)
+            {
+                if (is_dirty(input))
+                {
+                    pending.emplace_back(input, false);
+                }
+            }
+        }
+        else
+        {
+            pending.pop_back();
+            ++evaluation_count;
+            target.program.run(ctx);
+            target.dirty = false;
+        }
+    }
+}
+
+}  // namespace calc
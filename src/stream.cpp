@@ -0,0 +1,315 @@
+#include "stream.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+
+#include "batch.hpp"
+#include "string_utils.hpp"
+
+namespace calc
+{
+namespace
+{
+constexpr std::size_t chunk_size = 1 << 20;
+constexpr std::size_t rows_per_batch = 16 * batch_block_size;
+
+// Sequential view of the input: either all of it in memory, or a stdio stream read in large chunks.
+struct Reader
+{
+    std::FILE* file = nullptr;
+    std::vector<char> buffer;
+    const char* data = nullptr;
+    std::size_t begin = 0;
+    std::size_t end = 0;
+
+    explicit Reader(std::string_view text)
+        : data{ text.data() }
+        , end{ text.size() }
+    {
+    }
+
+    explicit Reader(std::FILE* file)
+        : file{ file }
+        , buffer(chunk_size)
+        , data{ buffer.data() }
+    {
+    }
+
+    // Makes at least n bytes available, unless the input ends first; returns the number available.
+    std::size_t fill(std::size_t n)
+    {
+        while (file && end - begin < n)
+        {
+            std::memmove(buffer.data(), buffer.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+            if (buffer.size() - end < chunk_size / 2)
+            {
+                buffer.resize(std::max(buffer.size() * 2, end + chunk_size));
+            }
+            data = buffer.data();
+            const std::size_t read = std::fread(buffer.data() + end, 1, buffer.size() - end, file);
+            end += read;
+            if (read == 0)
+            {
+                if (std::ferror(file))
+                {
+                    throw std::runtime_error{ "cannot read input" };
+                }
+                file = nullptr;
+            }
+        }
+        return end - begin;
+    }
+
+    std::optional<std::string_view> next_line()
+    {
+        std::size_t scanned = 0;
+        while (true)
+        {
+            const std::size_t available = end - begin;
+            if (const void* newline = std::memchr(data + begin + scanned, '\n', available - scanned))
+            {
+                const std::size_t size = static_cast<const char*>(newline) - (data + begin);
+                std::string_view line{ data + begin, size };
+                begin += size + 1;
+                return drop_last(line, !line.empty() && line.back() == '\r');
+            }
+            scanned = available;
+            if (fill(available + 1) == available)
+            {
+                if (available == 0)
+                {
+                    return std::nullopt;
+                }
+                std::string_view line{ data + begin, available };
+                begin = end;
+                return line;
+            }
+        }
+    }
+};
+
+struct Writer
+{
+    std::FILE* file;
+    std::vector<char> buffer = std::vector<char>(chunk_size);
+    std::size_t size = 0;
+
+    char* reserve(std::size_t n)
+    {
+        if (buffer.size() - size < n)
+        {
+            flush();
+        }
+        return buffer.data() + size;
+    }
+
+    void flush()
+    {
+        if (size > 0 && std::fwrite(buffer.data(), 1, size, file) != size)
+        {
+            size = 0;
+            throw std::runtime_error{ "cannot write output" };
+        }
+        size = 0;
+    }
+
+    // Shortest text that reads back as the same double.
+    void write_text(double value)
+    {
+        constexpr std::size_t max_size = 32;
+        char* first = reserve(max_size);
+        const auto res = std::to_chars(first, first + max_size - 1, value);
+        *res.ptr = '\n';
+        size += res.ptr + 1 - first;
+    }
+
+    void write_raw(const double* values, std::size_t count)
+    {
+        const std::size_t n = count * sizeof(double);
+        std::memcpy(reserve(n), values, n);
+        size += n;
+    }
+};
+
+std::vector<std::string_view> split_fields(std::string_view line)
+{
+    std::vector<std::string_view> res;
+    while (true)
+    {
+        const auto comma = line.find(',');
+        res.push_back(trim_whitespace(line.substr(0, comma)));
+        if (comma == std::string_view::npos)
+        {
+            return res;
+        }
+        line.remove_prefix(comma + 1);
+    }
+}
+
+// Accumulates rows column by column and evaluates them a batch at a time.
+struct Batcher
+{
+    const Program& program;
+    const Context& ctx;
+    Writer& writer;
+    StreamOptions::Format format;
+    std::vector<std::vector<double>> values;
+    std::vector<Column> columns;
+    std::vector<double> results = std::vector<double>(rows_per_batch);
+    BatchWorkspace workspace;
+    std::size_t rows = 0;
+    std::size_t total = 0;
+
+    Batcher(const Program& program, const Context& ctx, Writer& writer, StreamOptions::Format format, const std::vector<std::string>& names)
+        : program{ program }
+        , ctx{ ctx }
+        , writer{ writer }
+        , format{ format }
+        , values(names.size(), std::vector<double>(rows_per_batch))
+    {
+        for (std::size_t k = 0; k < names.size(); ++k)
+        {
+            columns.emplace_back(names[k], values[k]);
+        }
+    }
+
+    double* next_row_field(std::size_t column)
+    {
+        return &values[column][rows];
+    }
+
+    void end_row()
+    {
+        if (++rows == rows_per_batch)
+        {
+            flush();
+        }
+    }
+
+    void flush()
+    {
+        if (rows == 0)
+        {
+            return;
+        }
+        eval_batch(program, columns, 0, Span<double>{ results.data(), rows }, ctx, workspace);
+        if (format == StreamOptions::Format::binary)
+        {
+            writer.write_raw(results.data(), rows);
+        }
+        else
+        {
+            for (std::size_t i = 0; i < rows; ++i)
+            {
+                writer.write_text(results[i]);
+            }
+        }
+        total += rows;
+        rows = 0;
+    }
+};
+
+std::size_t eval_csv(const Program& program, Reader& reader, Writer& writer, const StreamOptions& options, const Context& ctx)
+{
+    std::size_t line_number = 0;
+    std::vector<std::string> names = options.columns;
+    if (names.empty())
+    {
+        const auto header = reader.next_line();
+        ++line_number;
+        if (!header)
+        {
+            return 0;
+        }
+        for (const auto name : split_fields(*header))
+        {
+            names.emplace_back(name);
+        }
+    }
+
+    Batcher batcher{ program, ctx, writer, options.format, names };
+    while (const auto line = reader.next_line())
+    {
+        ++line_number;
+        if (trim_whitespace(*line).empty())
+        {
+            continue;
+        }
+        std::string_view rest = *line;
+        for (std::size_t k = 0; k < names.size(); ++k)
+        {
+            const auto comma = rest.find(',');
+            const auto value = parse_double(trim_whitespace(rest.substr(0, comma)));
+            if (!value || (comma == std::string_view::npos) != (k + 1 == names.size()))
+            {
+                throw std::runtime_error{ "line " + std::to_string(line_number) + ": expected " + std::to_string(names.size()) + " numbers" };
+            }
+            *batcher.next_row_field(k) = *value;
+            rest.remove_prefix(comma == std::string_view::npos ? rest.size() : comma + 1);
+        }
+        batcher.end_row();
+    }
+    batcher.flush();
+    return batcher.total;
+}
+
+std::size_t eval_binary(const Program& program, Reader& reader, Writer& writer, const StreamOptions& options, const Context& ctx)
+{
+    if (options.columns.empty())
+    {
+        throw std::invalid_argument{ "binary input needs its column names" };
+    }
+    const std::size_t row_size = options.columns.size() * sizeof(double);
+    Batcher batcher{ program, ctx, writer, options.format, options.columns };
+    while (true)
+    {
+        const std::size_t available = reader.fill(row_size);
+        if (available < row_size)
+        {
+            if (available != 0)
+            {
+                throw std::runtime_error{ "input ends in the middle of a row" };
+            }
+            break;
+        }
+        for (std::size_t k = 0; k < options.columns.size(); ++k)
+        {
+            std::memcpy(batcher.next_row_field(k), reader.data + reader.begin + k * sizeof(double), sizeof(double));
+        }
+        reader.begin += row_size;
+        batcher.end_row();
+    }
+    batcher.flush();
+    return batcher.total;
+}
+
+std::size_t eval_stream(const Program& program, Reader& reader, std::FILE* out, const StreamOptions& options, const Context& ctx)
+{
+    Writer writer{ out };
+    const std::size_t rows = options.format == StreamOptions::Format::binary ? eval_binary(program, reader, writer, options, ctx)
+                                                                             : eval_csv(program, reader, writer, options, ctx);
+    writer.flush();
+    std::fflush(out);
+    return rows;
+}
+
+}  // namespace
+
+std::size_t eval_stream(const Program& program, std::FILE* in, std::FILE* out, const StreamOptions& options, const Context& ctx)
+{
+    Reader reader{ in };
+    return eval_stream(program, reader, out, options, ctx);
+}
+
+std::size_t eval_stream(const Program& program, std::string_view in, std::FILE* out, const StreamOptions& options, const Context& ctx)
+{
+    Reader reader{ in };
+    return eval_stream(program, reader, out, options, ctx);
+}
+
+}  // namespace calc
@@ -0,0 +1,302 @@
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+
+#include "batch.hpp"
+#include "calc.hpp"
+#include "program.hpp"
+
+using namespace ::testing;
+
+struct batch_matches_scalar : TestWithParam<const char*>
+{
+};
+
+TEST_P(batch_matches_scalar, same_result_as_expr_eval)
+{
+    const std::size_t rows = 1000;
+    std::vector<double> x(rows);
+    std::vector<double> y(rows);
+    for (std::size_t i = 0; i < rows; ++i)
+    {
+        x[i] = 0.01 * i - 3.0;
+        y[i] = std::cos(0.1 * i);
+    }
+
+    const auto expr = calc::parse(GetParam());
+    ASSERT_THAT(expr, NotNull());
+
+    calc::Context ctx{ { "a", 2.0 }, { "b", -0.5 } };
+    std::vector<double> out(rows);
+    const std::vector<calc::Column> columns{ { "x", x }, { "y", y } };
+    calc::eval_batch(*expr, columns, out, ctx);
+
+    for (std::size_t i = 0; i < rows; ++i)
+    {
+        calc::Context row_ctx = ctx;
+        row_ctx.set("x", x[i]);
+        row_ctx.set("y", y[i]);
+        const double expected = expr->eval(row_ctx);
+        if (std::isnan(expected))
+        {
+            ASSERT_THAT(out[i], IsNan()) << "row " << i;
+        }
+        else
+        {
+            ASSERT_THAT(out[i], DoubleEq(expected)) << "row " << i;
+        }
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    expressions,
+    batch_matches_scalar,
+    Values(
+        "a*x^2 + b*x + 1",
+        "-(x + 3) / y",
+        "x < y",
+        "x >= y",
+        "x == y",
+        "x != 0",
+        "sum(x, y, a)",
+        "sqrt(x) + sin(x) * cos(y) - min(x, y) + max(x, y, b)",
+        "z = x * 2",
+        "(t = x * y) + t",
+        "x > 0 ? sqrt(x) : y",
+        "x > 0 ? (y > 0 ? x : y) : x < -2 ? a : b",
+        "(x > 0 && y > 0) + (x < -1 || y < 0) * 2",
+        "(x > 0 ? (t = x) : (t = y)) + t",
+        "x > 0 ? (a = x) : 0",
+        "(x > 1 ? x : y) > 0 ? 1 : x > 2 ? 2 : 3"));
+
+TEST(batch, user_functions_are_called_per_row)
+{
+    calc::Parser parser;
+    parser.register_function("twice", [](const std::vector<double>& args) { return 2.0 * args.at(0); });
+    const std::vector<double> x{ 1.0, 2.0, 3.0 };
+    std::vector<double> out(x.size());
+    calc::eval_batch(*parser("twice(x) + 1"), std::vector<calc::Column>{ { "x", x } }, out);
+    ASSERT_THAT(out, ElementsAre(3.0, 5.0, 7.0));
+}
+
+TEST(batch, batch_functions_are_called_once_per_block)
+{
+    calc::Parser parser;
+    std::vector<std::size_t> blocks;
+    parser.register_function(
+        "lerp",
+        [](const std::vector<double>& args) { return args.at(0) + (args.at(1) - args.at(0)) * args.at(2); },
+        [&](calc::Span<const calc::Span<const double>> args, calc::Span<double> out)
+        {
+            blocks.push_back(out.size);
+            for (std::size_t i = 0; i < out.size; ++i)
+            {
+                out[i] = args[0][i] + (args[1][i] - args[0][i]) * args[2][i];
+            }
+        });
+    const std::size_t rows = calc::batch_block_size + 10;
+    std::vector<double> x(rows);
+    for (std::size_t i = 0; i < rows; ++i)
+    {
+        x[i] = 0.5 * i;
+    }
+    std::vector<double> out(rows);
+    calc::eval_batch(*parser("lerp(1, x, 0.5) * 2"), std::vector<calc::Column>{ { "x", x } }, out);
+    ASSERT_THAT(blocks, ElementsAre(calc::batch_block_size, 10));
+    for (std::size_t i = 0; i < rows; ++i)
+    {
+        ASSERT_THAT(out[i], DoubleEq(1 + x[i]));
+    }
+
+    calc::Context ctx{ { "x", 3 } };
+    ASSERT_THAT(parser("lerp(1, x, 0.5)")->eval(ctx), 2);
+    ASSERT_THAT(blocks.size(), 2);
+}
+
+TEST(batch, batch_only_functions_also_evaluate_per_row)
+{
+    calc::Parser parser;
+    parser.register_function("negate", [](calc::Span<const calc::Span<const double>> args, calc::Span<double> out) {
+        std::transform(args[0].begin(), args[0].end(), out.begin(), [](double v) { return -v; });
+    });
+    calc::Context ctx{ { "x", 3 } };
+    ASSERT_THAT(parser("negate(x) + 1")->eval(ctx), -2);
+    ASSERT_THAT(calc::Program::compile(*parser("negate(x)")).run(ctx), -3);
+    const std::vector<double> x{ 1.0, 2.0 };
+    std::vector<double> out(x.size());
+    calc::eval_batch(*parser("negate(x)"), std::vector<calc::Column>{ { "x", x } }, out);
+    ASSERT_THAT(out, ElementsAre(-1.0, -2.0));
+}
+
+TEST(batch, missing_variable_throws)
+{
+    std::vector<double> out(4);
+    ASSERT_THROW(calc::eval_batch(*calc::parse("undefined_column + 1"), {}, out), std::runtime_error);
+}
+
+TEST(batch, short_column_throws)
+{
+    const std::vector<double> x{ 1.0 };
+    std::vector<double> out(4);
+    ASSERT_THROW(calc::eval_batch(*calc::parse("x"), std::vector<calc::Column>{ { "x", x } }, out), std::invalid_argument);
+}
+
+TEST(batch, branches_only_see_the_rows_taking_them)
+{
+    calc::Parser parser;
+    std::vector<double> seen;
+    parser.register_function("log_row", [&](const std::vector<double>& args) { return seen.push_back(args.at(0)), args.at(0); });
+    std::vector<double> blocks;
+    parser.register_function(
+        "negate",
+        [](calc::Span<const calc::Span<const double>> args, calc::Span<double> out)
+        {
+            for (std::size_t i = 0; i < out.size; ++i)
+            {
+                out[i] = -args[0][i];
+            }
+        });
+    parser.register_function("log_block", [](const std::vector<double>& args) { return args.at(0); },
+        [&](calc::Span<const calc::Span<const double>> args, calc::Span<double> out)
+        {
+            blocks.insert(blocks.end(), args[0].begin(), args[0].end());
+            std::copy(args[0].begin(), args[0].end(), out.begin());
+        });
+    const std::vector<double> x{ 1.0, -2.0, 3.0, -4.0 };
+    std::vector<double> out(x.size());
+    const std::vector<calc::Column> columns{ { "x", x } };
+
+    calc::eval_batch(*parser("x > 0 ? log_row(x) : negate(log_block(x))"), columns, out);
+    ASSERT_THAT(out, ElementsAre(1.0, 2.0, 3.0, 4.0));
+    ASSERT_THAT(seen, ElementsAre(1.0, 3.0));
+    ASSERT_THAT(blocks, ElementsAre(-2.0, -4.0));
+
+    // A branch no row takes is skipped, undefined variables included.
+    seen.clear();
+    calc::eval_batch(*parser("x > 10 ? log_row(undefined) : x < 10 || undefined"), columns, out);
+    ASSERT_THAT(out, Each(1.0));
+    ASSERT_THAT(seen, IsEmpty());
+}
+
+TEST(batch, assignments_in_branches_keep_other_rows)
+{
+    const std::vector<double> x{ 1.0, -2.0, 3.0 };
+    std::vector<double> out(x.size());
+    calc::Context ctx{ { "t", 10.0 } };
+    calc::eval_batch(*calc::parse("(x > 0 ? (t = x) : 0) + t"), std::vector<calc::Column>{ { "x", x } }, out, ctx);
+    ASSERT_THAT(out, ElementsAre(2.0, 10.0, 6.0));
+    calc::eval_batch(*calc::parse("(x > 0 ? (x = 0) : 0) + x"), std::vector<calc::Column>{ { "x", x } }, out, ctx);
+    ASSERT_THAT(out, ElementsAre(0.0, -2.0, 0.0));
+    calc::eval_batch(*calc::parse("x > 0 ? (u = x) : 0"), std::vector<calc::Column>{ { "x", x } }, out, ctx);
+    ASSERT_THAT(out, ElementsAre(1.0, 0.0, 3.0));
+}
+
+struct batch_typed : TestWithParam<const char*>
+{
+};
+
+TEST_P(batch_typed, float_and_int64_columns_match_scalar)
+{
+    const std::size_t rows = 600;
+    std::vector<float> x(rows);
+    std::vector<float> y(rows);
+    std::vector<std::int64_t> i(rows);
+    std::vector<std::int64_t> j(rows);
+    for (std::size_t r = 0; r < rows; ++r)
+    {
+        x[r] = static_cast<float>(0.01 * r - 3.0);
+        y[r] = static_cast<float>(std::cos(0.1 * r));
+        i[r] = static_cast<std::int64_t>(r % 17) - 8;
+        j[r] = static_cast<std::int64_t>(r % 5) * 3;
+    }
+    const auto expr = calc::parse(GetParam());
+    ASSERT_THAT(expr, NotNull());
+    const calc::Context ctx{ { "a", 2.0 }, { "b", -3.0 } };
+
+    std::vector<float> float_out(rows);
+    calc::eval_batch(calc::TypedProgram<float>::compile(*expr), std::vector<calc::FloatColumn>{ { "x", x }, { "y", y } }, float_out, ctx);
+    std::vector<std::int64_t> int_out(rows);
+    calc::eval_batch(calc::TypedProgram<std::int64_t>::compile(*expr), std::vector<calc::Int64Column>{ { "x", i }, { "y", j } }, int_out, ctx);
+
+    for (std::size_t r = 0; r < rows; ++r)
+    {
+        calc::Context float_ctx = ctx;
+        float_ctx.set("x", x[r]);
+        float_ctx.set("y", y[r]);
+        const double expected = expr->eval(float_ctx);
+        ASSERT_THAT(float_out[r], FloatNear(static_cast<float>(expected), 1e-4f * std::max(1.0f, std::abs(static_cast<float>(expected))))) << "row " << r;
+
+        calc::Context int_ctx = ctx;
+        int_ctx.set("x", static_cast<double>(i[r]));
+        int_ctx.set("y", static_cast<double>(j[r]));
+        ASSERT_THAT(int_out[r], static_cast<std::int64_t>(expr->eval(int_ctx))) << "row " << r;
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    expressions,
+    batch_typed,
+    Values(
+        "a*x*x + b*x + 1",
+        "-(x + 3) * y",
+        "x < y",
+        "x >= y",
+        "x == y",
+        "x != 0",
+        "sum(x, y, a) - max(x, y, b) + min(x, 1)",
+        "(t = x * y) + t",
+        "x > 0 ? x : y && b",
+        "x > 0 ? (t = x) : 0"));
+
+TEST(batch, int64_programs_reject_what_integers_cannot_compute)
+{
+    calc::Parser parser;
+    parser.register_function("twice", [](const std::vector<double>& args) { return 2 * args.at(0); });
+    for (const char* text : { "x / 2", "x ^ 2", "sqrt(x)", "sin(x)", "x * 1.5", "twice(x)" })
+    {
+        ASSERT_THROW(calc::TypedProgram<std::int64_t>::compile(*parser(text)), std::invalid_argument) << text;
+        ASSERT_NO_THROW(calc::TypedProgram<float>::compile(*parser(text))) << text;
+    }
+    ASSERT_NO_THROW(calc::TypedProgram<std::int64_t>::compile(*parser("sum(x, 2) * max(x, y) - min(x) > 3 ? x : -x")));
+}
+
+TEST(batch, int64_arithmetic_wraps_around)
+{
+    const std::vector<std::int64_t> x{ std::numeric_limits<std::int64_t>::max(), std::numeric_limits<std::int64_t>::min() };
+    std::vector<std::int64_t> out(x.size());
+    const std::vector<calc::Int64Column> columns{ { "x", x } };
+    calc::eval_batch(calc::TypedProgram<std::int64_t>::compile(*calc::parse("x + 1")), columns, out);
+    ASSERT_THAT(out, ElementsAre(std::numeric_limits<std::int64_t>::min(), std::numeric_limits<std::int64_t>::min() + 1));
+    calc::eval_batch(calc::TypedProgram<std::int64_t>::compile(*calc::parse("-x")), columns, out);
+    ASSERT_THAT(out, ElementsAre(std::numeric_limits<std::int64_t>::min() + 1, std::numeric_limits<std::int64_t>::min()));
+
+    const auto scaled = calc::TypedProgram<std::int64_t>::compile(*calc::parse("x * k"));
+    ASSERT_NO_THROW(calc::eval_batch(scaled, columns, out, calc::Context{ { "k", 3.0 } }));
+    ASSERT_THROW(calc::eval_batch(scaled, columns, out, calc::Context{ { "k", 0.5 } }), std::invalid_argument);
+    ASSERT_THROW(calc::eval_batch(scaled, columns, out), std::runtime_error);
+}
+
+TEST(batch, float_columns_pass_doubles_to_user_functions)
+{
+    calc::Parser parser;
+    std::vector<double> seen;
+    parser.register_function("log_row", [&](const std::vector<double>& args) { return seen.push_back(args.at(0)), args.at(0) / 3; });
+    std::size_t batch_rows = 0;
+    parser.register_function(
+        "negate",
+        [&](calc::Span<const calc::Span<const double>> args, calc::Span<double> out)
+        {
+            batch_rows += out.size;
+            std::transform(args[0].begin(), args[0].end(), out.begin(), [](double v) { return -v; });
+        });
+    const std::vector<float> x{ 1.5f, -2.0f, 3.0f };
+    std::vector<float> out(x.size());
+    const auto program = calc::TypedProgram<float>::compile(*parser("x > 0 ? log_row(x) : negate(x)"));
+    calc::eval_batch(program, std::vector<calc::FloatColumn>{ { "x", x } }, out);
+    ASSERT_THAT(out, ElementsAre(0.5f, 2.0f, 1.0f));
+    ASSERT_THAT(seen, ElementsAre(1.5, 3.0));
+    ASSERT_THAT(batch_rows, 1);
+}
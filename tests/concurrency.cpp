@@ -0,0 +1,122 @@
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <cmath>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "calc.hpp"
+#include "program.hpp"
+
+using namespace ::testing;
+
+namespace
+{
+constexpr int thread_count = 32;
+
+template <class Body>
+void run_threads(int count, Body body)
+{
+    std::vector<std::thread> threads;
+    threads.reserve(count);
+    for (int i = 0; i < count; ++i)
+    {
+        threads.emplace_back(body, i);
+    }
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+}
+// Function names are letters only: "fa", "fb", ..., "fba", ...
+std::string name_of(int i)
+{
+    std::string name;
+    do
+    {
+        name.insert(name.begin(), static_cast<char>('a' + i % 26));
+        i /= 26;
+    } while (i > 0);
+    return "f" + name;
+}
+}  // namespace
+
+TEST(concurrency, shared_tree_evaluates_with_per_thread_contexts)
+{
+    const auto expr = calc::parse("t = x * 2 + max(x, 3) - sin(0)");
+    std::atomic<int> failures{ 0 };
+    run_threads(
+        thread_count,
+        [&](int id)
+        {
+            calc::Context ctx{};
+            for (int i = 0; i < 1000; ++i)
+            {
+                const double x = id * 1000 + i;
+                ctx.set("x", x);
+                const double expected = x * 2 + std::max(x, 3.0);
+                if (expr->eval(ctx) != expected || ctx.get("t") != expected)
+                {
+                    ++failures;
+                }
+            }
+        });
+    ASSERT_THAT(failures.load(), 0);
+}
+
+TEST(concurrency, shared_program_runs_with_per_thread_contexts)
+{
+    const auto program = calc::Program::compile(*calc::parse("x ^ 2 + sqrt(x)"));
+    std::atomic<int> failures{ 0 };
+    run_threads(
+        thread_count,
+        [&](int id)
+        {
+            calc::Context ctx{ { "x", static_cast<double>(id) } };
+            for (int i = 0; i < 1000; ++i)
+            {
+                if (program.run(ctx) != id * id + std::sqrt(id))
+                {
+                    ++failures;
+                }
+            }
+        });
+    ASSERT_THAT(failures.load(), 0);
+}
+
+TEST(concurrency, register_function_while_parsing_keeps_existing_trees_valid)
+{
+    calc::Parser parser{};
+    parser.register_function("twice", [](const std::vector<double>& args) { return 2 * args.at(0); });
+    const auto expr = parser("twice(x) + 1");
+
+    std::atomic<int> failures{ 0 };
+    std::thread registrar{ [&]
+                           {
+                               for (int i = 0; i < 2000; ++i)
+                               {
+                                   parser.register_function(name_of(i), [i](const std::vector<double>&) { return i; });
+                               }
+                           } };
+    run_threads(
+        8,
+        [&](int id)
+        {
+            calc::Context ctx{ { "x", static_cast<double>(id) } };
+            for (int i = 0; i < 500; ++i)
+            {
+                if (parser("twice(x) * 3")->eval(ctx) != 6 * id || expr->eval(ctx) != 2 * id + 1)
+                {
+                    ++failures;
+                }
+            }
+        });
+    registrar.join();
+
+    calc::Context ctx{ { "x", 5 } };
+    ASSERT_THAT(failures.load(), 0);
+    ASSERT_THAT(expr->eval(ctx), 11);
+    ASSERT_THAT(parser(name_of(1999) + "(0)")->eval(ctx), 1999);
+}
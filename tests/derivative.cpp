@@ -0,0 +1,143 @@
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <sstream>
+#include <utility>
+#include <vector>
+
+#include "calc.hpp"
+#include "derivative.hpp"
+
+using namespace ::testing;
+
+namespace
+{
+std::string printed(const calc::Expr& expr)
+{
+    std::ostringstream os;
+    expr.print(os, 0);
+    return os.str();
+}
+
+std::string derivative(std::string_view text, std::string_view variable, const calc::Differentiator& differentiator = calc::Differentiator{})
+{
+    return printed(*differentiator.derivative(*calc::parse(text), variable));
+}
+
+double central_difference(const calc::Expr& expr, calc::Context ctx, std::string_view variable)
+{
+    constexpr double h = 1e-6;
+    const double x = *ctx.get(variable);
+    ctx.set(variable, x + h);
+    const double above = expr.eval(ctx);
+    ctx.set(variable, x - h);
+    const double below = expr.eval(ctx);
+    return (above - below) / (2 * h);
+}
+}  // namespace
+
+TEST(derivative, matches_finite_differences)
+{
+    const calc::Differentiator differentiator;
+    for (const char* text : {
+             "x * y + 3 * x - y / 2",
+             "x / y - y / x",
+             "x ^ 3 - 2 * (x ^ 2) * y + y ^ -1",
+             "sin(x * y) + cos(x) ^ 2",
+             "sqrt(x ^ 2 + y ^ 2)",
+             "-x * +y",
+             "sum(x, x * y, 2) * max(x, y, 0) - min(x * x, y)",
+             "x > y ? x * x : y * x",
+             "(x < 1 && y > 0) * x",
+         })
+    {
+        const auto expr = calc::parse(text);
+        const calc::Context ctx{ { "x", 0.7 }, { "y", 1.3 } };
+        for (const char* variable : { "x", "y" })
+        {
+            calc::Context eval_ctx = ctx;
+            const double exact = differentiator.derivative(*expr, variable)->eval(eval_ctx);
+            ASSERT_THAT(exact, DoubleNear(central_difference(*expr, ctx, variable), 1e-6)) << text << " by " << variable;
+        }
+    }
+}
+
+TEST(derivative, simplifies_as_it_builds)
+{
+    ASSERT_THAT(derivative("x * y", "x"), "y\n");
+    ASSERT_THAT(derivative("3 * x + y", "x"), "3\n");
+    ASSERT_THAT(derivative("x ^ 3", "x"), printed(*calc::parse("3 * (x ^ 2)")));
+    ASSERT_THAT(derivative("x ^ 2", "x"), printed(*calc::parse("2 * x")));
+    ASSERT_THAT(derivative("y - x", "x"), "-1\n");
+    ASSERT_THAT(derivative("sin(y) * 2", "x"), "0\n");
+    ASSERT_THAT(derivative("sin(x)", "x"), "cos\n  x\n");
+    ASSERT_THAT(derivative("x > 0 ? x : 2 * x", "x"), printed(*calc::parse("x > 0 ? 1 : 2")));
+}
+
+TEST(derivative, keeps_the_sign_of_zero)
+{
+    // The derivatives written out in full, with -0 for the derivative of anything independent of x.
+    for (const auto& [text, expanded] : std::vector<std::pair<const char*, const char*>>{
+             { "x * y", "1 * y + x * -0" },
+             { "y - x * y", "-0 - (1 * y + x * -0)" },
+             { "y * y - x", "(-0 * y + y * -0) - 1" },
+             { "x - x + x * y", "(1 - 1) + (1 * y + x * -0)" },
+             { "x / 2 - y / x", "(1 / 2 - -0) - (-0 / x - y * 1 / x ^ 2)" },
+         })
+    {
+        for (const double y : { 0.0, -0.0 })
+        {
+            calc::Context ctx{ { "x", 2 }, { "y", y } };
+            const double expected = calc::parse(expanded)->eval(ctx);
+            ASSERT_THAT(std::signbit(calc::Differentiator{}.derivative(*calc::parse(text), "x")->eval(ctx)), std::signbit(expected))
+                << text << " at y = " << y;
+        }
+    }
+}
+
+TEST(derivative, applies_registered_rules)
+{
+    calc::Parser parser;
+    parser.register_function("lerp", [](const std::vector<double>& args) { return args[0] + (args[1] - args[0]) * args[2]; });
+    calc::Differentiator differentiator{ parser };
+    differentiator.register_rule("lerp", { "a", "b", "t" }, { "1 - t", "t", "b - a" });
+
+    const auto expr = parser("lerp(x, 2 * x, y)");
+    calc::Context ctx{ { "x", 1.5 }, { "y", 0.25 } };
+    // d/dx = (1 - y) + y * 2, d/dy = 2 * x - x
+    ASSERT_THAT(differentiator.derivative(*expr, "x")->eval(ctx), DoubleEq(1.25));
+    ASSERT_THAT(differentiator.derivative(*expr, "y")->eval(ctx), DoubleEq(1.5));
+    ASSERT_THAT(printed(*differentiator.derivative(*parser("lerp(1, 2, y)"), "x")), "0\n");
+
+    ASSERT_THROW(differentiator.register_rule("lerp", { "a", "b" }, { "1" }), std::invalid_argument);
+    ASSERT_THROW(differentiator.register_rule("lerp", { "a" }, { "1 +" }), std::exception);
+}
+
+TEST(derivative, rejects_what_it_has_no_rule_for)
+{
+    calc::Parser parser;
+    parser.register_function("next", [](const std::vector<double>&) { return 1.0; });
+    const calc::Differentiator differentiator{ parser };
+    ASSERT_THROW(differentiator.derivative(*parser("next(x)"), "x"), std::invalid_argument);
+    ASSERT_THROW(differentiator.derivative(*parser("x ^ y"), "y"), std::invalid_argument);
+    ASSERT_THROW(differentiator.derivative(*parser("y = x * 2"), "x"), std::invalid_argument);
+    // An exponent independent of the variable is fine.
+    ASSERT_NO_THROW(differentiator.derivative(*parser("x ^ y"), "x"));
+}
+
+TEST(derivative, gradient_yields_the_value_and_every_partial_in_one_run)
+{
+    const auto expr = calc::parse("sqrt(x ^ 2 + y ^ 2) * sin(x * y) + z");
+    const calc::Differentiator differentiator;
+    const auto gradient = calc::Gradient::compile(*expr, { "x", "y", "z" }, differentiator);
+    ASSERT_THAT(gradient.partials, SizeIs(3));
+
+    calc::Context ctx{ { "x", 0.4 }, { "y", -1.1 }, { "z", 3.0 } };
+    std::vector<double> results(4);
+    gradient.run(ctx, results);
+    ASSERT_THAT(results[0], DoubleEq(expr->eval(ctx)));
+    ASSERT_THAT(results[1], DoubleEq(differentiator.derivative(*expr, "x")->eval(ctx)));
+    ASSERT_THAT(results[2], DoubleEq(differentiator.derivative(*expr, "y")->eval(ctx)));
+    ASSERT_THAT(results[3], DoubleEq(1.0));
+}
@@ -0,0 +1,159 @@
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <numeric>
+#include <string>
+#include <vector>
+
+#include "calc.hpp"
+#include "profile.hpp"
+#include "program.hpp"
+
+using namespace ::testing;
+
+namespace
+{
+calc::ExprPtr parse(const std::string& text)
+{
+    static calc::Parser parser;
+    static const bool registered = (parser.register_function(
+                                        "sum",
+                                        [](const std::vector<double>& args)
+                                        { return std::accumulate(args.begin(), args.end(), 0.0); }),
+                                    true);
+    static_cast<void>(registered);
+    return parser(text);
+}
+
+// Fails the test if anything allocates between construction and destruction.
+struct NoAllocations
+{
+    std::size_t before = calc::allocation_count();
+
+    ~NoAllocations()
+    {
+        EXPECT_THAT(calc::allocation_count() - before, 0);
+    }
+};
+
+// "1 + (2 + (... + x))", whose compiled program needs more stack than Program::run keeps inline.
+std::string right_nested_sum(int n)
+{
+    std::string res;
+    for (int i = 1; i <= n; ++i)
+    {
+        res += std::to_string(i) + " + (";
+    }
+    return res + "x" + std::string(n, ')');
+}
+
+class eval_workspace : public TestWithParam<std::string>
+{
+};
+
+}  // namespace
+
+TEST_P(eval_workspace, tree_eval_does_not_allocate_once_warmed_up)
+{
+    const auto expr = parse(GetParam());
+    calc::Context expected_ctx{ { "x", 3 } };
+    const double expected = expr->eval(expected_ctx);
+
+    calc::Context ctx{ { "x", 3 } };
+    calc::EvalWorkspace workspace;
+    ASSERT_THAT(calc::eval(*expr, ctx, workspace), expected);
+    {
+        const NoAllocations guard;
+        for (int i = 0; i < 3; ++i)
+        {
+            ASSERT_THAT(calc::eval(*expr, ctx, workspace), expected);
+        }
+    }
+    ASSERT_THAT(ctx.workspace, IsNull());
+}
+
+TEST_P(eval_workspace, program_run_does_not_allocate_once_warmed_up)
+{
+    const auto expr = parse(GetParam());
+    calc::Context expected_ctx{ { "x", 3 } };
+    const double expected = expr->eval(expected_ctx);
+
+    const auto program = calc::Program::compile(*expr);
+    calc::Context ctx{ { "x", 3 } };
+    calc::EvalWorkspace workspace;
+    ASSERT_THAT(program.run(ctx, workspace), expected);
+    {
+        const NoAllocations guard;
+        for (int i = 0; i < 3; ++i)
+        {
+            ASSERT_THAT(program.run(ctx, workspace), expected);
+        }
+    }
+    ASSERT_THAT(ctx.workspace, IsNull());
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    eval_workspace,
+    eval_workspace,
+    Values(
+        "x * 2 + 1",
+        "sum(x, 1, 2)",
+        "sum(x, sum(x, 1), sum(sum(x, 2), 3))",
+        "max(x, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10)",
+        "sum(x, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10) * max(1, 2, 3, 4, 5, 6, 7, 8, 9, x)",
+        right_nested_sum(100),
+        "workspace_new_variable = x + 1"));
+
+TEST(eval_workspace_binding, nested_calls_keep_their_own_arguments)
+{
+    const auto expr = parse("sum(1, sum(2, sum(3, 4), 5), sum(6, 7))");
+    calc::Context ctx;
+    calc::EvalWorkspace workspace;
+    ASSERT_THAT(calc::eval(*expr, ctx, workspace), 28);
+    ASSERT_THAT(calc::Program::compile(*expr).run(ctx, workspace), 28);
+}
+
+TEST(eval_workspace_binding, undefined_variables_do_not_allocate_with_try_eval)
+{
+    const auto expr = parse("sum(x, 1, 2, 3, 4, 5, 6, 7, 8, 9, workspace_undefined_variable)");
+    const auto program = calc::Program::compile(*expr);
+    calc::Context ctx{ { "x", 3 } };
+    calc::EvalWorkspace workspace;
+    ASSERT_FALSE(calc::try_eval(*expr, ctx, workspace));
+    {
+        const calc::ScopedWorkspace scope{ ctx, workspace };
+        ASSERT_FALSE(program.try_run(ctx));
+    }
+    const NoAllocations guard;
+    for (int i = 0; i < 3; ++i)
+    {
+        ASSERT_FALSE(calc::try_eval(*expr, ctx, workspace));
+        const calc::ScopedWorkspace scope{ ctx, workspace };
+        ASSERT_FALSE(program.try_run(ctx));
+    }
+}
+
+TEST(eval_workspace_binding, is_released_when_evaluation_throws)
+{
+    const auto expr = calc::parse("max(1, 2, 3, 4, 5, 6, 7, 8, 9, undefined_variable)");
+    calc::Context ctx;
+    calc::EvalWorkspace workspace;
+    ASSERT_ANY_THROW(calc::eval(*expr, ctx, workspace));
+    ASSERT_THAT(ctx.workspace, IsNull());
+    ASSERT_THAT(calc::eval(*calc::parse("max(1, 2, 3, 4, 5, 6, 7, 8, 9, 10)"), ctx, workspace), 10);
+}
+
+TEST(eval_workspace_binding, sizes_the_context_by_the_program_not_the_symbol_table)
+{
+    calc::Context ctx{ { "x", 3 } };
+    const auto program = calc::Program::compile(*parse("x * 2"));
+    for (int i = 0; i < 100; ++i)
+    {
+        calc::symbols().intern("workspace_unrelated_" + std::to_string(i));
+    }
+    calc::EvalWorkspace workspace;
+    ASSERT_THAT(program.slot_count, calc::symbols().intern("x") + 1);
+    ASSERT_THAT(program.run(ctx, workspace), 6);
+    ASSERT_THAT(calc::eval(*parse("x * 2"), ctx, workspace), 6);
+    ASSERT_THAT(ctx.values.size(), program.slot_count);
+}
@@ -0,0 +1,88 @@
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <stdexcept>
+
+#include "calc.hpp"
+#include "executor.hpp"
+
+using namespace ::testing;
+
+namespace
+{
+std::vector<calc::Program> compile_all(const std::vector<const char*>& texts)
+{
+    std::vector<calc::Program> programs;
+    for (const char* text : texts)
+    {
+        programs.push_back(calc::Program::compile(*calc::parse(text)));
+    }
+    return programs;
+}
+}  // namespace
+
+TEST(executor, matches_eval_batch_for_every_program)
+{
+    const std::size_t rows = 5000;
+    std::vector<double> x(rows);
+    std::vector<double> y(rows);
+    for (std::size_t i = 0; i < rows; ++i)
+    {
+        x[i] = 0.5 * i - 100;
+        y[i] = std::sin(0.01 * i);
+    }
+    const std::vector<calc::Column> columns{ { "x", x }, { "y", y } };
+    const calc::Context ctx{ { "a", 3 } };
+    const auto programs = compile_all({ "x + y", "a * x - y", "(t = x * y) + t", "max(x, y, a)", "x > a" });
+
+    // One spare double in front, so that every output starts off a cache-line boundary.
+    std::vector<std::vector<double>> storage(programs.size(), std::vector<double>(rows + 1));
+    std::vector<calc::Span<double>> outputs;
+    for (auto& buffer : storage)
+    {
+        outputs.emplace_back(buffer.data() + 1, rows);
+    }
+
+    calc::Executor executor{ 4, calc::batch_block_size };
+    executor.run(programs, columns, outputs, ctx);
+
+    for (std::size_t k = 0; k < programs.size(); ++k)
+    {
+        std::vector<double> expected(rows);
+        calc::eval_batch(programs[k], columns, expected, ctx);
+        ASSERT_THAT(std::vector<double>(outputs[k].begin(), outputs[k].end()), ContainerEq(expected)) << "program " << k;
+    }
+}
+
+TEST(executor, can_run_repeatedly)
+{
+    const std::vector<double> x{ 1, 2, 3 };
+    const std::vector<calc::Column> columns{ { "x", x } };
+    const auto programs = compile_all({ "x * 2", "x + 1" });
+    std::vector<double> first(3);
+    std::vector<double> second(3);
+    const std::vector<calc::Span<double>> outputs{ first, second };
+
+    calc::Executor executor{ 2 };
+    for (int i = 0; i < 10; ++i)
+    {
+        std::fill(first.begin(), first.end(), 0);
+        executor.run(programs, columns, outputs);
+        ASSERT_THAT(first, ElementsAre(2, 4, 6));
+        ASSERT_THAT(second, ElementsAre(2, 3, 4));
+    }
+}
+
+TEST(executor, rethrows_task_errors)
+{
+    const std::vector<double> x(1000, 1.0);
+    const std::vector<calc::Column> columns{ { "x", x } };
+    const auto programs = compile_all({ "x + 1", "x + undefined_in_executor" });
+    std::vector<double> first(1000);
+    std::vector<double> second(1000);
+    const std::vector<calc::Span<double>> outputs{ first, second };
+
+    calc::Executor executor{ 3, calc::batch_block_size };
+    ASSERT_THROW(executor.run(programs, columns, outputs), std::runtime_error);
+    ASSERT_THROW(executor.run(programs, columns, {}), std::invalid_argument);
+}
@@ -0,0 +1,75 @@
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <thread>
+
+#include "expression_cache.hpp"
+
+using namespace ::testing;
+
+TEST(expression_cache, returns_shared_entry_for_same_normalized_text)
+{
+    calc::ExpressionCache cache{ calc::parse, 4 };
+    const auto first = cache.get("1 + 2");
+    const auto second = cache.get("  1 + 2\t");
+    ASSERT_THAT(first, NotNull());
+    ASSERT_THAT(second.get(), first.get());
+
+    calc::Context ctx{};
+    ASSERT_THAT(first->eval(ctx), 3);
+    ASSERT_THAT(cache.stats().hits, 1);
+    ASSERT_THAT(cache.stats().misses, 1);
+}
+
+TEST(expression_cache, evicts_least_recently_used)
+{
+    calc::ExpressionCache cache{ calc::parse, 2 };
+    const auto a = cache.get("1");
+    cache.get("2");
+    cache.get("1");
+    cache.get("3");
+    ASSERT_THAT(cache.size(), 2);
+    ASSERT_THAT(cache.stats().evictions, 1);
+    ASSERT_THAT(cache.get("1").get(), a.get());
+    cache.get("2");
+    ASSERT_THAT(cache.stats().misses, 4);
+    ASSERT_THAT(cache.stats().evictions, 2);
+}
+
+TEST(expression_cache, does_not_cache_unparsable_text)
+{
+    calc::ExpressionCache cache{ calc::parse, 2 };
+    ASSERT_THAT(cache.get("1 +"), IsNull());
+    ASSERT_THAT(cache.size(), 0);
+    ASSERT_THROW(cache.get("(1"), std::runtime_error);
+}
+
+TEST(expression_cache, concurrent_lookups)
+{
+    calc::ExpressionCache cache{ calc::parse, 8 };
+    std::vector<std::thread> threads;
+    std::atomic<int> failures{ 0 };
+    for (int t = 0; t < 8; ++t)
+    {
+        threads.emplace_back([&, t]() {
+            calc::Context ctx{};
+            for (int i = 0; i < 200; ++i)
+            {
+                const int n = (i + t) % 12;
+                const auto expr = cache.get(std::to_string(n) + " * 2");
+                if (!expr || expr->eval(ctx) != n * 2)
+                {
+                    ++failures;
+                }
+            }
+        });
+    }
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+    ASSERT_THAT(failures.load(), 0);
+    ASSERT_THAT(cache.size(), Le(8u));
+    const auto stats = cache.stats();
+    ASSERT_THAT(stats.hits + stats.misses, 8 * 200);
+}
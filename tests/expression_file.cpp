@@ -0,0 +1,81 @@
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+#include "calc.hpp"
+#include "expression_file.hpp"
+
+using namespace ::testing;
+
+namespace
+{
+std::string write_file(const std::string& name, const std::string& contents)
+{
+    const std::string path = testing::TempDir() + name;
+    std::ofstream file{ path, std::ios::binary };
+    file << contents;
+    return path;
+}
+
+}  // namespace
+
+TEST(expression_file, parses_each_line_skipping_blanks_and_comments)
+{
+    const auto path = write_file("expression_file_lines.txt", "# rules\nx + 1\n\n  2 * y  \r\n# done\nmax(x, y)");
+    const calc::ExpressionFile file{ path, calc::parse };
+    calc::Context ctx{ { "x", 3 }, { "y", 5 } };
+    ASSERT_THAT(file.size(), 3);
+    ASSERT_THAT(file.text(1), "2 * y");
+    ASSERT_THAT(file[0].eval(ctx), 4);
+    ASSERT_THAT(file[1].eval(ctx), 10);
+    ASSERT_THAT(file[2].eval(ctx), 5);
+    std::remove(path.c_str());
+}
+
+TEST(expression_file, parallel_load_matches_sequential_load)
+{
+    std::string contents;
+    for (int i = 0; i < 1000; ++i)
+    {
+        contents += "x * " + std::to_string(i) + " + y\n";
+    }
+    const auto path = write_file("expression_file_parallel.txt", contents);
+    const calc::ExpressionFile sequential{ path, calc::parse };
+    const calc::ExpressionFile parallel{ path, calc::parse, 4 };
+    calc::Context ctx{ { "x", 2 }, { "y", 1 } };
+    ASSERT_THAT(parallel.size(), 1000);
+    for (std::size_t i = 0; i < sequential.size(); ++i)
+    {
+        ASSERT_THAT(parallel[i].eval(ctx), sequential[i].eval(ctx));
+    }
+    std::remove(path.c_str());
+}
+
+TEST(expression_file, names_the_first_bad_line)
+{
+    const auto path = write_file("expression_file_bad.txt", "x + 1\n\nx +\nx * 2\n(x\n");
+    for (const std::size_t threads : { 1, 3 })
+    {
+        try
+        {
+            calc::ExpressionFile{ path, calc::parse, threads };
+            FAIL();
+        }
+        catch (const std::runtime_error& ex)
+        {
+            ASSERT_THAT(ex.what(), StartsWith(path + ":3: "));
+        }
+    }
+    std::remove(path.c_str());
+}
+
+TEST(expression_file, loads_empty_file)
+{
+    const auto path = write_file("expression_file_empty.txt", "");
+    ASSERT_THAT(calc::ExpressionFile(path, calc::parse, 4).size(), 0);
+    std::remove(path.c_str());
+}
@@ -0,0 +1,102 @@
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include "calc.hpp"
+#include "history.hpp"
+
+using namespace ::testing;
+
+namespace
+{
+calc::Program compile(std::string_view text)
+{
+    return calc::Program::compile(*calc::parse(text));
+}
+
+std::string read_file(const std::string& path)
+{
+    std::ifstream file{ path, std::ios::binary };
+    std::ostringstream os;
+    os << file.rdbuf();
+    return os.str();
+}
+
+}  // namespace
+
+TEST(history, keeps_entry_numbers_when_dropping_the_oldest)
+{
+    calc::History history{ 2 };
+    history.push("1", compile("1"), 1);
+    history.push("2", compile("2"), 2);
+    history.push("3", compile("3"), 3);
+    ASSERT_THAT(history.first(), 1);
+    ASSERT_THAT(history.end(), 3);
+    ASSERT_THAT(history[1].text, "2");
+    ASSERT_THAT(history[2].result, 3);
+    ASSERT_THROW(history[0], std::out_of_range);
+    ASSERT_THROW(history[3], std::out_of_range);
+}
+
+TEST(history, reruns_entries_against_the_current_variables)
+{
+    calc::History history{ 10 };
+    calc::Context ctx{ { "x", 2 } };
+    history.push("x * 3", compile("x * 3"), 6);
+    history.push("y = x + 1", compile("y = x + 1"), 3);
+    ctx.set("x", 5);
+    ASSERT_THAT(history.rerun(0, ctx), 15);
+    ASSERT_THAT(history.rerun(1, ctx), 6);
+    ASSERT_THAT(history[0].result, 15);
+    ASSERT_THAT(*ctx.get("y"), 6);
+}
+
+TEST(history, appends_to_its_file_and_loads_it_back)
+{
+    const std::string path = testing::TempDir() + "history_lines.txt";
+    std::remove(path.c_str());
+    {
+        calc::History history{ path, calc::parse, 10 };
+        ASSERT_THAT(history.end(), 0);
+        history.push("x + 1", compile("x + 1"), 1);
+        history.push("max(x, 2)", compile("max(x, 2)"), 2);
+        history.flush();
+        ASSERT_THAT(read_file(path), "x + 1\nmax(x, 2)\n");
+    }
+    {
+        calc::History history{ path, calc::parse, 10, 2 };
+        ASSERT_THAT(history.end(), 2);
+        ASSERT_THAT(history[1].text, "max(x, 2)");
+        ASSERT_TRUE(std::isnan(history[1].result));
+        calc::Context ctx{ { "x", 4 } };
+        ASSERT_THAT(history.rerun(0, ctx), 5);
+        ASSERT_THAT(history.rerun(1, ctx), 4);
+        history.push("x * 2", compile("x * 2"), 8);
+    }
+    {
+        // Only the last max_size lines are loaded, under their numbers in the file.
+        const calc::History history{ path, calc::parse, 2 };
+        ASSERT_THAT(history.first(), 1);
+        ASSERT_THAT(history.end(), 3);
+        ASSERT_THAT(history[2].text, "x * 2");
+    }
+    std::remove(path.c_str());
+}
+
+TEST(history, rejects_files_it_cannot_use)
+{
+    const std::string path = testing::TempDir() + "history_broken.txt";
+    {
+        std::ofstream file{ path, std::ios::binary };
+        file << "x + 1\nx +\n";
+    }
+    ASSERT_THROW((calc::History{ path, calc::parse, 10 }), std::runtime_error);
+    std::remove(path.c_str());
+    ASSERT_THROW((calc::History{ testing::TempDir() + "no_such_dir/history.txt", calc::parse, 10 }), std::runtime_error);
+}
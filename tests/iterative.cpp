@@ -0,0 +1,169 @@
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <pthread.h>
+
+#include <functional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include "calc.hpp"
+#include "derivative.hpp"
+#include "iterative.hpp"
+#include "optimize.hpp"
+#include "program.hpp"
+#include "shared_program.hpp"
+
+using namespace ::testing;
+
+namespace
+{
+// Runs body on a thread whose stack is far too small for recursing once per node of the trees below.
+void run_on_small_stack(const std::function<void()>& body)
+{
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 128 * 1024);
+    pthread_t thread;
+    const auto run = [](void* arg) -> void* {
+        (*static_cast<const std::function<void()>*>(arg))();
+        return nullptr;
+    };
+    ASSERT_THAT(pthread_create(&thread, &attr, run, const_cast<std::function<void()>*>(&body)), 0);
+    pthread_join(thread, nullptr);
+    pthread_attr_destroy(&attr);
+}
+
+std::string repeat(const std::string& text, int count)
+{
+    std::string res;
+    for (int i = 0; i < count; ++i)
+    {
+        res += text;
+    }
+    return res;
+}
+
+std::string printed(const calc::Expr& expr)
+{
+    std::ostringstream os;
+    expr.print(os, 0);
+    return os.str();
+}
+
+std::string printed_iterative(const calc::Expr& expr)
+{
+    std::ostringstream os;
+    calc::print_iterative(expr, os);
+    return os.str();
+}
+
+}  // namespace
+
+TEST(iterative, parses_evaluates_and_releases_deep_trees_on_a_small_stack)
+{
+    run_on_small_stack([] {
+        calc::Context ctx{ { "x", 2 } };
+        const int n = 50000;
+
+        auto chain = calc::parse("x" + repeat(" + 1", n));
+        EXPECT_THAT(calc::eval_iterative(*chain, ctx), n + 2);
+        EXPECT_THAT(calc::Program::compile(*chain).run(ctx), n + 2);
+        EXPECT_THAT(calc::eval_iterative(*calc::optimize(*chain), ctx), n + 2);
+        EXPECT_THAT(printed(*calc::optimize(*chain, { &ctx })), std::to_string(n + 2) + "\n");
+        chain.reset();
+
+        const auto power = calc::parse(repeat("1 ^ ", n) + "x");
+        EXPECT_THAT(calc::eval_iterative(*power, ctx), 1);
+        EXPECT_THAT(calc::Program::compile(*power).run(ctx), 1);
+
+        const auto parens = calc::parse(repeat("(", n) + "x" + repeat(")", n));
+        EXPECT_THAT(calc::eval_iterative(*parens, ctx), 2);
+
+        const auto negations = calc::parse(repeat("-", n + 1) + "x");
+        EXPECT_THAT(calc::eval_iterative(*negations, ctx), -2);
+
+        const auto calls = calc::parse(repeat("max(1, ", n) + "x" + repeat(")", n));
+        EXPECT_THAT(calc::eval_iterative(*calls, ctx), 2);
+        EXPECT_THAT(calc::Program::compile(*calls).run(ctx), 2);
+        EXPECT_THAT(calc::eval_iterative(*calc::optimize(*calls), ctx), 2);
+
+        const auto assignments = calc::parse(repeat("y = ", n) + "x");
+        EXPECT_THAT(calc::eval_iterative(*assignments, ctx), 2);
+        EXPECT_THAT(ctx.get("y"), Optional(2.0));
+        EXPECT_THAT(calc::eval_iterative(*calc::optimize(*assignments, { &ctx }), ctx), 2);
+
+        const auto conditionals = calc::parse(repeat("1 ? ", n) + "x" + repeat(" : 0", n));
+        EXPECT_THAT(printed(*calc::optimize(*conditionals)), "x\n");
+    });
+}
+
+TEST(iterative, compiles_shared_programs_of_deep_trees_on_a_small_stack)
+{
+    run_on_small_stack([] {
+        calc::Context ctx{ { "x", 2 } };
+        const int n = 50000;
+        std::vector<calc::ExprPtr> exprs;
+        exprs.push_back(calc::parse("y = x" + repeat(" + x", n) + " + 1"));
+        exprs.push_back(calc::parse(repeat("max(1, ", n) + "y" + repeat(")", n)));
+        // Every branch adds a guard, so these stay shorter.
+        exprs.push_back(calc::parse(repeat("x > 0 ? ", 2000) + "y" + repeat(" : 0", 2000)));
+        exprs.push_back(calc::parse("x" + repeat(" && x", 2000)));
+        const auto program = calc::SharedProgram::compile(exprs);
+        std::vector<double> results(exprs.size());
+        program.run(ctx, results);
+        EXPECT_THAT(results, ElementsAre(2 * (n + 1) + 1, 2 * (n + 1) + 1, 2 * (n + 1) + 1, 1));
+    });
+}
+
+TEST(iterative, differentiates_deep_trees_on_a_small_stack)
+{
+    run_on_small_stack([] {
+        calc::Parser parser;
+        parser.register_function("square", [](const std::vector<double>& args) { return args[0] * args[0]; });
+        calc::Differentiator differentiator{ parser };
+        differentiator.register_rule("square", { "a" }, { "2 * a" });
+
+        calc::Context ctx{ { "x", 2 }, { "y", 3 } };
+        const int n = 50000;
+        const auto chain = parser("x * y" + repeat(" + x", n));
+        EXPECT_THAT(calc::eval_iterative(*differentiator.derivative(*chain, "x"), ctx), n + 3);
+        EXPECT_THAT(calc::eval_iterative(*differentiator.derivative(*chain, "y"), ctx), 2);
+        // The rule's partial gets a copy of the whole chain as its argument.
+        const auto call = parser("square(x" + repeat(" + y", n) + ")");
+        EXPECT_THAT(calc::eval_iterative(*differentiator.derivative(*call, "x"), ctx), 2 * (2 + 3 * n));
+
+        const auto gradient = calc::Gradient::compile(*chain, { "x", "y" }, differentiator);
+        std::vector<double> results(3);
+        gradient.run(ctx, results);
+        EXPECT_THAT(results, ElementsAre(6 + 2 * n, n + 3, 2));
+    });
+}
+
+TEST(iterative, matches_recursive_eval_and_print)
+{
+    for (const char* text : { "1", "-x + 2 * y", "z = max(x, y, 3) ^ 2 - sqrt(x) / sum()", "sin(cos(x)) == 1 - -y",
+                              "x > 1 ? undefined : y < 0 || y && (z = 1)" })
+    {
+        const auto expr = calc::parse(text);
+        calc::Context expected_ctx{ { "x", 0.5 }, { "y", 3 } };
+        calc::Context ctx = expected_ctx;
+        ASSERT_THAT(calc::eval_iterative(*expr, ctx), DoubleEq(expr->eval(expected_ctx)));
+        ASSERT_THAT(printed_iterative(*expr), printed(*expr));
+    }
+}
+
+TEST(iterative, max_depth_rejects_deeper_input)
+{
+    for (const auto engine : { calc::Parser::Engine::legacy, calc::Parser::Engine::pratt })
+    {
+        calc::Parser parser{ engine };
+        parser.set_max_depth(64);
+        calc::Context ctx{};
+        ASSERT_THAT(parser(repeat("(", 60) + "1" + repeat(")", 60))->eval(ctx), 1);
+        ASSERT_THAT(parser("2" + repeat(" * 1", 40))->eval(ctx), 2);
+        ASSERT_THROW(parser(repeat("(", 200) + "1" + repeat(")", 200) + repeat(" + 1", 100)), std::runtime_error);
+        ASSERT_THROW(parser("2" + repeat(" * 1", 100)), std::runtime_error);
+    }
+}
@@ -0,0 +1,162 @@
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "calc.hpp"
+#include "jit.hpp"
+
+using namespace ::testing;
+
+struct jit_matches_tree : TestWithParam<const char*>
+{
+};
+
+TEST_P(jit_matches_tree, same_result_as_expr_eval)
+{
+    const auto expr = calc::parse(GetParam());
+    ASSERT_THAT(expr, NotNull());
+    const auto jit = calc::JitProgram::compile(*expr);
+
+    for (const double x : { 1.5, -0.25, 0.0, std::nan("") })
+    {
+        calc::Context tree_ctx{ { "x", x }, { "y", -2.0 } };
+        calc::Context jit_ctx = tree_ctx;
+        const double expected = expr->eval(tree_ctx);
+        if (std::isnan(expected))
+        {
+            ASSERT_THAT(jit.run(jit_ctx), IsNan()) << "x = " << x;
+        }
+        else
+        {
+            ASSERT_THAT(jit.run(jit_ctx), DoubleEq(expected)) << "x = " << x;
+        }
+        ASSERT_THAT(jit_ctx.defined, ContainerEq(tree_ctx.defined));
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    expressions,
+    jit_matches_tree,
+    Values(
+        "2.1 + 3.2",
+        "(2 + 3) * (3 - 1) - 1",
+        "2 * 10 ^ 3 - x ^ y",
+        "-(x + 3) / y",
+        "+x",
+        "x < y",
+        "x <= 1.5",
+        "x > y",
+        "x >= 1.5",
+        "x == 1.5",
+        "x != 1.5",
+        "sum(1, x, y, max(x, y, 7))",
+        "sum()",
+        "sqrt(16) + sin(x) * cos(y) - min(x, y) + sqrt(x)",
+        "z = x * 2",
+        "a = b = x ^ y",
+        "(t = x * y) + t",
+        "x ? y : 2",
+        "x >= 0 ? (x < 1 ? x : y) : y * 2",
+        "(x > 0 && y < 0) + (x || y) * 2 + (0 && x) + (x || 0)",
+        "x > 0 ? (z = 1) : 2"));
+
+#if defined(CPP_CALCULATOR_JIT) && defined(__x86_64__) && defined(__linux__)
+TEST(jit, generates_native_code)
+{
+    const auto jit = calc::JitProgram::compile(*calc::parse("x * 2"));
+    ASSERT_TRUE(jit.is_native());
+
+    calc::Context ctx{ { "x", 4 } };
+    ASSERT_THAT(jit.run(ctx), 8);
+}
+
+TEST(jit, interprets_programs_that_need_a_deep_stack)
+{
+    std::string text = "x";
+    for (int i = 0; i < 2000; ++i)
+    {
+        text = "1 + (" + text + ")";
+    }
+    const auto jit = calc::JitProgram::compile(*calc::parse(text));
+    ASSERT_THAT(jit.program().stack_size, Gt(1000));
+    ASSERT_FALSE(jit.is_native());
+
+    calc::Context ctx{ { "x", 4 } };
+    ASSERT_THAT(jit.run(ctx), 2004);
+}
+#endif
+
+TEST(jit, undefined_variable_throws)
+{
+    calc::Context ctx{};
+    const auto jit = calc::JitProgram::compile(*calc::parse("x + 1"));
+    ASSERT_THROW(jit.run(ctx), std::runtime_error);
+}
+
+TEST(jit, try_run_reports_undefined_variables)
+{
+    const auto jit = calc::JitProgram::compile(*calc::parse("x + y * 2"));
+    calc::Context ctx{ { "x", 1.0 } };
+    const auto res = calc::try_eval_with(ctx, [&](calc::Context& ctx) { return jit.run(ctx); });
+    ASSERT_FALSE(res);
+    ASSERT_THAT(res.error, calc::EvalError::undefined_variable);
+    ASSERT_THAT(res.slot, calc::symbols().intern("y"));
+    ASSERT_THAT(res.value, IsNan());
+}
+
+TEST(jit, user_function_errors_are_rethrown)
+{
+    calc::Parser parser;
+    parser.register_function("fail", [](const std::vector<double>&) -> double { throw std::domain_error{ "fail" }; });
+    parser.register_function("twice", [](const std::vector<double>& args) { return 2 * args.at(0); });
+    calc::Context ctx{ { "x", 3 } };
+
+    ASSERT_THAT(calc::JitProgram::compile(*parser("twice(x) + 1")).run(ctx), 7);
+    ASSERT_THROW(calc::JitProgram::compile(*parser("1 + fail(x)")).run(ctx), std::domain_error);
+    ASSERT_THAT(calc::JitProgram::compile(*parser("twice(x)")).run(ctx), 6);
+}
+
+TEST(jit, shared_between_threads)
+{
+    const auto jit = calc::JitProgram::compile(*calc::parse("t = x * x + sqrt(x)"));
+    std::vector<std::thread> threads;
+    std::vector<double> results(16);
+    for (std::size_t i = 0; i < results.size(); ++i)
+    {
+        threads.emplace_back(
+            [&, i]
+            {
+                calc::Context ctx{ { "x", static_cast<double>(i) } };
+                for (int k = 0; k < 1000; ++k)
+                {
+                    results[i] = jit.run(ctx);
+                }
+            });
+    }
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+    for (std::size_t i = 0; i < results.size(); ++i)
+    {
+        ASSERT_THAT(results[i], DoubleEq(i * i + std::sqrt(i)));
+    }
+}
+
+TEST(jit, branches_not_taken_may_read_undefined_variables)
+{
+    const auto jit = calc::JitProgram::compile(*calc::parse("x > 0 ? x : undefined"));
+#if defined(CPP_CALCULATOR_JIT) && defined(__x86_64__) && defined(__linux__)
+    ASSERT_TRUE(jit.is_native());
+#endif
+    calc::Context ctx{ { "x", 1.0 } };
+    ASSERT_THAT(jit.run(ctx), 1);
+    ctx.set("x", -1.0);
+    ASSERT_THROW(jit.run(ctx), std::runtime_error);
+    ctx.set("undefined", 7.0);
+    ASSERT_THAT(jit.run(ctx), 7);
+}
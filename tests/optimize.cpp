@@ -0,0 +1,101 @@
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <sstream>
+
+#include "calc.hpp"
+#include "optimize.hpp"
+
+using namespace ::testing;
+
+std::string print(const calc::Expr& expr)
+{
+    std::ostringstream os;
+    expr.print(os, 0);
+    return os.str();
+}
+
+std::string optimized(std::string_view text, const calc::OptimizeOptions& options = {})
+{
+    return print(*calc::optimize(*calc::parse(text), options));
+}
+
+TEST(optimize, folds_constant_subtrees)
+{
+    ASSERT_THAT(optimized("2 * 3 + 4"), "10\n");
+    ASSERT_THAT(optimized("x + 2 * 3"), "+\n  x\n  6\n");
+    ASSERT_THAT(optimized("-(1 + 2)"), "-3\n");
+}
+
+TEST(optimize, folds_pure_function_calls_with_constant_arguments)
+{
+    ASSERT_THAT(optimized("x * sqrt(16)"), "*\n  x\n  4\n");
+    ASSERT_THAT(optimized("max(1, 2, sum(1, 2))"), "3\n");
+    ASSERT_THAT(optimized("sin(x)"), "sin\n  x\n");
+}
+
+TEST(optimize, does_not_fold_user_functions)
+{
+    calc::Parser parser;
+    parser.register_function("next", [](const std::vector<double>&) { return 1.0; });
+    ASSERT_THAT(print(*calc::optimize(*parser("next()"))), "next\n");
+}
+
+TEST(optimize, removes_identities)
+{
+    ASSERT_THAT(optimized("x * 1"), "x\n");
+    ASSERT_THAT(optimized("1 * x"), "x\n");
+    ASSERT_THAT(optimized("x + -0"), "x\n");
+    ASSERT_THAT(optimized("-0 + x"), "x\n");
+    ASSERT_THAT(optimized("x - (2 - 2)"), "x\n");
+    ASSERT_THAT(optimized("x / 1"), "x\n");
+    ASSERT_THAT(optimized("x ^ 1"), "x\n");
+    ASSERT_THAT(optimized("--x"), "x\n");
+    ASSERT_THAT(optimized("+x"), "x\n");
+    ASSERT_THAT(optimized("0 - x"), "-\n  0\n  x\n");
+}
+
+TEST(optimize, keeps_the_sign_of_zero)
+{
+    // -0 + 0 is +0, so only -0 is an identity of addition, and only +0 of subtraction.
+    ASSERT_THAT(optimized("x + 0"), "+\n  x\n  0\n");
+    ASSERT_THAT(optimized("0 + x"), "+\n  0\n  x\n");
+    ASSERT_THAT(optimized("x - -0"), "-\n  x\n  -0\n");
+    for (const auto text : { "x + 0", "0 + x", "x - -0", "x + -0", "x - 0" })
+    {
+        calc::Context ctx{ { "x", -0.0 } };
+        const auto expr = calc::parse(text);
+        ASSERT_THAT(std::signbit(calc::optimize(*expr)->eval(ctx)), std::signbit(expr->eval(ctx))) << text;
+    }
+}
+
+TEST(optimize, keeps_only_the_branch_a_constant_condition_selects)
+{
+    ASSERT_THAT(optimized("1 < 2 ? x : y"), "x\n");
+    ASSERT_THAT(optimized("0 ? x : y - 0"), "y\n");
+    ASSERT_THAT(optimized("x ? 1 + 1 : y"), "?\n  x\n  2\n  y\n");
+    ASSERT_THAT(optimized("0 && x"), "0\n");
+    ASSERT_THAT(optimized("2 || x"), "1\n");
+    ASSERT_THAT(optimized("2 && 3"), "1\n");
+    ASSERT_THAT(optimized("x || 1 * 0"), "||\n  x\n  0\n");
+}
+
+TEST(optimize, folds_context_constants_on_request)
+{
+    const calc::Context ctx{ { "pi", 3.0 } };
+    ASSERT_THAT(optimized("2 * pi / 4 * x"), "*\n  /\n    *\n      2\n      pi\n    4\n  x\n");
+    ASSERT_THAT(optimized("2 * pi / 4 * x", { &ctx }), "*\n  1.5\n  x\n");
+    ASSERT_THAT(optimized("(pi = 4) + pi", { &ctx }), "+\n  pi\n    4\n  pi\n");
+}
+
+TEST(optimize, keeps_results)
+{
+    for (const auto text : { "2 * 10 ^ 3 - x", "(x = 3) * x + 0", "sum(x, 1 * 2, --x) / 1" })
+    {
+        calc::Context lhs{ { "x", 2.0 } };
+        calc::Context rhs = lhs;
+        const auto expr = calc::parse(text);
+        ASSERT_THAT(calc::optimize(*expr)->eval(lhs), DoubleEq(expr->eval(rhs))) << text;
+    }
+}
@@ -2,6 +2,7 @@
 #include <gtest/gtest.h>
 
 #include "calc.hpp"
+#include "expressions.hpp"
 
 double eval(std::string_view text)
 {
@@ -56,4 +57,367 @@ TEST(parser, operator_precedence)
     ASSERT_THAT(eval("+(1 + 3)"), 4);
     ASSERT_THAT(eval("-(1 + 3)"), -4);
     ASSERT_THAT(eval("-2 * 3"), -6);
-}
\ No newline at end of file
+}
+
+struct parser_engine : TestWithParam<calc::Parser::Engine>
+{
+    calc::Parser parse{ GetParam() };
+    calc::Context ctx{};
+
+    double eval(std::string_view text)
+    {
+        const auto expr = parse(text);
+        if (!expr)
+        {
+            throw std::runtime_error{ "cannot parse '" + std::string{ text } + "'" };
+        }
+        return expr->eval(ctx);
+    }
+};
+
+TEST_P(parser_engine, empty_string_returns_null)
+{
+    ASSERT_THAT(parse(""), IsNull());
+    ASSERT_THAT(parse("    "), IsNull());
+}
+
+TEST_P(parser_engine, on_invalid_parens_throws_exception)
+{
+    ASSERT_THROW(parse("()("), std::runtime_error);
+    ASSERT_THROW(parse("(1 + 2))"), std::runtime_error);
+}
+
+TEST_P(parser_engine, binary_operators)
+{
+    ASSERT_THAT(eval("2.1 + 3.2"), DoubleEq(5.3));
+    ASSERT_THAT(eval("2.1 - 3.2"), DoubleEq(-1.1));
+    ASSERT_THAT(eval("2.1 * 3.2"), DoubleEq(6.72));
+    ASSERT_THAT(eval("6.3 / 2.1"), DoubleEq(3.00));
+    ASSERT_THAT(eval("1 - 2 - 3"), -4);
+    ASSERT_THAT(eval("12 / 2 / 3"), 2);
+    ASSERT_THAT(eval("2 ^ 3 ^ 2"), 512);
+}
+
+TEST_P(parser_engine, comparison_operators)
+{
+    ASSERT_THAT(eval("1 + 1 > 1"), 1);
+    ASSERT_THAT(eval("1 < 2 - 3"), 0);
+}
+
+TEST_P(parser_engine, operator_precedence)
+{
+    ASSERT_THAT(eval("(2 + 3) * (3 - 1) - 1"), 9);
+    ASSERT_THAT(eval("2 * 10 ^ 3"), 8000);
+    ASSERT_THAT(eval("+(1 + 3)"), 4);
+    ASSERT_THAT(eval("-(1 + 3)"), -4);
+    ASSERT_THAT(eval("-2 * 3"), -6);
+    ASSERT_THAT(eval("((1 + 2)) * ((3))"), 9);
+}
+
+TEST_P(parser_engine, number_literals)
+{
+    ASSERT_THAT(eval("1.5e3"), 1500);
+    ASSERT_THAT(eval(".5"), 0.5);
+    ASSERT_THAT(eval("0x10"), 16);
+    ASSERT_THAT(std::isinf(eval("inf")), true);
+}
+
+TEST_P(parser_engine, functions)
+{
+    ASSERT_THAT(eval("sum(1, 2, 3)"), 6);
+    ASSERT_THAT(eval("max(1, sqrt(16), 2)"), 4);
+    ASSERT_THAT(eval("min(3, max(1, 2))"), 2);
+    ASSERT_THAT(eval("2 * cos(0) + sin(0)"), 2);
+    ASSERT_THAT(parse("unknown(1)"), IsNull());
+}
+
+TEST_P(parser_engine, variables_and_assignment)
+{
+    ASSERT_THAT(eval("x = 2 + 3"), 5);
+    ASSERT_THAT(ctx.get("x"), Optional(5.0));
+    ASSERT_THAT(eval("x * 2 - x"), 5);
+}
+
+TEST_P(parser_engine, undefined_variable_throws_on_eval)
+{
+    ASSERT_THROW(eval("2 * undefined"), std::runtime_error);
+}
+
+TEST_P(parser_engine, malformed_input_returns_null)
+{
+    ASSERT_THAT(parse("2 +"), IsNull());
+    ASSERT_THAT(parse("2 3"), IsNull());
+    ASSERT_THAT(parse("2 # 3"), IsNull());
+}
+
+TEST_P(parser_engine, arena_parse_matches_heap_parse)
+{
+    calc::Context arena_ctx{};
+    for (const auto text : { "2 * 10 ^ 3", "max(1, sqrt(16), 2) + sum()", "y = -(1 + 3) * 2", "y * y" })
+    {
+        const auto arena_expr = parse.parse_in_arena(text);
+        ASSERT_THAT(arena_expr, IsTrue()) << text;
+        ASSERT_THAT(arena_expr->eval(arena_ctx), eval(text)) << text;
+    }
+    ASSERT_THAT(parse.parse_in_arena("2 +"), IsFalse());
+    ASSERT_THAT(parse.parse_in_arena(""), IsFalse());
+}
+
+TEST_P(parser_engine, builtins_get_specialized_nodes)
+{
+    using namespace calc::expressions;
+    const auto sum = parse("1 + (-x)");
+    const auto add = dynamic_cast<const BuiltinBinaryOp<calc::BinaryOpKind::add>*>(sum.get());
+    ASSERT_THAT(add, NotNull());
+    ASSERT_THAT(dynamic_cast<const BuiltinUnaryOp<calc::UnaryOpKind::neg>*>(add->rhs.get()), NotNull());
+    ASSERT_THAT(dynamic_cast<const UnaryFuncCall*>(parse("sin(x)").get()), NotNull());
+    ASSERT_THAT(dynamic_cast<const UnaryFuncCall*>(parse("max(x)").get()), IsNull());
+}
+
+TEST_P(parser_engine, user_functions_use_generic_path)
+{
+    parse.register_function("mean", [](const std::vector<double>& args) { return (args.at(0) + args.at(1)) / 2; });
+    ASSERT_THAT(eval("mean(1, 2) * 2"), 3);
+    ASSERT_THAT(eval("mean(sum(1, 2, 3, 4, 5, 6, 7, 8, 9, 10), 1)"), 28);
+}
+
+TEST_P(parser_engine, conditional_and_logical_operators)
+{
+    ASSERT_THAT(eval("1 < 2 ? 10 : 20"), 10);
+    ASSERT_THAT(eval("0 ? 10 : 1 ? 20 : 30"), 20);
+    ASSERT_THAT(eval("(1 ? 0 : 1) ? 10 : 20"), 20);
+    ASSERT_THAT(eval("1 ? 2 ? 3 : 4 : 5"), 3);
+    ASSERT_THAT(eval("1 + 1 ? 2 + 3 : 4"), 5);
+    ASSERT_THAT(eval("2 && 3"), 1);
+    ASSERT_THAT(eval("2 && 0"), 0);
+    ASSERT_THAT(eval("0 || -1"), 1);
+    ASSERT_THAT(eval("0 || 0"), 0);
+    ASSERT_THAT(eval("1 || 0 && 0"), 1);
+    ASSERT_THAT(eval("1 < 2 && 2 < 3"), 1);
+    ASSERT_THAT(eval("if(0, 1, 2) + if(3, 4, 5)"), 6);
+    ASSERT_THAT(eval("x = 0 ? 1 : 2"), 2);
+    ASSERT_THAT(eval("1 ? 0 || 1 : 2"), 1);
+    ASSERT_THAT(parse("1 ? 2"), IsNull());
+    ASSERT_THAT(parse("1 : 2"), IsNull());
+    ASSERT_THAT(parse("1 ? : 2"), IsNull());
+}
+
+TEST_P(parser_engine, branches_not_taken_are_not_evaluated)
+{
+    int calls = 0;
+    parse.register_function("count", [&](const std::vector<double>& args) { return ++calls, args.at(0); }, false);
+    ASSERT_THAT(eval("1 ? 2 : undefined"), 2);
+    ASSERT_THAT(eval("0 ? undefined : 3"), 3);
+    ASSERT_THAT(eval("0 && undefined"), 0);
+    ASSERT_THAT(eval("1 || undefined"), 1);
+    ASSERT_THAT(eval("if(1, 2, undefined)"), 2);
+    ASSERT_THAT(eval("0 ? count(1) : 1 || count(2)"), 1);
+    ASSERT_THAT(calls, 0);
+    ASSERT_THAT(eval("1 && count(2)"), 1);
+    ASSERT_THAT(calls, 1);
+    ASSERT_THROW(eval("0 ? 1 : undefined"), std::runtime_error);
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    engines,
+    parser_engine,
+    Values(calc::Parser::Engine::legacy, calc::Parser::Engine::pratt),
+    [](const TestParamInfo<calc::Parser::Engine>& info) { return info.param == calc::Parser::Engine::legacy ? "legacy" : "pratt"; });
+
+TEST(pratt_parser, parses_operands_the_legacy_parser_rejects)
+{
+    calc::Context ctx{};
+    ASSERT_THAT(calc::parse("2 * -3")->eval(ctx), -6);
+    ASSERT_THAT(calc::parse("1 == 1")->eval(ctx), 1);
+    ASSERT_THAT(calc::parse("2 <= 1")->eval(ctx), 0);
+    ASSERT_THAT(calc::parse("a = b = 4")->eval(ctx), 4);
+    ASSERT_THAT(ctx.get("a"), Optional(4.0));
+}
+
+TEST(pratt_parser, long_chain)
+{
+    std::string text = "1";
+    for (int i = 0; i < 10000; ++i)
+    {
+        text += " + 1";
+    }
+    calc::Context ctx{};
+    ASSERT_THAT(calc::parse(text)->eval(ctx), 10001);
+}
+
+TEST(parse_stats, off_by_default)
+{
+    const calc::Parser parser;
+    parser("x + 1");
+    ASSERT_THAT(parser.stats().parses, 0);
+}
+
+TEST(parse_stats, counts_legacy_rescans)
+{
+    calc::Parser parser{ calc::Parser::Engine::legacy };
+    parser.set_collect_stats(true);
+    parser("(x + 1) * 2");
+    const auto stats = parser.stats();
+    ASSERT_THAT(stats.parses, 1);
+    ASSERT_THAT(stats.bytes, 11);
+    ASSERT_THAT(stats.failures, 0);
+    // "(x + 1) * 2", "2", "(x + 1)" -> "x + 1", "1", "x".
+    ASSERT_THAT(stats.parse_expr_calls, 5);
+    ASSERT_THAT(stats.max_depth, 3);
+    // The group "(x + 1)" is stepped over as a whole at the top level.
+    ASSERT_THAT(stats.operator_scan_bytes, 5 + 5 + 1);
+    ASSERT_THAT(stats.paren_scans, Ge(stats.parse_expr_calls));
+    ASSERT_THAT(stats.failed_attempts[calc::ParseStats::number], 3);
+    ASSERT_THAT(stats.failed_attempts[calc::ParseStats::binary_or_assignment], 1);
+    ASSERT_THAT(stats.rejected_numbers, 3);
+    ASSERT_THAT(stats.tokens, 0);
+
+    parser("x +");
+    ASSERT_THAT(parser.stats().parses, 2);
+    ASSERT_THAT(parser.stats().failures, 1);
+    parser.reset_stats();
+    ASSERT_THAT(parser.stats().parses, 0);
+}
+
+TEST(legacy_parser, deep_nesting_does_not_rescan)
+{
+    const int depth = 2000;
+    const std::string text = std::string(depth, '(') + "x" + std::string(depth, ')') + " + max((1), ((2)), (3, 4))";
+    calc::Parser parser{ calc::Parser::Engine::legacy };
+    parser.set_collect_stats(true);
+    calc::Context ctx{ { "x", 1 } };
+    ASSERT_THAT(parser(text)->eval(ctx), 5);
+    ASSERT_THAT(parser.stats().operator_scan_bytes, Lt(text.size()));
+    ASSERT_THAT(parser.stats().paren_scan_bytes, text.size());
+    ASSERT_THROW(parser(std::string(depth, '(') + "x" + std::string(depth - 1, ')')), std::runtime_error);
+    ASSERT_THROW(parser("(x))(" + std::string(depth, '(')), std::runtime_error);
+}
+
+TEST(parse_stats, counts_pratt_tokens_and_errors)
+{
+    calc::Parser parser{ calc::Parser::Engine::pratt };
+    parser.set_collect_stats(true);
+    parser("max(x, 2)");
+    ASSERT_THAT(parser.stats().tokens, 7);
+    ASSERT_THAT(parser.stats().parse_expr_calls, 0);
+    ASSERT_THROW(parser("(x"), std::runtime_error);
+    ASSERT_THAT(parser.stats().errors, 1);
+}
+
+TEST(parse_stats, hook_receives_each_parse)
+{
+    calc::Parser parser{ calc::Parser::Engine::legacy };
+    std::vector<std::pair<std::string, std::size_t>> calls;
+    parser.set_parse_hook([&](std::string_view text, const calc::ParseStats& stats) { calls.emplace_back(text, stats.parse_expr_calls); });
+    parser("1");
+    parser.parse_in_arena("1 + 2");
+    ASSERT_THAT(calls, ElementsAre(Pair("1", 1), Pair("1 + 2", 3)));
+    ASSERT_THAT(parser.stats().parses, 2);
+}
+
+TEST(context, variables_are_bound_to_slots)
+{
+    calc::Context ctx{ { "alpha", 1.0 }, { "beta", 2.0 } };
+    const auto alpha = calc::symbols().find("alpha");
+    ASSERT_THAT(alpha, Optional(_));
+    ASSERT_THAT(calc::symbols().intern("alpha"), *alpha);
+    ASSERT_THAT(calc::symbols().name(*alpha), "alpha");
+    ASSERT_THAT(ctx.get(*alpha), 1.0);
+    ASSERT_THAT(ctx.get("beta"), Optional(2.0));
+    ASSERT_THAT(ctx.get("gamma"), Eq(std::nullopt));
+
+    std::vector<std::pair<std::string, double>> vars;
+    for (const auto& [name, value] : ctx.vars())
+    {
+        vars.emplace_back(name, value);
+    }
+    ASSERT_THAT(vars, UnorderedElementsAre(Pair("alpha", 1.0), Pair("beta", 2.0)));
+}
+
+TEST(try_eval, reports_the_first_undefined_variable_instead_of_throwing)
+{
+    const auto expr = calc::parse("max(x, try_eval_missing, try_eval_other) + 1");
+    calc::Context ctx{ { "x", 2.0 } };
+    ASSERT_THROW(expr->eval(ctx), std::runtime_error);
+
+    const auto res = calc::try_eval(*expr, ctx);
+    ASSERT_FALSE(res);
+    ASSERT_THAT(res.error, calc::EvalError::undefined_variable);
+    ASSERT_THAT(calc::symbols().name(res.slot), "try_eval_missing");
+    ASSERT_THAT(res.value, IsNan());
+    ASSERT_THAT(ctx.status, IsNull());
+
+    ctx.set("try_eval_missing", 3.0);
+    ctx.set("try_eval_other", 4.0);
+    const auto ok = calc::try_eval(*expr, ctx);
+    ASSERT_TRUE(ok);
+    ASSERT_THAT(ok.value, 5.0);
+}
+
+TEST(arity, is_checked_when_parsing)
+{
+    for (const auto engine : { calc::Parser::Engine::legacy, calc::Parser::Engine::pratt })
+    {
+        calc::Parser parser{ engine };
+        parser.register_function(
+            "two", [](const std::vector<double>& args) { return args[0] + args[1]; }, false, calc::Arity::exactly(2));
+        parser.register_function(
+            "some", [](const std::vector<double>& args) { return args[0]; }, false, calc::Arity{ 1, 3 });
+        calc::Context ctx{};
+        ASSERT_THAT(parser("two(1, 2)")->eval(ctx), 3.0);
+        ASSERT_THAT(parser("some(1, 2, 3)")->eval(ctx), 1.0);
+        ASSERT_THAT(parser("sum()")->eval(ctx), 0.0);
+        ASSERT_THAT(
+            [&] { parser("two(1)"); },
+            ThrowsMessage<std::runtime_error>(StrEq("'two' takes 2 arguments, got 1")));
+        ASSERT_THAT(
+            [&] { parser("sin(1, 2)"); },
+            ThrowsMessage<std::runtime_error>(StrEq("'sin' takes 1 argument, got 2")));
+        ASSERT_THAT(
+            [&] { parser("some()"); },
+            ThrowsMessage<std::runtime_error>(StrEq("'some' takes 1 to 3 arguments, got 0")));
+        ASSERT_THAT(
+            [&] { parser("1 + sqrt()"); },
+            ThrowsMessage<std::runtime_error>(StrEq("'sqrt' takes 1 argument, got 0")));
+        ASSERT_THAT(
+            [&] { parser("max()"); },
+            ThrowsMessage<std::runtime_error>(StrEq("'max' takes at least 1 argument, got 0")));
+        ASSERT_THAT(
+            [&] { parser("2 * min()"); },
+            ThrowsMessage<std::runtime_error>(StrEq("'min' takes at least 1 argument, got 0")));
+    }
+}
+
+TEST(arena, deep_tree_is_released_without_recursion)
+{
+    std::string text = "1";
+    for (int i = 0; i < 20000; ++i)
+    {
+        text += " + 1";
+    }
+    calc::Context ctx{};
+    auto expr = calc::parse.parse_in_arena(text);
+    ASSERT_THAT(expr, IsTrue());
+    ASSERT_THAT(expr->eval(ctx), 20001);
+}
+
+TEST(parse_double, accepts_std_stod_literals)
+{
+    ASSERT_THAT(calc::parse_double("42"), Optional(42.0));
+    ASSERT_THAT(calc::parse_double("  -1.5e3"), Optional(-1500.0));
+    ASSERT_THAT(calc::parse_double("+.25"), Optional(0.25));
+    ASSERT_THAT(calc::parse_double("1E-2"), Optional(0.01));
+    ASSERT_THAT(calc::parse_double("0x1p4"), Optional(16.0));
+    ASSERT_THAT(calc::parse_double("-0XA"), Optional(-10.0));
+    ASSERT_THAT(calc::parse_double("Infinity"), Optional(std::numeric_limits<double>::infinity()));
+    ASSERT_THAT(calc::parse_double("-inf"), Optional(-std::numeric_limits<double>::infinity()));
+    ASSERT_THAT(calc::parse_double("nan"), Optional(IsNan()));
+}
+
+TEST(parse_double, rejects_partial_or_malformed_literals)
+{
+    for (const auto text : { "", " ", "-", "+-1", "--1", "1 ", "1e", "1x", "0x", "0x-1", ".", "e5", "x", "1..2", "1e999" })
+    {
+        ASSERT_THAT(calc::parse_double(text), Eq(std::nullopt)) << "'" << text << "'";
+    }
+}
@@ -0,0 +1,114 @@
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "calc.hpp"
+#include "profile.hpp"
+
+using namespace ::testing;
+
+namespace
+{
+std::vector<std::string> labels(const calc::ProfiledExpr& profiled)
+{
+    std::vector<std::string> res;
+    for (const auto& node : profiled.nodes())
+    {
+        res.push_back(std::string(node.depth, ' ') + node.label);
+    }
+    return res;
+}
+
+}  // namespace
+
+TEST(profile, evaluates_like_the_original_tree)
+{
+    const auto expr = calc::parse("y = max(x, 2) * -x + sqrt(x)");
+    calc::Context expected_ctx{ { "x", 4 } };
+    calc::Context ctx = expected_ctx;
+    const calc::ProfiledExpr profiled{ *expr };
+    ASSERT_THAT(profiled.eval(ctx), expr->eval(expected_ctx));
+    ASSERT_THAT(ctx.get("y"), expected_ctx.get("y"));
+    ASSERT_THAT(labels(profiled), ElementsAre("y", " +", "  *", "   max", "    x", "    2", "   -", "    x", "  sqrt", "   x"));
+}
+
+TEST(profile, counts_calls_and_time_per_node)
+{
+    calc::Parser parser;
+    parser.register_function("slow", [](const std::vector<double>& args) {
+        volatile double res = 0;
+        for (int i = 0; i < 100000; ++i)
+        {
+            res = res + args.at(0);
+        }
+        return res;
+    });
+    const calc::ProfiledExpr profiled{ *parser("slow(x) + 1") };
+    calc::Context ctx{ { "x", 1 } };
+    for (int i = 0; i < 3; ++i)
+    {
+        profiled.eval(ctx);
+    }
+
+    const auto& nodes = profiled.nodes();
+    ASSERT_THAT(nodes.size(), 4);
+    for (const auto& node : nodes)
+    {
+        ASSERT_THAT(node.calls, 3);
+    }
+    const auto& call = nodes[1];
+    ASSERT_THAT(call.label, "slow");
+    ASSERT_THAT(call.callback_nanoseconds, Gt(0));
+    ASSERT_THAT(call.callback_nanoseconds, Le(call.nanoseconds));
+    ASSERT_THAT(nodes[0].nanoseconds, Ge(call.nanoseconds));
+    ASSERT_THAT(profiled.self_nanoseconds(1), Ge(call.callback_nanoseconds - nodes[2].nanoseconds));
+
+    std::ostringstream os;
+    profiled.print(os);
+    ASSERT_THAT(os.str(), HasSubstr("  slow  [calls 3, total "));
+}
+
+TEST(profile, counts_allocations_in_callbacks)
+{
+    calc::Parser parser;
+    parser.register_function("alloc", [](const std::vector<double>& args) { return static_cast<double>(std::vector<double>(args).size()); });
+    calc::ProfiledExpr profiled{ *parser("alloc(x) + sqrt(x)") };
+    calc::Context ctx{ { "x", 1 } };
+    profiled.eval(ctx);
+
+    const auto& nodes = profiled.nodes();
+    // The argument vector and the callback's copy of it.
+    ASSERT_THAT(nodes[1].allocations, 2);
+    ASSERT_THAT(nodes[3].allocations, 0);
+    ASSERT_THAT(nodes[0].allocations, 2);
+
+    profiled.reset();
+    ASSERT_THAT(nodes[1].allocations, 0);
+}
+
+TEST(profile, writes_json)
+{
+    calc::ProfiledExpr profiled{ *calc::parse("x * 2") };
+    std::ostringstream os;
+    profiled.write_json(os);
+    ASSERT_THAT(os.str(), StartsWith("[\n {\"label\": \"*\", \"depth\": 0, \"calls\": 0, \"total_ns\": 0, \"self_ns\": 0, \"callback_ns\": 0, \"allocations\": 0},\n {\"label\": \"x\", \"depth\": 1"));
+}
+
+TEST(profile, rejects_trees_too_deep_to_evaluate)
+{
+    std::string text = "x";
+    for (std::size_t i = 1; i < calc::ProfiledExpr::max_depth; ++i)
+    {
+        text += " + 1";
+    }
+    calc::Context ctx{ { "x", 1 } };
+    const calc::ProfiledExpr profiled{ *calc::parse(text) };
+    ASSERT_THAT(profiled.eval(ctx), calc::ProfiledExpr::max_depth);
+    ASSERT_THAT(profiled.nodes()[calc::ProfiledExpr::max_depth - 1].label, "x");
+    ASSERT_THAT(profiled.nodes()[calc::ProfiledExpr::max_depth - 1].depth, calc::ProfiledExpr::max_depth - 1);
+    ASSERT_THROW(calc::ProfiledExpr{ *calc::parse(text + " + 1") }, std::invalid_argument);
+}
@@ -0,0 +1,168 @@
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <map>
+#include <stdexcept>
+#include <string>
+
+#include "calc.hpp"
+#include "expressions.hpp"
+#include "program.hpp"
+
+using namespace ::testing;
+
+std::map<std::string, double> variables(const calc::Context& ctx)
+{
+    std::map<std::string, double> res;
+    for (const auto& [name, value] : ctx.vars())
+    {
+        res.emplace(name, value);
+    }
+    return res;
+}
+
+struct program_matches_tree : TestWithParam<const char*>
+{
+};
+
+TEST_P(program_matches_tree, same_result_as_expr_eval)
+{
+    const auto expr = calc::parse(GetParam());
+    ASSERT_THAT(expr, NotNull());
+    const auto program = calc::Program::compile(*expr);
+
+    calc::Context tree_ctx{ { "x", 1.5 }, { "y", -2.0 } };
+    calc::Context program_ctx = tree_ctx;
+    ASSERT_THAT(program.run(program_ctx), DoubleEq(expr->eval(tree_ctx)));
+    ASSERT_THAT(variables(program_ctx), ContainerEq(variables(tree_ctx)));
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    expressions,
+    program_matches_tree,
+    Values(
+        "2.1 + 3.2",
+        "(2 + 3) * (3 - 1) - 1",
+        "2 * 10 ^ 3",
+        "-(x + 3) / y",
+        "+x",
+        "x < y",
+        "x >= y",
+        "x == 1.5",
+        "x != 1.5",
+        "sum(1, x, y, max(x, y, 7))",
+        "sum()",
+        "sqrt(16) + sin(x) * cos(y) - min(x, y)",
+        "z = x * 2",
+        "a = b = x ^ y",
+        "x > y ? x * 2 : y",
+        "x < y ? x : y > 0 ? 1 : (z = 2)",
+        "(x > 0 && y > 0) + (x > 0 || y > 0) * 2",
+        "if(x, y, 0) + (y && x) + (0 || y)"));
+
+TEST(program, undefined_variable_throws)
+{
+    calc::Context ctx{};
+    const auto program = calc::Program::compile(*calc::parse("x + 1"));
+    ASSERT_THROW(program.run(ctx), std::runtime_error);
+}
+
+TEST(program, try_run_reports_undefined_variables)
+{
+    calc::Context ctx{};
+    const auto program = calc::Program::compile(*calc::parse("x + 1"));
+    const auto res = program.try_run(ctx);
+    ASSERT_THAT(res.error, calc::EvalError::undefined_variable);
+    ASSERT_THAT(calc::symbols().name(res.slot), "x");
+    ASSERT_THAT(res.value, IsNan());
+
+    ctx.set("x", 1.0);
+    ASSERT_THAT(program.try_run(ctx).value, 2.0);
+}
+
+TEST(program, deep_expression_uses_large_stack)
+{
+    std::string text = "1";
+    for (int i = 0; i < 100; ++i)
+    {
+        text = "(" + text + " + 1)";
+    }
+    for (int i = 0; i < 100; ++i)
+    {
+        text = "1 + (" + text + ")";
+    }
+    calc::Context ctx{};
+    const auto expr = calc::parse(text);
+    const auto program = calc::Program::compile(*expr);
+    ASSERT_THAT(program.run(ctx), 201);
+}
+
+TEST(program, constants_are_deduplicated)
+{
+    const auto program = calc::Program::compile(*calc::parse("x * 2 + x * 2"));
+    ASSERT_THAT(program.constants, ElementsAre(2));
+    ASSERT_THAT(program.stack_size, 3);
+}
+
+TEST(program, constants_are_deduplicated_by_bit_pattern)
+{
+    const auto& plus = *calc::parse.find_binary_op("+");
+    const auto& times = *calc::parse.find_binary_op("*");
+    auto zeros = calc::make_binary_op(plus, std::make_unique<calc::expressions::Value>(0.0), std::make_unique<calc::expressions::Value>(-0.0));
+    auto expr = calc::make_binary_op(times, std::move(zeros), std::make_unique<calc::expressions::Value>(-0.0));
+    const auto program = calc::Program::compile(*expr);
+    ASSERT_THAT(program.constants, SizeIs(2));
+    ASSERT_FALSE(std::signbit(program.constants[0]));
+    ASSERT_TRUE(std::signbit(program.constants[1]));
+    calc::Context ctx;
+    ASSERT_TRUE(std::signbit(program.run(ctx)));
+}
+
+TEST(program, rejects_calls_with_more_arguments_than_an_instruction_holds)
+{
+    std::string args = "1";
+    for (int i = 1; i < 65535; ++i)
+    {
+        args += ", 1";
+    }
+    calc::Context ctx;
+    ASSERT_THAT(calc::Program::compile(*calc::parse("sum(" + args + ")")).run(ctx), 65535);
+    const auto expr = calc::parse("sum(" + args + ", 1)");
+    ASSERT_THAT(expr->eval(ctx), 65536);
+    ASSERT_THROW(calc::Program::compile(*expr), std::invalid_argument);
+}
+
+TEST(program, variables_are_loaded_by_slot)
+{
+    const auto program = calc::Program::compile(*calc::parse("x + y"));
+    ASSERT_THAT(program.code[0].op, calc::OpCode::load_var);
+    ASSERT_THAT(program.code[0].index, calc::symbols().find("x"));
+    ASSERT_THAT(program.code[1].index, calc::symbols().find("y"));
+}
+
+TEST(program, branches_not_taken_are_skipped)
+{
+    calc::Context ctx{ { "x", 1.0 } };
+    const auto program = calc::Program::compile(*calc::parse("x > 0 ? x : undefined"));
+    ASSERT_THAT(program.run(ctx), 1);
+    ASSERT_THAT(calc::Program::compile(*calc::parse("x < 0 && undefined")).run(ctx), 0);
+    ASSERT_THAT(calc::Program::compile(*calc::parse("x > 0 || undefined")).run(ctx), 1);
+    ctx.set("x", -1.0);
+    ASSERT_THROW(program.run(ctx), std::runtime_error);
+}
+
+TEST(program, conditional_jumps_over_the_branch_not_taken)
+{
+    const auto program = calc::Program::compile(*calc::parse("x ? 1 : 2"));
+    std::vector<calc::OpCode> ops;
+    for (const calc::Instruction& instr : program.code)
+    {
+        ops.push_back(instr.op);
+    }
+    using calc::OpCode;
+    ASSERT_THAT(ops, ElementsAre(OpCode::load_var, OpCode::jump_if_zero, OpCode::push_const, OpCode::jump, OpCode::push_const));
+    ASSERT_THAT(program.code[1].index, 4);
+    ASSERT_THAT(program.code[3].index, 5);
+    ASSERT_THAT(program.stack_size, 1);
+}
@@ -0,0 +1,134 @@
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "calc.hpp"
+#include "program.hpp"
+#include "program_file.hpp"
+
+using namespace ::testing;
+
+namespace
+{
+std::vector<calc::Program> compile_all(const calc::Parser& parser, std::initializer_list<const char*> texts)
+{
+    std::vector<calc::Program> res;
+    for (const char* text : texts)
+    {
+        res.push_back(calc::Program::compile(*parser(text)));
+    }
+    return res;
+}
+
+std::string save(const std::vector<calc::Program>& programs)
+{
+    std::ostringstream os;
+    calc::save_programs(programs, os);
+    return os.str();
+}
+
+std::string listing(const calc::Program& program)
+{
+    std::ostringstream os;
+    program.print(os);
+    return os.str();
+}
+
+}  // namespace
+
+TEST(program_file, round_trips_programs)
+{
+    calc::Parser parser;
+    parser.register_function("twice", [](const std::vector<double>& args) { return 2 * args.at(0); });
+    const auto programs = compile_all(parser, { "x * 2 + 1", "sqrt(x) + max(x, y, 3) - sin(y)", "z = twice(x) ^ -y", "x + z", "x > y ? (y > 1 || z) : x && 0" });
+    const auto loaded = calc::load_programs(save(programs), parser);
+    ASSERT_THAT(loaded.size(), programs.size());
+
+    calc::Context expected_ctx{ { "x", 4 }, { "y", 0.5 } };
+    calc::Context ctx = expected_ctx;
+    for (std::size_t i = 0; i < programs.size(); ++i)
+    {
+        ASSERT_THAT(listing(loaded[i]), listing(programs[i]));
+        ASSERT_THAT(loaded[i].stack_size, programs[i].stack_size);
+        ASSERT_THAT(loaded[i].slot_count, programs[i].slot_count);
+        ASSERT_THAT(loaded[i].run(ctx), DoubleEq(programs[i].run(expected_ctx)));
+    }
+}
+
+TEST(program_file, loads_from_mapped_file)
+{
+    const std::string path = testing::TempDir() + "program_file_test.bin";
+    {
+        std::ofstream file{ path, std::ios::binary };
+        calc::save_programs(compile_all(calc::parse, { "a * a - 1", "min(a, 2)" }), file);
+    }
+    const auto loaded = calc::load_program_file(path);
+    std::remove(path.c_str());
+    calc::Context ctx{ { "a", 3 } };
+    ASSERT_THAT(loaded.size(), 2);
+    ASSERT_THAT(loaded[0].run(ctx), 8);
+    ASSERT_THAT(loaded[1].run(ctx), 2);
+}
+
+TEST(program_file, resolves_functions_by_name_against_the_loading_parser)
+{
+    calc::Parser saving;
+    saving.register_function("f", [](const std::vector<double>& args) { return args.at(0) + 1; });
+    const auto data = save(compile_all(saving, { "f(x)" }));
+
+    ASSERT_THROW(calc::load_programs(data), std::runtime_error);
+
+    calc::Parser loading;
+    loading.register_function("f", [](const std::vector<double>& args) { return args.at(0) * 10; });
+    calc::Context ctx{ { "x", 2 } };
+    ASSERT_THAT(calc::load_programs(data, loading).at(0).run(ctx), 20);
+
+    calc::Parser binary;
+    binary.register_function(
+        "f", [](const std::vector<double>& args) { return args[0] * args[1]; }, false, calc::Arity::exactly(2));
+    ASSERT_THROW(calc::load_programs(data, binary), std::runtime_error);
+}
+
+TEST(program_file, rejects_malformed_data)
+{
+    const auto data = save(compile_all(calc::parse, { "x + 1" }));
+    ASSERT_THAT(calc::load_programs(save({})), IsEmpty());
+    ASSERT_THROW(calc::load_programs(""), std::runtime_error);
+    ASSERT_THROW(calc::load_programs(data.substr(0, data.size() - 8)), std::runtime_error);
+
+    auto bad_magic = data;
+    bad_magic[0] = 'X';
+    ASSERT_THROW(calc::load_programs(bad_magic), std::runtime_error);
+
+    auto bad_version = data;
+    bad_version[8] = static_cast<char>(calc::program_file_version + 1);
+    ASSERT_THROW(calc::load_programs(bad_version), std::runtime_error);
+}
+
+TEST(program_file, rejects_malformed_branches)
+{
+    const auto programs = compile_all(calc::parse, { "x ? 1 : 2" });
+    ASSERT_THAT(calc::load_programs(save(programs)), SizeIs(1));
+    for (const auto& [pc, index] : std::vector<std::pair<std::size_t, std::uint32_t>>{ { 1, 2 }, { 1, 6 }, { 1, 3 }, { 3, 9 }, { 3, 3 } })
+    {
+        auto bad = programs;
+        bad[0].code[pc].index = index;
+        ASSERT_THROW(calc::load_programs(save(bad)), std::runtime_error) << pc << " -> " << index;
+    }
+    auto stray_jump = compile_all(calc::parse, { "x + 1" });
+    stray_jump[0].code.insert(stray_jump[0].code.begin() + 1, calc::Instruction{ calc::OpCode::jump, 0, 2 });
+    ASSERT_THROW(calc::load_programs(save(stray_jump)), std::runtime_error);
+    // The then branch leaves two values.
+    auto unbalanced = programs;
+    auto& code = unbalanced[0].code;
+    code.insert(code.begin() + 2, code[2]);
+    code[1].index += 1;
+    code[4].index += 1;
+    ASSERT_THROW(calc::load_programs(save(unbalanced)), std::runtime_error);
+}
@@ -0,0 +1,159 @@
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include "calc.hpp"
+#include "expressions.hpp"
+#include "shared_program.hpp"
+
+using namespace ::testing;
+
+namespace
+{
+std::vector<calc::ExprPtr> parse_all(const calc::Parser& parser, const std::vector<const char*>& texts)
+{
+    std::vector<calc::ExprPtr> res;
+    for (const char* text : texts)
+    {
+        res.push_back(parser(text));
+    }
+    return res;
+}
+}  // namespace
+
+TEST(shared_program, matches_separate_evaluation)
+{
+    const auto exprs = parse_all(
+        calc::parse,
+        { "sqrt(x ^ 2 + y ^ 2) * 2",
+          "sqrt(x ^ 2 + y ^ 2) > 1",
+          "-x + max(x, y) - max(x, y)",
+          "t = x * y",
+          "t + x * y",
+          "(t = 1) + t",
+          "t * 3",
+          "x > 0 ? sqrt(x ^ 2 + y ^ 2) : y",
+          "x < 0 && y < 0 || sqrt(x ^ 2 + y ^ 2) > 1",
+          "y > 0 ? 1 : x > 1 ? (u = x) : 2" });
+    const auto program = calc::SharedProgram::compile(exprs);
+
+    calc::Context shared_ctx{ { "x", 1.5 }, { "y", -2.0 } };
+    calc::Context separate_ctx = shared_ctx;
+    std::vector<double> results(exprs.size());
+    program.run(shared_ctx, results);
+    for (std::size_t k = 0; k < exprs.size(); ++k)
+    {
+        ASSERT_THAT(results[k], DoubleEq(exprs[k]->eval(separate_ctx))) << k;
+    }
+    ASSERT_THAT(shared_ctx.values, ContainerEq(separate_ctx.values));
+}
+
+TEST(shared_program, merges_identical_subtrees)
+{
+    const auto exprs = parse_all(calc::parse, { "sqrt(x ^ 2 + y ^ 2)", "sqrt(x ^ 2 + y ^ 2) + 1", "1 + sqrt(x ^ 2 + y ^ 2)" });
+    const auto program = calc::SharedProgram::compile(exprs);
+    // x, 2, ^, y, ^, +, sqrt, 1 and the two additions.
+    ASSERT_THAT(program.nodes.size(), 10);
+    ASSERT_THAT(program.roots[0], program.operands[program.nodes[program.roots[1]].first_operand]);
+}
+
+TEST(shared_program, keeps_negative_zero_apart_from_zero)
+{
+    std::vector<calc::ExprPtr> exprs;
+    exprs.push_back(std::make_unique<calc::expressions::Value>(0.0));
+    exprs.push_back(std::make_unique<calc::expressions::Value>(-0.0));
+    const auto program = calc::SharedProgram::compile(exprs);
+    ASSERT_THAT(program.constants, SizeIs(2));
+
+    calc::Context ctx;
+    std::vector<double> results(2);
+    program.run(ctx, results);
+    ASSERT_FALSE(std::signbit(results[0]));
+    ASSERT_TRUE(std::signbit(results[1]));
+}
+
+TEST(shared_program, rejects_calls_with_more_arguments_than_a_node_holds)
+{
+    std::string args = "1";
+    for (int i = 0; i < 65535; ++i)
+    {
+        args += ", 1";
+    }
+    ASSERT_THROW(calc::SharedProgram::compile(parse_all(calc::parse, { ("sum(" + args + ")").c_str() })), std::invalid_argument);
+}
+
+TEST(shared_program, calls_pure_functions_once_and_impure_every_time)
+{
+    int pure_calls = 0;
+    int impure_calls = 0;
+    calc::Parser parser;
+    parser.register_function(
+        "norm",
+        [&](const std::vector<double>& args)
+        {
+            ++pure_calls;
+            return std::hypot(args.at(0), args.at(1));
+        },
+        true);
+    parser.register_function("tick", [&](const std::vector<double>&) { return ++impure_calls; });
+
+    const auto exprs = parse_all(parser, { "norm(x, y) + tick()", "norm(x, y) * tick()", "2 * norm(x, y)" });
+    const auto program = calc::SharedProgram::compile(exprs);
+    calc::Context ctx{ { "x", 3 }, { "y", 4 } };
+    std::vector<double> results(exprs.size());
+    program.run(ctx, results);
+
+    ASSERT_THAT(results, ElementsAre(6, 10, 10));
+    ASSERT_THAT(pure_calls, 1);
+    ASSERT_THAT(impure_calls, 2);
+}
+
+TEST(shared_program, does_not_merge_reads_of_assigned_variables)
+{
+    const auto exprs = parse_all(calc::parse, { "v + 1", "v = 10", "v + 1" });
+    const auto program = calc::SharedProgram::compile(exprs);
+    calc::Context ctx{ { "v", 1 } };
+    std::vector<double> results(exprs.size());
+    program.run(ctx, results);
+    ASSERT_THAT(results, ElementsAre(2, 10, 11));
+}
+
+TEST(shared_program, prints_nodes)
+{
+    const auto exprs = parse_all(calc::parse, { "x * x", "x * x + 1" });
+    std::ostringstream os;
+    calc::SharedProgram::compile(exprs).print(os);
+    ASSERT_THAT(os.str(), "  %0 = x\n  %1 = * %0 %0\n  %2 = 1\n  %3 = + %1 %2\n");
+}
+
+TEST(shared_program, branches_are_computed_only_when_taken)
+{
+    calc::Parser parser;
+    int calls = 0;
+    parser.register_function("count", [&](const std::vector<double>& args) { return ++calls, args.at(0); }, true);
+    const auto exprs = parse_all(parser, { "x > 0 ? count(x) : -x", "x > 0 && count(x) > 0", "count(x) + (x > 0 ? count(x) : 0)" });
+    const auto program = calc::SharedProgram::compile(exprs);
+    std::vector<double> results(exprs.size());
+
+    calc::Context ctx{ { "x", -2.0 } };
+    program.run(ctx, results);
+    ASSERT_THAT(results, ElementsAre(2.0, 0.0, -2.0));
+    // Only the unguarded call of the last expression runs.
+    ASSERT_THAT(calls, 1);
+
+    ctx.set("x", 3.0);
+    calls = 0;
+    program.run(ctx, results);
+    ASSERT_THAT(results, ElementsAre(3.0, 1.0, 6.0));
+    // The calls under the same guard are merged, and so is the guarded one with the unguarded one.
+    ASSERT_THAT(calls, 2);
+
+    const auto lazy = calc::SharedProgram::compile(parse_all(parser, { "x > 0 ? x : undefined" }));
+    std::vector<double> lazy_results(1);
+    lazy.run(ctx, lazy_results);
+    ASSERT_THAT(lazy_results[0], 3.0);
+}
@@ -0,0 +1,183 @@
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+#include "calc.hpp"
+#include "sheet.hpp"
+
+using namespace ::testing;
+
+namespace
+{
+calc::Slot slot_of(std::string_view name)
+{
+    return calc::symbols().intern(name);
+}
+}  // namespace
+
+TEST(sheet, recomputes_downstream_formulas_on_change)
+{
+    calc::Context ctx{};
+    calc::Sheet sheet{ ctx };
+    sheet.eval(calc::parse("a = 2"));
+    sheet.eval(calc::parse("b = a * 3"));
+    sheet.eval(calc::parse("c = b + sin(a)"));
+    ASSERT_THAT(sheet.get("c"), DoubleEq(6 + std::sin(2)));
+
+    sheet.set("a", 1);
+    ASSERT_THAT(sheet.is_dirty(slot_of("b")), true);
+    ASSERT_THAT(sheet.is_dirty(slot_of("c")), true);
+    ASSERT_THAT(sheet.get("c"), DoubleEq(3 + std::sin(1)));
+    ASSERT_THAT(sheet.get("b"), 3);
+    ASSERT_THAT(ctx.get("b"), 3);
+}
+
+TEST(sheet, only_computes_what_is_read)
+{
+    calc::Context ctx{};
+    calc::Sheet sheet{ ctx };
+    sheet.set("input", 1);
+    for (int i = 0; i < 100; ++i)
+    {
+        sheet.define(calc::parse("cell" + std::string(1, static_cast<char>('a' + i % 26)) + std::string(i / 26 + 1, 'z') + " = input * 2"));
+    }
+    sheet.define(calc::parse("other = 5"));
+    ASSERT_THAT(sheet.evaluations(), 0);
+
+    ASSERT_THAT(sheet.get("cellaz"), 2);
+    ASSERT_THAT(sheet.evaluations(), 1);
+
+    sheet.set("input", 4);
+    ASSERT_THAT(sheet.get("cellaz"), 8);
+    ASSERT_THAT(sheet.get("other"), 5);
+    ASSERT_THAT(sheet.get("other"), 5);
+    ASSERT_THAT(sheet.evaluations(), 3);
+}
+
+TEST(sheet, evaluates_shared_inputs_once)
+{
+    calc::Context ctx{};
+    calc::Sheet sheet{ ctx };
+    sheet.set("x", 2);
+    sheet.define(calc::parse("left = x + 1"));
+    sheet.define(calc::parse("right = x * 10"));
+    sheet.define(calc::parse("top = left + right + left"));
+    ASSERT_THAT(sheet.eval(calc::parse("top * 2")), 52);
+    ASSERT_THAT(sheet.evaluations(), 3);
+}
+
+TEST(sheet, redefinition_replaces_dependencies)
+{
+    calc::Context ctx{};
+    calc::Sheet sheet{ ctx };
+    sheet.set("p", 1);
+    sheet.set("q", 10);
+    sheet.define(calc::parse("r = p + 1"));
+    ASSERT_THAT(sheet.get("r"), 2);
+
+    sheet.define(calc::parse("r = q + 1"));
+    ASSERT_THAT(sheet.get("r"), 11);
+    sheet.set("p", 5);
+    ASSERT_THAT(sheet.is_dirty(slot_of("r")), false);
+    sheet.set("q", 20);
+    ASSERT_THAT(sheet.get("r"), 21);
+
+    sheet.set("r", 0);
+    ASSERT_THAT(sheet.is_formula(slot_of("r")), false);
+    sheet.set("q", 30);
+    ASSERT_THAT(sheet.get("r"), 0);
+}
+
+TEST(sheet, rejects_cycles)
+{
+    calc::Context ctx{};
+    calc::Sheet sheet{ ctx };
+    sheet.define(calc::parse("e = 1"));
+    sheet.define(calc::parse("f = e + 1"));
+    sheet.define(calc::parse("g = f * 2"));
+    ASSERT_THROW(sheet.define(calc::parse("e = g")), std::invalid_argument);
+    ASSERT_THROW(sheet.define(calc::parse("h = h + 1")), std::invalid_argument);
+    ASSERT_THAT(sheet.get("g"), 4);
+}
+
+TEST(sheet, rejects_nested_assignments)
+{
+    calc::Context ctx{};
+    calc::Sheet sheet{ ctx };
+    ASSERT_THROW(sheet.define(calc::parse("u = (v = 2) + 1")), std::invalid_argument);
+    ASSERT_THROW(sheet.define(calc::parse("u + 1")), std::invalid_argument);
+}
+
+TEST(sheet, undefined_inputs_throw_when_read)
+{
+    calc::Context ctx{};
+    calc::Sheet sheet{ ctx };
+    sheet.define(calc::parse("late = early * 2"));
+    ASSERT_THROW(sheet.get("late"), std::runtime_error);
+    sheet.set("early", 3);
+    ASSERT_THAT(sheet.get("late"), 6);
+}
+
+TEST(sheet, freeze_replaces_formulas_by_their_values)
+{
+    calc::Context ctx{};
+    calc::Sheet sheet{ ctx };
+    sheet.eval(calc::parse("a = 1"));
+    sheet.eval(calc::parse("b = a * 2"));
+    sheet.define(calc::parse("c = missing + 1"));
+    sheet.define(calc::parse("d = c * 2"));
+    sheet.set("a", 5);
+    sheet.freeze();
+    ASSERT_THAT(sheet.is_formula(slot_of("b")), false);
+    ASSERT_THAT(ctx.get("b"), 10);
+    ASSERT_THAT(ctx.get("c"), std::nullopt);
+    ASSERT_THAT(ctx.get("d"), std::nullopt);
+
+    // Later changes no longer propagate.
+    sheet.set("a", 7);
+    ASSERT_THAT(sheet.get("b"), 10);
+}
+
+TEST(sheet, long_chains_do_not_recurse)
+{
+    calc::Context ctx{};
+    calc::Sheet sheet{ ctx };
+    std::vector<std::string> names;
+    for (int i = 0; i < 20000; ++i)
+    {
+        std::string name = "chain";
+        for (int k = i; k > 0; k /= 26)
+        {
+            name += static_cast<char>('a' + k % 26);
+        }
+        names.push_back(name + "_");
+    }
+    sheet.set(names[0], 0);
+    for (std::size_t i = 1; i < names.size(); ++i)
+    {
+        sheet.define(calc::parse(names[i] + " = " + names[i - 1] + " + 1"));
+    }
+    ASSERT_THAT(sheet.get(names.back()), names.size() - 1);
+    sheet.set(names[0], 1);
+    ASSERT_THAT(sheet.get(names.back()), names.size());
+}
+
+TEST(sheet, deep_formulas_do_not_recurse)
+{
+    calc::Context ctx{};
+    calc::Sheet sheet{ ctx };
+    std::string text = "deep_ = deep_input_";
+    for (int i = 0; i < 100000; ++i)
+    {
+        text += " + deep_input_";
+    }
+    sheet.set("deep_input_", 1);
+    sheet.define(calc::parse(text + " + 1"));
+    ASSERT_THAT(sheet.get("deep_"), 100002);
+    sheet.set("deep_input_", 2);
+    ASSERT_THAT(sheet.eval(calc::parse(text.substr(8))), 200002);
+    ASSERT_THAT(sheet.get("deep_"), 200003);
+}
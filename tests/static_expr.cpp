@@ -0,0 +1,141 @@
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <stdexcept>
+
+#include "calc.hpp"
+#include "static_expr.hpp"
+
+using namespace ::testing;
+
+namespace
+{
+template <class StaticExpr>
+void expect_same_as_parsed(const StaticExpr& expr, const char* text)
+{
+    const auto parsed = calc::parse(text);
+    ASSERT_THAT(parsed, NotNull()) << text;
+    for (const double x : { 1.5, -0.25, 0.0, 3.0 })
+    {
+        calc::Context static_ctx{ { "x", x }, { "y", -2.0 }, { "a", 2.0 }, { "b", 0.5 } };
+        calc::Context parsed_ctx = static_ctx;
+        const double expected = parsed->eval(parsed_ctx);
+        if (std::isnan(expected))
+        {
+            EXPECT_THAT(expr.eval(static_ctx), IsNan()) << text;
+        }
+        else
+        {
+            EXPECT_THAT(expr.eval(static_ctx), DoubleEq(expected)) << text;
+        }
+        EXPECT_THAT(static_ctx.values, Pointwise(DoubleEq(), parsed_ctx.values)) << text;
+    }
+}
+
+#define EXPECT_STATIC_MATCHES_PARSED(text) expect_same_as_parsed(CALC_STATIC_EXPR(text), text)
+
+struct Quadratic
+{
+    static constexpr std::string_view value()
+    {
+        // ^ binds looser than * in this grammar.
+        return "a * (x ^ 2) + b";
+    }
+};
+}  // namespace
+
+TEST(static_expr, matches_runtime_parser)
+{
+    EXPECT_STATIC_MATCHES_PARSED("2.1 + 3.2");
+    EXPECT_STATIC_MATCHES_PARSED("(2 + 3) * (3 - 1) - 1");
+    EXPECT_STATIC_MATCHES_PARSED("2 * 10 ^ 3");
+    EXPECT_STATIC_MATCHES_PARSED("2 ^ 3 ^ 2");
+    EXPECT_STATIC_MATCHES_PARSED("10 - 4 - 3");
+    EXPECT_STATIC_MATCHES_PARSED("-2 ^ 2");
+    EXPECT_STATIC_MATCHES_PARSED("-(x + 3) / y");
+    EXPECT_STATIC_MATCHES_PARSED("+x * --y");
+    EXPECT_STATIC_MATCHES_PARSED("x < y == 0");
+    EXPECT_STATIC_MATCHES_PARSED("x >= 1.5");
+    EXPECT_STATIC_MATCHES_PARSED("x != 1.5");
+    EXPECT_STATIC_MATCHES_PARSED("sum(1, x, y, max(x, y, 7))");
+    EXPECT_STATIC_MATCHES_PARSED("sum()");
+    EXPECT_STATIC_MATCHES_PARSED("sqrt(16) + sin(x) * cos(y) - min(x, y)");
+    EXPECT_STATIC_MATCHES_PARSED("z = x * 2");
+    EXPECT_STATIC_MATCHES_PARSED("a = b = x ^ y");
+    EXPECT_STATIC_MATCHES_PARSED("(t = x * y) + t");
+    EXPECT_STATIC_MATCHES_PARSED("0.1 + 1e-3 + 2.5E2 + .5");
+    EXPECT_STATIC_MATCHES_PARSED("inf - x");
+    EXPECT_STATIC_MATCHES_PARSED("x > 0 ? x * 2 : y");
+    EXPECT_STATIC_MATCHES_PARSED("x < 0 ? 1 : x > 1 ? 2 : (t = 3)");
+    EXPECT_STATIC_MATCHES_PARSED("(x > 0 && y < 0) + (x || 0) * 2 + (x > 2 || x < -1 && y)");
+    EXPECT_STATIC_MATCHES_PARSED("if(x, y, 1) + (x ? 1 ? 2 : 3 : 4)");
+}
+
+TEST(static_expr, branches_not_taken_are_not_evaluated)
+{
+    calc::Context ctx{ { "x", 1.0 } };
+    ASSERT_THAT(CALC_STATIC_EXPR("x > 0 ? x : undefined_static").eval(ctx), 1);
+    ASSERT_THAT(CALC_STATIC_EXPR("x < 0 && undefined_static || x").eval(ctx), 1);
+    ASSERT_THROW(CALC_STATIC_EXPR("x < 0 ? x : undefined_static").eval(ctx), std::runtime_error);
+}
+
+TEST(static_expr, parses_at_compile_time)
+{
+    using Tree = std::decay_t<decltype(calc::static_expr<Quadratic>::tree)>;
+    static_assert(std::is_same_v<Tree, calc::static_expressions::Tree<Quadratic::value().size()>>);
+    static_assert(calc::static_expr<Quadratic>::tree.node_count == 7);
+    static_assert(calc::static_expr<Quadratic>::tree.name_count == 3);
+    static_assert(calc::static_expr<Quadratic>::tree.nodes[calc::static_expr<Quadratic>::tree.root].kind == calc::static_expressions::Kind::add);
+
+    const calc::static_expr<Quadratic> expr;
+    calc::Context ctx{ { "a", 2 }, { "x", 3 }, { "b", 1 } };
+    ASSERT_THAT(expr(ctx), 19);
+}
+
+TEST(static_expr, calls_registered_functions)
+{
+    calc::Parser parser;
+    parser.register_function("twice", [](const std::vector<double>& args) { return 2 * args.at(0); });
+    struct Source
+    {
+        static constexpr std::string_view value()
+        {
+            return "twice(x) + twice(1)";
+        }
+    };
+    const calc::static_expr<Source> expr{ parser };
+    calc::Context ctx{ { "x", 4 } };
+    ASSERT_THAT(expr(ctx), 10);
+
+    ASSERT_THROW(calc::static_expr<Source>{}, std::runtime_error);
+}
+
+TEST(static_expr, checks_the_arity_of_each_call)
+{
+    calc::Parser parser;
+    parser.register_function(
+        "two", [](const std::vector<double>& args) { return args[0] + args[1]; }, false, calc::Arity::exactly(2));
+    struct Source
+    {
+        static constexpr std::string_view value()
+        {
+            return "two(1, 2) + two(1)";
+        }
+    };
+    ASSERT_THAT(
+        [&] { calc::static_expr<Source>{ parser }; },
+        ThrowsMessage<std::runtime_error>(StrEq("'two' takes 2 arguments, got 1")));
+    ASSERT_THAT(
+        [] { CALC_STATIC_EXPR("sin()"); },
+        ThrowsMessage<std::runtime_error>(StrEq("'sin' takes 1 argument, got 0")));
+    ASSERT_THAT(
+        [] { CALC_STATIC_EXPR("1 + max()"); },
+        ThrowsMessage<std::runtime_error>(StrEq("'max' takes at least 1 argument, got 0")));
+}
+
+TEST(static_expr, undefined_variable_throws)
+{
+    calc::Context ctx{};
+    ASSERT_THROW(CALC_STATIC_EXPR("undefined_static + 1").eval(ctx), std::runtime_error);
+}
@@ -0,0 +1,134 @@
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+#include "calc.hpp"
+#include "mapped_file.hpp"
+#include "program.hpp"
+#include "stream.hpp"
+
+using namespace ::testing;
+
+namespace
+{
+struct TempFile
+{
+    std::FILE* file = std::tmpfile();
+
+    ~TempFile()
+    {
+        std::fclose(file);
+    }
+
+    std::string contents() const
+    {
+        std::rewind(file);
+        std::string res;
+        char buffer[4096];
+        while (const std::size_t n = std::fread(buffer, 1, sizeof(buffer), file))
+        {
+            res.append(buffer, n);
+        }
+        return res;
+    }
+};
+
+std::string eval_text(const char* expr, const std::string& input, const calc::StreamOptions& options = {}, const calc::Context& ctx = {})
+{
+    const auto program = calc::Program::compile(*calc::parse(expr));
+    TempFile out;
+    calc::eval_stream(program, input, out.file, options, ctx);
+    return out.contents();
+}
+
+}  // namespace
+
+TEST(stream, evaluates_csv_rows_named_by_header)
+{
+    ASSERT_THAT(eval_text("x * y + c", "x, y\n1, 2\n3,4\r\n\n0.5,-1\n", {}, { { "c", 0.5 } }), "2.5\n12.5\n0\n");
+}
+
+TEST(stream, evaluates_headerless_csv_with_given_columns)
+{
+    calc::StreamOptions options;
+    options.columns = { "a", "b" };
+    ASSERT_THAT(eval_text("a - b", "5,3\n1,1", options), "2\n0\n");
+}
+
+TEST(stream, reports_malformed_lines)
+{
+    try
+    {
+        eval_text("x", "x\n1\n2\nthree\n");
+        FAIL();
+    }
+    catch (const std::runtime_error& ex)
+    {
+        ASSERT_THAT(ex.what(), HasSubstr("line 4"));
+    }
+    ASSERT_THROW(eval_text("x + y", "x,y\n1,2,3\n"), std::runtime_error);
+    ASSERT_THROW(eval_text("x + y", "x,y\n1\n"), std::runtime_error);
+}
+
+TEST(stream, evaluates_binary_rows)
+{
+    const std::vector<double> rows{ 1, 2, 3, 4, 5, 6 };
+    const std::string input(reinterpret_cast<const char*>(rows.data()), rows.size() * sizeof(double));
+    calc::StreamOptions options;
+    options.format = calc::StreamOptions::Format::binary;
+    options.columns = { "x", "y" };
+
+    const std::string output = eval_text("x * y", input, options);
+    ASSERT_THAT(output.size(), 3 * sizeof(double));
+    std::vector<double> results(3);
+    std::memcpy(results.data(), output.data(), output.size());
+    ASSERT_THAT(results, ElementsAre(2, 12, 30));
+
+    ASSERT_THROW(eval_text("x", input.substr(0, 12), options), std::runtime_error);
+}
+
+TEST(stream, reads_large_inputs_from_a_file)
+{
+    const std::size_t rows = 300000;
+    TempFile in;
+    std::string expected;
+    std::fputs("x\n", in.file);
+    for (std::size_t i = 0; i < rows; ++i)
+    {
+        std::fprintf(in.file, "%zu\n", i);
+        // Results are written in their shortest round-trip form, such as 1e+05.
+        char buffer[32];
+        expected.append(buffer, std::to_chars(buffer, buffer + sizeof(buffer), 2.0 * i).ptr) += '\n';
+    }
+    std::rewind(in.file);
+
+    TempFile out;
+    const auto program = calc::Program::compile(*calc::parse("2 * x"));
+    ASSERT_THAT(calc::eval_stream(program, in.file, out.file, {}), rows);
+    ASSERT_THAT(out.contents() == expected, true);
+}
+
+TEST(mapped_file, maps_whole_file)
+{
+    const std::string path = testing::TempDir() + "mapped_file_test.txt";
+    {
+        std::ofstream file{ path, std::ios::binary };
+        file << "x\n1\n2\n";
+    }
+    const calc::MappedFile file{ path };
+    ASSERT_THAT(file.text(), "x\n1\n2\n");
+
+    {
+        std::ofstream empty{ path, std::ios::binary | std::ios::trunc };
+    }
+    ASSERT_THAT(calc::MappedFile{ path }.text(), "");
+    std::remove(path.c_str());
+
+    ASSERT_THROW(calc::MappedFile{ path }, std::runtime_error);
+}